@@ -5,6 +5,31 @@
 #define truss_message_UNKNOWN 0
 #define truss_message_CSTR    1
 #define truss_message_BLOB    2
+#define truss_message_IO      3
+#define truss_message_SHARED  4
+
+#define TRUSS_IO_LOAD         0
+#define TRUSS_IO_SAVE         1
+#define TRUSS_IO_RAW          1
+#define TRUSS_IO_MAP          2
+#define TRUSS_IO_PRIORITY_LOW    0
+#define TRUSS_IO_PRIORITY_NORMAL 1
+#define TRUSS_IO_PRIORITY_HIGH   2
+#define TRUSS_IO_OK           0
+#define TRUSS_IO_ERROR       -1
+
+#define TRUSS_STREAM_READ     0
+#define TRUSS_STREAM_WRITE    1
+#define TRUSS_STREAM_APPEND   2
+#define TRUSS_STREAM_RAW      4
+
+#define TRUSS_CHANNEL_BLOCK       0
+#define TRUSS_CHANNEL_DROP_OLDEST 1
+#define TRUSS_CHANNEL_DROP_NEWEST 2
+#define TRUSS_CHANNEL_OK          0
+#define TRUSS_CHANNEL_DROPPED     1
+#define TRUSS_CHANNEL_TIMEOUT     2
+#define TRUSS_CHANNEL_CLOSED      3
 
 #define TRUSS_LOG_CRITICAL    0
 #define TRUSS_LOG_ERROR       1
@@ -26,27 +51,92 @@ typedef struct {
   unsigned int message_type;
   size_t data_length;
   unsigned char* data;
-  unsigned int refcount;
+  unsigned int refcount; /* atomic: use truss_acquire/release_message */
 } truss_message;
 
+typedef struct {
+  uint64_t live_messages;
+  uint64_t live_bytes;
+  uint64_t pool_hits;
+  uint64_t pool_misses;
+  uint64_t large_allocations;
+  double pool_hit_rate;
+} truss_message_stats;
+
+typedef struct {
+  uint64_t request_id;
+  int op;
+  int status;
+  truss_message* data;
+} truss_io_result;
+
+typedef struct {
+  int target_size;
+  int ready;
+  int booting;
+  uint64_t warm_spawns;
+  uint64_t cold_spawns;
+  double last_spawn_ms;
+  double avg_warm_spawn_ms;
+  double avg_cold_spawn_ms;
+  double avg_boot_ms;
+  double occupancy;
+} truss_interpreter_pool_stats;
+
+typedef struct {
+  uint64_t pushed;
+  uint64_t popped;
+  uint64_t dropped;
+  uint32_t depth;
+  uint32_t max_depth;
+  uint32_t capacity;
+  double mean_latency_ms;
+  double max_latency_ms;
+} truss_channel_stats;
+
+typedef struct truss_channel truss_channel;
+
 typedef int truss_interpreter_id;
 
+typedef struct truss_stream truss_stream;
+
+typedef void (*truss_job_fn)(void* userdata);
+typedef void (*truss_range_fn)(void* userdata, uint64_t begin, uint64_t end);
+typedef struct truss_job_counter truss_job_counter;
+
 const char* truss_get_version();
 void truss_test();
 void truss_log(int log_level, const char* str);
 void truss_set_error(int errcode);
 int truss_get_error();
+void truss_set_log_level(int log_level);
+int truss_get_log_level();
+int truss_open_log(const char* path, int binary);
+void truss_flush_log();
+uint64_t truss_get_dropped_log_count();
 void truss_shutdown();
 
 uint64_t truss_get_hp_time();
 uint64_t truss_get_hp_freq();
 void truss_sleep(unsigned int ms);
 
+int truss_trace_enabled();
+void truss_set_trace_enabled(int enabled);
+uint64_t truss_trace_now();
+void truss_trace_span(const char* name, const char* category, uint64_t start_us);
+void truss_trace_thread_name(const char* name);
+int truss_save_trace(const char* path);
+
+int truss_acquire_profiler(int interpreter);
+void truss_release_profiler(int interpreter);
+
 int truss_check_file(const char* filename);
 const char* truss_get_file_real_path(const char* filename);
 truss_message* truss_load_file(const char* filename);
+truss_message* truss_map_file(const char* filename);
+truss_message* truss_map_file_raw(const char* path);
 int truss_save_file(const char* filename, truss_message* data);
-int truss_save_data(const char* filename, const char* data, unsigned int datalength);
+int truss_save_data(const char* filename, const char* data, uint64_t datalength);
 int truss_add_fs_path(const char* path, const char* mountpath, int append, int relative);
 int truss_set_fs_savedir(const char* path);
 int truss_set_raw_write_dir(const char* path);
@@ -54,19 +144,79 @@ int truss_list_directory(truss_interpreter_id interpreter, const char* path);
 const char* truss_get_string_result(truss_interpreter_id interpreter, int idx);
 void truss_clear_string_results(truss_interpreter_id interpreter);
 
+uint64_t truss_hash_data(const void* data, uint64_t length, uint64_t seed);
+truss_message* truss_load_cache_entry(const char* cache_name, uint64_t key);
+int truss_save_cache_entry(const char* cache_name, uint64_t key, const void* data, uint64_t length);
+
+void truss_set_io_threads(int nthreads);
+int truss_get_io_threads();
+uint64_t truss_io_load(truss_interpreter_id requester, const char* filename, int flags, int priority);
+uint64_t truss_io_save(truss_interpreter_id requester, const char* filename, truss_message* data, int flags, int priority);
+int truss_io_pending();
+
+truss_stream* truss_stream_open(const char* filename, int mode);
+int64_t truss_stream_read(truss_stream* stream, void* dest, int64_t size);
+int64_t truss_stream_write(truss_stream* stream, const void* src, int64_t size);
+int truss_stream_seek(truss_stream* stream, int64_t pos);
+int64_t truss_stream_tell(truss_stream* stream);
+int64_t truss_stream_length(truss_stream* stream);
+int truss_stream_eof(truss_stream* stream);
+void truss_stream_close(truss_stream* stream);
+
+void truss_set_job_threads(int nthreads);
+int truss_get_job_threads();
+truss_job_counter* truss_create_job_counter();
+void truss_destroy_job_counter(truss_job_counter* counter);
+int64_t truss_job_counter_pending(truss_job_counter* counter);
+void truss_submit_job(truss_job_fn fn, void* userdata, truss_job_counter* counter);
+void truss_parallel_for(truss_range_fn fn, void* userdata, uint64_t begin, uint64_t end, uint64_t grain, truss_job_counter* counter);
+void truss_job_wait(truss_job_counter* counter);
+
 truss_message* truss_get_store_value(const char* key);
 int truss_set_store_value(const char* key, truss_message* val);
 int truss_set_store_value_str(const char* key, const char* msg);
+truss_message* truss_get_store_value_versioned(const char* key, uint64_t* version);
+truss_message* truss_acquire_store_value(const char* key, uint64_t* version);
+uint64_t truss_get_store_version(const char* key);
+uint64_t truss_compare_and_swap_store_value(const char* key, uint64_t expected_version, truss_message* val);
+int truss_erase_store_value(const char* key);
 
 int truss_spawn_interpreter(int debug_level, const char* init_script_name);
+void truss_set_interpreter_pool_size(int count);
+void truss_get_interpreter_pool_stats(truss_interpreter_pool_stats* stats);
 void truss_stop_interpreter(truss_interpreter_id target_id);
 int truss_step_interpreter(truss_interpreter_id target_id);
 truss_interpreter_state truss_get_interpreter_state(truss_interpreter_id target_id);
+int truss_step_interpreters(const truss_interpreter_id* targets, int ntargets);
+int truss_join_interpreters(const truss_interpreter_id* targets, int ntargets, int timeout_ms, double* frame_ms);
+double truss_get_interpreter_frame_time(truss_interpreter_id target_id);
+void truss_wait_for_interpreters();
 
 void truss_send_message(truss_interpreter_id dest, truss_message* message);
 int truss_fetch_messages(truss_interpreter_id interpreter);
 truss_message* truss_get_message(truss_interpreter_id interpreter, int message_index);
+truss_message** truss_fetch_message_array(truss_interpreter_id interpreter, int* count);
+truss_message** truss_fetch_typed_message_array(truss_interpreter_id interpreter, int message_type, int* count);
 truss_message* truss_create_message(size_t data_length);
 void truss_acquire_message(truss_message* msg);
 void truss_release_message(truss_message* msg);
 truss_message* truss_copy_message(truss_message* src);
+void truss_freeze_message(truss_message* msg);
+int truss_is_message_frozen(truss_message* msg);
+unsigned char* truss_get_writable_data(truss_message* msg);
+int truss_broadcast_message(const truss_interpreter_id* dests, int ndests, truss_message* msg);
+void truss_get_message_stats(truss_message_stats* stats);
+truss_message* truss_create_shared_buffer(size_t data_length, size_t alignment);
+int truss_transfer_message(truss_interpreter_id dest, truss_message* msg);
+int truss_is_message_exclusive(truss_message* msg);
+
+truss_channel* truss_open_channel(const char* name, uint32_t capacity, int policy);
+truss_channel* truss_find_channel(const char* name);
+int truss_channel_push(truss_channel* channel, truss_message* msg, int timeout_ms);
+truss_message* truss_channel_pop(truss_channel* channel, int timeout_ms);
+int truss_channel_pop_batch(truss_channel* channel, truss_message** dest, int max_count, int timeout_ms);
+void truss_close_channel(truss_channel* channel);
+void truss_get_channel_stats(truss_channel* channel, truss_channel_stats* stats);
+int truss_subscribe_topic(const char* topic, truss_channel* channel);
+int truss_unsubscribe_topic(const char* topic, truss_channel* channel);
+int truss_publish(const char* topic, truss_message* msg, int timeout_ms);
@@ -5,6 +5,7 @@ local m = {}
 
 function m.run(test)
   test("async", m.test_async)
+  test("async fileio", m.test_fileio)
 end
 
 function m.test_async(t)
@@ -208,4 +209,53 @@ function m.test_async(t)
   t.expect(p.value, 12, "update separate loop did dispatch")
 end
 
+-- update the async loop until p settles (the io pool runs on other threads)
+local function await_settled(async, p, maxframes)
+  for i = 1, (maxframes or 1000) do
+    if p.state >= 3 then return true end -- resolved or rejected
+    async.update()
+    truss.C.sleep(1)
+  end
+  return false
+end
+
+function m.test_fileio(t)
+  local async = require("async")
+  async.clear()
+
+  -- an unrelated message should survive the io module's typed fetches
+  local other = truss.C.create_message(0)
+  truss.C.send_message(TRUSS_ID, other)
+  truss.C.release_message(other)
+
+  local contents = "io pool test " .. string.rep("x", 100000)
+  local p = async.run(function()
+    async.await(async.save_file("_test_fileio.txt", contents))
+    return async.await(async.load_file_string("_test_fileio.txt",
+                       {priority = async.IO_PRIORITY_HIGH}))
+  end)
+  t.ok(await_settled(async, p), "fileio: save and load completed")
+  t.ok(p.value == contents, "fileio: loaded what was saved")
+
+  local p = async.run(function()
+    local happy, err = async.pawait(async.load_file("_does_not_exist.txt"))
+    return (happy and "happy") or "error"
+  end)
+  t.ok(await_settled(async, p), "fileio: missing load completed")
+  t.expect(p.value, "error", "fileio: missing file rejects")
+  t.expect(async.io_pending(), 0, "fileio: nothing left pending")
+
+  local messages, n = truss.fetch_messages()
+  t.expect(n, 1, "fileio: other messages left in the mailbox")
+  -- the io poller's typed fetches mustn't release the untyped batch
+  truss.fetch_messages(truss.C.message_IO)
+  t.ok(n == 1 and messages[0].refcount == 1, "fileio: typed fetch keeps untyped batch")
+  truss.fetch_messages()
+
+  local realdir = truss.C.get_file_real_path("_test_fileio.txt")
+  if realdir ~= nil then
+    os.remove(ffi.string(realdir) .. "/_test_fileio.txt")
+  end
+end
+
 return m
\ No newline at end of file
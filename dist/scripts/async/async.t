@@ -14,6 +14,7 @@ m.Async = Async
 local _instance
 
 function Async:init()
+  self._pollers = {}
   self:clear()
 end
 
@@ -73,6 +74,25 @@ function m.schedule(n, f)
   return _instance:schedule(n, f)
 end
 
+-- pollers are called at the start of every update (e.g., to resolve
+-- promises from outside sources like the io thread pool); unlike procs
+-- they survive a clear
+function Async:add_poller(f)
+  self._pollers[f] = true
+end
+
+function Async:remove_poller(f)
+  self._pollers[f] = nil
+end
+
+function m.add_poller(f)
+  return _instance:add_poller(f)
+end
+
+function m.remove_poller(f)
+  return _instance:remove_poller(f)
+end
+
 function Async:run(f, ...)
   local proc = {
     co = coroutine.create(f),
@@ -106,6 +126,7 @@ end
 function Async:update(maxtime)
   -- TODO: deal with maxtime
 
+  for poller, _ in pairs(self._pollers) do poller() end
   self._schedule:update(1)
 
   -- only process the current number of items in the queue
@@ -0,0 +1,113 @@
+-- async/fileio.t
+--
+-- promise-based file loads and saves on the core io thread pool
+
+local async = require("./async.t")
+local promise = require("./promise.t")
+local m = {}
+
+local C = truss.C
+
+m.IO_PRIORITY_LOW = C.IO_PRIORITY_LOW
+m.IO_PRIORITY_NORMAL = C.IO_PRIORITY_NORMAL
+m.IO_PRIORITY_HIGH = C.IO_PRIORITY_HIGH
+
+-- request id (as a number) -> {promise, on_complete}
+local _requests = {}
+local _nrequests = 0
+
+-- resolve the promises of any requests that have completed; called by
+-- the async event loop so only needs to be called manually when not using it
+local function poll()
+  if _nrequests == 0 then return end
+  local messages, n = truss.fetch_messages(C.message_IO)
+  for i = 0, n-1 do
+    local result = terralib.cast(&C.io_result, messages[i].data)
+    local id = tonumber(result.request_id)
+    local request = _requests[id]
+    if request then
+      _requests[id] = nil
+      _nrequests = _nrequests - 1
+      request[2](request[1], result)
+    end
+  end
+end
+m._poll = poll
+async.add_poller(poll)
+
+local function submit(id, on_complete, filename)
+  local p = promise.Promise()
+  if id == 0 then
+    p:reject("Unable to queue io request for [" .. filename .. "]")
+    return p
+  end
+  _requests[tonumber(id)] = {p, on_complete}
+  _nrequests = _nrequests + 1
+  return p
+end
+
+local function options_flags(options)
+  local flags = 0
+  if options.raw then flags = flags + C.IO_RAW end
+  if options.map then flags = flags + C.IO_MAP end
+  return flags, options.priority or m.IO_PRIORITY_NORMAL
+end
+
+-- load a file in the background; the promise resolves to a truss_message
+-- which the caller is responsible for releasing.
+-- options: {priority = ..., raw = (real path), map = (read-only zero-copy)}
+function m.load_file(filename, options)
+  local flags, priority = options_flags(options or {})
+  local id = C.io_load(TRUSS_ID, filename, flags, priority)
+  return submit(id, function(p, result)
+    if result.status ~= C.IO_OK then
+      p:reject("Error loading [" .. filename .. "]")
+      return
+    end
+    C.acquire_message(result.data)
+    p:resolve(result.data)
+  end, filename)
+end
+
+-- like load_file, but resolves to a lua string
+function m.load_file_string(filename, options)
+  local flags, priority = options_flags(options or {})
+  local id = C.io_load(TRUSS_ID, filename, flags, priority)
+  return submit(id, function(p, result)
+    if result.status ~= C.IO_OK then
+      p:reject("Error loading [" .. filename .. "]")
+      return
+    end
+    p:resolve(ffi.string(result.data.data, result.data.data_length))
+  end, filename)
+end
+
+-- save a string or truss_message in the background; resolves to true
+function m.save_file(filename, data, options)
+  local flags, priority = options_flags(options or {})
+  local msg = data
+  if type(data) == "string" then
+    msg = C.create_message(#data)
+    ffi.copy(msg.data, data, #data)
+  end
+  local id = C.io_save(TRUSS_ID, filename, msg, flags, priority)
+  if msg ~= data then C.release_message(msg) end -- the pool holds its own ref
+  return submit(id, function(p, result)
+    if result.status ~= C.IO_OK then
+      p:reject("Error saving [" .. filename .. "]")
+      return
+    end
+    p:resolve(true)
+  end, filename)
+end
+
+-- number of requests (from any interpreter) still queued or in progress
+function m.io_pending()
+  return C.io_pending()
+end
+
+function m.set_io_threads(n)
+  C.set_io_threads(n or 0)
+end
+
+return m
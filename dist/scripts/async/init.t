@@ -9,7 +9,8 @@ moduleutils.include_submodules({
   "async/promise.t",
   "async/async.t",
   "async/scheduler.t",
-  "async/eventqueue.t"
+  "async/eventqueue.t",
+  "async/fileio.t"
 }, async)
 
 return async
\ No newline at end of file
@@ -0,0 +1,30 @@
+-- core/_aot_test_module.t
+--
+-- tiny module marked for AOT compilation, for the test in _test_core.t
+
+local build = require("core/build.t")
+local m = {}
+
+local struct Pair {
+  a: int32;
+  b: int32;
+}
+m.Pair = Pair
+
+terra m.add(a: int32, b: int32): int32
+  return a + b
+end
+
+terra m.sum_pair(p: &Pair): int32
+  return p.a + p.b
+end
+
+-- returned by value, so it can't be precompiled
+terra m.make_pair(a: int32, b: int32): Pair
+  return Pair {a, b}
+end
+
+m.original = {add = m.add, sum_pair = m.sum_pair, make_pair = m.make_pair}
+build.aot_module("_test", m, {"add", "sum_pair", "make_pair"})
+
+return m
@@ -0,0 +1,13 @@
+-- core/_batch_test_job.t
+--
+-- batch script for the batch mode test in _test_core.t: "fail" inputs
+-- return false, "error" inputs raise, anything else succeeds
+
+local m = {}
+
+function m.process(input, index)
+  if input == "error" then error("job " .. index .. " raised") end
+  return input ~= "fail"
+end
+
+return m
@@ -0,0 +1,20 @@
+-- core/_log_test_job.t
+--
+-- batch script for the logger test in _test_core.t: logs more than a
+-- ring buffer holds, at levels on both sides of the --log-level cutoff
+
+local m = {}
+
+m.COUNT = 400
+m.PADDING = string.rep("x", 300)
+
+function m.process(input, index)
+  local C = truss.C
+  for i = 1, m.COUNT do
+    C.log(C.LOG_DEBUG, "logtest filtered " .. i)
+    C.log(C.LOG_WARNING, ("logtest %d %s"):format(i, m.PADDING))
+  end
+  return true
+end
+
+return m
@@ -0,0 +1,102 @@
+-- core/_message_stress_worker.t
+--
+-- worker interpreter for the stress tests in _test_core.t: every step it
+-- checks the frozen messages it received, then broadcasts a new one to
+-- every worker (itself included), hammers a datastore counter with
+-- compare-and-swap, or just takes SLEEP_MS to step
+
+local m = {}
+
+m.PAYLOAD_SIZE = 256
+m.CAS_PER_STEP = 50
+m.COUNTER_KEY = "store_stress_counter"
+m.SLEEP_MS = 20
+
+function m.fill(msg, seed)
+  for i = 0, m.PAYLOAD_SIZE - 1 do
+    msg.data[i] = (seed + i) % 256
+  end
+end
+
+function m.check(msg)
+  if msg.data_length ~= m.PAYLOAD_SIZE then return false end
+  local seed = msg.data[0]
+  for i = 1, m.PAYLOAD_SIZE - 1 do
+    if msg.data[i] ~= (seed + i) % 256 then return false end
+  end
+  return true
+end
+
+local function store_string(key)
+  local val = truss.C.get_store_value(key)
+  if val == nil then return nil end
+  return ffi.string(val.data, val.data_length)
+end
+
+local function parse_targets(s)
+  local targets = {}
+  for id in s:gmatch("%d+") do table.insert(targets, tonumber(id)) end
+  return terralib.new(int32[#targets], targets), #targets
+end
+
+-- increment the counter stored (as a uint32) under COUNTER_KEY
+function m.cas_increment()
+  local C = truss.C
+  local version = terralib.new(uint64[1])
+  local retries = 0
+  while true do
+    local cur = C.get_store_value_versioned(m.COUNTER_KEY, version)
+    local count = 0
+    if cur ~= nil then count = terralib.cast(&uint32, cur.data)[0] end
+    local msg = C.create_message(4)
+    terralib.cast(&uint32, msg.data)[0] = count + 1
+    local ok = C.compare_and_swap_store_value(m.COUNTER_KEY, version[0], msg) ~= 0
+    C.release_message(msg)
+    if ok then return retries end
+    retries = retries + 1
+  end
+end
+
+function m.init()
+  m.errors = 0
+  m.received = 0
+  m.frame = 0
+end
+
+function m.update()
+  if not m.targets then -- only known once every worker has been spawned
+    m.targets, m.ntargets = parse_targets(store_string("message_stress_targets"))
+  end
+
+  local messages, n = truss.fetch_messages()
+  for i = 0, n - 1 do
+    local msg = messages[i]
+    if truss.C.is_message_frozen(msg) == 0 or not m.check(msg) then
+      m.errors = m.errors + 1
+    end
+    m.received = m.received + 1
+  end
+
+  local mode = store_string("message_stress_mode")
+  if mode == "send" then
+    m.frame = m.frame + 1
+    local msg = truss.C.create_message(m.PAYLOAD_SIZE)
+    msg.message_type = truss.C.message_BLOB
+    m.fill(msg, truss.interpreter_id * 13 + m.frame)
+    truss.C.broadcast_message(m.targets, m.ntargets, msg)
+    truss.C.release_message(msg)
+  elseif mode == "count" then
+    for i = 1, m.CAS_PER_STEP do m.cas_increment() end
+  elseif mode == "sleep" then
+    truss.sleep(m.SLEEP_MS)
+  elseif mode == "report" then
+    local report = m.errors .. " " .. m.received
+    local msg = truss.C.create_message(#report)
+    msg.message_type = truss.C.message_CSTR
+    ffi.copy(msg.data, report, #report)
+    truss.C.send_message(0, msg)
+    truss.C.release_message(msg)
+  end
+end
+
+return m
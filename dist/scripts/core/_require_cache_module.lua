@@ -0,0 +1,5 @@
+-- core/_require_cache_module.lua
+--
+-- tiny module required by the require cache test in _test_core.t
+
+return {value = 42}
@@ -0,0 +1,620 @@
+-- core/_test_core.t
+--
+-- tests for the core message, datastore, interpreter and cache apis
+
+local m = {}
+
+function m.run(test)
+  test("message refcounting", m.test_refcount)
+  test("shared buffers", m.test_shared_buffer)
+  test("shared buffer views", m.test_shared_buffer_view)
+  test("channels and topics", m.test_channels)
+  test("message freeze/broadcast stress", m.test_broadcast_stress)
+  test("datastore", m.test_datastore)
+  test("datastore compare-and-swap stress", m.test_datastore_stress)
+  test("fork-join interpreter stepping", m.test_step_join)
+  test("batch mode", m.test_batch)
+  test("binary log", m.test_binary_log)
+  test("interpreter pool resizing", m.test_pool_resize)
+  test("cache entries", m.test_cache_entries)
+  test("require cache", m.test_require_cache)
+  test("AOT libraries", m.test_aot)
+  test("sampling profiler", m.test_profiler)
+  test("trace export", m.test_trace)
+end
+
+function m.test_refcount(t)
+  local C = truss.C
+  local live0 = truss.message_stats().live_messages
+
+  local msg = C.create_message(100)
+  t.ok(msg.refcount == 1, "new message has one reference")
+  t.ok(truss.message_stats().live_messages == live0 + 1, "counted as live")
+  C.acquire_message(msg)
+  t.ok(msg.refcount == 2, "acquire adds a reference")
+  C.release_message(msg)
+  t.ok(msg.refcount == 1, "release drops a reference")
+
+  t.ok(C.is_message_frozen(msg) == 0, "new message is not frozen")
+  C.freeze_message(msg)
+  t.ok(C.is_message_frozen(msg) == 1, "message is frozen")
+  C.freeze_message(msg)
+  t.ok(C.is_message_frozen(msg) == 1, "freezing twice is harmless")
+  t.ok(C.get_writable_data(msg) == nil, "frozen message isn't writable")
+  t.expect(C.transfer_message(truss.interpreter_id, msg), -1, "frozen message can't be transferred")
+  t.ok(msg.refcount == 1, "failed transfer keeps the reference")
+  local copy = C.copy_message(msg)
+  t.ok(C.is_message_frozen(copy) == 0, "copy of a frozen message is mutable")
+  t.ok(C.get_writable_data(copy) == copy.data, "copy is writable")
+
+  C.release_message(copy)
+  C.release_message(msg)
+  t.ok(truss.message_stats().live_messages == live0, "messages freed")
+end
+
+function m.test_shared_buffer(t)
+  local C = truss.C
+  local live0 = truss.message_stats().live_messages
+
+  local buf = C.create_shared_buffer(100000, 4096)
+  t.ok(buf ~= nil, "created")
+  t.expect(tonumber(buf.message_type), 4, "TRUSS_MESSAGE_SHARED")
+  t.expect(tonumber(ffi.cast("uintptr_t", buf.data)) % 4096, 0, "aligned")
+  t.ok(C.create_shared_buffer(16, 48) == nil, "alignment must be a power of two")
+  ffi.fill(buf.data, buf.data_length, 7)
+
+  t.expect(C.is_message_exclusive(buf), 1, "new buffer is exclusive")
+  C.acquire_message(buf)
+  t.expect(C.is_message_exclusive(buf), 0, "not exclusive with two references")
+  C.release_message(buf)
+
+  -- the receiver gets the same memory and the sender's only reference
+  local data = buf.data
+  t.expect(C.transfer_message(-1, buf), -1, "no such interpreter")
+  t.expect(C.transfer_message(truss.interpreter_id, buf), 0, "transferred")
+  local received, n = truss.fetch_messages(4)
+  t.expect(n, 1, "received")
+  t.ok(n == 1 and received[0] == buf and received[0].data == data, "same buffer")
+  t.ok(received[0].data[99999] == 7, "contents")
+  t.expect(tonumber(buf.refcount), 1, "reference moved rather than added")
+
+  -- keep it past the fetch, then share it read-only
+  C.acquire_message(buf)
+  truss.fetch_messages(4)
+  C.freeze_message(buf)
+  t.expect(C.is_message_exclusive(buf), 0, "frozen buffers aren't exclusive")
+  C.release_message(buf)
+  t.ok(truss.message_stats().live_messages == live0, "buffers freed")
+end
+
+function m.test_shared_buffer_view(t)
+  local C = truss.C
+  local FloatBuffer = require("native/sharedbuffer.t").SharedBuffer(float)
+  local function new_view()
+    local view = terralib.new(FloatBuffer)
+    view:init()
+    return view
+  end
+
+  local buf = new_view()
+  t.ok(buf:create(1000, 0), "created")
+  t.expect(tonumber(buf.count), 1000, "count")
+  t.expect(tonumber(buf:datasize()), 4000, "datasize")
+  t.ok(buf:is_exclusive(), "new buffer is exclusive")
+
+  local other = new_view()
+  other:view(buf.message)
+  t.ok(other.data == buf.data, "views share the data")
+  t.ok(not buf:is_exclusive(), "not exclusive while viewed")
+  other:release()
+  t.ok(buf:is_exclusive(), "exclusive again once the view is released")
+
+  -- transferring to ourselves: the fetched batch holds the reference
+  -- until the next fetch
+  local data = buf.data
+  t.ok(buf:transfer(truss.interpreter_id), "transferred")
+  t.ok(not buf:is_valid(), "transfer clears the view")
+  local received = new_view()
+  local messages, n = truss.fetch_messages()
+  for i = 0, n - 1 do
+    if messages[i].data == ffi.cast("unsigned char*", data) then
+      received:view(messages[i])
+    end
+  end
+  t.ok(received:is_valid(), "received the buffer")
+  t.ok(not received:is_exclusive(), "not exclusive while the batch holds it")
+  truss.fetch_messages()
+  t.ok(received:is_exclusive(), "exclusive after the next fetch")
+
+  -- bgfx sizes are 32 bit
+  local count = received.count
+  received.count = 2^31
+  t.ok(received:bgfx_ref() == nil, "bgfx_ref refuses buffers over 4 GB")
+  t.ok(received:is_exclusive(), "refused bgfx_ref adds no reference")
+  received.count = count
+
+  -- once shared, it's frozen and can't be transferred
+  received:share(truss.interpreter_id)
+  t.ok(not received:transfer(truss.interpreter_id), "frozen buffer can't be transferred")
+  t.ok(received:is_valid(), "failed transfer keeps the view")
+  truss.fetch_messages()
+  truss.fetch_messages()
+  received:release()
+end
+
+function m.test_channels(t)
+  local C = truss.C
+  local live0 = truss.message_stats().live_messages
+  local function send(channel, value)
+    local msg = C.create_message(0)
+    msg.message_type = value
+    local status = C.channel_push(channel, msg, 0)
+    C.release_message(msg) -- the channel holds its own reference
+    return status
+  end
+  local function pop_type(channel)
+    local msg = C.channel_pop(channel, 0)
+    if msg == nil then return nil end
+    local value = tonumber(msg.message_type)
+    C.release_message(msg)
+    return value
+  end
+
+  local blocking = truss.open_channel("_test_block", 2)
+  t.ok(truss.open_channel("_test_block", 100, "drop_newest") == blocking, "opened by name")
+  t.ok(C.find_channel("_test_block") == blocking, "found by name")
+  t.expect(send(blocking, 10), C.CHANNEL_OK, "push")
+  t.expect(send(blocking, 11), C.CHANNEL_OK, "push")
+  t.expect(send(blocking, 12), C.CHANNEL_TIMEOUT, "full channel times out")
+  t.expect(pop_type(blocking), 10, "fifo")
+
+  local oldest = truss.open_channel("_test_oldest", 2, "drop_oldest")
+  local newest = truss.open_channel("_test_newest", 2, "drop_newest")
+  t.expect(C.subscribe_topic("_test_topic", oldest), 1, "subscribed")
+  t.expect(C.subscribe_topic("_test_topic", newest), 2, "subscribed")
+  local delivered = 0
+  for i = 1, 4 do
+    local msg = C.create_message(0)
+    msg.message_type = 100 + i
+    delivered = delivered + C.publish("_test_topic", msg, 0)
+    C.release_message(msg)
+  end
+  t.expect(delivered, 6, "drop_newest refuses once full")
+  t.expect(pop_type(oldest), 103, "oldest dropped")
+  t.expect(pop_type(newest), 101, "newest dropped")
+  local stats = truss.channel_stats(oldest)
+  t.expect(stats.dropped, 2, "drop count")
+  t.expect(stats.max_depth, 2, "max depth")
+  t.expect(stats.depth, 1, "depth")
+  C.unsubscribe_topic("_test_topic", oldest)
+  C.unsubscribe_topic("_test_topic", newest)
+
+  -- drain everything so the live count balances
+  for _, channel in ipairs({blocking, oldest, newest}) do
+    while pop_type(channel) do end
+  end
+  C.close_channel(blocking)
+  t.expect(send(blocking, 13), C.CHANNEL_CLOSED, "closed channels refuse pushes")
+  t.ok(truss.message_stats().live_messages == live0, "messages freed")
+end
+
+function m.test_broadcast_stress(t)
+  local C = truss.C
+  local stress = require("core/_message_stress_worker.t")
+  local NWORKERS, NROUNDS = 8, 200
+
+  truss.fetch_messages() -- release anything left over
+  local live0 = truss.message_stats().live_messages
+
+  C.set_store_value_str("message_stress_mode", "wait")
+  local workers = {}
+  for i = 1, NWORKERS do
+    workers[i] = C.spawn_interpreter(0, "core/_message_stress_worker.t")
+  end
+  C.set_store_value_str("message_stress_targets", table.concat(workers, " "))
+  local targets = terralib.new(int32[NWORKERS], workers)
+  truss.step_all_interpreters(workers) -- workers pick up the target list
+
+  -- every round each worker (and this interpreter) broadcasts one frozen
+  -- message to all of the workers in parallel
+  C.set_store_value_str("message_stress_mode", "send")
+  for round = 1, NROUNDS do
+    truss.step_interpreters(workers)
+    local msg = C.create_message(stress.PAYLOAD_SIZE)
+    stress.fill(msg, round)
+    C.broadcast_message(targets, NWORKERS, msg)
+    C.release_message(msg)
+    truss.join_interpreters(workers)
+  end
+  C.set_store_value_str("message_stress_mode", "drain")
+  truss.step_all_interpreters(workers)
+  C.set_store_value_str("message_stress_mode", "report")
+  truss.step_all_interpreters(workers)
+
+  local errors, received = 0, 0
+  local messages, n = truss.fetch_messages()
+  for i = 0, n - 1 do
+    local report = ffi.string(messages[i].data, messages[i].data_length)
+    local e, r = report:match("(%d+) (%d+)")
+    errors = errors + tonumber(e)
+    received = received + tonumber(r)
+  end
+  truss.fetch_messages() -- releases the reports
+
+  t.expect(n, NWORKERS, "every worker reported")
+  t.expect(errors, 0, "no corrupted or unfrozen messages")
+  t.expect(received, NROUNDS * NWORKERS * (NWORKERS + 1), "all deliveries")
+  t.expect(truss.message_stats().live_messages, live0, "every message freed")
+
+  for _, w in ipairs(workers) do C.stop_interpreter(w) end
+end
+
+local function store_string(key, version)
+  local val = truss.C.get_store_value_versioned(key, version)
+  if val == nil then return nil end
+  return ffi.string(val.data, val.data_length)
+end
+
+function m.test_datastore(t)
+  local C = truss.C
+  local key = "_test_datastore_key"
+  local version = terralib.new(uint64[1])
+
+  t.expect(tonumber(C.get_store_version(key)), 0, "unwritten key has version 0")
+  t.expect(C.set_store_value_str(key, "a"), 0, "first set adds the key")
+  t.expect(store_string(key, version), "a", "read back value")
+  t.expect(tonumber(version[0]), 1, "first write is version 1")
+  t.expect(C.set_store_value_str(key, "b"), 1, "second set replaces")
+  t.expect(tonumber(C.get_store_version(key)), 2, "version increases")
+
+  local msg = C.create_message(1)
+  msg.data[0] = string.byte("c")
+  t.expect(tonumber(C.compare_and_swap_store_value(key, 1, msg)), 0, "stale cas fails")
+  t.expect(tonumber(C.compare_and_swap_store_value(key, 2, msg)), 3, "current cas succeeds")
+  t.expect(store_string(key), "c", "cas wrote the value")
+
+  local held = C.acquire_store_value(key, version)
+  t.ok(held == msg and version[0] == 3, "acquired read")
+  C.release_message(held)
+  C.release_message(msg)
+
+  t.expect(C.erase_store_value(key), 1, "erase existing key")
+  t.ok(C.get_store_value(key) == nil, "erased key reads nil")
+  t.expect(tonumber(C.get_store_version(key)), 4, "erase bumps the version")
+  t.expect(C.erase_store_value(key), 0, "erase missing key")
+end
+
+function m.test_datastore_stress(t)
+  local C = truss.C
+  local stress = require("core/_message_stress_worker.t")
+  local NWORKERS, NSTEPS = 8, 20
+
+  C.set_store_value_str("message_stress_mode", "wait")
+  C.erase_store_value(stress.COUNTER_KEY)
+  local version0 = tonumber(C.get_store_version(stress.COUNTER_KEY))
+  local workers = {}
+  for i = 1, NWORKERS do
+    workers[i] = C.spawn_interpreter(0, "core/_message_stress_worker.t")
+  end
+  C.set_store_value_str("message_stress_targets", table.concat(workers, " "))
+  truss.step_all_interpreters(workers)
+
+  -- every worker (and this interpreter) increments the same key at once
+  C.set_store_value_str("message_stress_mode", "count")
+  for step = 1, NSTEPS do
+    truss.step_interpreters(workers)
+    for i = 1, stress.CAS_PER_STEP do stress.cas_increment() end
+    truss.join_interpreters(workers)
+  end
+  C.set_store_value_str("message_stress_mode", "wait")
+
+  local expected = NSTEPS * stress.CAS_PER_STEP * (NWORKERS + 1)
+  local cur = C.get_store_value(stress.COUNTER_KEY)
+  t.expect(terralib.cast(&uint32, cur.data)[0], expected, "no lost increments")
+  t.expect(tonumber(C.get_store_version(stress.COUNTER_KEY)), version0 + expected,
+           "one version per increment")
+
+  for _, w in ipairs(workers) do C.stop_interpreter(w) end
+  truss.fetch_messages()
+end
+
+function m.test_step_join(t)
+  local C = truss.C
+  local stress = require("core/_message_stress_worker.t")
+  local NWORKERS = 4
+
+  C.set_store_value_str("message_stress_mode", "wait")
+  local workers = {}
+  for i = 1, NWORKERS do
+    workers[i] = C.spawn_interpreter(0, "core/_message_stress_worker.t")
+  end
+  C.set_store_value_str("message_stress_targets", table.concat(workers, " "))
+  local nrunning, frame_ms = truss.step_all_interpreters(workers)
+  t.expect(nrunning, 0, "join waits for every worker")
+  t.ok(#frame_ms == NWORKERS and frame_ms[1] >= 0, "frame times reported")
+
+  C.set_store_value_str("message_stress_mode", "sleep")
+  t.expect(truss.step_interpreters(workers), NWORKERS, "every worker stepped")
+  t.expect(truss.step_interpreters(workers), 0, "busy workers aren't stepped again")
+  t.ok(truss.join_interpreters(workers, 0) > 0, "polling join doesn't wait")
+  nrunning, frame_ms = truss.join_interpreters(workers)
+  t.expect(nrunning, 0, "blocking join finishes")
+  local all_slept = true
+  for i = 1, NWORKERS do
+    all_slept = all_slept and frame_ms[i] >= stress.SLEEP_MS * 0.9
+    all_slept = all_slept and C.get_interpreter_frame_time(workers[i]) == frame_ms[i]
+  end
+  t.ok(all_slept, "frame times cover the step")
+  for _, w in ipairs(workers) do
+    t.expect(tonumber(C.get_interpreter_state(w)), truss.C_raw.THREAD_IDLE, "idle after join")
+  end
+
+  C.set_store_value_str("message_stress_mode", "wait")
+  for _, w in ipairs(workers) do C.stop_interpreter(w) end
+  truss.fetch_messages()
+end
+
+function m.test_batch(t)
+  -- run a second truss in batch mode from a scratch directory, so that its
+  -- trusslog.txt doesn't replace ours
+  local exe = truss.args[1]
+  if not (exe:match("^[/\\]") or exe:match("^%a:")) then exe = "../" .. exe end
+  local dir = "_test_batch"
+  os.execute("mkdir " .. dir)
+  local cmd = ('cd %s && "%s" --batch core/_batch_test_job.t --jobs 2 ok fail ok error ok')
+  local f = io.popen(cmd:format(dir, exe), "r")
+  local out = f:read("*a")
+  f:close()
+  os.remove(dir .. "/trusslog.txt")
+  os.remove(dir)
+
+  t.ok(out:find("5 jobs of core/_batch_test_job.t on 2 workers", 1, true) ~= nil,
+       "workers started")
+  t.ok(out:find("Batch: 3 ok, 2 failed", 1, true) ~= nil, "every job ran")
+  t.ok(out:find("FAILED [1] fail", 1, true) ~= nil, "false is status 1")
+  t.ok(out:find("FAILED [-1] error: ", 1, true) ~= nil, "errors are reported")
+end
+
+-- records of a binary log (see logger.h): {level, interpreter, text}
+local function read_binary_log(data)
+  local records = {}
+  local pos = 8
+  while pos + 20 <= #data do
+    local header = ffi.cast("const uint8_t*", data) + pos
+    local length = ffi.cast("const uint32_t*", header)[0]
+    local level = ffi.cast("const int32_t*", header + 4)[0]
+    local interpreter = ffi.cast("const int32_t*", header + 8)[0]
+    table.insert(records, {level, interpreter, data:sub(pos + 21, pos + 20 + length)})
+    pos = pos + 20 + length
+  end
+  return records
+end
+
+function m.test_binary_log(t)
+  -- a second truss logs more than its ring buffer holds, so the ring wraps
+  -- around, and quits right away, so the tail only lands on shutdown
+  local exe = truss.args[1]
+  if not (exe:match("^[/\\]") or exe:match("^%a:")) then exe = "../" .. exe end
+  local dir = "_test_log"
+  os.execute("mkdir " .. dir)
+  local cmd = ('cd %s && "%s" --binary-log --log-level 2 --batch core/_log_test_job.t x')
+  local f = io.popen(cmd:format(dir, exe), "r")
+  f:read("*a")
+  f:close()
+  local binfile = io.open(dir .. "/trusslog.bin", "rb")
+  local data = binfile and binfile:read("*a") or ""
+  if binfile then binfile:close() end
+  local textfile = io.open(dir .. "/trusslog.txt", "rb")
+  if textfile then textfile:close() end
+  os.remove(dir .. "/trusslog.bin")
+  os.remove(dir .. "/trusslog.txt")
+  os.remove(dir)
+
+  t.ok(textfile == nil, "no text log alongside the binary one")
+  t.expect(data:sub(1, 8), "TRUSSLOG", "binary log header")
+  local job = require("core/_log_test_job.t")
+  local next_index, in_order, filtered = 1, true, 0
+  for _, record in ipairs(read_binary_log(data)) do
+    local level, text = record[1], record[3]
+    if text:find("^logtest filtered") then
+      filtered = filtered + 1
+    else
+      local index = tonumber(text:match("^logtest (%d+) "))
+      if index then
+        in_order = in_order and index == next_index and level == 2 and
+                   text == ("logtest %d %s"):format(index, job.PADDING)
+        next_index = index + 1
+      end
+    end
+  end
+  t.expect(filtered, 0, "records below the log level are discarded")
+  t.expect(next_index - 1, job.COUNT, "every warning was written")
+  t.ok(in_order, "warnings are intact and in order")
+end
+
+function m.test_pool_resize(t)
+  local C = truss.C
+  local target0 = truss.interpreter_pool_stats().target_size
+  local function fill(n)
+    truss.set_interpreter_pool_size(n)
+    local stats = truss.interpreter_pool_stats()
+    while stats.ready < n and stats.booting > 0 do
+      C.sleep(1)
+      stats = truss.interpreter_pool_stats()
+    end
+    return stats.ready
+  end
+
+  C.set_store_value_str("message_stress_mode", "wait")
+  truss.set_interpreter_pool_size(0)
+  local first = C.spawn_interpreter(0, "core/_message_stress_worker.t")
+  C.stop_interpreter(first)
+  local NPOOL = 2
+  for cycle = 1, 3 do
+    t.expect(fill(NPOOL), NPOOL, "pool filled (" .. cycle .. ")")
+    truss.set_interpreter_pool_size(0)
+  end
+  -- trimmed interpreters gave their slots back, so the cycles above only
+  -- ever used NPOOL new slots, and a cold spawn takes one of them
+  local id = C.spawn_interpreter(0, "core/_message_stress_worker.t")
+  t.ok(id <= first + NPOOL, "trimmed slots are reused")
+  C.stop_interpreter(id)
+  truss.set_interpreter_pool_size(target0)
+end
+
+function m.test_cache_entries(t)
+  local C = truss.C
+  local data = "cached data " .. tostring(truss.tic())
+  local key = C.hash_data(data, #data, 0)
+  t.ok(C.hash_data(data, #data, 0) == key, "hash is deterministic")
+  t.ok(C.hash_data(data, #data, key) ~= key, "seed changes the hash")
+  t.ok(C.load_cache_entry("test", key) == nil, "missing entry")
+  t.expect(C.save_cache_entry("test", key, data, #data), 0, "entry saved")
+  local entry = C.load_cache_entry("test", key)
+  t.ok(entry ~= nil and ffi.string(entry.data, entry.data_length) == data,
+       "entry round trips")
+  if entry ~= nil then C.release_message(entry) end
+
+  local filename = ("cache/test/%s.bin"):format(bit.tohex(key, 16))
+  local realdir = C.get_file_real_path(filename)
+  t.ok(realdir ~= nil, "entry file exists")
+  if realdir == nil then return end
+  local path = ffi.string(realdir) .. "/" .. filename
+  -- flip a payload byte (after the 32 byte header): the content hash no
+  -- longer matches
+  local f = io.open(path, "r+b")
+  f:seek("set", 32 + 3)
+  f:write(data:sub(4, 4) == "x" and "y" or "x")
+  f:close()
+  t.ok(C.load_cache_entry("test", key) == nil, "corrupted entry is rejected")
+  os.remove(path)
+end
+
+function m.test_require_cache(t)
+  local cache = truss.require_cache
+  local modname = "core/_require_cache_module.lua"
+  local hits0 = cache.hits
+  t.expect(truss.require(modname, {force = true}).value, 42, "first load")
+  t.expect(truss.require(modname, {force = true}).value, 42, "second load")
+  if cache.enabled then
+    t.ok(cache.hits > hits0, "second load hits the cache")
+  end
+end
+
+function m.test_aot(t)
+  local build = require("core/build.t")
+  local modname = "core/_aot_test_module.t"
+  local lib_path = build.aot_library_path("_test")
+  local manifest_path = build.aot_manifest_path("_test")
+  os.remove(lib_path)
+  os.remove(manifest_path)
+
+  -- without a library everything stays JIT compiled
+  build.forget_aot_group("_test")
+  local mod = truss.require(modname, {force = true})
+  t.ok(mod.add == mod.original.add, "no library: add is the original")
+  t.ok(mod.sum_pair == mod.original.sum_pair, "no library: sum_pair is the original")
+  t.expect(mod.add(2, 3), 5, "no library: add")
+
+  local ok, nsaved = pcall(build.save_aot_library, "_test")
+  t.ok(ok, "saved library: " .. tostring(nsaved))
+  if not ok then return end
+  t.expect(nsaved, 2, "struct returned by value is left out")
+  local manifest = truss.load_string_from_file(manifest_path)
+  t.ok(manifest:find(modname, 1, true) ~= nil, "manifest hashes the module")
+  t.ok(manifest:find("core/_test_core.t", 1, true) == nil,
+       "manifest doesn't hash unrelated modules")
+
+  -- with one, precompiled externs are returned
+  build.forget_aot_group("_test")
+  mod = truss.require(modname, {force = true})
+  t.ok(mod.add ~= mod.original.add, "library: add is an extern")
+  t.ok(mod.sum_pair ~= mod.original.sum_pair, "library: sum_pair is an extern")
+  t.ok(mod.make_pair == mod.original.make_pair, "library: make_pair is the original")
+  t.expect(mod.add(2, 3), 5, "library: add")
+  local pair = terralib.new(mod.Pair[1])
+  pair[0].a, pair[0].b = 4, 5
+  t.expect(mod.sum_pair(pair), 9, "library: sum_pair")
+  local add_twice = terra(a: int32): int32
+    var p = mod.Pair {a, a}
+    return mod.add(a, a) + mod.sum_pair(&p)
+  end
+  t.expect(add_twice(3), 12, "externs called from terra")
+
+  build.forget_aot_group("_test")
+  os.remove(manifest_path)
+  os.remove(lib_path) -- (fails harmlessly where a linked library is locked)
+end
+
+function m.test_trace(t)
+  local json = require("lib/json.lua")
+  local C = truss.C
+  local was_enabled = C.trace_enabled() ~= 0
+  truss.set_tracing(true)
+  C.trace_thread_name("trace test")
+  local outer = truss.trace_begin()
+  local inner = truss.trace_begin()
+  C.sleep(2)
+  truss.trace_end(inner, "_test_trace inner", "test")
+  C.sleep(2)
+  truss.trace_end(outer, "_test_trace outer", "test")
+  truss.set_tracing(was_enabled)
+
+  local path = "_test_trace.json"
+  t.expect(C.save_trace(path), 0, "saved")
+  local trace = json:decode(truss.load_string_from_file(path))
+  os.remove(path)
+  t.ok(trace and trace.traceEvents, "valid trace json")
+  if not (trace and trace.traceEvents) then return end
+  t.ok(type(trace.otherData.dropped_spans) == "number", "records dropped spans")
+  t.ok(trace.otherData.truncated == (trace.otherData.dropped_spans > 0),
+       "records whether the trace was truncated")
+
+  local spans, named = {}, false
+  for _, event in ipairs(trace.traceEvents) do
+    if event.ph == "X" and event.cat == "test" then spans[event.name] = event end
+    if event.ph == "M" and event.args.name == "trace test" then named = true end
+  end
+  local o, i = spans["_test_trace outer"], spans["_test_trace inner"]
+  t.ok(named, "thread name")
+  t.ok(o and i, "both spans exported")
+  if not (o and i) then return end
+  t.ok(o.tid == i.tid and o.pid == i.pid, "same thread")
+  t.ok(i.ts >= o.ts and i.ts + i.dur <= o.ts + o.dur, "inner span nests in outer")
+  t.ok(o.dur >= 4000 and i.dur >= 2000, "durations in microseconds")
+end
+
+function m.test_profiler(t)
+  local profiler = require("core/profiler.t")
+  local was_running = profiler.is_running()
+  profiler.stop()
+  profiler.reset()
+  t.ok(profiler.start({interval_ms = 1}), "profiler started")
+
+  local function spin(ms)
+    local t0 = truss.tic()
+    local x = 0
+    while truss.toc(t0) * 1000.0 < ms do
+      for i = 1, 1000 do x = x + math.sin(i) end
+    end
+    return x
+  end
+  spin(100)
+  profiler.stop()
+
+  t.ok(profiler.sample_count() > 0, "collected samples")
+  local collapsed = profiler.collapsed()
+  t.ok(collapsed:match("^[^\n]+ %d+\n") ~= nil, "collapsed stack lines")
+  t.ok(collapsed:find("_test_core.t", 1, true) ~= nil, "samples attributed to this file")
+  t.ok(profiler.report(5):find("self samples by files", 1, true) ~= nil, "report")
+
+  -- another interpreter can't take the profiler while it's held
+  t.expect(truss.C.acquire_profiler(truss.interpreter_id), 0, "acquire")
+  t.expect(truss.C.acquire_profiler(truss.interpreter_id + 1), -1, "held elsewhere")
+  truss.C.release_profiler(truss.interpreter_id)
+
+  profiler.reset()
+  if was_running then profiler.start() end
+end
+
+return m
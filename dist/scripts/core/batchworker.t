@@ -0,0 +1,84 @@
+-- core/batchworker.t
+--
+-- worker side of batch mode (truss --batch script.t --jobs N inputs...,
+-- see src/truss/batch.h): each update pops one input off the batch/jobs
+-- channel, calls the batch script's process(input, index), and reports
+-- its status and time on batch/results; quits once the jobs run out
+--
+-- process returns nothing, true or 0 for success, false for status 1, or
+-- a numeric status; raising an error reports status -1 with the message
+
+local m = {}
+local C = truss.C
+
+-- set by the runner before any worker is spawned
+local function batch_script_name()
+  local val = C.get_store_value("batch/script")
+  if val == nil then return nil end
+  return ffi.string(val.data, val.data_length)
+end
+
+function m.init()
+  m.jobs = C.find_channel("batch/jobs")
+  m.results = C.find_channel("batch/results")
+  if m.jobs == nil or m.results == nil then
+    log.error("Batch worker started without batch channels")
+    truss.quit(1)
+  end
+end
+
+-- loaded on the first update rather than in init, so that every worker
+-- compiles the script in parallel
+local function load_script()
+  local name = batch_script_name()
+  local happy, script = pcall(truss.require, name)
+  if not happy then
+    m.load_error = "unable to load " .. tostring(name) .. ": " .. tostring(script)
+    log.error(m.load_error)
+  elseif type(script) ~= "table" or type(script.process) ~= "function" then
+    m.load_error = tostring(name) .. " has no process(input, index) function"
+    log.error(m.load_error)
+  else
+    m.script = script
+  end
+end
+
+local function run_job(input, index)
+  if m.load_error then return -1, m.load_error end
+  local happy, ret = pcall(m.script.process, input, index)
+  if not happy then
+    log.error(("Batch job %d (%s) failed: %s"):format(index, input, tostring(ret)))
+    return -1, tostring(ret)
+  end
+  if ret == nil or ret == true then return 0, "" end
+  if ret == false then return 1, "" end
+  return tonumber(ret) or 1, ""
+end
+
+local function report(index, status, ms, err)
+  local text = ("%d\t%d\t%f\t%s"):format(index, status, ms, (err:gsub("[\r\n]", " ")))
+  local msg = C.create_message(#text)
+  msg.message_type = C.message_CSTR
+  ffi.copy(msg.data, text, #text)
+  C.channel_push(m.results, msg, -1)
+  C.release_message(msg)
+end
+
+function m.update()
+  if not (m.script or m.load_error) then load_script() end
+
+  local msg = C.channel_pop(m.jobs, 0)
+  if msg == nil then
+    truss.quit()
+    return
+  end
+  local index, input = ffi.string(msg.data, msg.data_length):match("^(%d+)\t(.*)$")
+  C.release_message(msg)
+  index = tonumber(index)
+
+  local t0 = truss.tic()
+  local status, err = run_job(input, index)
+  report(index, status, truss.toc(t0) * 1000.0, err)
+end
+
+return m
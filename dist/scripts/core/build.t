@@ -54,4 +54,266 @@ function m.create_cross_compilation_root(options)
   return root
 end
 
+-- Ahead-of-time compilation
+--
+-- Modules mark Terra functions worth precompiling with build.aot (or
+-- build.aot_module for several at once). Normally that just records the
+-- function and returns it, so it gets JIT compiled on first use as usual.
+-- dev/build_aot.t requires the modules and saves every recorded function
+-- of a group into lib/<prefix>truss_aot_<group><ext> with terralib.saveobj,
+-- plus a manifest with each function's signature and a hash of the source
+-- of every module that added functions to the group. Later, while the
+-- manifest still matches (same Terra and truss versions, none of those
+-- sources changed), build.aot links the library and returns an extern
+-- declared from the recorded signature instead, so the function is never
+-- typechecked or JIT compiled.
+--
+-- Signatures are Lua expressions over the primitive types (see
+-- encode_type); pointers to structs are recorded as &opaque, which has the
+-- same ABI, so the manifest doesn't need the module's own types. Functions
+-- whose signatures can't be written that way (e.g. a struct passed or
+-- returned by value) are always JIT compiled.
+
+local AOT_FORMAT = 2
+local aot_groups = {}
+local aot_building = false
+
+local function aot_symbol(group_name, name)
+  return "truss_aot_" .. group_name .. "_" .. name
+end
+
+function m.aot_library_path(group_name)
+  return "lib/" .. truss.library_prefix .. "truss_aot_" .. group_name ..
+         truss.library_extension
+end
+
+function m.aot_manifest_path(group_name)
+  return "lib/truss_aot_" .. group_name .. ".manifest"
+end
+
+local function source_hash(modname)
+  local fullpath = truss._script_path .. modname
+  if truss.C.check_file(fullpath) == 2 then
+    fullpath = fullpath .. "/init.t"
+  end
+  local src = truss.C.map_file(fullpath)
+  if src == nil then return nil end
+  local hash = truss.C.hash_data(src.data, src.data_length, 0)
+  truss.C.release_message(src)
+  return bit.tohex(hash, 16)
+end
+
+local primitive_types = {}
+for _, t in ipairs({bool, int8, int16, int32, int64, uint8, uint16, uint32,
+                    uint64, float, double}) do
+  primitive_types[tostring(t)] = t
+end
+
+local signature_env = {
+  opaque = terralib.types.opaque,
+  unit = terralib.types.unit,
+  ptr = terralib.types.pointer,
+  arr = terralib.types.array,
+  vec = terralib.types.vector,
+  fn = function(params, ret) return terralib.types.functype(params, ret, false) end
+}
+for name, t in pairs(primitive_types) do signature_env[name] = t end
+
+local encode_function_type
+
+-- t as an expression over signature_env, or nil; with lower_pointers,
+-- pointers to types that can't be written out become ptr(opaque)
+local function encode_type(t, lower_pointers)
+  if t == terralib.types.opaque then return "opaque" end
+  if primitive_types[tostring(t)] == t then return tostring(t) end
+  if t:ispointer() then
+    local inner = encode_type(t.type, false)
+    if inner then return "ptr(" .. inner .. ")" end
+    if lower_pointers and not t.type:isfunction() then return "ptr(opaque)" end
+    return nil
+  end
+  if t:isarray() or t:isvector() then
+    local inner = encode_type(t.type, false)
+    if not inner then return nil end
+    return ("%s(%s, %d)"):format(t:isarray() and "arr" or "vec", inner, t.N)
+  end
+  if t:isfunction() then return encode_function_type(t, false) end
+  return nil
+end
+
+encode_function_type = function(t, lower_pointers)
+  if t.isvararg then return nil end
+  local params = {}
+  for i, param in ipairs(t.parameters) do
+    params[i] = encode_type(param, lower_pointers)
+    if not params[i] then return nil end
+  end
+  local ret = "unit"
+  if t.returntype ~= terralib.types.unit then
+    ret = encode_type(t.returntype, false)
+    if not ret then return nil end
+  end
+  return ("fn({%s}, %s)"):format(table.concat(params, ", "), ret)
+end
+
+local function decode_signature(signature)
+  local def = loadstring("return " .. signature)
+  if not def then return nil end
+  setfenv(def, signature_env)
+  local ok, fntype = pcall(def)
+  if not (ok and terralib.types.istype(fntype) and fntype:isfunction()) then
+    return nil
+  end
+  return fntype
+end
+
+local function aot_versions()
+  return tostring(terralib.version) .. "|" .. truss.VERSION .. "|" .. AOT_FORMAT
+end
+
+local function load_manifest(group_name)
+  local path = m.aot_manifest_path(group_name)
+  if not truss.is_file(path) then return nil end
+  local manifest_def = loadstring(truss.load_string_from_file(path), path)
+  if not manifest_def then return nil end
+  setfenv(manifest_def, {})
+  local ok, manifest = pcall(manifest_def)
+  if not (ok and type(manifest) == "table") then return nil end
+  return manifest
+end
+
+-- the reason a manifest can't be used, or nil if it's current
+local function stale_reason(manifest)
+  if manifest.versions ~= aot_versions() then
+    return "built with a different Terra or truss version"
+  end
+  for modname, hash in pairs(manifest.sources) do
+    if source_hash(modname) ~= hash then
+      return "[" .. modname .. "] has changed"
+    end
+  end
+  return nil
+end
+
+local function get_aot_group(group_name)
+  local group = aot_groups[group_name]
+  if group then return group end
+  group = {name = group_name, functions = {}, order = {}, modules = {},
+           signatures = {}}
+  aot_groups[group_name] = group
+  if aot_building or not m.is_native() then return group end
+
+  local manifest = load_manifest(group_name)
+  if not manifest then return group end
+  local reason = stale_reason(manifest)
+  if reason then
+    log.info("AOT library [" .. group_name .. "] is stale (" .. reason ..
+             "); rebuild with dev/build_aot.t")
+    return group
+  end
+  local ok, err = pcall(terralib.linklibrary, m.aot_library_path(group_name))
+  if not ok then
+    log.warn("Unable to link AOT library [" .. group_name .. "]: " .. tostring(err))
+    return group
+  end
+  group.signatures = manifest.signatures
+  log.info("Using AOT library [" .. group_name .. "]")
+  return group
+end
+
+local function add_aot_function(group_name, name, fn, modname)
+  if not m.is_native() then return fn end
+  local group = get_aot_group(group_name)
+  if not group.functions[name] then
+    table.insert(group.order, name)
+  end
+  group.functions[name] = fn
+  if modname then group.modules[modname] = true end
+  local fntype = group.signatures[name] and decode_signature(group.signatures[name])
+  if fntype then
+    return terralib.externfunction(aot_symbol(group_name, name), fntype)
+  end
+  return fn
+end
+
+-- the name of the module calling into build.t, from its environment
+local function calling_module()
+  return rawget(getfenv(3), "_module_name")
+end
+
+-- returns fn, or an extern bound to its precompiled version
+function m.aot(group_name, name, fn)
+  return add_aot_function(group_name, name, fn, calling_module())
+end
+
+-- replaces each of the named functions in tab with build.aot(...)
+function m.aot_module(group_name, tab, names)
+  local modname = calling_module()
+  for _, name in ipairs(names) do
+    tab[name] = add_aot_function(group_name, name, tab[name], modname)
+  end
+  return tab
+end
+
+-- drops what's been recorded for a group, so the next build.aot for it
+-- reads its manifest again
+function m.forget_aot_group(group_name)
+  aot_groups[group_name] = nil
+end
+
+-- while building, build.aot never substitutes precompiled functions, so
+-- the new library doesn't depend on the old one
+function m.begin_aot_build()
+  aot_building = true
+end
+
+function m.aot_group_names()
+  local names = {}
+  for group_name, _ in pairs(aot_groups) do table.insert(names, group_name) end
+  table.sort(names)
+  return names
+end
+
+-- compiles and saves a group's library and manifest; every module it
+-- depends on must have been required already. Returns the number of
+-- functions saved.
+function m.save_aot_library(group_name, link_args)
+  local group = aot_groups[group_name]
+  if not group then truss.error("No AOT functions in group [" .. group_name .. "]") end
+
+  local exports, signatures, saved = {}, {}, {}
+  for _, name in ipairs(group.order) do
+    local fn = group.functions[name]
+    local signature = encode_function_type(fn:gettype(), true)
+    if signature then
+      exports[aot_symbol(group_name, name)] = fn
+      signatures[name] = signature
+      table.insert(saved, name)
+    else
+      log.warn("AOT [" .. group_name .. "]: signature of [" .. name ..
+               "] can't be recorded; it will be JIT compiled")
+    end
+  end
+  terralib.saveobj(m.aot_library_path(group_name), "sharedlib", exports, link_args)
+
+  local modnames = {}
+  for modname, _ in pairs(group.modules) do table.insert(modnames, modname) end
+  table.sort(modnames)
+
+  local lines = {"return {", string.format("  versions = %q,", aot_versions()),
+                 "  sources = {"}
+  for _, modname in ipairs(modnames) do
+    table.insert(lines, string.format("    [%q] = %q,", modname, source_hash(modname)))
+  end
+  table.insert(lines, "  },")
+  table.insert(lines, "  signatures = {")
+  for _, name in ipairs(saved) do
+    table.insert(lines, string.format("    [%q] = %q,", name, signatures[name]))
+  end
+  table.insert(lines, "  }")
+  table.insert(lines, "}")
+  truss.save_string(m.aot_manifest_path(group_name), table.concat(lines, "\n") .. "\n")
+  return #saved
+end
+
 return m
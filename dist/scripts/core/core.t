@@ -51,15 +51,26 @@ local function stringify_args(...)
 end
 
 -- let log be a global because it's inconvenient to have to do truss.log
+-- (filtered levels skip stringifying their arguments)
 log = {}
-log.debug = function(...) ctruss.truss_log(4, stringify_args(...)) end
-log.info = function(...) ctruss.truss_log(3, stringify_args(...)) end
-log.warn = function(...) ctruss.truss_log(2, stringify_args(...)) end
+local function log_at(level)
+  return function(...)
+    if level <= ctruss.truss_get_log_level() then
+      ctruss.truss_log(level, stringify_args(...))
+    end
+  end
+end
+log.debug = log_at(4)
+log.info = log_at(3)
+log.warn = log_at(2)
 log.warning = log.warn
-log.error = function(...) ctruss.truss_log(1, stringify_args(...)) end
-log.critical = function(...) ctruss.truss_log(0, stringify_args(...)) end
+log.error = log_at(1)
+log.critical = log_at(0)
 truss.log = log
 
+function truss.set_log_level(level) ctruss.truss_set_log_level(level) end
+function truss.flush_log() ctruss.truss_flush_log() end
+
 -- use default lua error handling
 truss.error = error
 
@@ -106,6 +117,25 @@ terra truss.toc(startTime: uint64)
   return deltaF / [float](freq)
 end
 
+-- tracing (see truss_trace_* in truss_api.h); spans are only recorded
+-- while tracing is on, e.g. when started with --profile-startup:
+--   local t0 = truss.trace_begin()
+--   ...
+--   truss.trace_end(t0, "name", "category")
+local _tracing = truss.C.trace_enabled() ~= 0
+function truss.set_tracing(enabled)
+  truss.C.set_trace_enabled(enabled and 1 or 0)
+  _tracing = enabled
+end
+
+function truss.trace_begin()
+  return _tracing and truss.C.trace_now()
+end
+
+function truss.trace_end(t0, name, category)
+  if t0 then truss.C.trace_span(name, category or "lua", t0) end
+end
+
 -- register a function to be called right before truss quits
 -- (e.g., openvr cleanup)
 truss._cleanup_functions = {}
@@ -139,8 +169,9 @@ function truss.quit(code)
 end
 
 -- load an entire file into memory as a string (8-bit clean)
+-- (the file is mapped rather than read, so the Lua string is the only copy)
 function truss.load_string_from_file(filename)
-  local temp = truss.C.load_file(filename)
+  local temp = truss.C.map_file(filename)
   if temp ~= nil then
     local ret = ffi.string(temp.data, temp.data_length)
     truss.C.release_message(temp)
@@ -262,6 +293,102 @@ function truss.list_directory(path)
   return ret
 end
 
+-- fetch every message sent to this interpreter since the last fetch;
+-- returns a (truss_message**, count) pair that stays valid until the next
+-- fetch, which also releases the previous batch. If message_type is given
+-- only messages of that type are fetched and the rest are left for later;
+-- each type keeps its own batch, released by the next fetch of that type.
+local _fetch_count = terralib.new(int32[1])
+function truss.fetch_messages(message_type)
+  local messages
+  if message_type then
+    messages = truss.C.fetch_typed_message_array(TRUSS_ID, message_type, _fetch_count)
+  else
+    messages = truss.C.fetch_message_array(TRUSS_ID, _fetch_count)
+  end
+  return messages, _fetch_count[0]
+end
+
+-- bounded channels and topics (see truss_open_channel in truss_api.h);
+-- policy is "block" (default), "drop_oldest" or "drop_newest"
+local _channel_policies = {
+  block = truss.C.CHANNEL_BLOCK,
+  drop_oldest = truss.C.CHANNEL_DROP_OLDEST,
+  drop_newest = truss.C.CHANNEL_DROP_NEWEST
+}
+function truss.open_channel(name, capacity, policy)
+  local policy_id = _channel_policies[policy or "block"]
+  if not policy_id then truss.error("Unknown channel policy " .. tostring(policy)) end
+  return truss.C.open_channel(name, capacity or 64, policy_id)
+end
+
+-- returns the channel's counters as a plain table
+function truss.channel_stats(channel)
+  local stats = terralib.new(truss.C.channel_stats)
+  truss.C.get_channel_stats(channel, stats)
+  return {
+    pushed = tonumber(stats.pushed),
+    popped = tonumber(stats.popped),
+    dropped = tonumber(stats.dropped),
+    depth = stats.depth,
+    max_depth = stats.max_depth,
+    capacity = stats.capacity,
+    mean_latency_ms = stats.mean_latency_ms,
+    max_latency_ms = stats.max_latency_ms
+  }
+end
+
+-- keep n interpreters booted in the background so spawning is fast
+function truss.set_interpreter_pool_size(n)
+  truss.C.set_interpreter_pool_size(n)
+end
+
+-- returns interpreter pool metrics as a plain table (see
+-- truss_interpreter_pool_stats in truss_api.h for the fields)
+function truss.interpreter_pool_stats()
+  local stats = terralib.new(truss.C.interpreter_pool_stats)
+  truss.C.get_interpreter_pool_stats(stats)
+  return {
+    target_size = stats.target_size,
+    ready = stats.ready,
+    booting = stats.booting,
+    warm_spawns = tonumber(stats.warm_spawns),
+    cold_spawns = tonumber(stats.cold_spawns),
+    last_spawn_ms = stats.last_spawn_ms,
+    avg_warm_spawn_ms = stats.avg_warm_spawn_ms,
+    avg_cold_spawn_ms = stats.avg_cold_spawn_ms,
+    avg_boot_ms = stats.avg_boot_ms,
+    occupancy = stats.occupancy
+  }
+end
+
+-- fork-join frame stepping: step_interpreters starts a step on each of the
+-- listed interpreters, and join_interpreters blocks until they finish
+-- (timeout_ms: nil waits forever, 0 just polls). The join returns how many
+-- are still running and a list of frame times in ms (-1 if unfinished).
+local function interpreter_id_array(ids)
+  return terralib.new(int32[math.max(#ids, 1)], ids), #ids
+end
+
+function truss.step_interpreters(ids)
+  return truss.C.step_interpreters(interpreter_id_array(ids))
+end
+
+function truss.join_interpreters(ids, timeout_ms)
+  local targets, n = interpreter_id_array(ids)
+  local frame_ms = terralib.new(double[math.max(n, 1)])
+  local nrunning = truss.C.join_interpreters(targets, n, timeout_ms or -1, frame_ms)
+  local times = {}
+  for i = 1, n do times[i] = frame_ms[i - 1] end
+  return nrunning, times
+end
+
+-- steps the interpreters and waits for all of them
+function truss.step_all_interpreters(ids)
+  truss.step_interpreters(ids)
+  return truss.join_interpreters(ids)
+end
+
 function truss.extract_from_archive(src_path, dest_path)
   if not (truss.is_file(src_path) and truss.is_archived(src_path)) then
     truss.error(src_path .. " is not a file or is not in archive!")
@@ -295,8 +422,9 @@ function truss.is_archived(path)
   return ext == ".zip" 
 end
 
+-- returns whether the whole string was written
 function truss.save_string(filename, s)
-  truss.C.save_data(filename, s, #s)
+  return truss.C.save_data(filename, s, #s) == 0
 end
 
 function truss.save_data(filename, data, datasize)
@@ -310,9 +438,9 @@ function truss.save_data(filename, data, datasize)
         truss.error("Provided datasize is too large! " .. datasize .. " > " .. dsize)
       end
     end
-    truss.C.save_data(filename, terralib.cast(&int8, data), datasize)
+    return truss.C.save_data(filename, terralib.cast(&int8, data), datasize) == 0
   elseif dtype == "string" then
-    truss.save_string(filename, data:sub(1, datasize))
+    return truss.save_string(filename, data:sub(1, datasize))
   else
     truss.error("Only CDATA and strings can be saved, got [" .. dtype .. "]")
   end
@@ -381,6 +509,105 @@ local loaded_libs = {}
 truss._loaded_libs = loaded_libs
 truss._script_path = "scripts/"
 
+-- Compiled modules are cached (as bytecode) in the write dir, keyed by a
+-- hash of the file name and source, so an edited module simply misses.
+-- This covers .lua, .moon (the compiled Lua, so the MoonScript compiler
+-- isn't even loaded on a hit; errors then report Lua line numbers) and .t
+-- files with no Terra code in them. Modules with Terra code still have to
+-- be parsed by Terra every time.
+truss.require_cache = {enabled = true, hits = 0, misses = 0, uncacheable = 0}
+local REQUIRE_CACHE_NAME = "require"
+local REQUIRE_CACHE_FORMAT = 1 -- bump to invalidate every entry
+local require_cache_salt = table.concat({
+  REQUIRE_CACHE_FORMAT, jit.version, jit.arch, tostring(ffi.abi("gc64"))
+}, "|")
+
+local function require_cache_key(filename, src)
+  local salt = require_cache_salt .. "|" .. filename
+  local key = truss.C.hash_data(salt, #salt, 0)
+  return truss.C.hash_data(src.data, src.data_length, key)
+end
+
+local function load_cached_module(key, filename)
+  local entry = truss.C.load_cache_entry(REQUIRE_CACHE_NAME, key)
+  if entry == nil then return nil end
+  local bytecode = ffi.string(entry.data, entry.data_length)
+  truss.C.release_message(entry)
+  return load(bytecode, "@" .. filename)
+end
+
+-- .t files are valid Lua unless they use Terra syntax; the one Terra
+-- statement that also parses as Lua is 'import'
+local function load_plain_lua(source, filename)
+  if source:find("%f[%w_]import%f[^%w_]") then return nil end
+  return truss.load_named_string(source, filename, load)
+end
+
+local function save_cached_module(key, module_def, filename)
+  local ok, bytecode = pcall(string.dump, module_def)
+  if ok and truss.C.save_cache_entry(REQUIRE_CACHE_NAME, key, bytecode, #bytecode) ~= 0 then
+    log.warn("Unable to cache [" .. filename .. "]; disabling the require cache")
+    truss.require_cache.enabled = false
+  end
+end
+
+-- returns the module's (not yet evaluated) function, and whether it came
+-- from the cache
+local function load_module_def(modname, filename, fullpath)
+  local cache = truss.require_cache
+  local trace_load = truss.trace_begin()
+  local src = truss.C.map_file(fullpath)
+  if src == nil then
+    truss.error("require('" .. filename .. "'): file does not exist.")
+    return nil
+  end
+  local key
+  if cache.enabled then
+    key = require_cache_key(filename, src)
+    local module_def = load_cached_module(key, filename)
+    if module_def then
+      truss.C.release_message(src)
+      cache.hits = cache.hits + 1
+      truss.trace_end(trace_load, filename .. " (cached)", "load")
+      return module_def, true
+    end
+  end
+
+  -- terra has issues with dos line endings (see load_script_from_file)
+  local funcsource = ffi.string(src.data, src.data_length):gsub("\r", "")
+  truss.C.release_message(src)
+  truss.trace_end(trace_load, filename, "load")
+
+  local loader = truss.select_loader(fullpath)
+  if not loader then
+    truss.error("No loader for " .. fullpath)
+  end
+  local trace_parse = truss.trace_begin()
+  local module_def, loaderror
+  local cacheable = key and (loader == load or loader == truss.loaders[".moon"])
+  if key and loader == truss.loaders[".t"] then
+    module_def = load_plain_lua(funcsource, filename)
+    cacheable = (module_def ~= nil)
+  end
+  if not module_def then
+    module_def, loaderror = truss.load_named_string(funcsource, filename, loader)
+  end
+  if not module_def then
+    truss.error("require('" .. modname .. "'): syntax error: " .. loaderror)
+    return nil
+  end
+  -- (MoonScript compiles to Lua in its loader)
+  truss.trace_end(trace_parse, filename,
+                  loader == truss.loaders[".moon"] and "compile" or "parse")
+  if cacheable then
+    cache.misses = cache.misses + 1
+    save_cached_module(key, module_def, filename)
+  elseif key then
+    cache.uncacheable = cache.uncacheable + 1
+  end
+  return module_def, false
+end
+
 function truss.require(modname, options)
   options = options or {}
   if type(options) == 'boolean' then
@@ -404,20 +631,9 @@ function truss.require(modname, options)
     end
 
     local t0 = truss.tic()
-    local funcsource = truss.load_script_from_file(fullpath)
-    if not funcsource then
-      truss.error("require('" .. filename .. "'): file does not exist.")
-      return nil
-    end
-    local loader = truss.select_loader(fullpath)
-    if not loader then
-      truss.error("No loader for " .. fullpath)
-    end
-    local module_def, loaderror = truss.load_named_string(funcsource, filename, loader)
-    if not module_def then
-      truss.error("require('" .. modname .. "'): syntax error: " .. loaderror)
-      return nil
-    end
+    local trace_require = truss.trace_begin()
+    local module_def, cached = load_module_def(modname, filename, fullpath)
+    if not module_def then return nil end
     local modenv = options.env or create_module_env(modname, filename, options)
     rawset(modenv, "_preregister", function(v)
       if loaded_libs[modname] then
@@ -427,7 +643,9 @@ function truss.require(modname, options)
       return v
     end)
     setfenv(module_def, modenv)
+    local trace_evaluate = truss.trace_begin()
     local evaluated_module = module_def()
+    truss.trace_end(trace_evaluate, modname, "evaluate")
     rawset(modenv, "_preregister", nil)
     if not (evaluated_module or options.allow_globals) then 
       truss.error("Module [" .. modname .. "] did not return a table!")
@@ -437,8 +655,10 @@ function truss.require(modname, options)
       truss.error("Module [" .. modname .. "] did not return preregistered table!")
     end
     loaded_libs[modname] = modtab
-    log.info(string.format("Loaded [%s] in %.2f ms",
-                          modname, truss.toc(t0) * 1000.0))
+    log.info(string.format("Loaded [%s] in %.2f ms%s",
+                          modname, truss.toc(t0) * 1000.0,
+                          cached and " (cached)" or ""))
+    truss.trace_end(trace_require, "require " .. modname, "require")
   end
   return loaded_libs[modname]
 end
@@ -555,14 +775,50 @@ local function call_on_main(funcname, arg)
   end
 end
 
+-- interpreters are started with a script path like "scripts/main.t";
+-- spawned workers can name their own script instead of main.t
+local function main_script_name(script_path)
+  if not script_path or script_path == "" then return "main.t" end
+  local prefix = truss._script_path
+  if script_path:sub(1, #prefix) == prefix then
+    script_path = script_path:sub(#prefix + 1)
+  end
+  return script_path
+end
+
+-- --profile-scripts[=id]: sample interpreter id (default 0, the main one)
+-- with core/profiler.t and save profile_<id>.folded when it quits
+local function start_profile_flag()
+  for i = 3, #(truss.args) do
+    local id = truss.args[i]:match("^%-%-profile%-scripts=?(%d*)$")
+    if id and (tonumber(id) or 0) == TRUSS_ID then
+      local profiler = truss.require("core/profiler.t")
+      if profiler.start() then
+        truss.on_quit(function()
+          profiler.stop()
+          profiler.save(("profile_%d.folded"):format(TRUSS_ID))
+          log.info(profiler.report())
+        end)
+      end
+      return
+    end
+  end
+end
+
 -- These functions have to be global because
-function _core_init()
+function _core_init(script_path)
   add_paths()
+  start_profile_flag()
   local t0 = truss.tic()
-  truss.mainobj = load_main("main.t")
+  truss.mainobj = load_main(main_script_name(script_path))
+  local trace_init = truss.trace_begin()
   call_on_main("init", truss.mainobj)
+  truss.trace_end(trace_init, main_script_name(script_path) .. " init", "init")
   local delta = truss.toc(t0) * 1000.0
   log.info(string.format("Time to init: %.2f ms", delta))
+  local cache = truss.require_cache
+  log.info(string.format("Require cache: %d hits, %d misses, %d not cacheable",
+                         cache.hits, cache.misses, cache.uncacheable))
   if not truss.mainobj.update then
     log.info("No 'update' function provided; simply quitting.")
     _core_update = function()
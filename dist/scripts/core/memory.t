@@ -17,4 +17,20 @@ function m.release_unmanaged(mem)
   truss.error("Unimplemented")
 end
 
+-- returns message allocator statistics as a plain table:
+-- live_messages, live_bytes, pool_hits, pool_misses, large_allocations,
+-- pool_hit_rate
+function m.message_stats()
+  local stats = terralib.new(truss.C.message_stats)
+  truss.C.get_message_stats(stats)
+  return {
+    live_messages = tonumber(stats.live_messages),
+    live_bytes = tonumber(stats.live_bytes),
+    pool_hits = tonumber(stats.pool_hits),
+    pool_misses = tonumber(stats.pool_misses),
+    large_allocations = tonumber(stats.large_allocations),
+    pool_hit_rate = stats.pool_hit_rate
+  }
+end
+
 return m
\ No newline at end of file
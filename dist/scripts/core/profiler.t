@@ -0,0 +1,152 @@
+-- core/profiler.t
+--
+-- sampling profiler for the calling interpreter, built on LuaJIT's
+-- jit.profile; saves collapsed stacks ("a;b;c 12" per line) for
+-- flamegraph.pl or speedscope
+--
+-- LuaJIT can only sample one Lua state at a time, so an interpreter has to
+-- claim the profiler first (truss_acquire_profiler); starting it while
+-- another interpreter holds it logs a warning and returns false.
+--
+-- Terra functions run as native code called through the FFI, so their time
+-- shows up as a "[native]" frame under the Lua function that called them.
+
+local m = {}
+
+local jprofile = nil
+local running = false
+local stacks = {}
+local nsamples = 0
+local stack_format, stack_depth
+
+-- frames appended for samples that weren't in (interpreted or compiled) Lua
+local VMSTATE_FRAMES = {C = "[native]", G = "[gc]", J = "[jit compiler]"}
+
+local function on_sample(thread, samples, vmstate)
+  local stack = jprofile.dumpstack(thread, stack_format, stack_depth)
+  local extra = VMSTATE_FRAMES[vmstate]
+  if extra then
+    stack = (stack == "" and extra) or (stack .. ";" .. extra)
+  end
+  stacks[stack] = (stacks[stack] or 0) + samples
+  nsamples = nsamples + samples
+end
+
+-- options:
+--   interval_ms: sampling interval (default 10)
+--   depth: maximum frames per stack (default 64)
+--   lines: attribute samples to source lines instead of functions
+-- samples accumulate across start/stop until reset
+function m.start(options)
+  if running then return true end
+  options = options or {}
+  if not jprofile then
+    local happy, lib = pcall(lua_require, "jit.profile")
+    if not happy then
+      log.warn("Profiler unavailable: " .. tostring(lib))
+      return false
+    end
+    jprofile = lib
+  end
+  if truss.C.acquire_profiler(truss.interpreter_id) ~= 0 then
+    log.warn("Profiler is already running in another interpreter")
+    return false
+  end
+  -- p: full paths, F/l: function or line, Z: no separator after the leaf;
+  -- a negative depth dumps the outermost frame first
+  stack_format = options.lines and "plZ;" or "pFZ;"
+  stack_depth = -(options.depth or 64)
+  jprofile.start("i" .. (options.interval_ms or 10), on_sample)
+  running = true
+  return true
+end
+
+function m.stop()
+  if not running then return end
+  jprofile.stop()
+  truss.C.release_profiler(truss.interpreter_id)
+  running = false
+end
+
+function m.is_running()
+  return running
+end
+
+function m.reset()
+  stacks = {}
+  nsamples = 0
+end
+
+function m.sample_count()
+  return nsamples
+end
+
+-- returns a list of {stack, samples}, most sampled first
+function m.stacks()
+  local ret = {}
+  for stack, count in pairs(stacks) do
+    table.insert(ret, {stack, count})
+  end
+  table.sort(ret, function(a, b) return a[2] > b[2] end)
+  return ret
+end
+
+-- collapsed stack text, as read by flamegraph.pl
+function m.collapsed()
+  local lines = {}
+  for _, entry in ipairs(m.stacks()) do
+    table.insert(lines, entry[1] .. " " .. entry[2])
+  end
+  return table.concat(lines, "\n") .. "\n"
+end
+
+-- saves collapsed stacks into the write directory
+function m.save(filename)
+  truss.save_string(filename, m.collapsed())
+  log.info(("Saved %d profile samples to %s"):format(nsamples, filename))
+end
+
+-- the Lua frame a sample belongs to (the caller, for native/gc frames)
+local function leaf_frame(stack)
+  local frames = {}
+  for frame in stack:gmatch("[^;]+") do table.insert(frames, frame) end
+  local leaf = frames[#frames] or "?"
+  local owner = leaf
+  if leaf:sub(1, 1) == "[" then owner = frames[#frames - 1] or leaf end
+  return leaf, owner
+end
+
+local function sorted_totals(totals, n)
+  local ret = {}
+  for name, count in pairs(totals) do table.insert(ret, {name, count}) end
+  table.sort(ret, function(a, b) return a[2] > b[2] end)
+  while #ret > n do table.remove(ret) end
+  return ret
+end
+
+-- returns a text summary of the n (default 20) functions and module files
+-- with the most self samples
+function m.report(n)
+  n = n or 20
+  local functions, files = {}, {}
+  for stack, count in pairs(stacks) do
+    local leaf, owner = leaf_frame(stack)
+    functions[leaf] = (functions[leaf] or 0) + count
+    -- Lua frames read "file:line"; builtins have no file
+    local file = owner:match("^(.*):%d+$") or "[builtin]"
+    files[file] = (files[file] or 0) + count
+  end
+
+  local total = math.max(nsamples, 1)
+  local lines = {("%d samples"):format(nsamples)}
+  for _, section in ipairs({{"functions", functions}, {"files", files}}) do
+    table.insert(lines, "self samples by " .. section[1] .. ":")
+    for _, entry in ipairs(sorted_totals(section[2], n)) do
+      table.insert(lines, ("  %6.2f%%  %6d  %s"):format(
+                   100 * entry[2] / total, entry[2], entry[1]))
+    end
+  end
+  return table.concat(lines, "\n")
+end
+
+return m
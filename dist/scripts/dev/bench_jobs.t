@@ -0,0 +1,74 @@
+-- dev/bench_jobs.t
+--
+-- job system scaling benchmark: runs the same terra kernel over a large
+-- array serially and then with parallel_for at increasing thread counts
+--
+-- usage: truss dev/bench_jobs.t [n_items] [max_workers] [reps]
+
+local jobs = require("native/jobs.t")
+local cmath = require("math/cmath.t")
+local m = {}
+
+local n_items = tonumber(truss.args[3]) or 2^22
+local max_workers = tonumber(truss.args[4]) or jobs.num_threads()
+local reps = tonumber(truss.args[5]) or 5
+
+struct KernelData {
+  src: &float
+  dest: &float
+}
+
+-- a few dozen flops per item so the benchmark isn't purely memory bound
+terra kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var data = [&KernelData](userdata)
+  for i = range_begin, range_end do
+    var x = data.src[i]
+    var acc: float = 0.0
+    for k = 0, 16 do
+      acc = acc + cmath.sinf(x * k) * cmath.sqrtf(x + k)
+    end
+    data.dest[i] = acc
+  end
+end
+
+local function time_reps(f)
+  local t0 = truss.tic()
+  for i = 1, reps do f() end
+  return truss.toc(t0) / reps
+end
+
+function m.init()
+  m.src = terralib.new(float[n_items])
+  m.dest = terralib.new(float[n_items])
+  for i = 0, n_items - 1 do m.src[i] = (i % 1000) / 1000.0 end
+  m.data = terralib.new(KernelData)
+  m.data.src = m.src
+  m.data.dest = m.dest
+end
+
+function m.update()
+  local userdata = terralib.cast(&opaque, m.data)
+  print(("%d items, %d reps"):format(n_items, reps))
+
+  local serial = time_reps(function() kernel(userdata, 0, n_items) end)
+  print(("%-12s %9.2f ms"):format("serial", serial * 1000.0))
+  local expected = m.dest[n_items - 1]
+
+  -- the calling thread helps while it waits, so workers + 1 threads run
+  local nworkers = 1
+  while nworkers <= max_workers do
+    jobs.set_threads(nworkers)
+    m.dest[n_items - 1] = 0
+    local dt = time_reps(function()
+      jobs.parallel_for(kernel, userdata, 0, n_items)
+    end)
+    local ok = m.dest[n_items - 1] == expected
+    print(("%2d workers   %9.2f ms  speedup %5.2fx%s"):format(
+          nworkers, dt * 1000.0, serial / dt, ok and "" or "  (WRONG RESULT)"))
+    nworkers = nworkers * 2
+  end
+  jobs.set_threads(0)
+  truss.quit()
+end
+
+return m
@@ -0,0 +1,98 @@
+-- dev/bench_messages.t
+--
+-- message throughput benchmark: worker interpreters flood the main
+-- interpreter with small messages, which is drained either one
+-- truss_get_message call per index or with a single batched fetch
+--
+-- usage: truss dev/bench_messages.t [nworkers] [messages_per_frame] [frames]
+
+local m = {}
+
+local nworkers = tonumber(truss.args[3]) or 8
+local per_frame = tonumber(truss.args[4]) or 10000
+local nframes = tonumber(truss.args[5]) or 100
+local MESSAGE_SIZE = 16
+
+-- workers take their settings from the main interpreter through the
+-- datastore rather than parsing the command line themselves
+local PER_FRAME_KEY = "bench_messages/per_frame"
+
+local function store_number(key)
+  local val = truss.C.get_store_value(key)
+  if val == nil then return nil end
+  return tonumber(ffi.string(val.data, val.data_length))
+end
+
+local function worker_update()
+  local C = truss.C
+  for i = 1, per_frame do
+    local msg = C.create_message(MESSAGE_SIZE)
+    C.send_message(0, msg)
+    C.release_message(msg)
+  end
+end
+
+local function drain_per_index()
+  local total = 0
+  local n = truss.C.fetch_messages(truss.interpreter_id)
+  for i = 0, n - 1 do
+    local msg = truss.C.get_message(truss.interpreter_id, i)
+    total = total + msg.data_length
+  end
+  return n, total
+end
+
+local function drain_batched()
+  local total = 0
+  local messages, n = truss.fetch_messages()
+  for i = 0, n - 1 do
+    total = total + messages[i].data_length
+  end
+  return n, total
+end
+
+local function run_frames(workers, drain)
+  local received = 0
+  local t0 = truss.tic()
+  for frame = 1, nframes do
+    truss.step_all_interpreters(workers)
+    received = received + drain()
+  end
+  return received, truss.toc(t0)
+end
+
+local function report(name, received, dt)
+  print(string.format("%-12s %10d msgs in %8.2f ms  (%.2f M msg/s)",
+                      name, received, dt * 1000.0, received / dt / 1e6))
+end
+
+function m.init()
+  truss.C.set_store_value_str(PER_FRAME_KEY, tostring(per_frame))
+  m.workers = {}
+  for i = 1, nworkers do
+    table.insert(m.workers, truss.C.spawn_interpreter(0, "dev/bench_messages.t"))
+  end
+  print(("%d workers x %d msgs/frame x %d frames"):format(
+        nworkers, per_frame, nframes))
+end
+
+function m.update()
+  drain_batched() -- clear anything left over from startup
+  report("per-index", run_frames(m.workers, drain_per_index))
+  report("batched", run_frames(m.workers, drain_batched))
+  drain_batched() -- release the last batch
+  local stats = truss.message_stats()
+  print(string.format("live messages: %d, pool hit rate: %.1f%%",
+                      stats.live_messages, stats.pool_hit_rate * 100.0))
+  for _, w in ipairs(m.workers) do truss.C.stop_interpreter(w) end
+  truss.quit()
+end
+
+if truss.interpreter_id > 0 then
+  m.init = function()
+    per_frame = store_number(PER_FRAME_KEY) or per_frame
+  end
+  m.update = worker_update
+end
+
+return m
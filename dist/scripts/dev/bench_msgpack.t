@@ -0,0 +1,75 @@
+-- dev/bench_msgpack.t
+--
+-- serialization benchmark: encodes and decodes a mesh-like payload (a few
+-- thousand vertices plus some metadata) with format/msgpack.t, the pure Lua
+-- lib/messagepack.lua, and lib/json.lua
+--
+-- usage: truss dev/bench_msgpack.t [n_vertices] [reps]
+
+local msgpack = require("format/msgpack.t")
+local luapack = require("lib/messagepack.lua")
+local json = require("lib/json.lua")
+local m = {}
+
+local n_vertices = tonumber(truss.args[3]) or 4096
+local reps = tonumber(truss.args[4]) or 50
+
+local function make_payload(typed)
+  local positions = {}
+  for i = 1, n_vertices * 3 do positions[i] = (i % 97) * 0.25 end
+  local payload = {
+    name = "bench_mesh",
+    id = 12345,
+    tags = {"static", "opaque", "lod0"},
+    bounds = {min = {-1.5, -2.5, -3.5}, max = {1.5, 2.5, 3.5}},
+    positions = positions
+  }
+  if typed then
+    local data = terralib.new(float[#positions])
+    for i = 1, #positions do data[i-1] = positions[i] end
+    payload.positions = msgpack.typed(data, #positions, "float")
+    payload.keepalive = data
+  end
+  return payload
+end
+
+local function time_reps(f)
+  local ret
+  local t0 = truss.tic()
+  for i = 1, reps do ret = f() end
+  return truss.toc(t0) / reps, ret
+end
+
+local function report(name, encode, decode)
+  local enc_dt, encoded = time_reps(encode)
+  local dec_dt = time_reps(function() return decode(encoded) end)
+  local mb = #encoded / 2^20
+  print(("%-22s %9d B   encode %8.3f ms %8.1f MB/s   decode %8.3f ms %8.1f MB/s"):format(
+        name, #encoded, enc_dt * 1000.0, mb / enc_dt, dec_dt * 1000.0, mb / dec_dt))
+end
+
+function m.init()
+  m.payload = make_payload(false)
+  m.typed_payload = make_payload(true)
+end
+
+function m.update()
+  print(("%d vertices, %d reps"):format(n_vertices, reps))
+  local payload, typed_payload = m.payload, m.typed_payload
+  report("json.lua",
+    function() return json:encode(payload) end,
+    function(s) return json:decode(s) end)
+  report("messagepack.lua",
+    function() return luapack.pack(payload) end,
+    function(s) return luapack.unpack(s) end)
+  report("msgpack.t",
+    function() return msgpack.encode_string(payload) end,
+    function(s) return msgpack.decode_string(s) end)
+  -- positions as one typed blob: decoding doesn't copy them at all
+  report("msgpack.t (typed)",
+    function() return msgpack.encode_string(typed_payload) end,
+    function(s) return msgpack.decode_string(s) end)
+  truss.quit()
+end
+
+return m
@@ -0,0 +1,87 @@
+-- dev/bench_obj.t
+--
+-- obj loading benchmark: parses a synthetic grid mesh (quads with uvs and
+-- normals) the way the old lua loader did (split lines and tokens, then
+-- tonumber) and with the native parser, into tables and into a geometry
+--
+-- usage: truss dev/bench_obj.t [grid_size] [reps]
+
+local obj = require("format/obj.t")
+local stringutils = require("util/string.t")
+local m = {}
+
+local grid_size = tonumber(truss.args[3]) or 512
+local reps = tonumber(truss.args[4]) or 3
+
+local function make_grid(n)
+  local lines = {}
+  for y = 0, n do
+    for x = 0, n do
+      lines[#lines+1] = ("v %f %f %f"):format(x, y, math.sin(x * 0.1) * math.cos(y * 0.1))
+      lines[#lines+1] = ("vt %f %f"):format(x / n, y / n)
+    end
+  end
+  lines[#lines+1] = "vn 0 0 1"
+  for y = 0, n - 1 do
+    for x = 0, n - 1 do
+      local i = y * (n + 1) + x + 1
+      local j = i + n + 1
+      lines[#lines+1] = ("f %d/%d/1 %d/%d/1 %d/%d/1 %d/%d/1"):format(
+                        i, i, i + 1, i + 1, j + 1, j + 1, j, j)
+    end
+  end
+  return table.concat(lines, "\n")
+end
+
+-- roughly what format/obj.t used to do: tokenizing only, without
+-- reindexing (so it flatters the old loader)
+local function split_parse(src)
+  local strsplit, strip = stringutils.split, stringutils.strip
+  local attributes, faces = {v = {}, vt = {}, vn = {}}, {}
+  for _, line in ipairs(stringutils.split_lines(src)) do
+    local gps = strsplit("%s+", strip(line))
+    local target = attributes[gps[1]]
+    if target then
+      local val = {}
+      for i = 2, #gps do val[i-1] = tonumber(gps[i]) end
+      target[#target+1] = val
+    elseif gps[1] == "f" then
+      faces[#faces+1] = {gps[2], gps[3], gps[4]}
+    end
+  end
+  return attributes, faces
+end
+
+local function time_reps(f)
+  f() -- warm up (compiles the kernels)
+  local t0 = truss.tic()
+  for i = 1, reps do f() end
+  return truss.toc(t0) / reps
+end
+
+local function report(name, nbytes, dt, baseline)
+  local speedup = ""
+  if baseline then speedup = ("  %6.1fx"):format(baseline / dt) end
+  print(("%-22s %10.2f ms %10.1f MB/s%s"):format(
+        name, dt * 1000.0, nbytes / 2^20 / dt, speedup))
+end
+
+function m.init()
+  m.src = make_grid(grid_size)
+end
+
+function m.update()
+  local src, nbytes = m.src, #m.src
+  print(("%dx%d grid: %.1f MB, %d reps"):format(grid_size, grid_size, nbytes / 2^20, reps))
+  local baseline = time_reps(function() split_parse(src) end)
+  report("lua split", nbytes, baseline)
+  report("native -> tables", nbytes, time_reps(function()
+    obj.parse_obj(src)
+  end), baseline)
+  report("native -> geometry", nbytes, time_reps(function()
+    obj.parse_geo(src, nbytes, {commit = false})
+  end), baseline)
+  truss.quit()
+end
+
+return m
@@ -0,0 +1,75 @@
+-- dev/bench_soa.t
+--
+-- scene merge benchmark: merges n_parts posed copies of a small mesh with
+-- merge.merge_data (lua tables of Vectors) and with geometry/soa.t, on one
+-- thread and on the job system, and reports vertices/s
+--
+-- usage: truss dev/bench_soa.t [n_parts] [reps] [legacy_max_parts]
+
+local math = require("math")
+local geometry = require("geometry")
+local merge = require("geometry/merge.t")
+local soa = require("geometry/soa.t")
+local jobs = require("native/jobs.t")
+local m = {}
+
+local n_parts = tonumber(truss.args[3]) or 10000
+local reps = tonumber(truss.args[4]) or 3
+-- merge_data allocates a Vector per vertex, so keep it to a sample
+local legacy_max_parts = tonumber(truss.args[5]) or 1000
+
+local function time_reps(f)
+  f() -- warm up (compiles the kernels)
+  local t0 = truss.tic()
+  for i = 1, reps do f() end
+  return truss.toc(t0) / reps
+end
+
+local function report(name, n_verts, dt)
+  print(("%-26s %10.2f ms %10.1f Mverts/s"):format(name, dt * 1000.0, n_verts / 1e6 / dt))
+end
+
+local function make_poses(n)
+  local poses = {}
+  for i = 1, n do
+    local mat = math.Matrix4():translation(math.Vector(i % 100, math.floor(i / 100), 0))
+    poses[i] = {position = mat, normal = mat}
+  end
+  return poses
+end
+
+function m.init()
+  m.data = geometry.uvsphere_data{lat_divs = 10, lon_divs = 20}
+  m.part = soa.from_data(m.data)
+  m.poses = make_poses(n_parts)
+end
+
+local function native(parallel)
+  jobs.parallel = parallel
+  local parts = {}
+  for i, pose in ipairs(m.poses) do parts[i] = {m.part, pose} end
+  return time_reps(function()
+    soa.merge(parts):release()
+  end)
+end
+
+function m.update()
+  local part_verts = #m.data.attributes.position
+  print(("%d parts of %d vertices, %d reps"):format(n_parts, part_verts, reps))
+
+  local legacy_parts = math.min(n_parts, legacy_max_parts)
+  local datalist = {}
+  for i = 1, legacy_parts do datalist[i] = {m.data, m.poses[i]} end
+  report(("merge_data (%d parts)"):format(legacy_parts), legacy_parts * part_verts,
+         time_reps(function()
+           merge.merge_data(datalist, {"position", "normal", "texcoord0"})
+         end))
+
+  local n_verts = n_parts * part_verts
+  report("soa, 1 thread", n_verts, native(false))
+  report("soa, parallel", n_verts, native(true))
+  m.part:release()
+  truss.quit()
+end
+
+return m
@@ -0,0 +1,63 @@
+-- dev/bench_spawn.t
+--
+-- interpreter spawn latency: spawns workers cold, then from a pre-booted
+-- interpreter pool, and prints the pool metrics
+--
+-- usage: truss dev/bench_spawn.t [n_spawns]
+
+local m = {}
+
+local n_spawns = tonumber(truss.args[3]) or 4
+
+local function spawn_batch()
+  local ids = {}
+  local t0 = truss.tic()
+  for i = 1, n_spawns do
+    ids[i] = truss.C.spawn_interpreter(0, "dev/bench_spawn.t")
+  end
+  return ids, truss.toc(t0) * 1000.0 / n_spawns
+end
+
+local function print_stats(label)
+  local stats = truss.interpreter_pool_stats()
+  print(("%-6s ready %d/%d (occupancy %.0f%%), booting %d, warm %d, cold %d, " ..
+         "avg boot %.1f ms"):format(label, stats.ready, stats.target_size,
+         stats.occupancy * 100.0, stats.booting, stats.warm_spawns,
+         stats.cold_spawns, stats.avg_boot_ms))
+end
+
+function m.init()
+  m.workers = {}
+end
+
+function m.update()
+  truss.set_interpreter_pool_size(0)
+  local cold_ids, cold_ms = spawn_batch()
+  print(("cold spawn: %8.2f ms per interpreter"):format(cold_ms))
+
+  truss.set_interpreter_pool_size(n_spawns)
+  print_stats("filling")
+  local stats = truss.interpreter_pool_stats()
+  while stats.ready < n_spawns and stats.booting > 0 do
+    truss.C.sleep(1)
+    stats = truss.interpreter_pool_stats()
+  end
+  print_stats("full")
+  local warm_ids, warm_ms = spawn_batch()
+  print(("warm spawn: %8.2f ms per interpreter (%.1fx faster)"):format(
+        warm_ms, cold_ms / warm_ms))
+  print_stats("after")
+
+  truss.set_interpreter_pool_size(0)
+  for _, id in ipairs(cold_ids) do truss.C.stop_interpreter(id) end
+  for _, id in ipairs(warm_ids) do truss.C.stop_interpreter(id) end
+  truss.quit()
+end
+
+-- spawned workers do nothing
+if truss.interpreter_id > 0 then
+  m.init = function() end
+  m.update = function() end
+end
+
+return m
@@ -0,0 +1,89 @@
+-- dev/bench_stl.t
+--
+-- STL loading benchmark: parses a synthetic binary STL and its ASCII
+-- equivalent with the legacy lua-table loader and with the native loader,
+-- both on one thread and on the job system, and reports MB/s
+--
+-- usage: truss dev/bench_stl.t [n_faces] [reps] [legacy_max_faces]
+
+local stl = require("format/stl.t")
+local jobs = require("native/jobs.t")
+local m = {}
+
+local n_faces = tonumber(truss.args[3]) or 2^20
+local reps = tonumber(truss.args[4]) or 3
+-- the legacy loader is very slow and memory hungry on big models
+local legacy_max_faces = tonumber(truss.args[5]) or 2^17
+
+terra fill_binary_stl(dest: &uint8, n_faces: uint32)
+  for i = 0, 80 do dest[i] = 32 end
+  @[&uint32](dest + 80) = n_faces
+  for face = 0, n_faces do
+    var tri = [&float](dest + 84 + face * 50)
+    var x = [float](face % 1024)
+    var y = [float](face / 1024)
+    tri[0], tri[1], tri[2] = 0.0f, 0.0f, 1.0f
+    tri[3], tri[4], tri[5] = x, y, 0.0f
+    tri[6], tri[7], tri[8] = x + 1.0f, y, 0.0f
+    tri[9], tri[10], tri[11] = x, y + 1.0f, 0.0f
+    @[&uint16](dest + 84 + face * 50 + 48) = 0
+  end
+end
+
+local function make_ascii(n)
+  local parts = {"solid bench"}
+  for face = 0, n - 1 do
+    local x, y = face % 1024, math.floor(face / 1024)
+    parts[#parts+1] = (" facet normal 0 0 1\n  outer loop\n"
+      .. "   vertex %.6e %.6e 0\n   vertex %.6e %.6e 0\n   vertex %.6e %.6e 0\n"
+      .. "  endloop\n endfacet"):format(x, y, x + 1, y, x, y + 1)
+  end
+  parts[#parts+1] = "endsolid bench\n"
+  return table.concat(parts, "\n")
+end
+
+local function time_reps(f)
+  f() -- warm up (compiles the kernels)
+  local t0 = truss.tic()
+  for i = 1, reps do f() end
+  return truss.toc(t0) / reps
+end
+
+local function report(name, nbytes, dt)
+  print(("%-22s %10.2f ms %10.1f MB/s"):format(name, dt * 1000.0, nbytes / 2^20 / dt))
+end
+
+local function native(src, nbytes, parallel)
+  jobs.parallel = parallel
+  return time_reps(function()
+    stl.parse_geo(src, nbytes, {commit = false})
+  end)
+end
+
+function m.init()
+  m.binary_size = 84 + 50 * n_faces
+  m.binary = terralib.new(uint8[m.binary_size])
+  fill_binary_stl(m.binary, n_faces)
+  m.ascii = make_ascii(n_faces)
+end
+
+function m.update()
+  print(("%d faces: binary %.1f MB, ascii %.1f MB, %d reps"):format(
+        n_faces, m.binary_size / 2^20, #m.ascii / 2^20, reps))
+
+  local legacy_faces = math.min(n_faces, legacy_max_faces)
+  local legacy_size = 84 + 50 * legacy_faces
+  local legacy = terralib.new(uint8[legacy_size])
+  fill_binary_stl(legacy, legacy_faces)
+  report(("legacy (%d faces)"):format(legacy_faces), legacy_size, time_reps(function()
+    stl.parse_binary_stl(legacy, legacy_size)
+  end))
+
+  report("binary, 1 thread", m.binary_size, native(m.binary, m.binary_size, false))
+  report("binary, parallel", m.binary_size, native(m.binary, m.binary_size, true))
+  report("ascii, 1 thread", #m.ascii, native(m.ascii, #m.ascii, false))
+  report("ascii, parallel", #m.ascii, native(m.ascii, #m.ascii, true))
+  truss.quit()
+end
+
+return m
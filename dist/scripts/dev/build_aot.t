@@ -0,0 +1,34 @@
+-- dev/build_aot.t
+--
+-- precompiles the Terra functions that modules mark with build.aot into
+-- shared libraries in lib/ (see core/build.t); rerun after changing any of
+-- the modules, since stale libraries are ignored
+--
+-- usage: truss dev/build_aot.t [module ...]
+
+local build = require("core/build.t")
+local m = {}
+
+m.DEFAULT_MODULES = {
+  "math/matrix.t",
+  "procgen/simplex.t",
+  "procgen/marchingcubes.t"
+}
+
+function m.init()
+  build.begin_aot_build()
+  local modules = {}
+  for i = 3, #truss.args do table.insert(modules, truss.args[i]) end
+  if #modules == 0 then modules = m.DEFAULT_MODULES end
+  for _, modname in ipairs(modules) do require(modname) end
+
+  for _, group_name in ipairs(build.aot_group_names()) do
+    local t0 = truss.tic()
+    local nfuncs = build.save_aot_library(group_name)
+    print(("%-10s %3d functions -> %s  (%.1f s)"):format(
+          group_name, nfuncs, build.aot_library_path(group_name), truss.toc(t0)))
+  end
+  truss.quit()
+end
+
+return m
@@ -0,0 +1,106 @@
+-- format/_test_msgpack.t
+--
+-- tests for the terra messagepack codec
+
+local m = {}
+
+function m.run(test)
+  test("msgpack roundtrip", m.test_roundtrip)
+  test("msgpack wire format", m.test_wire_format)
+  test("msgpack typed arrays", m.test_typed_arrays)
+  test("msgpack fixed buffers", m.test_fixed_buffers)
+end
+
+local function hex(s)
+  return (s:gsub(".", function(ch) return ("%02x"):format(ch:byte()) end))
+end
+
+function m.test_roundtrip(t)
+  local msgpack = require("format/msgpack.t")
+  local values = {
+    0, 1, 127, 128, 255, 256, 65535, 65536, 2^32, 2^40, -1, -32, -33, -128,
+    -129, -32768, -32769, -2^31, -2^31 - 1, -2^40, 0.5, -1.25e300, 1/0,
+    "", "hello", string.rep("x", 31), string.rep("y", 32), string.rep("z", 70000),
+    true, false, {}, {1, 2, 3}, {a = 1, b = {c = "d"}}, {1, {2, {3, {}}}},
+    {[1] = "a", [3] = "c"}
+  }
+  for i, value in ipairs(values) do
+    local encoded = msgpack.encode_string(value)
+    local decoded, nbytes = msgpack.decode_string(encoded)
+    t.expect(nbytes, #encoded, "consumed everything (" .. i .. ")")
+    t.expect(decoded, value, "roundtrip (" .. i .. ")")
+  end
+
+  local msg = msgpack.encode_message({name = "frame", values = {1.5, 2.5}})
+  local frame = msgpack.decode_message(msg)
+  truss.C.release_message(msg)
+  t.expect(frame.name, "frame", "via message")
+  t.expect(frame.values[2], 2.5, "via message")
+end
+
+-- the codec has to interoperate with lib/messagepack.lua (and so anything
+-- else speaking messagepack)
+function m.test_wire_format(t)
+  local msgpack = require("format/msgpack.t")
+  local luapack = require("lib/messagepack.lua")
+  t.expect(hex(msgpack.encode_string(1)), "01", "positive fixint")
+  t.expect(hex(msgpack.encode_string(-1)), "ff", "negative fixint")
+  t.expect(hex(msgpack.encode_string(300)), "cd012c", "uint16")
+  t.expect(hex(msgpack.encode_string(-200)), "d1ff38", "int16")
+  t.expect(hex(msgpack.encode_string(0.5)), "cb3fe0000000000000", "double")
+  t.expect(hex(msgpack.encode_string("abc")), "a3616263", "fixstr")
+  t.expect(hex(msgpack.encode_string({1, 2})), "920102", "fixarray")
+  t.expect(hex(msgpack.encode_string({a = true})), "81a161c3", "fixmap")
+  -- int64 2^53 + 1 isn't exactly representable as a lua number
+  local big = msgpack.decode_string("\211\000\032\000\000\000\000\000\001")
+  t.expect(tostring(big), "9007199254740993LL", "large int64 stays int64")
+
+  local value = {1, -5, 70000, "text", {x = 1.25, y = {true, false}}, 2^33}
+  local from_lua = msgpack.decode_string(luapack.pack(value))
+  t.expect(from_lua[3], 70000, "decodes lua messagepack")
+  t.expect(from_lua[5].x, 1.25, "decodes lua messagepack")
+  t.expect(from_lua[6], 2^33, "decodes lua messagepack")
+  local to_lua = luapack.unpack(msgpack.encode_string(value))
+  t.expect(to_lua[4], "text", "lua messagepack decodes it")
+  t.expect(to_lua[5].y[2], false, "lua messagepack decodes it")
+end
+
+function m.test_typed_arrays(t)
+  local msgpack = require("format/msgpack.t")
+  local n = 1000
+  local src = terralib.new(float[n])
+  for i = 0, n - 1 do src[i] = i * 0.5 end
+
+  -- misalign the array on purpose: the padding should realign it
+  local msg = msgpack.encode_message({"x", msgpack.typed(src, n, "float")})
+  local decoded = msgpack.decode_message(msg)
+  local arr = decoded[2]
+  t.expect(arr.type, "float", "element type")
+  t.expect(arr.count, n, "element count")
+  local addr = tonumber(ffi.cast("uintptr_t", arr.data))
+  local base = tonumber(ffi.cast("uintptr_t", msg.data))
+  t.ok(addr > base and addr < base + msg.data_length, "points into the message")
+  t.expect(addr % 4, 0, "aligned")
+  t.expect(arr.data[n - 1], (n - 1) * 0.5, "contents")
+  truss.C.release_message(msg)
+
+  -- ext8 typed int32 array with no padding and 3 bytes of elements
+  t.err(function()
+    msgpack.decode_string("\xc7\x05\x54\x05\x00\x01\x02\x03")
+  end, "partial element rejected")
+end
+
+function m.test_fixed_buffers(t)
+  local msgpack = require("format/msgpack.t")
+  local ByteBuffer = require("native/buffer.t").ByteBuffer
+  local buf = terralib.new(ByteBuffer)
+  buf:init()
+  buf:allocate(16)
+  t.ok(msgpack.encode_buffer({1, 2, 3}, buf) == 4, "fits")
+  t.expect(buf.used_count, 4, "used count")
+  t.ok(msgpack.encode_buffer(string.rep("a", 100), buf) == nil, "overflow reported")
+  t.expect(msgpack.decode(buf.data, 4)[3], 3, "decodes in place")
+  buf:release()
+end
+
+return m
@@ -0,0 +1,76 @@
+-- format/_test_obj.t
+--
+-- tests for the native obj parser
+
+local m = {}
+
+function m.run(test)
+  test("obj attributes", m.test_attributes)
+  test("obj polygons", m.test_polygons)
+  test("obj geometry", m.test_geometry)
+end
+
+local CUBE_FACE = [[
+# a quad with uvs and one normal, written twice over
+v 0 0 0
+v 1 0 0
+v 1 1 0
+v 0 1 0
+vt 0 0
+vt 1 0
+vt 1 1
+vt 0 1
+vn 0 0 1
+f 1/1/1 2/2/1 3/3/1 4/4/1
+f -4/-4/-1 -3/-3/-1 -2/-2/-1 # same quad, relative indices
+]]
+
+local POLYGONS = [[
+v 0 0 0
+v 1 0 0
+v 2 1 0
+v 1 2 0
+v 0 1 0
+v 5 5 5
+vn 0 0 1
+f 1 2 3 4 5
+f 1//1 2 6
+f 1 2 99 -99
+]]
+
+function m.test_attributes(t)
+  local obj = require("format/obj.t")
+  local data = obj.parse_obj(CUBE_FACE)
+  t.expect(#data.attributes.position, 4, "corners shared between faces")
+  t.expect(#data.indices, 3, "quad triangulated (plus one triangle)")
+  t.expect(data.attributes.position[3], {1, 1, 0}, "position")
+  t.expect(data.attributes.texcoord0[2], {1, 0}, "uv")
+  t.expect(data.attributes.normal[4], {0, 0, 1}, "normal")
+  t.expect(data.indices[1], {0, 1, 2}, "first triangle")
+  t.expect(data.indices[2], {0, 2, 3}, "fan triangle")
+  t.expect(data.indices[3], {0, 1, 2}, "relative indices")
+
+  local inverted = obj.parse_obj(CUBE_FACE, true)
+  t.expect(inverted.indices[2], {0, 3, 2}, "inverted winding")
+end
+
+function m.test_polygons(t)
+  local obj = require("format/obj.t")
+  local objdata = obj.parse_native(POLYGONS, #POLYGONS)
+  t.expect(objdata.n_indices, 3 * 3 + 3, "pentagon fan plus a triangle")
+  t.expect(objdata.bad_corners, 2, "bad corners skipped")
+  t.expect(objdata.n_verts, 7, "v and v//vn are different vertices")
+  objdata:release()
+end
+
+function m.test_geometry(t)
+  local obj = require("format/obj.t")
+  local geo = obj.parse_geo(CUBE_FACE, #CUBE_FACE, {commit = false})
+  t.expect(geo.n_verts, 4, "vertex count")
+  t.expect(geo.n_indices, 9, "index count")
+  t.expect(geo.verts[2].texcoord0[1], 1, "uv")
+  t.expect(geo.verts[3].normal[2], 1, "normal")
+  t.expect({geo.indices[3], geo.indices[4], geo.indices[5]}, {0, 2, 3}, "indices")
+end
+
+return m
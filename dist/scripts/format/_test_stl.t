@@ -0,0 +1,114 @@
+-- format/_test_stl.t
+--
+-- tests for the native STL loader
+
+local m = {}
+
+function m.run(test)
+  test("stl ascii", m.test_ascii)
+  test("stl binary roundtrip", m.test_binary_roundtrip)
+  test("stl ascii chunking", m.test_ascii_chunking)
+end
+
+local ASCII_TRI = [[
+solid test facet vertex endfacet
+  facet normal 0 0 1
+    outer loop
+      vertex 0 0 0
+      vertex 1.5 0 0
+      vertex 0 -2.5e-1 0
+    endloop
+  endfacet
+  facet normal 0.0 1.0E0 -0
+    outer loop
+      vertex 1 2 3
+      vertex -4 5 6
+      vertex 7 8 -9.75
+    endloop
+  endfacet
+endsolid test facet vertex endfacet
+]]
+
+local function ascii_grid(n)
+  local lines = {"solid grid"}
+  for i = 0, n - 1 do
+    lines[#lines+1] = "facet normal 0 0 1\nouter loop"
+    lines[#lines+1] = ("vertex %d 0 0\nvertex %d 1 0\nvertex %d 0 1"):format(i, i, i)
+    lines[#lines+1] = "endloop\nendfacet"
+  end
+  lines[#lines+1] = "endsolid grid\n"
+  return table.concat(lines, "\n")
+end
+
+local function parse(src, options)
+  local stl = require("format/stl.t")
+  options = options or {}
+  options.commit = false
+  return stl.parse_geo(src, #src, options)
+end
+
+local function position(geo, idx)
+  local p = geo.verts[idx].position
+  return {p[0], p[1], p[2]}
+end
+
+function m.test_ascii(t)
+  local geo = parse(ASCII_TRI)
+  t.expect(geo.n_verts, 6, "vertex count")
+  t.expect(geo.n_indices, 6, "index count")
+  t.expect(position(geo, 1), {1.5, 0, 0}, "vertex")
+  t.expect(position(geo, 2), {0, -0.25, 0}, "exponent")
+  t.expect(position(geo, 5), {7, 8, -9.75}, "second facet")
+  t.expect(geo.verts[3].normal[1], 1, "normal")
+  t.expect({geo.indices[3], geo.indices[4], geo.indices[5]}, {3, 4, 5}, "indices")
+
+  local inverted = parse(ASCII_TRI, {invert = true})
+  t.expect({inverted.indices[3], inverted.indices[4], inverted.indices[5]},
+           {3, 5, 4}, "inverted winding")
+  t.expect(inverted.verts[0].normal[2], -1, "inverted normal")
+end
+
+function m.test_binary_roundtrip(t)
+  local stl = require("format/stl.t")
+  local geo = parse(ASCII_TRI)
+  local binary = stl.dump_geo(geo)
+  t.expect(#binary, 84 + 2 * 50, "binary size")
+  local reloaded = parse(binary)
+  t.expect(reloaded.n_verts, 6, "vertex count")
+  for i = 0, 5 do
+    t.expect(position(reloaded, i), position(geo, i), "vertex " .. i)
+  end
+  t.expect(reloaded.verts[4].normal[1], 1, "normal")
+end
+
+function m.test_ascii_chunking(t)
+  local stl = require("format/stl.t")
+  -- enough facets for 2^16+ vertices, so the chunks write 32 bit indices
+  local n = 22000
+  local src = ascii_grid(n)
+  local prev_chunk_size = stl.ASCII_CHUNK_SIZE
+  stl.ASCII_CHUNK_SIZE = 1000
+
+  local jobs = require("native/jobs.t")
+  jobs.parallel = false
+  local serial = parse(src)
+  jobs.parallel = true
+  local parallel = parse(src)
+  stl.ASCII_CHUNK_SIZE = prev_chunk_size
+
+  t.expect(parallel.n_verts, n * 3, "vertex count")
+  t.expect(parallel.index_type, uint32, "32 bit indices")
+  local same = true
+  for i = 0, n * 3 - 1 do
+    local a, b = serial.verts[i].position, parallel.verts[i].position
+    if a[0] ~= b[0] or a[1] ~= b[1] or a[2] ~= b[2] or
+       serial.indices[i] ~= parallel.indices[i] then
+      same = false
+      break
+    end
+  end
+  t.ok(same, "chunked parallel parse matches serial parse")
+  t.expect(position(parallel, (n - 1) * 3 + 1), {n - 1, 1, 0}, "last facet")
+end
+
+return m
@@ -0,0 +1,119 @@
+-- format/_test_tgeo.t
+--
+-- tests for the binary geometry format
+
+local m = {}
+
+function m.run(test)
+  test("tgeo vertex layout", m.test_layout)
+  test("tgeo roundtrip", m.test_roundtrip)
+  test("tgeo cache", m.test_cache)
+end
+
+local TRI = [[
+solid tri
+facet normal 0 0 1
+outer loop
+vertex 0 0 0
+vertex 1 0 0
+vertex 0 1 0
+endloop
+endfacet
+endsolid tri
+]]
+
+function m.test_layout(t)
+  local vdefs = require("gfx/vertexdefs.t")
+  local vtype = vdefs.create_basic_vertex_type({"position", "normal", "color0", "texcoord0"})
+  local parsed = vdefs.vertex_type_from_id(vtype.type_id)
+  t.ok(parsed == vtype, "same vertex type from its id")
+  t.err(function() vdefs.vertex_type_from_id("p:3q") end, "invalid id")
+end
+
+function m.test_roundtrip(t)
+  local C = truss.C
+  local tgeo = require("format/tgeo.t")
+  local geoexport = require("format/geoexport.t")
+  local geo = require("format/stl.t").parse_geo(TRI, #TRI, {commit = false})
+
+  local msg = geoexport.dump_tgeo(geo, 1234)
+  local header = terralib.cast(&tgeo.Header, msg.data)
+  t.expect(tonumber(header.vertex_offset) % tgeo.ALIGNMENT, 0, "vertex data aligned")
+  t.expect(tonumber(header.index_offset) % tgeo.ALIGNMENT, 0, "index data aligned")
+  local index_offset = tonumber(header.index_offset)
+
+  local loaded = tgeo.parse_geo(msg, {commit = false})
+  C.release_message(msg) -- the geometry keeps its own reference
+  t.ok(loaded.vertinfo == geo.vertinfo, "vertex type")
+  t.expect(loaded.n_verts, 3, "vertex count")
+  t.expect(loaded.index_type, geo.index_type, "index type")
+  t.expect(tonumber(loaded.source_hash), 1234, "source hash")
+  t.expect(loaded.verts[1].position[0], 1, "vertex data")
+  t.expect(loaded.verts[2].normal[2], 1, "vertex data")
+  t.expect(loaded.indices[2], 2, "index data")
+  loaded:deallocate()
+
+  local bad = C.create_message(8)
+  local geo2, err = tgeo.parse_geo(bad, {commit = false})
+  C.release_message(bad)
+  t.ok(geo2 == nil and err ~= nil, "rejects short data")
+
+  local function rejects(field, value, desc)
+    local badmsg = geoexport.dump_tgeo(geo, 1234)
+    terralib.cast(&tgeo.Header, badmsg.data)[field] = value
+    local badgeo, baderr = tgeo.parse_geo(badmsg, {commit = false})
+    C.release_message(badmsg)
+    t.ok(badgeo == nil and baderr ~= nil, desc)
+  end
+  rejects("index_size", 3, "rejects an index size other than 2 or 4")
+  rejects("vertex_offset", 0, "rejects vertex data overlapping the header")
+  rejects("index_offset", index_offset + 2, "rejects misaligned data")
+end
+
+-- the triangle with its second vertex moved
+local TRI_MOVED = TRI:gsub("vertex 1 0 0", "vertex 2 0 0")
+
+function m.test_cache(t)
+  local C = truss.C
+  local tgeo = require("format/tgeo.t")
+  local filename = "_test_tgeo_cache.stl"
+  local function load()
+    -- only geometry mapped from a .tgeo has a source hash
+    local geo = tgeo.load_model(filename, {commit = false})
+    local hit = geo.source_hash ~= nil
+    local x = geo.verts[1].position[0]
+    geo:deallocate()
+    return hit, x
+  end
+
+  t.ok(truss.save_string(filename, TRI), "wrote source")
+  local realdir = C.get_file_real_path(filename)
+  t.ok(realdir ~= nil, "source is on disk")
+  if realdir == nil then return end
+  local cache_path = ffi.string(realdir) .. "/" .. filename .. tgeo.EXTENSION
+  os.remove(cache_path)
+
+  local hit, x = load()
+  t.ok(not hit, "first load misses")
+  t.expect(x, 1, "geometry from the source")
+  local cache = io.open(cache_path, "rb")
+  t.ok(cache ~= nil, "cache written")
+  if cache then cache:close() end
+
+  hit, x = load()
+  t.ok(hit, "second load hits")
+  t.expect(x, 1, "geometry from the cache")
+
+  truss.save_string(filename, TRI_MOVED)
+  hit, x = load()
+  t.ok(not hit, "changed source invalidates the cache")
+  t.expect(x, 2, "geometry from the changed source")
+  hit, x = load()
+  t.ok(hit, "rewritten cache hits")
+  t.expect(x, 2, "geometry from the rewritten cache")
+
+  os.remove(cache_path)
+  os.remove(ffi.string(realdir) .. "/" .. filename)
+end
+
+return m
@@ -4,57 +4,127 @@
 
 local m = {}
 
-function m.dump_obj_geo(geo, dumper)
+-- when saving, dumpers that support it (have :flush(stream)) are flushed
+-- to the output stream every this many vertices/faces, so memory use stays
+-- bounded regardless of the size of the geometry
+m.FLUSH_INTERVAL = 65536
+
+local function maybe_flush(dumper, stream, count)
+  if stream and count % m.FLUSH_INTERVAL == 0 then
+    dumper:flush(stream)
+  end
+end
+
+function m.dump_obj_geo(geo, dumper, stream)
   if not geo.allocated then
     truss.error("Geometry has no allocated data!")
   end
   for vidx = 0, geo.n_verts-1 do
     dumper:push_vert(geo.verts[vidx])
+    maybe_flush(dumper, stream, vidx+1)
   end
   local nfaces = geo.n_indices / 3
   local fidx = 0
-  for _ = 1, nfaces do
+  for face = 1, nfaces do
     dumper:push_face(geo.indices[fidx+0], geo.indices[fidx+1], geo.indices[fidx+2])
     fidx = fidx + 3
+    maybe_flush(dumper, stream, face)
   end
+  if stream then return dumper:flush(stream) end
   return dumper:dump()
 end
 
-function m.dump_obj_data(data, dumper)
+function m.dump_obj_data(data, dumper, stream)
   local v = data.attributes.position
   local vn = data.attributes.normal or {}
   local vt = data.attributes.texcoord0 or {}
   for vidx = 1, #v do
     dumper:push_vert(v[vidx], vt[vidx], vn[vidx])
+    maybe_flush(dumper, stream, vidx)
   end
   if type(data.indices[1]) == "number" then
     local nfaces = #data.indices / 3
     local fidx = 1
-    for _ = 1, nfaces do
+    for face = 1, nfaces do
       dumper:push_face(data.indices[fidx+0], data.indices[fidx+1], data.indices[fidx+2])
       fidx = fidx + 3
+      maybe_flush(dumper, stream, face)
     end
   else -- assume list-of-lists
-    for _, ftuple in ipairs(data.indices) do
+    for face, ftuple in ipairs(data.indices) do
       dumper:push_face(unpack(ftuple))
+      maybe_flush(dumper, stream, face)
     end
   end
+  if stream then return dumper:flush(stream) end
   return dumper:dump()
 end
 
-function m.dump(geo_or_data, dumper)
+function m.dump(geo_or_data, dumper, stream)
   local s = ""
   if geo_or_data.attributes then
-    s = m.dump_obj_data(geo_or_data, dumper)
+    s = m.dump_obj_data(geo_or_data, dumper, stream)
   else
-    s = m.dump_obj_geo(geo_or_data, dumper)
+    s = m.dump_obj_geo(geo_or_data, dumper, stream)
   end
   return s
 end
 
 function m.save(filename, geo_or_data, dumper)
-  local s = m.dump(geo_or_data, dumper)
-  truss.save_string(filename, s)
+  if not dumper.flush then
+    truss.save_string(filename, m.dump(geo_or_data, dumper))
+    return
+  end
+  local stream = require("io/stream.t").open(filename, "w")
+  m.dump(geo_or_data, dumper, stream)
+  stream:close()
+end
+
+-- returns geo in the binary format/tgeo.t format as a new truss_message
+function m.dump_tgeo(geo, source_hash)
+  if not geo.allocated then
+    truss.error("Geometry has no allocated data!")
+  end
+  local tgeo = require("./tgeo.t")
+  local header = tgeo.make_header(geo, source_hash)
+  local type_id = geo.vertinfo.type_id
+  local index_offset = tonumber(header.index_offset)
+  local msg = truss.C.create_message(index_offset + geo.index_data_size)
+  local dest = terralib.cast(&uint8, msg.data)
+  ffi.fill(dest, index_offset)
+  ffi.copy(dest, header, sizeof(tgeo.Header))
+  ffi.copy(dest + sizeof(tgeo.Header), type_id, #type_id)
+  ffi.copy(dest + tonumber(header.vertex_offset), geo.verts, geo.vert_data_size)
+  ffi.copy(dest + index_offset, geo.indices, geo.index_data_size)
+  return msg
+end
+
+-- writes geo in the binary format/tgeo.t format, which loads without any
+-- per-vertex work; source_hash (optional) records what it was derived
+-- from. raw: filename is a real path rather than a physfs path.
+function m.save_tgeo(filename, geo, source_hash, raw)
+  if not geo.allocated then
+    truss.error("Geometry has no allocated data!")
+  end
+  local tgeo = require("./tgeo.t")
+  local header = tgeo.make_header(geo, source_hash)
+  local type_id = geo.vertinfo.type_id
+  local stream = require("io/stream.t").open(filename, "w", raw)
+  local pos = 0
+  local function pad_to(offset)
+    offset = tonumber(offset)
+    if offset > pos then stream:write(string.rep("\0", offset - pos)) end
+    pos = offset
+  end
+  stream:write(header, sizeof(tgeo.Header))
+  stream:write(type_id)
+  pos = sizeof(tgeo.Header) + #type_id
+  pad_to(header.vertex_offset)
+  stream:write(geo.verts, geo.vert_data_size)
+  pos = pos + geo.vert_data_size
+  pad_to(header.index_offset)
+  stream:write(geo.indices, geo.index_data_size)
+  stream:close()
 end
 
 return m
\ No newline at end of file
@@ -0,0 +1,574 @@
+-- format/msgpack.t
+--
+-- MessagePack codec in Terra. Encoding writes straight into a growable
+-- native buffer, which is copied out whole into fixed destinations such as
+-- a truss_message payload or a native/buffer.t ByteBuffer; decoding reads
+-- straight out of that memory. Neither builds intermediate Lua strings
+-- except for string values.
+--
+-- Typed arrays (m.typed) travel as extension type m.TYPED_EXT, whose
+-- payload is: element type (uint8), padding count (uint8), padding, then
+-- the raw native-endian elements. The padding aligns the elements relative
+-- to the start of the encoded data, so the decoder hands back a pointer
+-- into the source (zero-copy); it stays valid only as long as the source.
+
+local c = require("native/clib.t")
+local m = {}
+
+m.TYPED_EXT = 0x54 -- 'T'
+
+-- element type codes for typed arrays
+local TYPED_ELEMENTS = {
+  {"int8", int8}, {"uint8", uint8}, {"int16", int16}, {"uint16", uint16},
+  {"int32", int32}, {"uint32", uint32}, {"int64", int64}, {"uint64", uint64},
+  {"float", float}, {"double", double}
+}
+local TYPED_CODES = {}
+for code, entry in ipairs(TYPED_ELEMENTS) do TYPED_CODES[entry[1]] = code end
+
+-- token kinds produced by Reader:next
+m.NIL, m.BOOL, m.INT, m.UINT, m.FLOAT = 0, 1, 2, 3, 4
+m.STR, m.BIN, m.ARRAY, m.MAP, m.EXT, m.TYPED = 5, 6, 7, 8, 9, 10
+
+local terra store_be(p: &uint8, v: uint64, nbytes: int)
+  for i = 0, nbytes do
+    p[i] = [uint8]((v >> (8 * (nbytes - 1 - i))) and 0xff)
+  end
+end
+
+local terra load_be(p: &uint8, nbytes: int): uint64
+  var v: uint64 = 0
+  for i = 0, nbytes do
+    v = (v << 8) or p[i]
+  end
+  return v
+end
+
+local struct Writer {
+  data: &uint8;
+  size: uint64;
+  capacity: uint64;
+  owned: bool;     -- false for fixed buffers, which never grow
+  overflow: bool;  -- set if a fixed buffer ran out of room
+}
+m.Writer = Writer
+
+terra Writer:init()
+  self.data = nil
+  self.size = 0
+  self.capacity = 0
+  self.owned = true
+  self.overflow = false
+end
+
+-- writes into memory owned elsewhere; check overflow when done, since
+-- whatever was written before running out of room is left in place
+terra Writer:init_fixed(data: &uint8, capacity: uint64)
+  self:release()
+  self.data = data
+  self.capacity = capacity
+  self.owned = false
+end
+
+terra Writer:release()
+  if self.owned and self.data ~= nil then
+    c.std.free(self.data)
+  end
+  self:init()
+end
+
+terra Writer:reset()
+  self.size = 0
+  self.overflow = false
+end
+
+-- returns room for n more bytes (nil on overflow, and for every request
+-- after one, so nothing is written past a value that didn't fit)
+terra Writer:reserve(n: uint64): &uint8
+  if self.overflow then return nil end
+  var needed = self.size + n
+  if needed > self.capacity then
+    if not self.owned then
+      self.overflow = true
+      return nil
+    end
+    var newcap = self.capacity * 2
+    if newcap < 256 then newcap = 256 end
+    while newcap < needed do newcap = newcap * 2 end
+    var newdata = [&uint8](c.std.realloc(self.data, newcap))
+    if newdata == nil then
+      self.overflow = true
+      return nil
+    end
+    self.data = newdata
+    self.capacity = newcap
+  end
+  var p = self.data + self.size
+  self.size = needed
+  return p
+end
+
+terra Writer:put_byte(b: uint8)
+  var p = self:reserve(1)
+  if p ~= nil then p[0] = b end
+end
+
+-- a marker byte followed by an nbytes big-endian value
+terra Writer:put_marked(marker: uint8, v: uint64, nbytes: int)
+  var p = self:reserve(1 + nbytes)
+  if p ~= nil then
+    p[0] = marker
+    store_be(p + 1, v, nbytes)
+  end
+end
+
+terra Writer:put_nil()
+  self:put_byte(0xc0)
+end
+
+terra Writer:put_bool(b: bool)
+  self:put_byte(terralib.select(b, 0xc3, 0xc2))
+end
+
+terra Writer:put_uint(v: uint64)
+  if v < 128 then
+    self:put_byte([uint8](v))
+  elseif v < 0x100 then
+    self:put_marked(0xcc, v, 1)
+  elseif v < 0x10000 then
+    self:put_marked(0xcd, v, 2)
+  elseif v < 0x100000000ULL then
+    self:put_marked(0xce, v, 4)
+  else
+    self:put_marked(0xcf, v, 8)
+  end
+end
+
+terra Writer:put_int(v: int64)
+  if v >= 0 then
+    self:put_uint(v)
+  elseif v >= -32 then
+    self:put_byte([uint8](v))
+  elseif v >= -128 then
+    self:put_marked(0xd0, [uint64](v), 1)
+  elseif v >= -32768 then
+    self:put_marked(0xd1, [uint64](v), 2)
+  elseif v >= -2147483648LL then
+    self:put_marked(0xd2, [uint64](v), 4)
+  else
+    self:put_marked(0xd3, [uint64](v), 8)
+  end
+end
+
+terra Writer:put_float(f: float)
+  self:put_marked(0xca, @[&uint32](&f), 4)
+end
+
+terra Writer:put_double(d: double)
+  self:put_marked(0xcb, @[&uint64](&d), 8)
+end
+
+terra Writer:put_raw(src: &opaque, len: uint64)
+  var p = self:reserve(len)
+  if p ~= nil and len > 0 then c.str.memcpy(p, src, len) end
+end
+
+terra Writer:put_str(s: &int8, len: uint64)
+  if len < 32 then
+    self:put_byte([uint8](0xa0 or len))
+  elseif len < 0x100 then
+    self:put_marked(0xd9, len, 1)
+  elseif len < 0x10000 then
+    self:put_marked(0xda, len, 2)
+  else
+    self:put_marked(0xdb, len, 4)
+  end
+  self:put_raw(s, len)
+end
+
+terra Writer:put_bin(src: &opaque, len: uint64)
+  if len < 0x100 then
+    self:put_marked(0xc4, len, 1)
+  elseif len < 0x10000 then
+    self:put_marked(0xc5, len, 2)
+  else
+    self:put_marked(0xc6, len, 4)
+  end
+  self:put_raw(src, len)
+end
+
+terra Writer:put_array_header(n: uint64)
+  if n < 16 then
+    self:put_byte([uint8](0x90 or n))
+  elseif n < 0x10000 then
+    self:put_marked(0xdc, n, 2)
+  else
+    self:put_marked(0xdd, n, 4)
+  end
+end
+
+terra Writer:put_map_header(n: uint64)
+  if n < 16 then
+    self:put_byte([uint8](0x80 or n))
+  elseif n < 0x10000 then
+    self:put_marked(0xde, n, 2)
+  else
+    self:put_marked(0xdf, n, 4)
+  end
+end
+
+terra Writer:put_ext(tag: int8, src: &opaque, len: uint64)
+  if len == 1 or len == 2 or len == 4 or len == 8 or len == 16 then
+    var marker: uint8 = 0xd4
+    if len == 2 then marker = 0xd5
+    elseif len == 4 then marker = 0xd6
+    elseif len == 8 then marker = 0xd7
+    elseif len == 16 then marker = 0xd8 end
+    self:put_byte(marker)
+  elseif len < 0x100 then
+    self:put_marked(0xc7, len, 1)
+  elseif len < 0x10000 then
+    self:put_marked(0xc8, len, 2)
+  else
+    self:put_marked(0xc9, len, 4)
+  end
+  self:put_byte(tag)
+  self:put_raw(src, len)
+end
+
+-- typed arrays always use the 6 byte ext32 header, so the padding that
+-- aligns the elements is known before writing it
+terra Writer:put_typed(code: uint8, elemsize: uint64, src: &opaque, count: uint64)
+  var align = elemsize
+  if align > 8 then align = 8 end
+  var start = self.size + 6 + 2
+  var pad = (align - (start % align)) % align
+  var nbytes = count * elemsize
+  self:put_marked(0xc9, 2 + pad + nbytes, 4)
+  self:put_byte([m.TYPED_EXT])
+  self:put_byte(code)
+  self:put_byte([uint8](pad))
+  var p = self:reserve(pad)
+  if p ~= nil then
+    for i = 0, pad do p[i] = 0 end
+  end
+  self:put_raw(src, nbytes)
+end
+
+local struct Token {
+  kind: int32;
+  tag: int32;     -- ext type, or element type code for typed arrays
+  i: int64;       -- INT, BOOL
+  u: uint64;      -- UINT
+  d: double;      -- FLOAT
+  ptr: &uint8;    -- STR, BIN, EXT, TYPED: points into the source
+  len: uint64;    -- bytes, or elements for ARRAY and MAP
+}
+m.Token = Token
+
+local struct Reader {
+  data: &uint8;
+  size: uint64;
+  pos: uint64;
+}
+m.Reader = Reader
+
+terra Reader:init(data: &uint8, size: uint64)
+  self.data = data
+  self.size = size
+  self.pos = 0
+end
+
+terra Reader:remaining(): uint64
+  return self.size - self.pos
+end
+
+-- returns a pointer to the next n bytes and skips them (nil if truncated)
+terra Reader:take(n: uint64): &uint8
+  if n > self.size - self.pos then return nil end
+  var p = self.data + self.pos
+  self.pos = self.pos + n
+  return p
+end
+
+terra Reader:take_be(nbytes: int, ok: &bool): uint64
+  var p = self:take(nbytes)
+  if p == nil then
+    @ok = false
+    return 0
+  end
+  return load_be(p, nbytes)
+end
+
+-- reads n bytes of payload into tok as a (kind) blob
+terra Reader:take_blob(tok: &Token, kind: int32, n: uint64): bool
+  tok.kind = kind
+  tok.len = n
+  tok.ptr = self:take(n)
+  return tok.ptr ~= nil or n == 0
+end
+
+terra Reader:take_ext(tok: &Token, n: uint64): bool
+  var ok = true
+  tok.tag = [int8](self:take_be(1, &ok))
+  if not ok or not self:take_blob(tok, [m.EXT], n) then return false end
+  if tok.tag ~= [m.TYPED_EXT] then return true end
+  -- typed array: element code, padding, elements
+  if n < 2 then return false end
+  var pad = tok.ptr[1]
+  if 2 + pad > n then return false end
+  tok.kind = [m.TYPED]
+  tok.tag = tok.ptr[0]
+  tok.ptr = tok.ptr + 2 + pad
+  tok.len = n - 2 - pad
+  return true
+end
+
+-- reads the next value header into tok; containers report their element
+-- count and their elements follow as further tokens. Returns false on
+-- truncated or invalid data.
+terra Reader:next(tok: &Token): bool
+  var ok = true
+  var marker = [uint8](self:take_be(1, &ok))
+  if not ok then return false end
+  tok.tag = 0
+  if marker < 0x80 then
+    tok.kind, tok.u = [m.UINT], marker
+  elseif marker < 0x90 then
+    tok.kind, tok.len = [m.MAP], marker and 0x0f
+  elseif marker < 0xa0 then
+    tok.kind, tok.len = [m.ARRAY], marker and 0x0f
+  elseif marker < 0xc0 then
+    return self:take_blob(tok, [m.STR], marker and 0x1f)
+  elseif marker >= 0xe0 then
+    tok.kind, tok.i = [m.INT], [int8](marker)
+  elseif marker == 0xc0 then
+    tok.kind = [m.NIL]
+  elseif marker == 0xc2 or marker == 0xc3 then
+    tok.kind, tok.i = [m.BOOL], marker - 0xc2
+  elseif marker >= 0xc4 and marker <= 0xc6 then
+    var n = self:take_be(1 << (marker - 0xc4), &ok)
+    return ok and self:take_blob(tok, [m.BIN], n)
+  elseif marker >= 0xc7 and marker <= 0xc9 then
+    var n = self:take_be(1 << (marker - 0xc7), &ok)
+    return ok and self:take_ext(tok, n)
+  elseif marker == 0xca then
+    var bits = [uint32](self:take_be(4, &ok))
+    tok.kind, tok.d = [m.FLOAT], @[&float](&bits)
+  elseif marker == 0xcb then
+    var bits = self:take_be(8, &ok)
+    tok.kind, tok.d = [m.FLOAT], @[&double](&bits)
+  elseif marker >= 0xcc and marker <= 0xcf then
+    tok.kind, tok.u = [m.UINT], self:take_be(1 << (marker - 0xcc), &ok)
+  elseif marker >= 0xd0 and marker <= 0xd3 then
+    var nbytes = 1 << (marker - 0xd0)
+    var v = self:take_be(nbytes, &ok)
+    -- sign extend
+    var shift = 64 - 8 * nbytes
+    tok.kind, tok.i = [m.INT], ([int64](v << shift)) >> shift
+  elseif marker >= 0xd4 and marker <= 0xd8 then
+    return self:take_ext(tok, 1 << (marker - 0xd4))
+  elseif marker >= 0xd9 and marker <= 0xdb then
+    var n = self:take_be(1 << (marker - 0xd9), &ok)
+    return ok and self:take_blob(tok, [m.STR], n)
+  elseif marker == 0xdc or marker == 0xdd then
+    tok.kind, tok.len = [m.ARRAY], self:take_be(2 << (marker - 0xdc), &ok)
+  elseif marker == 0xde or marker == 0xdf then
+    tok.kind, tok.len = [m.MAP], self:take_be(2 << (marker - 0xde), &ok)
+  else
+    return false -- 0xc1 is never used
+  end
+  return ok
+end
+
+------------------------------------------------------------------------------
+-- Lua values
+------------------------------------------------------------------------------
+
+local TypedArray = {}
+TypedArray.__index = TypedArray
+m.TypedArray = TypedArray
+
+-- wraps count elements of type elemtype ("float", "uint16", ...) at ptr
+-- so that they encode as one binary blob instead of a Lua array
+function m.typed(ptr, count, elemtype)
+  local code = TYPED_CODES[elemtype]
+  if not code then truss.error("msgpack: unknown typed array type " .. tostring(elemtype)) end
+  return setmetatable({data = ptr, count = count, type = elemtype}, TypedArray)
+end
+
+local floor = math.floor
+local int64_t, uint64_t = ffi.typeof("int64_t"), ffi.typeof("uint64_t")
+
+local encode_value
+local function encode_table(w, v)
+  if getmetatable(v) == TypedArray then
+    local code = TYPED_CODES[v.type]
+    w:put_typed(code, terralib.sizeof(TYPED_ELEMENTS[code][2]), v.data, v.count)
+    return
+  end
+  local n, count = #v, 0
+  for _ in pairs(v) do count = count + 1 end
+  if count == n then
+    w:put_array_header(n)
+    for i = 1, n do encode_value(w, v[i]) end
+  else
+    w:put_map_header(count)
+    for key, val in pairs(v) do
+      encode_value(w, key)
+      encode_value(w, val)
+    end
+  end
+end
+
+function encode_value(w, v)
+  local tv = type(v)
+  if tv == "number" then
+    if v == floor(v) and v >= -2^63 and v < 2^64 then
+      if v >= 0 then w:put_uint(v) else w:put_int(v) end
+    else
+      w:put_double(v)
+    end
+  elseif tv == "string" then
+    w:put_str(v, #v)
+  elseif tv == "table" then
+    encode_table(w, v)
+  elseif tv == "boolean" then
+    w:put_bool(v)
+  elseif tv == "nil" then
+    w:put_nil()
+  elseif ffi.istype(int64_t, v) then
+    w:put_int(v)
+  elseif ffi.istype(uint64_t, v) then
+    w:put_uint(v)
+  else
+    truss.error("msgpack: can't encode a " .. tv)
+  end
+end
+
+-- encodes value into writer (a Writer cdata); returns the writer
+function m.encode(value, writer)
+  encode_value(writer, value)
+  return writer
+end
+
+-- shared scratch writer for the convenience functions below
+local scratch = terralib.new(Writer)
+scratch:init()
+
+-- encodes value into a new truss_message
+function m.encode_message(value)
+  scratch:reset()
+  encode_value(scratch, value)
+  if scratch.overflow then return nil end
+  local msg = truss.C.create_message(scratch.size)
+  c.str.memcpy(msg.data, scratch.data, scratch.size)
+  return msg
+end
+
+function m.encode_string(value)
+  scratch:reset()
+  encode_value(scratch, value)
+  if scratch.overflow then return nil end
+  return ffi.string(scratch.data, scratch.size)
+end
+
+-- encodes value into capacity bytes at dest (e.g., a message payload);
+-- returns the number of bytes written, or nil if it didn't fit, in which
+-- case dest is left untouched
+function m.encode_into(value, dest, capacity)
+  scratch:reset()
+  encode_value(scratch, value)
+  if scratch.overflow or scratch.size > capacity then return nil end
+  c.str.memcpy(dest, scratch.data, scratch.size)
+  return tonumber(scratch.size)
+end
+
+-- encodes value into a native/buffer.t ByteBuffer, setting its used_count
+function m.encode_buffer(value, buffer)
+  local size = m.encode_into(value, buffer.data, buffer.count)
+  if size then buffer.used_count = size end
+  return size
+end
+
+local typed_ptr_types = {}
+for code, entry in ipairs(TYPED_ELEMENTS) do
+  typed_ptr_types[code] = &entry[2]
+end
+
+local decode_value
+local function decode_token(reader, tok)
+  local kind = tok.kind
+  if kind == m.UINT then
+    local u = tok.u
+    return (u < 2^53) and tonumber(u) or u
+  elseif kind == m.INT then
+    local i = tok.i
+    return (i > -2^53 and i < 2^53) and tonumber(i) or i
+  elseif kind == m.STR then
+    return ffi.string(tok.ptr, tok.len)
+  elseif kind == m.FLOAT then
+    return tok.d
+  elseif kind == m.ARRAY then
+    local n = tonumber(tok.len)
+    local ret = {}
+    for i = 1, n do ret[i] = decode_value(reader, tok) end
+    return ret
+  elseif kind == m.MAP then
+    local n = tonumber(tok.len)
+    local ret = {}
+    for _ = 1, n do
+      local key = decode_value(reader, tok)
+      ret[key] = decode_value(reader, tok)
+    end
+    return ret
+  elseif kind == m.BOOL then
+    return tok.i ~= 0
+  elseif kind == m.NIL then
+    return nil
+  elseif kind == m.TYPED then
+    local code = tonumber(tok.tag)
+    local entry = TYPED_ELEMENTS[code]
+    if not entry then truss.error("msgpack: unknown typed array code " .. code) end
+    local elemsize = terralib.sizeof(entry[2])
+    if tonumber(tok.len) % elemsize ~= 0 then
+      truss.error("msgpack: truncated or invalid data")
+    end
+    local count = tonumber(tok.len) / elemsize
+    return setmetatable({data = terralib.cast(typed_ptr_types[code], tok.ptr),
+                         count = count, type = entry[1]}, TypedArray)
+  elseif kind == m.BIN then
+    return ffi.string(tok.ptr, tok.len)
+  else -- other extensions
+    return {ext = tonumber(tok.tag), data = ffi.string(tok.ptr, tok.len)}
+  end
+end
+
+function decode_value(reader, tok)
+  if not reader:next(tok) then
+    truss.error("msgpack: truncated or invalid data")
+  end
+  return decode_token(reader, tok)
+end
+
+local reader = terralib.new(Reader)
+local token = terralib.new(Token)
+
+-- decodes one value from size bytes at data; returns the value and the
+-- number of bytes it took. Typed arrays point into data.
+function m.decode(data, size)
+  reader:init(terralib.cast(&uint8, data), size)
+  local value = decode_value(reader, token)
+  return value, tonumber(reader.pos)
+end
+
+function m.decode_message(msg)
+  return m.decode(msg.data, msg.data_length)
+end
+
+-- typed arrays decoded from a string are only valid while it's referenced
+function m.decode_string(s)
+  return m.decode(s, #s)
+end
+
+return m
@@ -1,200 +1,432 @@
 -- format/obj.t
 --
 -- reads/writes wavefront .obj files
+--
+-- Parsing is done in terra straight out of the (mapped) file: a quick
+-- counting pass sizes every buffer, then a single parsing pass fills packed
+-- position/normal/uv arrays, unifies each face corner's v/vt/vn index
+-- triple into one vertex through a hash table, and fan-triangulates
+-- quads and other polygons.
+--
+-- Files are read through truss_map_file rather than io/stream.t: both
+-- passes need the whole file, and a mapping gives them that without a
+-- heap copy while the OS pages it in and out. Only saving streams.
 
 local class = require("class")
+local c = require("native/clib.t")
+local scan = require("./scan.t")
 local m = {}
 
 m.verbose = false
 
-function m.load_obj(filename, invert)
-  local starttime = truss.tic()
-  local src_message = truss.C.load_file(filename)
+local function load_native(filename, invert)
+  local src_message = truss.C.map_file(filename)
   if src_message == nil then
     log.error("Error: unable to open file " .. filename)
     return nil
   end
-
-  local srcstr = ffi.string(src_message.data, src_message.data_length)
-  local ret = m.parse_obj(srcstr, invert)
+  local datalength = tonumber(src_message.data_length)
+  local objdata = m.parse_native(src_message.data, datalength, invert)
   truss.C.release_message(src_message)
+  return objdata, datalength
+end
+
+local function log_load(filename, starttime, datalength)
   local dtime = truss.toc(starttime)
-  log.info("Loaded " .. filename .. " in " .. (dtime*1000.0) .. " ms")
+  log.info(("Loaded %s in %.1f ms (%.1f MB/s)"):format(
+           filename, dtime*1000.0, datalength / 2^20 / dtime))
+end
+
+-- loads into the lua table format used by Geometry:from_data
+function m.load_obj(filename, invert)
+  local starttime = truss.tic()
+  local objdata, datalength = load_native(filename, invert)
+  if not objdata then return nil end
+  local ret = m.to_data(objdata)
+  objdata:release()
+  log_load(filename, starttime, datalength)
   return ret
 end
 
 m.load = m.load_obj
 
--- implementation details
-
-local strfind = string.find
-local tinsert = table.insert
-local strsub = string.sub
+-- loads straight into a geometry; see m.fill_geo for options
+function m.load_geo(filename, options)
+  local starttime = truss.tic()
+  options = options or {}
+  local objdata, datalength = load_native(filename, options.invert)
+  if not objdata then return nil end
+  local opts = {name = filename}
+  for k, v in pairs(options) do opts[k] = v end
+  local ret = m.fill_geo(objdata, opts)
+  objdata:release()
+  log_load(filename, starttime, datalength)
+  return ret
+end
 
-local stringutils = require("util/string.t")
-local strsplit = stringutils.split
+-- implementation details
 
-local function is_comment(linegps)
-  local firstChar = strsub(linegps[1], 1, 1)
-  return firstChar == "#"
+local EMPTY = constant(uint32, 0xffffffff)
+local HASH_P = constant(uint32, 0x9E3779B1)
+local HASH_T = constant(uint32, 0x85EBCA77)
+local HASH_N = constant(uint32, 0xC2B2AE3D)
+
+local struct ObjData {
+  -- raw attributes, as listed in the file
+  positions: &float;  -- 3 per position
+  normals: &float;    -- 3 per normal
+  uvs: &float;        -- 2 per uv
+  n_positions: uint32;
+  n_normals: uint32;
+  n_uvs: uint32;
+  -- unified vertices: (position, uv, normal) index triples, -1 if absent
+  corners: &int32;
+  n_verts: uint32;
+  -- triangles over the unified vertices
+  indices: &uint32;
+  n_indices: uint32;
+  -- upper bounds from the counting pass
+  max_corners: uint32;
+  max_indices: uint32;
+  bad_corners: uint32; -- corners whose indices are out of range
+  -- open addressing hash table from index triples to unified vertices
+  table_keys: &int32;
+  table_values: &uint32;
+  table_size: uint32;
+}
+m.ObjData = ObjData
+
+terra ObjData:init()
+  c.str.memset(self, 0, sizeof(ObjData))
 end
 
-local attribute_table = {["v"] = "positions",
-                        ["vn"] = "normals",
-                        ["vt"] = "uvs",
-                        ["vp"] = "pspaces"}
-
-local function is_attribute(linegps)
-  local g1 = linegps[1]
-  return attribute_table[g1] ~= nil
+terra ObjData:release()
+  c.std.free(self.positions)
+  c.std.free(self.normals)
+  c.std.free(self.uvs)
+  c.std.free(self.corners)
+  c.std.free(self.indices)
+  c.std.free(self.table_keys)
+  c.std.free(self.table_values)
+  self:init()
 end
 
-local function parse_attribute(linegps, attribs)
-  local atype = attribute_table[linegps[1]]
-  local aval = {}
-  for i = 2,#linegps do
-      aval[i-1] = tonumber(linegps[i])
+-- 'v', 'vn', 'vt', 'f' or 0 for the line starting at cur
+local terra line_kind(cur: &uint8, stop: &uint8): uint8
+  if cur + 1 >= stop then return 0 end
+  if @cur == 102 and scan.is_blank(cur[1]) then return 102 end -- 'f'
+  if @cur ~= 118 then return 0 end -- 'v'
+  if scan.is_blank(cur[1]) then return 118 end
+  if cur + 2 < stop and scan.is_blank(cur[2]) then
+    if cur[1] == 110 then return 110 end -- 'vn'
+    if cur[1] == 116 then return 116 end -- 'vt'
   end
-  if attribs[atype] == nil then attribs[atype] = {} end
-  tinsert(attribs[atype], aval)
+  return 0
 end
 
-local function is_face(linegps)
-  if #linegps == 5 and linegps[1] == "f" then --QUAD!!!!
-    m.quadcount = m.quadcount + 1
-    return false
-  end
-  return #linegps == 4 and linegps[1] == "f"
+-- true at the end of a line or at a trailing comment
+local terra line_done(cur: &uint8, stop: &uint8): bool
+  return cur >= stop or @cur == 10 or @cur == 35 -- '\n', '#'
 end
 
-local function parse_face(linegps, rawfaces)
-  tinsert(rawfaces, {linegps[2], linegps[3], linegps[4]})
+-- counts corners (blank-separated words) on a face line
+local terra count_words(cur: &uint8, stop: &uint8): uint32
+  var n: uint32 = 0
+  while true do
+    cur = scan.skip_blank(cur, stop)
+    if line_done(cur, stop) then return n end
+    cur = scan.skip_word(cur, stop)
+    n = n + 1
+  end
 end
 
-local function parse_index(idxstr)
-  local gps = strsplit("/", idxstr)
-  local ret = {}
-  local ngps = #gps
-  for i = 1,ngps do
-    if #(gps[i]) > 0 then
-      ret[i] = tonumber(gps[i])
+terra ObjData:count(src: &uint8, stop: &uint8)
+  var cur = src
+  while cur < stop do
+    cur = scan.skip_space(cur, stop)
+    var kind = line_kind(cur, stop)
+    if kind == 118 then
+      self.n_positions = self.n_positions + 1
+    elseif kind == 110 then
+      self.n_normals = self.n_normals + 1
+    elseif kind == 116 then
+      self.n_uvs = self.n_uvs + 1
+    elseif kind == 102 then
+      var n = count_words(cur + 1, stop)
+      self.max_corners = self.max_corners + n
+      if n >= 3 then self.max_indices = self.max_indices + (n - 2) * 3 end
     end
+    cur = scan.skip_line(cur, stop)
   end
-  -- can't use unpack(ret) because ret[2] might be nil
-  -- in a .obj with normals but not uvs, and unpack uses
-  -- the length (which breaks on embedded nils)
-  -- to determine how many values to unpack
-  return ret[1],ret[2],ret[3]
 end
 
--- reindex_vertices(rawfaces) --> indexedfaces, vertexlist
---
--- since an obj file may specify different indices for a
--- face's position, normals, and uvs, this function resolves
--- these into unified vertex indices where each index corresponds
--- to a single position, normal, uv.
-function m.reindex_vertices(rawfaces)
-  local vtable = {}
-  local vindex = 0
-  local vertexlist = {}
-
-  local function resolve_vertex(vstr)
-    if vtable[vstr] == nil then
-      vtable[vstr] = vindex
-      tinsert(vertexlist, vstr)
-      vindex = vindex + 1
-    end
-    return vtable[vstr]
+terra ObjData:allocate()
+  var n_positions, n_normals, n_uvs = self.n_positions, self.n_normals, self.n_uvs
+  self.positions = [&float](c.std.malloc(sizeof(float) * 3 * n_positions + 1))
+  self.normals = [&float](c.std.malloc(sizeof(float) * 3 * n_normals + 1))
+  self.uvs = [&float](c.std.malloc(sizeof(float) * 2 * n_uvs + 1))
+  self.corners = [&int32](c.std.malloc(sizeof(int32) * 3 * self.max_corners + 1))
+  self.indices = [&uint32](c.std.malloc(sizeof(uint32) * self.max_indices + 1))
+  -- load factor between 1/3 and 2/3
+  var table_size: uint32 = 16
+  while table_size < self.max_corners + self.max_corners / 2 do
+    table_size = table_size * 2
   end
+  self.table_size = table_size
+  self.table_keys = [&int32](c.std.malloc(sizeof(int32) * 3 * table_size))
+  self.table_values = [&uint32](c.std.malloc(sizeof(uint32) * table_size))
+  c.str.memset(self.table_values, 0xff, sizeof(uint32) * table_size)
+  -- the parsing pass counts these up again
+  self.n_positions, self.n_normals, self.n_uvs = 0, 0, 0
+end
 
-  local indexedfaces = {}
-  local nfaces = #rawfaces
-  for f = 1,nfaces do
-    local cf = rawfaces[f]
-    local nf = {resolve_vertex(cf[1]),
-                resolve_vertex(cf[2]),
-                resolve_vertex(cf[3])}
-    indexedfaces[f] = nf
+terra ObjData:vertex_id(p: int32, t: int32, n: int32): uint32
+  -- (^ is xor here, but binds tighter than *)
+  var h = ([uint32](p) * HASH_P) ^ ([uint32](t) * HASH_T) ^ ([uint32](n) * HASH_N)
+  h = h ^ (h >> 15)
+  var mask = self.table_size - 1
+  h = h and mask
+  while true do
+    var key = self.table_keys + h * 3
+    var value = self.table_values[h]
+    if value == EMPTY then
+      key[0], key[1], key[2] = p, t, n
+      var id = self.n_verts
+      var corner = self.corners + id * 3
+      corner[0], corner[1], corner[2] = p, t, n
+      self.table_values[h] = id
+      self.n_verts = id + 1
+      return id
+    elseif key[0] == p and key[1] == t and key[2] == n then
+      return value
+    end
+    h = (h + 1) and mask
   end
+end
 
-  return indexedfaces, vertexlist
+-- resolves an obj index (1-based, or negative relative to the end) against
+-- the count so far; returns -1 if it is missing or out of range
+local terra resolve_index(idx: int64, count: uint32): int32
+  if idx < 0 then idx = idx + count else idx = idx - 1 end
+  if idx < 0 or idx >= count then return -1 end
+  return [int32](idx)
 end
 
--- gather_vertices(vertexlist, posList, texList, normalList)
---                 --> {positions=, uvs=, normals=}
---
--- takes in the vertex list, where each vertex is a string like
--- "3/4/5" and pulls pos[3], uvs[4] and normals[5] and adds them
--- to the appropriate position, uv, and normal lists
-function m.gather_vertices(vertexlist, posList, texList, normalList)
-  local nvertices = #vertexlist
-  local positions, uvs, normals = {}, {}, {}
-  for i = 1,nvertices do
-    local posIndex, texIndex, normalIndex = parse_index(vertexlist[i])
-    if posIndex    then positions[i] =    posList[posIndex]    end
-    if texIndex    then uvs[i]       =    texList[texIndex]    end
-    if normalIndex then normals[i]   = normalList[normalIndex] end
+-- parses one "v", "v/vt", "v//vn" or "v/vt/vn" corner; returns the new
+-- position, and the unified vertex in id (EMPTY if it's invalid)
+terra ObjData:scan_corner(cur: &uint8, stop: &uint8, id: &uint32): &uint8
+  var idx: int64 = 0
+  var p, t, n = -1, -1, -1
+  var next = scan.scan_int(cur, stop, &idx)
+  var valid = next ~= cur
+  if valid then p = resolve_index(idx, self.n_positions) end
+  cur = next
+  if cur < stop and @cur == 47 then -- '/'
+    cur = cur + 1
+    next = scan.scan_int(cur, stop, &idx)
+    if next ~= cur then
+      t = resolve_index(idx, self.n_uvs)
+      valid = valid and t >= 0
+    end
+    cur = next
+    if cur < stop and @cur == 47 then
+      cur = cur + 1
+      next = scan.scan_int(cur, stop, &idx)
+      if next ~= cur then
+        n = resolve_index(idx, self.n_normals)
+        valid = valid and n >= 0
+      end
+      cur = next
+    end
   end
-  return {position = positions, texcoord0 = uvs, normal = normals}
+  cur = scan.skip_word(cur, stop) -- anything unexpected
+  if valid and p >= 0 then
+    @id = self:vertex_id(p, t, n)
+  else
+    self.bad_corners = self.bad_corners + 1
+    @id = EMPTY
+  end
+  return cur
 end
 
-function m.parse_obj(objstring, invert)
-  local lines = stringutils.split_lines(objstring) -- TODO: fix stringutils
-  local nlines = #lines
-  local attributes = {}
-  local rawfaces = {}
-  local strip = stringutils.strip
-
-  -- read in raw data
-  m.quadcount = 0
-  for i = 1,nlines do
-    local curline = strip(lines[i])
-    local gps = strsplit("%s+", curline)
-    if not is_comment(gps) then
-      if is_attribute(gps) then
-        parse_attribute(gps, attributes)
-      elseif is_face(gps) then
-        parse_face(gps, rawfaces)
-      elseif m.verbose then -- wasn't attribute or face, so what is it?
-        log.error("objloader: couldn't parse line [" .. curline .. "]")
+terra ObjData:parse_face(cur: &uint8, stop: &uint8, invert: bool): &uint8
+  var first, prev, ncorners = EMPTY, EMPTY, 0
+  while true do
+    cur = scan.skip_blank(cur, stop)
+    if line_done(cur, stop) then break end
+    var id: uint32
+    cur = self:scan_corner(cur, stop, &id)
+    if id ~= EMPTY then
+      if ncorners == 0 then
+        first = id
+      elseif ncorners >= 2 then
+        var tri = self.indices + self.n_indices
+        tri[0] = first
+        if invert then
+          tri[1], tri[2] = id, prev
+        else
+          tri[1], tri[2] = prev, id
+        end
+        self.n_indices = self.n_indices + 3
       end
+      prev = id
+      ncorners = ncorners + 1
     end
   end
-  if m.quadcount > 0 then
-    log.warn("Warning: model contained " .. m.quadcount
-                .. " quads, which were ignored!")
+  return cur
+end
+
+terra ObjData:parse(src: &uint8, stop: &uint8, invert: bool)
+  var cur = src
+  while cur < stop do
+    cur = scan.skip_space(cur, stop)
+    var kind = line_kind(cur, stop)
+    if kind == 118 then
+      cur = scan.scan_floats(cur + 1, stop, self.positions + self.n_positions * 3, 3)
+      self.n_positions = self.n_positions + 1
+    elseif kind == 110 then
+      cur = scan.scan_floats(cur + 2, stop, self.normals + self.n_normals * 3, 3)
+      self.n_normals = self.n_normals + 1
+    elseif kind == 116 then
+      cur = scan.scan_floats(cur + 2, stop, self.uvs + self.n_uvs * 2, 2)
+      self.n_uvs = self.n_uvs + 1
+    elseif kind == 102 then
+      cur = self:parse_face(cur + 1, stop, invert)
+    end
+    cur = scan.skip_line(cur, stop)
   end
+end
 
+-- parses datalength bytes of obj text at src; returns an ObjData which
+-- has to be :release()d
+function m.parse_native(src, datalength, invert)
+  local src = terralib.cast(&uint8, src) -- can also be a lua string
+  local stop = src + tonumber(datalength)
+  local objdata = terralib.new(ObjData)
+  objdata:init()
+  objdata:count(src, stop)
+  objdata:allocate()
+  objdata:parse(src, stop, not not invert)
+  if objdata.bad_corners > 0 then
+    log.warn("objloader: skipped " .. objdata.bad_corners
+             .. " face corners with missing or out of range indices")
+  end
   if m.verbose then
-    log.debug("#raw faces: " .. #rawfaces)
-    log.debug("#raw positions: " .. #(attributes.positions or {}))
-    log.debug("#raw uvs: " .. #(attributes.uvs or {}))
-    log.debug("#raw normals: " .. #(attributes.normals or {}))
+    log.debug("#raw positions: " .. objdata.n_positions)
+    log.debug("#raw uvs: " .. objdata.n_uvs)
+    log.debug("#raw normals: " .. objdata.n_normals)
+    log.debug("#triangles (faces): " .. objdata.n_indices / 3)
+    log.debug("#vertices: " .. objdata.n_verts)
   end
+  return objdata
+end
 
-  -- unify vertices
-  local faces, vertexlist = m.reindex_vertices(rawfaces)
-
-  -- produce attribute lists
-  local attr = m.gather_vertices(vertexlist, attributes.positions or {},
-                                             attributes.uvs or {},
-                                             attributes.normals or {})
+local fill_kernel = terralib.memoize(function(VertType, IndexType, has_normal, has_uv)
+  local terra fill(data: &ObjData, verts: &VertType, indices: &IndexType, nsign: float)
+    for i = 0, data.n_verts do
+      var corner = data.corners + i * 3
+      var p = data.positions + corner[0] * 3
+      for j = 0, 3 do verts[i].position[j] = p[j] end
+      escape if has_uv then emit quote
+        if corner[1] >= 0 then
+          var t = data.uvs + corner[1] * 2
+          for j = 0, 2 do verts[i].texcoord0[j] = t[j] end
+        else
+          for j = 0, 2 do verts[i].texcoord0[j] = 0.0f end
+        end
+      end end end
+      escape if has_normal then emit quote
+        if corner[2] >= 0 then
+          var n = data.normals + corner[2] * 3
+          for j = 0, 3 do verts[i].normal[j] = nsign * n[j] end
+        else
+          for j = 0, 3 do verts[i].normal[j] = 0.0f end
+        end
+      end end end
+    end
+    for i = 0, data.n_indices do
+      indices[i] = [IndexType](data.indices[i])
+    end
+  end
+  return fill
+end)
+
+-- fills a geometry from parsed ObjData
+-- options (all optional):
+--   invert: negate normals (the winding was flipped when parsing)
+--   geo: geometry to fill (allocated if it isn't already)
+--   name: name for a newly created geometry
+--   vertinfo: vertex type for a new geometry (default: position, plus
+--             normal and texcoord0 if the file has them)
+--   commit: commit the geometry (default true)
+function m.fill_geo(objdata, options)
+  options = options or {}
+  local n_verts, n_indices = objdata.n_verts, objdata.n_indices
+  local geo = options.geo
+  if not geo then
+    local gfx = require("gfx")
+    geo = gfx.StaticGeometry(options.name)
+  end
+  if not geo.allocated then
+    local vertinfo = options.vertinfo
+    if not vertinfo then
+      local attributes = {"position"}
+      if objdata.n_normals > 0 then table.insert(attributes, "normal") end
+      if objdata.n_uvs > 0 then table.insert(attributes, "texcoord0") end
+      vertinfo = require("gfx/vertexdefs.t").create_basic_vertex_type(attributes)
+    end
+    geo:allocate(n_verts, n_indices, vertinfo)
+  elseif geo.n_verts < n_verts or geo.n_indices < n_indices then
+    truss.error("obj has " .. n_verts .. " vertices and " .. n_indices
+                .. " indices; geometry is too small")
+  end
+  local attributes = geo.vertinfo.attributes
+  local fill = fill_kernel(geo.vertinfo.ttype, geo.index_type,
+                           attributes.normal ~= nil, attributes.texcoord0 ~= nil)
+  fill(objdata, geo.verts, geo.indices, (options.invert and -1.0) or 1.0)
+  if options.commit ~= false then geo:commit() end
+  return geo
+end
 
-  -- add in face index list
-  local ret = {
-    indices = faces,
-    attributes = attr
-  }
-  if #(attr.normal) == 0 then attr.normal = nil end
-  if #(attr.texcoord0) == 0 then attr.texcoord0 = nil end
+function m.parse_geo(src, datalength, options)
+  options = options or {}
+  local objdata = m.parse_native(src, datalength, options.invert)
+  local geo = m.fill_geo(objdata, options)
+  objdata:release()
+  return geo
+end
 
-  if m.verbose then
-    log.debug("#triangles (faces): " .. #ret.indices)
-    log.debug("#vertices: " .. #(attr.position or {}))
-    log.debug("#normals: " .. #(attr.normal or {}))
-    log.debug("#uvs: " .. #(attr.texcoord0 or {}))
+-- converts parsed ObjData into {indices = {{i0, i1, i2}, ...},
+-- attributes = {position = {{x, y, z}, ...}, normal = ..., texcoord0 = ...}}
+function m.to_data(objdata)
+  local positions, normals, uvs = {}, {}, {}
+  local has_normals, has_uvs = objdata.n_normals > 0, objdata.n_uvs > 0
+  local src_p, src_n, src_t = objdata.positions, objdata.normals, objdata.uvs
+  for i = 0, objdata.n_verts - 1 do
+    local p, t, n = objdata.corners[i*3], objdata.corners[i*3+1], objdata.corners[i*3+2]
+    positions[i+1] = {src_p[p*3], src_p[p*3+1], src_p[p*3+2]}
+    if has_uvs then
+      uvs[i+1] = (t >= 0 and {src_t[t*2], src_t[t*2+1]}) or {0, 0}
+    end
+    if has_normals then
+      normals[i+1] = (n >= 0 and {src_n[n*3], src_n[n*3+1], src_n[n*3+2]}) or {0, 0, 0}
+    end
   end
+  local faces = {}
+  local indices = objdata.indices
+  for f = 0, objdata.n_indices / 3 - 1 do
+    faces[f+1] = {indices[f*3], indices[f*3+1], indices[f*3+2]}
+  end
+  local attr = {position = positions}
+  if has_normals then attr.normal = normals end
+  if has_uvs then attr.texcoord0 = uvs end
+  return {indices = faces, attributes = attr}
+end
 
+function m.parse_obj(objstring, invert)
+  local objdata = m.parse_native(objstring, #objstring, invert)
+  local ret = m.to_data(objdata)
+  objdata:release()
   return ret
 end
 
@@ -246,14 +478,16 @@ function ObjDumper:push_face(i1, i2, i3)
     return self:push_face(unpack(i1))
   end
   if not self.face_format then
+    local has_vn = (self.vn_count or 0) + #self.vn > 0
+    local has_vt = (self.vt_count or 0) + #self.vt > 0
     local ff = "%d"
-    if #self.vn > 0 or #self.vt > 0 then
-      if #self.vt > 0 then
+    if has_vn or has_vt then
+      if has_vt then
         ff = ff .. "/%d"
       else
         ff = ff .. "/"
       end
-      if #self.vn > 0 then
+      if has_vn then
         ff = ff .. "/%d"
       end
     end
@@ -284,6 +518,19 @@ function ObjDumper:dump()
   return ret
 end
 
+-- write out (and clear) everything pushed so far; v/vt/vn/f lines are
+-- numbered per type, so sections can be written in any number of pieces
+function ObjDumper:flush(stream)
+  self.vn_count = (self.vn_count or 0) + #self.vn
+  self.vt_count = (self.vt_count or 0) + #self.vt
+  for _, aname in ipairs({"v", "vt", "vn", "f"}) do
+    if #self[aname] > 0 then
+      stream:write(table.concat(self[aname], "\n") .. "\n")
+      self[aname] = {}
+    end
+  end
+end
+
 local gexport = require("./geoexport.t")
 
 function m.dump(geo)
@@ -0,0 +1,154 @@
+-- format/scan.t
+--
+-- terra helpers for tokenizing text formats (ASCII STL, OBJ) in place,
+-- without creating lua strings. Every function takes the current position
+-- and the end of the buffer, and returns the new position.
+
+local c = require("native/clib.t")
+local m = {}
+
+terra m.is_space(ch: uint8): bool
+  return ch == 32 or (ch >= 9 and ch <= 13)
+end
+
+-- spaces and tabs, but not line ends
+terra m.is_blank(ch: uint8): bool
+  return ch == 32 or ch == 9 or ch == 13
+end
+
+terra m.is_digit(ch: uint8): bool
+  return ch >= 48 and ch <= 57
+end
+
+terra m.skip_space(cur: &uint8, stop: &uint8): &uint8
+  while cur < stop and m.is_space(@cur) do cur = cur + 1 end
+  return cur
+end
+
+terra m.skip_blank(cur: &uint8, stop: &uint8): &uint8
+  while cur < stop and m.is_blank(@cur) do cur = cur + 1 end
+  return cur
+end
+
+terra m.skip_word(cur: &uint8, stop: &uint8): &uint8
+  while cur < stop and not m.is_space(@cur) do cur = cur + 1 end
+  return cur
+end
+
+-- moves to the '\n' ending the line (or stop)
+terra m.skip_line(cur: &uint8, stop: &uint8): &uint8
+  while cur < stop and @cur ~= 10 do cur = cur + 1 end
+  return cur
+end
+
+terra m.word_is(word: &uint8, len: int64, keyword: rawstring, keylen: int64): bool
+  return len == keylen and c.str.memcmp(word, keyword, keylen) == 0
+end
+
+-- parses a decimal integer with optional sign; returns cur itself if there
+-- was no number
+terra m.scan_int(cur: &uint8, stop: &uint8, out: &int64): &uint8
+  var start = cur
+  var neg = false
+  if cur < stop and (@cur == 45 or @cur == 43) then -- '-', '+'
+    neg = (@cur == 45)
+    cur = cur + 1
+  end
+  if cur >= stop or not m.is_digit(@cur) then return start end
+  var v: int64 = 0
+  while cur < stop and m.is_digit(@cur) do
+    v = v * 10 + (@cur - 48)
+    cur = cur + 1
+  end
+  if neg then v = -v end
+  @out = v
+  return cur
+end
+
+local l_pow10 = {}
+for i = 0, 22 do l_pow10[i+1] = 10^i end
+local POW10 = terralib.constant(`arrayof(double, [l_pow10]))
+
+-- parses a decimal float ("-1.5e-3"); stops after at most 19 significant
+-- digits, which is plenty for a float. Returns cur itself if there was no
+-- number.
+terra m.scan_float(cur: &uint8, stop: &uint8, out: &float): &uint8
+  var start = cur
+  var neg = false
+  if cur < stop and (@cur == 45 or @cur == 43) then -- '-', '+'
+    neg = (@cur == 45)
+    cur = cur + 1
+  end
+  var mantissa: uint64 = 0
+  var exp10: int = 0
+  var ndigits = 0
+  var any = false
+  while cur < stop and m.is_digit(@cur) do
+    if ndigits < 19 then
+      mantissa = mantissa * 10 + (@cur - 48)
+      if mantissa > 0 then ndigits = ndigits + 1 end
+    else
+      exp10 = exp10 + 1
+    end
+    any = true
+    cur = cur + 1
+  end
+  if cur < stop and @cur == 46 then -- '.'
+    cur = cur + 1
+    while cur < stop and m.is_digit(@cur) do
+      if ndigits < 19 then
+        mantissa = mantissa * 10 + (@cur - 48)
+        if mantissa > 0 then ndigits = ndigits + 1 end
+        exp10 = exp10 - 1
+      end
+      any = true
+      cur = cur + 1
+    end
+  end
+  if not any then return start end
+  if cur < stop and (@cur == 101 or @cur == 69) then -- 'e', 'E'
+    var ecur = cur + 1
+    var eneg = false
+    if ecur < stop and (@ecur == 45 or @ecur == 43) then
+      eneg = (@ecur == 45)
+      ecur = ecur + 1
+    end
+    if ecur < stop and m.is_digit(@ecur) then
+      var e = 0
+      while ecur < stop and m.is_digit(@ecur) do
+        if e < 10000 then e = e * 10 + (@ecur - 48) end
+        ecur = ecur + 1
+      end
+      if eneg then exp10 = exp10 - e else exp10 = exp10 + e end
+      cur = ecur
+    end
+  end
+  var v = [double](mantissa)
+  while exp10 < -22 do
+    v = v / 1e22
+    exp10 = exp10 + 22
+  end
+  while exp10 > 22 do
+    v = v * 1e22
+    exp10 = exp10 - 22
+  end
+  if exp10 < 0 then v = v / POW10[-exp10] else v = v * POW10[exp10] end
+  if neg then v = -v end
+  @out = [float](v)
+  return cur
+end
+
+-- reads up to n blank-separated floats from the current line; missing or
+-- unparseable values are zero
+terra m.scan_floats(cur: &uint8, stop: &uint8, out: &float, n: int): &uint8
+  for i = 0, n do out[i] = 0.0f end
+  for i = 0, n do
+    cur = m.skip_blank(cur, stop)
+    var next = m.scan_float(cur, stop, &out[i])
+    if next == cur then return cur end
+    cur = next
+  end
+  return cur
+end
+
+return m
@@ -1,11 +1,18 @@
--- stlloader.t
+-- format/stl.t
 --
--- loads binary STL files
+-- loads and saves STL files
+--
+-- load_geo parses binary or ASCII STL in terra, in parallel chunks on the
+-- job system, straight into the vertex and index buffers of a geometry.
+-- load_stl is the older loader that produces lua tables for from_data.
 
 local m = {}
 local math = require("math")
 local Vector = math.Vector
 local vec4 = require("math/types.t").vec4_
+local c = require("native/clib.t")
+local jobs = require("native/jobs.t")
+local scan = require("./scan.t")
 
 m.verbose = false
 m.MAXFACES = 21845 -- each face needs 3 vertices, to fit into 16 bit index
@@ -13,9 +20,12 @@ m.MAXFACES = 21845 -- each face needs 3 vertices, to fit into 16 bit index
 
 local tic, toc = truss.tic, truss.toc
 
+-- Loading maps the file (truss_map_file) instead of streaming it: the
+-- parsers want random access to all of it, and a mapping costs no copy
+-- and keeps resident memory up to the OS. Saving streams (see save_geo).
 function m.load_stl(filename, invert)
   local starttime = tic()
-  local src_message = truss.C.load_file(filename)
+  local src_message = truss.C.map_file(filename)
   if src_message == nil then
     log.error("Error: unable to open file " .. filename)
     return nil
@@ -69,6 +79,23 @@ terra m.str_to_uint8_ptr(src: &int8)
   return ret
 end
 
+-- check for default color in header ("COLOR=rgba" sequence)
+-- by brute-forcing over the entire header space (80 bytes)
+local function header_color(databuf)
+  local color = {128, 128, 128, 255}
+  for index = 0, 69 do -- for(index = 0; index < 80-10; ++index)
+    if m.read_uint32_le(databuf, index) == 0x434F4C4F and -- COLO
+       m.read_uint8(databuf, index + 4) == 0x52 and       -- R
+       m.read_uint8(databuf, index + 5) == 0x3D then      -- =
+
+      log.warn("Warning: .stl has face colors but color parsing not implemented yet.")
+
+      for i = 1, 4 do color[i] = m.read_uint8(databuf, index + 5 + i) end
+    end
+  end
+  return color
+end
+
 function m.parse_binary_stl(databuf, datalength, invert)
   if m.verbose then
     log.debug("Going to parse a binary stl of length " .. tonumber(datalength))
@@ -80,28 +107,11 @@ function m.parse_binary_stl(databuf, datalength, invert)
   end
 
   if faces > m.MAXFACES then
-    log.warn("Warning: STL contains >2^16 vertices, will need 32bit index buffer")
+    log.warn("Warning: STL contains >2^16 vertices, will need 32bit index buffer"
+             .. " (load_geo handles this)")
   end
 
-  local defaultR, defaultG, defaultB, alpha = 128, 128, 128, 255
-
-  -- process STL header
-
-  -- check for default color in header ("COLOR=rgba" sequence)
-  -- by brute-forcing over the entire header space (80 bytes)
-  for index = 0, 69 do -- for(index = 0; index < 80-10; ++index)
-    if m.read_uint32_le(databuf, index) == 0x434F4C4F and -- COLO
-       m.read_uint8(databuf, index + 4) == 0x52 and       -- R
-       m.read_uint8(databuf, index + 5) == 0x3D then      -- =
-
-      log.warn("Warning: .stl has face colors but color parsing not implemented yet.")
-
-      defaultR = m.read_uint8(databuf, index + 6)
-      defaultG = m.read_uint8(databuf, index + 7)
-      defaultB = m.read_uint8(databuf, index + 8)
-      alpha    = m.read_uint8(databuf, index + 9)
-    end
-  end
+  local defaultR, defaultG, defaultB, alpha = unpack(header_color(databuf))
 
   if m.verbose then
     log.debug("stl color: " .. defaultR
@@ -155,6 +165,308 @@ function m.parse_binary_stl(databuf, datalength, invert)
           color = {defaultR, defaultG, defaultB, alpha}}
 end
 
+------------------------------------------------------------------------------
+-- native loader
+------------------------------------------------------------------------------
+
+local STL_BODY_OFFSET = 84
+local STL_TRI_SIZE = 50
+
+-- ASCII files are split into chunks of about this many bytes
+m.ASCII_CHUNK_SIZE = 2^18
+
+local terra load_f32(src: &uint8): float
+  var v: float
+  c.str.memcpy(&v, src, 4) -- may be unaligned
+  return sanitize_nan(v)
+end
+
+-- the vertex and index types are only known once the target geometry
+-- is, so these structs carry untyped pointers to the job functions
+local struct BinaryJob {
+  src: &uint8;
+  verts: &opaque;
+  indices: &opaque;
+  invert: bool;
+}
+
+local struct AsciiChunk {
+  start: &uint8;
+  stop: &uint8;
+  first_face: uint64;
+  face_count: uint64;
+  malformed: uint64;
+}
+
+local struct AsciiJob {
+  chunks: &AsciiChunk;
+  verts: &opaque;
+  indices: &opaque;
+  invert: bool;
+}
+
+-- writes one face (three unshared vertices) to verts/indices
+local function face_writer(VertType, IndexType, has_normal)
+  return macro(function(job, face, normal, positions)
+    return quote
+      var verts = [&VertType](job.verts)
+      var indices = [&IndexType](job.indices)
+      var base = face * 3
+      var sign: float = 1.0f
+      if job.invert then sign = -1.0f end
+      for i = 0, 3 do
+        for j = 0, 3 do
+          verts[base + i].position[j] = positions[i*3 + j]
+        end
+        escape if has_normal then emit quote
+          for j = 0, 3 do verts[base + i].normal[j] = sign * normal[j] end
+        end end end
+      end
+      indices[base] = [IndexType](base)
+      if job.invert then
+        indices[base + 1] = [IndexType](base + 2)
+        indices[base + 2] = [IndexType](base + 1)
+      else
+        indices[base + 1] = [IndexType](base + 1)
+        indices[base + 2] = [IndexType](base + 2)
+      end
+    end
+  end)
+end
+
+local binary_kernel = terralib.memoize(function(VertType, IndexType, has_normal)
+  local put_face = face_writer(VertType, IndexType, has_normal)
+  local terra kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+    var job = [&BinaryJob](userdata)
+    var normal: float[3]
+    var positions: float[9]
+    for face = range_begin, range_end do
+      var src = job.src + STL_BODY_OFFSET + face * STL_TRI_SIZE
+      for j = 0, 3 do normal[j] = load_f32(src + j*4) end
+      for j = 0, 9 do positions[j] = load_f32(src + 12 + j*4) end
+      put_face(job, face, normal, positions)
+    end
+  end
+  return kernel
+end)
+
+-- returns the position just past the next "endfacet" word at or after cur
+local terra after_endfacet(cur: &uint8, stop: &uint8): &uint8
+  while cur + 8 <= stop do
+    if @cur == 101 and c.str.memcmp(cur, "endfacet", 8) == 0 and
+       (cur + 8 == stop or scan.is_space(cur[8])) then
+      return cur + 8
+    end
+    cur = cur + 1
+  end
+  return stop
+end
+
+-- the counting pass tokenizes the same way as the parsing pass below, so
+-- the two always agree on which facets a chunk holds
+local terra count_ascii_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var job = [&AsciiJob](userdata)
+  for ci = range_begin, range_end do
+    var chunk = &job.chunks[ci]
+    var count: uint64 = 0
+    var cur, stop = chunk.start, chunk.stop
+    while true do
+      cur = scan.skip_space(cur, stop)
+      if cur >= stop then break end
+      var word = cur
+      cur = scan.skip_word(cur, stop)
+      var len = cur - word
+      if scan.word_is(word, len, "endfacet", 8) then
+        count = count + 1
+      elseif scan.word_is(word, len, "solid", 5) or scan.word_is(word, len, "endsolid", 8) then
+        cur = scan.skip_line(cur, stop)
+      end
+    end
+    chunk.face_count = count
+  end
+end
+
+local ascii_kernel = terralib.memoize(function(VertType, IndexType, has_normal)
+  local put_face = face_writer(VertType, IndexType, has_normal)
+  local terra kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+    var job = [&AsciiJob](userdata)
+    var normal: float[3]
+    var positions: float[9]
+    for ci = range_begin, range_end do
+      var chunk = &job.chunks[ci]
+      var face = chunk.first_face
+      var last_face = face + chunk.face_count
+      var nverts = 0
+      var cur, stop = chunk.start, chunk.stop
+      for j = 0, 3 do normal[j] = 0.0f end
+      while face < last_face do
+        cur = scan.skip_space(cur, stop)
+        if cur >= stop then break end
+        var word = cur
+        cur = scan.skip_word(cur, stop)
+        var len = cur - word
+        if scan.word_is(word, len, "vertex", 6) then
+          if nverts < 3 then
+            cur = scan.scan_floats(cur, stop, &positions[nverts * 3], 3)
+          end
+          nverts = nverts + 1
+        elseif scan.word_is(word, len, "normal", 6) then
+          cur = scan.scan_floats(cur, stop, normal, 3)
+        elseif scan.word_is(word, len, "facet", 5) then
+          nverts = 0
+          for j = 0, 3 do normal[j] = 0.0f end
+        elseif scan.word_is(word, len, "endfacet", 8) then
+          if nverts ~= 3 then
+            -- keep the face count in step with the counting pass: an
+            -- incomplete facet becomes a degenerate triangle
+            chunk.malformed = chunk.malformed + 1
+            for j = nverts * 3, 9 do positions[j] = 0.0f end
+          end
+          put_face(job, face, normal, positions)
+          face = face + 1
+          nverts = 0
+        elseif scan.word_is(word, len, "solid", 5) or scan.word_is(word, len, "endsolid", 8) then
+          cur = scan.skip_line(cur, stop) -- the name can be anything
+        end
+      end
+    end
+  end
+  return kernel
+end)
+
+local function is_binary_stl(databuf, datalength)
+  if datalength < STL_BODY_OFFSET then return false end
+  local body = STL_BODY_OFFSET + m.read_uint32_le(databuf, 80) * STL_TRI_SIZE
+  if body == datalength then return true end
+  -- some binary exporters also start the header with "solid"
+  if ffi.string(databuf, 5) == "solid" then return false end
+  return body <= datalength
+end
+
+local function target_geometry(options, n_faces)
+  local geo = options.geo
+  if not geo then
+    local gfx = require("gfx")
+    geo = gfx.StaticGeometry(options.name)
+  end
+  if not geo.allocated then
+    local vertinfo = options.vertinfo
+    if not vertinfo then
+      vertinfo = require("gfx/vertexdefs.t").create_basic_vertex_type({"position", "normal"})
+    end
+    geo:allocate(n_faces * 3, n_faces * 3, vertinfo)
+  elseif geo.n_verts < n_faces * 3 or geo.n_indices < n_faces * 3 then
+    truss.error("STL has " .. n_faces .. " faces; geometry is too small")
+  end
+  return geo
+end
+
+local function kernel_types(geo)
+  return geo.vertinfo.ttype, geo.index_type, geo.vertinfo.attributes.normal ~= nil
+end
+
+local function parse_binary_geo(databuf, datalength, options)
+  local n_faces = m.read_uint32_le(databuf, 80)
+  local geo = target_geometry(options, n_faces)
+  local job = terralib.new(BinaryJob)
+  job.src = databuf
+  job.verts = geo.verts
+  job.indices = geo.indices
+  job.invert = not not options.invert
+  jobs.run_kernel(binary_kernel(kernel_types(geo)), job, n_faces)
+  return geo, n_faces
+end
+
+local function parse_ascii_geo(databuf, datalength, options)
+  local src = databuf
+  local stop = src + datalength
+  local n_chunks = math.max(1, math.floor(datalength / m.ASCII_CHUNK_SIZE))
+  local chunks = terralib.new(AsciiChunk[n_chunks])
+  -- chunks start just past an "endfacet", so every one holds whole facets
+  local prev = src
+  for i = 0, n_chunks - 1 do
+    local chunk = chunks[i]
+    chunk.start = prev
+    if i == n_chunks - 1 then
+      chunk.stop = stop
+    else
+      local nominal = src + math.floor(datalength * (i + 1) / n_chunks)
+      if nominal < prev then nominal = prev end
+      chunk.stop = after_endfacet(nominal, stop)
+    end
+    chunk.malformed = 0
+    prev = chunk.stop
+  end
+
+  local job = terralib.new(AsciiJob)
+  job.chunks = chunks
+  job.invert = not not options.invert
+  jobs.run_kernel(count_ascii_kernel, job, n_chunks, 1)
+  local n_faces = 0
+  for i = 0, n_chunks - 1 do
+    chunks[i].first_face = n_faces
+    n_faces = n_faces + chunks[i].face_count
+  end
+
+  local geo = target_geometry(options, n_faces)
+  job.verts = geo.verts
+  job.indices = geo.indices
+  jobs.run_kernel(ascii_kernel(kernel_types(geo)), job, n_chunks, 1)
+
+  local malformed = 0
+  for i = 0, n_chunks - 1 do malformed = malformed + chunks[i].malformed end
+  if malformed > 0 then
+    log.warn("STL: " .. malformed .. " facets without exactly 3 vertices")
+  end
+  return geo, n_faces
+end
+
+-- parses datalength bytes of binary or ASCII STL at databuf into a geometry
+-- with unshared vertices (three per face); indices are 32 bit if needed.
+-- options (all optional):
+--   invert: flip normals and winding
+--   geo: geometry to fill (allocated if it isn't already)
+--   name: name for a newly created geometry
+--   vertinfo: vertex type for a new geometry (default position + normal)
+--   commit: commit the geometry (default true)
+function m.parse_geo(databuf, datalength, options)
+  options = options or {}
+  databuf = terralib.cast(&uint8, databuf) -- can also be a lua string
+  datalength = tonumber(datalength)
+  local geo, n_faces
+  if is_binary_stl(databuf, datalength) then
+    geo, n_faces = parse_binary_geo(databuf, datalength, options)
+    geo.color = header_color(databuf)
+  elseif datalength >= 5 and ffi.string(databuf, 5) == "solid" then
+    geo, n_faces = parse_ascii_geo(databuf, datalength, options)
+  else
+    truss.error("Not an STL file (" .. datalength .. " bytes)")
+  end
+  if m.verbose then
+    log.debug("STL contains " .. n_faces .. " faces.")
+  end
+  if options.commit ~= false then geo:commit() end
+  return geo
+end
+
+function m.load_geo(filename, options)
+  local starttime = tic()
+  local src_message = truss.C.map_file(filename)
+  if src_message == nil then
+    log.error("Error: unable to open file " .. filename)
+    return nil
+  end
+  local opts = {name = filename}
+  for k, v in pairs(options or {}) do opts[k] = v end
+  local ret = m.parse_geo(src_message.data, src_message.data_length, opts)
+  local datalength = tonumber(src_message.data_length)
+  truss.C.release_message(src_message)
+  local dtime = toc(starttime)
+  log.info(("Loaded %s in %.1f ms (%.1f MB/s)"):format(
+           filename, dtime*1000.0, datalength / 2^20 / dtime))
+  return ret
+end
+
 local struct STLHeader {
   comment: int8[80];
   tricount: uint32;
@@ -190,8 +502,6 @@ terra Tri:init()
   self.attrib_byte_count = 0 -- this is just always 0
 end
 
-local STL_TRI_SIZE = 50
-
 local terra put_triangle(target: &int8, tri: &Tri)
   var src = [&int8](tri)
   for idx = 0, STL_TRI_SIZE do
@@ -199,24 +509,17 @@ local terra put_triangle(target: &int8, tri: &Tri)
   end
 end
 
-function m.dump_geo(geo, dump_bytes)
-  if not geo.allocated then truss.error("Geo not allocated") end
-  local tricount = geo.n_indices / 3
-
-  local bytecount = terralib.sizeof(STLHeader) + STL_TRI_SIZE*tricount
-  local buff = terralib.new(int8[bytecount])
-
-  local header = terralib.cast(&STLHeader, buff)
-  print("Header size: " .. terralib.sizeof(STLHeader))
-
-  local body = buff+terralib.sizeof(STLHeader)
-
+local function fill_header(header, geo, tricount)
   local name = geo.name or "truss geometry"
   for idx = 1, 80 do
     header.comment[idx-1] = name:byte(idx) or (" "):byte(1)
   end
   header.tricount = tricount
+end
 
+-- returns a function(tridx, target) that writes triangle tridx of geo
+-- in STL layout to target
+local function triangle_writer(geo)
   local function V(idx)
     return geo.verts[geo.indices[idx]]
   end
@@ -232,8 +535,8 @@ function m.dump_geo(geo, dump_bytes)
 
   local tri = terralib.new(Tri)
 
-  for tridx = 0, tricount-1 do
-    local verts = {}
+  return function(tridx, target)
+    local fidx = tridx * 3
     tri:init()
     if has_normals then 
       tri.normal:copy_farr(V(fidx).normal) 
@@ -254,7 +557,22 @@ function m.dump_geo(geo, dump_bytes)
       fidx = fidx + 1
     end
     tri.attrib_byte_count = 0
-    put_triangle(body + tridx*STL_TRI_SIZE, tri)
+    put_triangle(target, tri)
+  end
+end
+
+function m.dump_geo(geo, dump_bytes)
+  if not geo.allocated then truss.error("Geo not allocated") end
+  local tricount = geo.n_indices / 3
+
+  local bytecount = terralib.sizeof(STLHeader) + STL_TRI_SIZE*tricount
+  local buff = terralib.new(int8[bytecount])
+  fill_header(terralib.cast(&STLHeader, buff), geo, tricount)
+
+  local body = buff+terralib.sizeof(STLHeader)
+  local write_triangle = triangle_writer(geo)
+  for tridx = 0, tricount-1 do
+    write_triangle(tridx, body + tridx*STL_TRI_SIZE)
   end
 
   if dump_bytes then 
@@ -264,9 +582,31 @@ function m.dump_geo(geo, dump_bytes)
   end
 end
 
+-- triangles are written through a fixed size buffer, so saving doesn't
+-- need memory proportional to the size of the model
+m.SAVE_CHUNK_TRIS = 16384
+
 function m.save_geo(filename, geo)
-  local bytes, bytecount = m.dump_geo(geo, true)
-  truss.C.save_data(filename, bytes, bytecount)
+  if not geo.allocated then truss.error("Geo not allocated") end
+  local tricount = geo.n_indices / 3
+  local stream = require("io/stream.t").open(filename, "w")
+
+  local header = terralib.new(STLHeader)
+  fill_header(header, geo, tricount)
+  stream:write(header, terralib.sizeof(STLHeader))
+
+  local chunk = terralib.new(int8[m.SAVE_CHUNK_TRIS * STL_TRI_SIZE])
+  local write_triangle = triangle_writer(geo)
+  local tridx = 0
+  while tridx < tricount do
+    local n = math.min(m.SAVE_CHUNK_TRIS, tricount - tridx)
+    for i = 0, n-1 do
+      write_triangle(tridx + i, chunk + i*STL_TRI_SIZE)
+    end
+    stream:write(chunk, n * STL_TRI_SIZE)
+    tridx = tridx + n
+  end
+  stream:close()
 end
 
 return m
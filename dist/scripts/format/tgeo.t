@@ -0,0 +1,254 @@
+-- format/tgeo.t
+--
+-- truss binary geometry (.tgeo): vertex and index data exactly as a
+-- StaticGeometry holds it, plus its vertex layout, so loading is a file
+-- mapping that bgfx references directly (no per-vertex work at all)
+--
+-- layout: Header (64 bytes), vertex type id (gfx/vertexdefs.t type_id,
+-- e.g., "p:3f_n:3f"), then vertex data and index data, each starting at
+-- a multiple of m.ALIGNMENT. Native (little) endian.
+--
+-- files are written by format/geoexport.t (save_tgeo); load_cached keeps
+-- a .tgeo next to a source model so it is only parsed once
+
+local m = {}
+local C = truss.C
+
+m.MAGIC = 0x4f454754 -- "TGEO"
+m.VERSION = 1
+m.ALIGNMENT = 16
+m.EXTENSION = ".tgeo"
+
+local struct Header {
+  magic: uint32;
+  version: uint32;
+  layout_size: uint32;  -- bytes of vertex type id following the header
+  vertex_size: uint32;  -- sizeof one vertex, to catch layout mismatches
+  index_size: uint32;   -- 2 or 4
+  reserved: uint32;
+  n_verts: uint64;
+  n_indices: uint64;
+  vertex_offset: uint64;
+  index_offset: uint64;
+  source_hash: uint64;  -- identifies what the geometry was derived from
+}
+m.Header = Header
+
+local function align(n)
+  return math.ceil(n / m.ALIGNMENT) * m.ALIGNMENT
+end
+
+-- returns a Header (cdata) describing geo
+function m.make_header(geo, source_hash)
+  local header = terralib.new(Header)
+  local type_id = geo.vertinfo.type_id
+  local vertex_offset = align(sizeof(Header) + #type_id)
+  header.magic = m.MAGIC
+  header.version = m.VERSION
+  header.layout_size = #type_id
+  header.vertex_size = sizeof(geo.vertinfo.ttype)
+  header.index_size = sizeof(geo.index_type)
+  header.reserved = 0
+  header.n_verts = geo.n_verts
+  header.n_indices = geo.n_indices
+  header.vertex_offset = vertex_offset
+  header.index_offset = align(vertex_offset + geo.vert_data_size)
+  header.source_hash = source_hash or 0
+  return header
+end
+
+-- validates a header at the start of msg; returns it, or nil and an error
+local function read_header(msg)
+  local size = tonumber(msg.data_length)
+  if size < sizeof(Header) then return nil, "file too short" end
+  local header = terralib.cast(&Header, msg.data)
+  if header.magic ~= m.MAGIC then return nil, "not a tgeo file" end
+  if header.version ~= m.VERSION then
+    return nil, "tgeo version " .. header.version .. " (expected " .. m.VERSION .. ")"
+  end
+  if header.index_size ~= 2 and header.index_size ~= 4 then
+    return nil, "bad index size " .. header.index_size
+  end
+  -- (as doubles, so huge counts can't wrap around)
+  local layout_end = sizeof(Header) + tonumber(header.layout_size)
+  local vertex_offset = tonumber(header.vertex_offset)
+  local index_offset = tonumber(header.index_offset)
+  if vertex_offset % m.ALIGNMENT ~= 0 or index_offset % m.ALIGNMENT ~= 0 then
+    return nil, "misaligned tgeo data"
+  end
+  local vertex_end = vertex_offset + tonumber(header.n_verts) * header.vertex_size
+  local index_end = index_offset + tonumber(header.n_indices) * header.index_size
+  if vertex_offset < layout_end or index_offset < vertex_end then
+    return nil, "overlapping tgeo sections"
+  end
+  if layout_end > size or vertex_end > size or index_end > size then
+    return nil, "truncated tgeo file"
+  end
+  return header
+end
+
+-- creates a geometry referencing the data in msg (which it keeps a
+-- reference to); options: geo (unallocated geometry to use), name, commit
+-- (default true). Returns nil and an error message on failure.
+function m.parse_geo(msg, options)
+  options = options or {}
+  local header, err = read_header(msg)
+  if not header then return nil, err end
+  local type_id = ffi.string(terralib.cast(&int8, msg.data) + sizeof(Header),
+                             header.layout_size)
+  local vertinfo = require("gfx/vertexdefs.t").vertex_type_from_id(type_id)
+  if sizeof(vertinfo.ttype) ~= header.vertex_size then
+    return nil, ("vertex size mismatch for %s: %d, expected %d"):format(
+                type_id, header.vertex_size, sizeof(vertinfo.ttype))
+  end
+  local index_type = (header.index_size == 4 and uint32) or uint16
+  local geo = options.geo or require("gfx").StaticGeometry(options.name)
+  geo:from_message(msg, vertinfo, tonumber(header.n_verts), tonumber(header.n_indices),
+                   index_type, tonumber(header.vertex_offset),
+                   tonumber(header.index_offset))
+  geo.source_hash = header.source_hash
+  if options.commit ~= false then geo:commit() end
+  return geo
+end
+
+local function load_message(msg, name, options)
+  local opts = {name = name}
+  for k, v in pairs(options or {}) do opts[k] = v end
+  local geo, err = m.parse_geo(msg, opts)
+  C.release_message(msg) -- the geometry holds its own reference
+  if not geo then log.error("Unable to load " .. name .. ": " .. err) end
+  return geo
+end
+
+-- maps a .tgeo (physfs path) into a new geometry
+function m.load_geo(filename, options)
+  local msg = C.map_file(filename)
+  if msg == nil then
+    log.error("Error: unable to open file " .. filename)
+    return nil
+  end
+  return load_message(msg, filename, options)
+end
+
+------------------------------------------------------------------------------
+-- caching derived geometry
+------------------------------------------------------------------------------
+
+-- disable to always parse sources (and never write caches)
+m.cache_enabled = true
+
+-- real path of filename's directory entry, if it's a plain file on disk
+local function real_path(filename)
+  if truss.is_archived(filename) then return nil end
+  local realdir = C.get_file_real_path(filename)
+  if realdir == nil then return nil end
+  local path = ffi.string(realdir) .. "/" .. filename
+  -- a file in a directory mounted somewhere other than / doesn't live
+  -- at realdir/filename; just don't cache those
+  local stream = C.stream_open(path, C.STREAM_READ + C.STREAM_RAW)
+  if stream == nil then return nil end
+  C.stream_close(stream)
+  return path
+end
+
+-- hash of the source file and everything else the geometry depends on
+local function source_key(src, salt)
+  salt = ("tgeo|%d|%s"):format(m.VERSION, salt or "")
+  local key = C.hash_data(salt, #salt, 0)
+  return C.hash_data(src.data, src.data_length, key)
+end
+
+-- looks up the cache of a geometry derived from filename: cache files
+-- live next to the source as source.ext[suffix].tgeo, and only count if
+-- they were made from the same source bytes and salt. Returns the mapped
+-- geometry (or nil), plus the path and key to save a new cache entry
+-- with (both nil if filename can't be cached).
+function m.find_cached(filename, salt, suffix, options)
+  local src_path = m.cache_enabled and real_path(filename)
+  if not src_path then return nil end
+  local src = C.map_file(filename)
+  if src == nil then return nil end
+  local key = source_key(src, salt)
+  C.release_message(src)
+
+  local cache_path = src_path .. (suffix or "") .. m.EXTENSION
+  local stream = C.stream_open(cache_path, C.STREAM_READ + C.STREAM_RAW)
+  if stream ~= nil then
+    C.stream_close(stream)
+    local msg = C.map_file_raw(cache_path)
+    if msg ~= nil then
+      local header = read_header(msg)
+      if header and header.source_hash == key then
+        log.info("Loaded " .. filename .. " from " .. cache_path)
+        return load_message(msg, filename, options), cache_path, key
+      end
+      C.release_message(msg)
+    end
+  end
+  return nil, cache_path, key
+end
+
+-- writes geo as a cache entry found missing by find_cached; it's written
+-- to a temporary file and renamed into place, so a reader never maps a
+-- half written cache, and anything still mapping the old one keeps it
+function m.save_cached(cache_path, geo, key)
+  local tmp_path = ("%s.%d.tmp"):format(cache_path, truss.interpreter_id)
+  local happy, err = pcall(require("./geoexport.t").save_tgeo, tmp_path, geo, key, true)
+  if happy then
+    happy, err = os.rename(tmp_path, cache_path)
+    if not happy then
+      -- (Windows won't rename over an existing file)
+      os.remove(cache_path)
+      happy, err = os.rename(tmp_path, cache_path)
+    end
+  end
+  if happy then
+    log.info("Cached " .. cache_path)
+  else
+    os.remove(tmp_path)
+    log.warn("Unable to write cache " .. cache_path .. ": " .. tostring(err))
+  end
+  return not not happy
+end
+
+-- loads the geometry derived from a source file (e.g., an STL) through a
+-- .tgeo cache written next to it: if source.ext.tgeo exists and was made
+-- from the same source bytes and salt it's simply mapped; otherwise
+-- load_fn(filename, options) builds the geometry (it's passed commit =
+-- false; it has to return a StaticGeometry) and the cache is written.
+-- salt should describe the whole derivation (loader, welding, ...) so
+-- that changing it invalidates old caches.
+function m.load_cached(filename, load_fn, options, salt)
+  options = options or {}
+  local geo, cache_path, key = m.find_cached(filename, salt, nil, options)
+  if geo then return geo end
+  if not cache_path then return load_fn(filename, options) end
+
+  local opts = {}
+  for k, v in pairs(options) do opts[k] = v end
+  opts.commit = false
+  geo = load_fn(filename, opts)
+  if not geo then return nil end
+  m.save_cached(cache_path, geo, key)
+  if options.commit ~= false then geo:commit() end
+  return geo
+end
+
+local loaders = {
+  [".stl"] = "format/stl.t",
+  [".obj"] = "format/obj.t"
+}
+
+-- loads an STL or OBJ straight into a geometry, through the cache
+function m.load_model(filename, options)
+  if filename:sub(-#m.EXTENSION):lower() == m.EXTENSION then
+    return m.load_geo(filename, options)
+  end
+  local ext = filename:sub(-4):lower()
+  local loader = loaders[ext]
+  if not loader then truss.error("No geometry loader for " .. filename) end
+  local salt = ext .. "|" .. tostring(options and options.invert)
+  return m.load_cached(filename, require(loader).load_geo, options, salt)
+end
+
+return m
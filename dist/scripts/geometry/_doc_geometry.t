@@ -202,3 +202,124 @@ Warning: poorly tested, known to fail in many edge cases, O(n^4) run time.
 args{list 'pts: a list of Vectors'}
 returns{table 'data'}
 
+
+sourcefile{'weld.t'}
+description[[
+Native vertex welding. Vertices are binned into a spatial hash and matched
+against their neighbouring cells in parallel on the job system, so welding
+large meshes (e.g., STL triangle soups) doesn't create any Lua values per
+vertex.
+]]
+
+func 'weld_geo'
+description[[
+Weld an allocated `StaticGeometry` into a new one: vertices within
+`epsilon` of each other are merged into the first of them, and triangles
+that collapse are dropped. Returns the new geometry and a table of stats
+`{verts_in, verts_out, tris_in, tris_out}`.
+
+Options: `epsilon` (weld distance, default 0: identical positions only),
+`attributes` (carry the other vertex attributes through, default true),
+`keep_degenerate` (default false), `name`, and `commit` (default true).
+]]
+args{object 'geo: StaticGeometry', table 'options'}
+returns{object 'StaticGeometry', table 'stats'}
+example[[
+local stl = require("format/stl.t")
+local weld = require("geometry/weld.t")
+local soup = stl.load_geo("models/part.stl", {commit = false})
+local geo, stats = weld.weld_geo(soup, {epsilon = 1e-5})
+soup:deallocate()
+]]
+
+sourcefile{'soa.t'}
+description[[
+Native structure-of-arrays geometry (`SoAGeometry`): positions, normals and
+uvs are stored one contiguous float array per component, plus a uint32
+index array. Transforms, merges, bounds and normals run as SIMD kernels
+(merges and transforms in parallel on the job system). An `SoAGeometry` is
+manually managed: call `:release()` when done with it.
+]]
+
+func 'from_data'
+description[[
+Convert geometry data (position, normal and texcoord0 attributes) into a
+new `SoAGeometry`. `to_data` converts back.
+]]
+args{table 'data'}
+returns{object 'SoAGeometry'}
+
+func 'merge'
+description[[
+Merge a list of `{SoAGeometry, pose}` pairs into a new `SoAGeometry`. As in
+`merge_data`, a pose is a table `{position = Matrix4, normal = Matrix4}`;
+normals only use the upper 3x3 of their matrix. The result only has
+normals or uvs if every part does.
+]]
+args{list 'parts'}
+returns{object 'SoAGeometry'}
+example[[
+local soa = require("geometry/soa.t")
+local part = soa.from_data(geometry.cube_data{1.0})
+local pose = math.Matrix4():translation(math.Vector(2, 0, 0))
+local merged = soa.merge({{part, {}}, {part, {position = pose}}})
+local geo = soa.to_geo(merged, "merged_cubes")
+merged:release()
+part:release()
+]]
+
+func 'to_geo'
+description[[
+Copy into a new `StaticGeometry`. Options: `vertinfo` (defaults to a basic
+vertex type with the attributes the `SoAGeometry` has) and `commit`
+(default true). `from_geo` copies an allocated `StaticGeometry` back.
+]]
+args{object 'SoAGeometry', string 'name', table 'options'}
+returns{object 'StaticGeometry'}
+
+sourcefile{'simplify.t'}
+description[[
+Native quadric error metric simplification and level of detail chains.
+Vertices collapse onto existing vertices, so simplified geometries keep
+the source's vertex type and attributes. Border and seam vertices are
+never collapsed; weld triangle soups (`weld.t`) first. LOD levels are
+simplified in parallel on the job system and can be cached on disk next
+to the source model.
+]]
+
+func 'simplify_geo'
+description[[
+Simplify an allocated geometry into a new one. Options: `ratio` (target
+fraction of the triangles, default 0.5), `max_error` (largest error,
+relative to the bounding box diagonal, default 1), `name`, `commit`
+(default true). Returns the new geometry and its relative error.
+]]
+args{object 'geo: StaticGeometry', table 'options'}
+returns{object 'StaticGeometry', number 'error'}
+
+func 'build_lods'
+description[[
+Build a LOD chain `{center, radius, levels = {{geo, ratio, error,
+min_size}, ...}}`, full detail first, for `MeshComponent:set_lods`.
+Options: `ratios` (default `{0.5, 0.25, 0.1}`), `sizes` (projected size
+each level is used down to), `max_error`, `cache` (source filename to
+cache levels next to), `commit`. `build_lods_async` returns a `LodBuild`
+instead, whose `poll()` returns the chain once the jobs are done.
+]]
+args{object 'geo: StaticGeometry', table 'options'}
+returns{table 'chain'}
+
+func 'load_lods'
+description[[
+Load a model (`.stl`, `.obj` or `.tgeo`), optionally weld it
+(`weld_epsilon`), and build its LOD chain with every level cached next to
+the model file.
+]]
+args{string 'filename', table 'options'}
+returns{table 'chain'}
+example[[
+local simplify = require("geometry/simplify.t")
+local chain = simplify.load_lods("models/part.stl", {weld_epsilon = 1e-5})
+local mesh = scene_root:create_child(graphics.Mesh, "part", chain.levels[1].geo, mat)
+mesh.mesh:set_lods(chain)
+]]
@@ -7,6 +7,9 @@ local m = {}
 function m.run(test)
   test("geometries", m.test_geometries)
   test("geoutils", m.test_geoutils)
+  test("weld", m.test_weld)
+  test("soa", m.test_soa)
+  test("simplify", m.test_simplify)
 end
 
 local function make_tri()
@@ -146,4 +149,174 @@ function m.test_geometries(t)
   t.ok(check_windings(Vec(0, 0, -1, 0), frame), "rect_frame: windings")
 end
 
-return m
\ No newline at end of file
+-- a quad as a triangle soup, plus a triangle that collapses once welded
+local function make_soup()
+  local vertexdefs = require("gfx/vertexdefs.t")
+  local gfx = require("gfx")
+  local pts = {{0,0,0}, {0,1,0}, {1,0,0},   {1,0,0}, {0,1,0.0001}, {1,1,0},
+               {5,5,5}, {5,5,5.0001}, {5,6,5}}
+  local geo = gfx.StaticGeometry("soup")
+  geo:allocate(#pts, #pts, vertexdefs.create_basic_vertex_type({"position"}))
+  for i, p in ipairs(pts) do
+    for j = 1, 3 do geo.verts[i-1].position[j-1] = p[j] end
+    geo.indices[i-1] = i-1
+  end
+  return geo
+end
+
+function m.test_weld(t)
+  local weld = require("geometry/weld.t")
+  local soup = make_soup()
+
+  local exact, stats = weld.weld_geo(soup, {commit = false})
+  t.expect(stats.verts_out, 8, "exact: vertices")
+  t.expect(stats.tris_out, 3, "exact: triangles")
+
+  local welded
+  welded, stats = weld.weld_geo(soup, {epsilon = 0.001, commit = false})
+  t.expect(stats.verts_out, 6, "epsilon: vertices")
+  t.expect(stats.tris_out, 2, "epsilon: degenerate triangle dropped")
+  t.expect({welded.indices[3], welded.indices[4], welded.indices[5]},
+           {2, 1, 3}, "epsilon: second triangle remapped")
+  t.expect(welded.verts[1].position[2], 0, "epsilon: first vertex of a group kept")
+
+  _, stats = weld.weld_geo(soup, {epsilon = 0.001, keep_degenerate = true,
+                                  commit = false})
+  t.expect(stats.tris_out, 3, "keep_degenerate")
+
+  local geoutils = require("geometry/geoutils.t")
+  local data = {indices = {{0, 1, 2}, {3, 4, 5}}, attributes = {position = {
+    Vec(0, 0, 0), Vec(0, 1, 0), Vec(1, 0, 0), Vec(1, 0, 0), Vec(0, 1, 0), Vec(1, 1, 0)
+  }}}
+  local combined = geoutils.combine_duplicate_vertices(data, 1000)
+  t.expect(#combined.attributes.position, 4, "combine_duplicate_vertices: vertices")
+  t.expect(combined.indices[2], {2, 1, 3}, "combine_duplicate_vertices: indices")
+
+  exact:deallocate()
+  welded:deallocate()
+  soup:deallocate()
+end
+
+local function geo_data_with_normals()
+  local geo = require("geometry")
+  return geo.uvsphere_data{lat_divs = 9, lon_divs = 13}
+end
+
+function m.test_soa(t)
+  local soa = require("geometry/soa.t")
+  local math = require("math")
+  -- enough vertices that kernels take both the vector and scalar paths
+  local data = geo_data_with_normals()
+  local n_verts = #data.attributes.position
+  local src = soa.from_data(data)
+  t.expect(tonumber(src.n_verts), n_verts, "from_data: vertices")
+  t.expect(tonumber(src.n_indices), #data.indices * 3, "from_data: indices")
+  t.ok(src:has_normals() and src:has_uvs(), "from_data: normals and uvs")
+  local back = soa.to_data(src)
+  t.expect(back.indices, data.indices, "to_data: indices")
+  t.expect(back.attributes.position[n_verts].elem.y,
+           data.attributes.position[n_verts].elem.y, "to_data: positions")
+
+  local function near(a, b) return math.abs(a - b) < 1e-5 end
+  -- the sphere has no vertices at some of its extremes, so expect the
+  -- bounds of its actual positions (under each pose given as a function)
+  local function expected_bounds(poses)
+    local lo, hi = {1/0, 1/0, 1/0}, {-1/0, -1/0, -1/0}
+    for _, pose in ipairs(poses) do
+      for _, p in ipairs(data.attributes.position) do
+        local q = {pose(p.elem.x, p.elem.y, p.elem.z)}
+        for k = 1, 3 do
+          lo[k], hi[k] = math.min(lo[k], q[k]), math.max(hi[k], q[k])
+        end
+      end
+    end
+    return lo, hi
+  end
+  local function bounds_match(geo, poses)
+    local lo, hi = terralib.new(float[3]), terralib.new(float[3])
+    geo:bounds(lo, hi)
+    local elo, ehi = expected_bounds(poses)
+    for k = 1, 3 do
+      if not (near(lo[k-1], elo[k]) and near(hi[k-1], ehi[k])) then return false end
+    end
+    return true
+  end
+  local function identity(x, y, z) return x, y, z end
+  t.ok(bounds_match(src, {identity}), "bounds")
+
+  local shift = math.Matrix4():translation(math.Vector(10, 0, 0))
+  local rot = math.Matrix4():from_quaternion(
+    math.Quaternion():axis_angle(math.Vector(0, 0, 1), math.pi / 2))
+  local merged = soa.merge({{src, {}}, {src, {position = shift}},
+                            {src, {position = rot, normal = rot}}})
+  t.expect(tonumber(merged.n_verts), n_verts * 3, "merge: vertices")
+  t.expect(merged.indices[#data.indices * 3], src.indices[0] + n_verts,
+           "merge: offset indices")
+  t.ok(bounds_match(merged, {identity,
+                             function(x, y, z) return x + 10, y, z end,
+                             function(x, y, z) return -y, x, z end}),
+       "merge: translated and rotated bounds")
+  local i = n_verts * 2 + 5 -- a vertex of the rotated copy
+  t.ok(near(merged.position[0][i], -src.position[1][5]) and
+       near(merged.position[1][i], src.position[0][5]), "merge: rotated positions")
+  t.ok(near(merged.normal[1][i], src.normal[0][5]), "merge: rotated normals")
+
+  soa.compute_normals(merged)
+  local nx, ny, nz = merged.normal[0][7], merged.normal[1][7], merged.normal[2][7]
+  t.ok(math.abs(nx*nx + ny*ny + nz*nz - 1.0) < 1e-4, "compute_normals: unit length")
+
+  local geo = soa.to_geo(src, "soa_test", {commit = false})
+  t.expect(geo.vertinfo.type_id, "p:3f_n:3f_t0:2f", "to_geo: vertex type")
+  local roundtrip = soa.from_geo(geo)
+  t.expect(roundtrip.indices[17], src.indices[17], "from_geo: indices")
+  t.expect(roundtrip.uv[1][9], src.uv[1][9], "from_geo: uvs")
+
+  geo:deallocate()
+  roundtrip:release()
+  merged:release()
+  src:release()
+end
+
+local function make_plane_geo(segments)
+  local gfx = require("gfx")
+  local data = require("geometry").plane_data{segments = segments}
+  return gfx.StaticGeometry("plane"):from_data(data, nil, true)
+end
+
+function m.test_simplify(t)
+  local simplify = require("geometry/simplify.t")
+  local plane = make_plane_geo(16)
+  local n_tris = plane.n_indices / 3
+
+  local half, error = simplify.simplify_geo(plane, {ratio = 0.5, commit = false})
+  t.ok(half.n_indices / 3 <= n_tris / 2, "simplify: reaches the ratio")
+  t.ok(half.n_indices > 0 and half.n_verts < plane.n_verts, "simplify: drops vertices")
+  t.ok(error < 1e-5, "simplify: a flat plane stays flat")
+  local in_range = true
+  for i = 0, half.n_indices - 1 do
+    if half.indices[i] >= half.n_verts then in_range = false end
+  end
+  t.ok(in_range, "simplify: indices in range")
+  local corners = 0
+  for i = 0, half.n_verts - 1 do
+    local p = half.verts[i].position
+    if math.abs(p[0]) == 0.5 and math.abs(p[1]) == 0.5 then corners = corners + 1 end
+  end
+  t.expect(corners, 4, "simplify: borders kept")
+
+  local chain = simplify.build_lods(plane, {ratios = {0.5, 0.25}, commit = false})
+  t.expect(#chain.levels, 3, "lods: levels")
+  t.ok(chain.levels[1].geo == plane, "lods: full detail first")
+  t.ok(chain.levels[3].geo.n_indices < chain.levels[2].geo.n_indices,
+       "lods: decreasing triangle counts")
+  t.ok(chain.levels[1].min_size > chain.levels[2].min_size, "lods: decreasing sizes")
+  t.expect(chain.levels[3].min_size, 0, "lods: last level always applies")
+  t.ok(math.abs(chain.radius - math.sqrt(2) / 2) < 1e-5, "lods: bounding radius")
+
+  half:deallocate()
+  chain.levels[2].geo:deallocate()
+  chain.levels[3].geo:deallocate()
+  plane:deallocate()
+end
+
+return m
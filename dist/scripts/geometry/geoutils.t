@@ -42,20 +42,6 @@ function m.spherize(srcdata, radius)
   return srcdata
 end
 
-local function canonize_vertex(v, precision)
-  local p = precision
-  if v.elem then -- is a Vector
-    local n = v.elem
-    return tostring(math.floor(n.x * p) / p) ..
-      "_" .. tostring(math.floor(n.y * p) / p) ..
-      "_" .. tostring(math.floor(n.z * p) / p)
-  else -- is a normal list
-    return tostring(math.floor(v[1] * p) / p) ..
-      "_" .. tostring(math.floor(v[2] * p) / p) ..
-      "_" .. tostring(math.floor(v[3] * p) / p)
-  end
-end
-
 local function convert_index(idx, vtable)
   if type(idx) == "number" then
     return vtable[idx]
@@ -64,28 +50,30 @@ local function convert_index(idx, vtable)
   end
 end
 
--- combines duplicate vertices; attributes other than positions are
--- discarded
+-- combines vertices closer than 1/precision (see geometry/weld.t, which
+-- also welds StaticGeometry directly); attributes other than positions
+-- are discarded
 function m.combine_duplicate_vertices(srcdata, precision)
-  local vtable = {}
-  local ctable = {}
-
-  -- first, hash (bin) all the vertex positions together and renumber
-  -- vertices
-  local nextVIdx = 0
-  local newpositions = {}
   local positions = srcdata.attributes.position
+  local n = #positions
+  local packed = terralib.new(float[n * 3])
   for i, v in ipairs(positions) do
-    local str_pos = canonize_vertex(v, precision)
-    local new_vid = ctable[str_pos]
-    if not new_vid then
-      new_vid = nextVIdx
-      nextVIdx = nextVIdx + 1
-      table.insert(newpositions, v)
-      ctable[str_pos] = new_vid
+    local base = (i-1) * 3
+    if v.elem then -- is a Vector
+      packed[base], packed[base+1], packed[base+2] = v.elem.x, v.elem.y, v.elem.z
+    else -- is a normal list
+      packed[base], packed[base+1], packed[base+2] = v[1], v[2], v[3]
     end
-    vtable[i-1] = new_vid
   end
+  local welder = require("./weld.t").weld_positions(packed, n, 1.0 / precision)
+
+  local newpositions = {}
+  for k = 0, tonumber(welder.n_unique) - 1 do
+    newpositions[k+1] = positions[welder.unique[k] + 1]
+  end
+  local vtable = {}
+  for i = 0, n - 1 do vtable[i] = welder.remap[i] end
+  welder:release()
 
   -- now reindex indices
   local newindices = {}
@@ -46,7 +46,8 @@ include_geometry("maxvol8")
 geometry.util = {}
 module.include_submodules({
   "geometry/geoutils.t",
-  "geometry/merge.t"
+  "geometry/merge.t",
+  "geometry/weld.t"
 }, geometry.util)
 
 return geometry
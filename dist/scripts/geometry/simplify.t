@@ -0,0 +1,625 @@
+-- geometry/simplify.t
+--
+-- native quadric error metric mesh simplification and LOD chains
+--
+-- Edges are collapsed in passes (after Garland & Heckbert): every vertex
+-- accumulates the quadric of the planes of its triangles, each pass sorts
+-- the candidate edge collapses by the quadric error of moving one end
+-- onto the other, and applies them cheapest first as long as neither end
+-- has moved yet in this pass and no triangle would flip. Vertices only
+-- ever collapse onto existing vertices, so the simplified mesh reuses the
+-- source vertices (and all their attributes) as they are.
+--
+-- Border vertices, and seam vertices (several vertices at one position,
+-- e.g., differing normals or uvs), are never collapsed. Weld triangle
+-- soups first (geometry/weld.t), or nothing can be simplified.
+--
+-- Each LOD level is simplified from the source independently, as a job on
+-- the job system, and levels can be cached on disk next to a source model
+-- (format/tgeo.t).
+
+local class = require("class")
+local c = require("native/clib.t")
+local jobs = require("native/jobs.t")
+local weld = require("./weld.t")
+local Welder = weld.Welder
+local m = {}
+
+-- part of every cache salt; bump when the output changes
+m.VERSION = 1
+-- default LOD ratios (fractions of the source's triangles)
+m.DEFAULT_RATIOS = {0.5, 0.25, 0.1}
+-- projected size (fraction of the view height) below which a LOD chain
+-- starts thinning out the full detail mesh
+m.FULL_DETAIL_SIZE = 0.25
+
+local struct Quadric {
+  a00: double; a01: double; a02: double;
+  a11: double; a12: double; a22: double;
+  b0: double; b1: double; b2: double;
+  c: double;
+}
+
+terra Quadric:add(o: &Quadric)
+  self.a00, self.a01, self.a02 = self.a00 + o.a00, self.a01 + o.a01, self.a02 + o.a02
+  self.a11, self.a12, self.a22 = self.a11 + o.a11, self.a12 + o.a12, self.a22 + o.a22
+  self.b0, self.b1, self.b2 = self.b0 + o.b0, self.b1 + o.b1, self.b2 + o.b2
+  self.c = self.c + o.c
+end
+
+-- plane n.p + d = 0 (n unit length)
+terra Quadric:add_plane(nx: double, ny: double, nz: double, d: double)
+  self.a00, self.a01, self.a02 = self.a00 + nx*nx, self.a01 + nx*ny, self.a02 + nx*nz
+  self.a11, self.a12, self.a22 = self.a11 + ny*ny, self.a12 + ny*nz, self.a22 + nz*nz
+  self.b0, self.b1, self.b2 = self.b0 + d*nx, self.b1 + d*ny, self.b2 + d*nz
+  self.c = self.c + d*d
+end
+
+-- sum of squared distances from p to the planes
+terra Quadric:error(x: double, y: double, z: double): double
+  var e = self.a00*x*x + self.a11*y*y + self.a22*z*z
+        + 2.0*(self.a01*x*y + self.a02*x*z + self.a12*y*z)
+        + 2.0*(self.b0*x + self.b1*y + self.b2*z) + self.c
+  if e < 0.0 then e = 0.0 end
+  return e
+end
+
+local struct Collapse {
+  from: uint32;
+  to: uint32;
+  cost: double;
+}
+
+local terra compare_collapses(a: &opaque, b: &opaque): int32
+  var ca, cb = [&Collapse](a).cost, [&Collapse](b).cost
+  if ca < cb then return -1 elseif ca > cb then return 1 end
+  return 0
+end
+
+local struct Simplifier {
+  positions: &uint8;     -- first vertex's position (3 floats)
+  stride: uint64;
+  n_verts: uint64;
+  indices: &uint32;      -- working (and finally output) triangles
+  n_indices: uint64;
+  max_cost: double;      -- don't make collapses costing more than this
+  error: double;         -- cost of the worst collapse made
+  quadrics: &Quadric;
+  remap: &uint32;        -- vertex -> vertex it collapsed onto this pass
+  locked: &bool;         -- border/seam vertices
+  pass_locked: &bool;    -- moved this pass
+  adj_offsets: &uint32;  -- vertex -> first entry in adj (n_verts + 1)
+  adj_fill: &uint32;
+  adj: &uint32;          -- triangles around each vertex
+  candidates: &Collapse;
+  vmap: &uint32;         -- source vertex -> output vertex (compact)
+}
+m.Simplifier = Simplifier
+
+local NO_VERTEX = constant(uint32, 0xffffffff)
+
+terra Simplifier:position(v: uint32): &float
+  return [&float](self.positions + v * self.stride)
+end
+
+terra Simplifier:corner(i: uint64): uint32
+  return self.remap[self.indices[i]]
+end
+
+terra Simplifier:build_adjacency()
+  var n = self.n_verts
+  c.str.memset(self.adj_offsets, 0, sizeof(uint32) * (n + 1))
+  for i = 0, self.n_indices do
+    var v = self.indices[i]
+    self.adj_offsets[v + 1] = self.adj_offsets[v + 1] + 1
+  end
+  for v = 0, n do
+    self.adj_offsets[v + 1] = self.adj_offsets[v + 1] + self.adj_offsets[v]
+    self.adj_fill[v] = self.adj_offsets[v]
+  end
+  for i = 0, self.n_indices do
+    var v = self.indices[i]
+    self.adj[self.adj_fill[v]] = [uint32](i / 3)
+    self.adj_fill[v] = self.adj_fill[v] + 1
+  end
+end
+
+-- whether the directed edge a->b belongs to a triangle around a
+terra Simplifier:has_edge(a: uint32, b: uint32): bool
+  for k = self.adj_offsets[a], self.adj_offsets[a + 1] do
+    var t = self.adj[k]
+    for j = 0, 3 do
+      var j1 = j + 1
+      if j1 == 3 then j1 = 0 end
+      if self.indices[t*3 + j] == a and self.indices[t*3 + j1] == b then
+        return true
+      end
+    end
+  end
+  return false
+end
+
+-- locks the ends of edges with no opposite edge, and vertices that share
+-- their position (position_ids: vertex -> its position's first vertex,
+-- or nil) with another used vertex
+terra Simplifier:lock_vertices(position_ids: &uint32)
+  var n_tris = self.n_indices / 3
+  for t = 0, n_tris do
+    for j = 0, 3 do
+      var j1 = j + 1
+      if j1 == 3 then j1 = 0 end
+      var a, b = self.indices[t*3 + j], self.indices[t*3 + j1]
+      if not self:has_edge(b, a) then
+        self.locked[a], self.locked[b] = true, true
+      end
+    end
+  end
+  if position_ids ~= nil then
+    var counts = self.adj_fill -- (free until the next build_adjacency)
+    c.str.memset(counts, 0, sizeof(uint32) * self.n_verts)
+    for v = 0, self.n_verts do
+      if self.adj_offsets[v + 1] > self.adj_offsets[v] then
+        counts[position_ids[v]] = counts[position_ids[v]] + 1
+      end
+    end
+    for v = 0, self.n_verts do
+      if counts[position_ids[v]] > 1 then self.locked[v] = true end
+    end
+  end
+end
+
+terra Simplifier:init(positions: &uint8, stride: uint64, n_verts: uint64,
+                      position_ids: &uint32, indices: &uint32, n_indices: uint64,
+                      max_cost: double)
+  c.str.memset(self, 0, sizeof(Simplifier))
+  self.positions, self.stride, self.n_verts = positions, stride, n_verts
+  self.max_cost = max_cost
+  n_indices = (n_indices / 3) * 3
+  self.n_indices = n_indices
+  self.indices = [&uint32](c.std.malloc(sizeof(uint32) * n_indices + 1))
+  c.str.memcpy(self.indices, indices, sizeof(uint32) * n_indices)
+  self.quadrics = [&Quadric](c.std.calloc(n_verts + 1, sizeof(Quadric)))
+  self.remap = [&uint32](c.std.malloc(sizeof(uint32) * n_verts + 1))
+  self.locked = [&bool](c.std.calloc(n_verts + 1, sizeof(bool)))
+  self.pass_locked = [&bool](c.std.malloc(sizeof(bool) * n_verts + 1))
+  self.adj_offsets = [&uint32](c.std.malloc(sizeof(uint32) * (n_verts + 1)))
+  self.adj_fill = [&uint32](c.std.malloc(sizeof(uint32) * n_verts + 1))
+  self.adj = [&uint32](c.std.malloc(sizeof(uint32) * n_indices + 1))
+  self.candidates = [&Collapse](c.std.malloc(sizeof(Collapse) * n_indices + 1))
+  for v = 0, n_verts do self.remap[v] = [uint32](v) end
+
+  for t = 0, n_indices / 3 do
+    var p0 = self:position(self.indices[t*3])
+    var p1 = self:position(self.indices[t*3 + 1])
+    var p2 = self:position(self.indices[t*3 + 2])
+    var e1x, e1y, e1z = [double](p1[0] - p0[0]), [double](p1[1] - p0[1]), [double](p1[2] - p0[2])
+    var e2x, e2y, e2z = [double](p2[0] - p0[0]), [double](p2[1] - p0[1]), [double](p2[2] - p0[2])
+    var nx, ny, nz = e1y*e2z - e1z*e2y, e1z*e2x - e1x*e2z, e1x*e2y - e1y*e2x
+    var len = c.math.sqrt(nx*nx + ny*ny + nz*nz)
+    if len > 0.0 then
+      nx, ny, nz = nx / len, ny / len, nz / len
+      var d = -(nx*p0[0] + ny*p0[1] + nz*p0[2])
+      for j = 0, 3 do
+        self.quadrics[self.indices[t*3 + j]]:add_plane(nx, ny, nz, d)
+      end
+    end
+  end
+  self:build_adjacency()
+  self:lock_vertices(position_ids)
+end
+
+terra Simplifier:release()
+  c.std.free(self.indices)
+  c.std.free(self.quadrics)
+  c.std.free(self.remap)
+  c.std.free(self.locked)
+  c.std.free(self.pass_locked)
+  c.std.free(self.adj_offsets)
+  c.std.free(self.adj_fill)
+  c.std.free(self.adj)
+  c.std.free(self.candidates)
+  c.std.free(self.vmap)
+  c.str.memset(self, 0, sizeof(Simplifier))
+end
+
+-- error of moving a onto b
+terra Simplifier:cost(a: uint32, b: uint32): double
+  var q = self.quadrics[a]
+  q:add(&self.quadrics[b])
+  var p = self:position(b)
+  return q:error(p[0], p[1], p[2])
+end
+
+local terra cross(ax: float, ay: float, az: float, bx: float, by: float, bz: float,
+                  out: &float)
+  out[0], out[1], out[2] = ay*bz - az*by, az*bx - ax*bz, ax*by - ay*bx
+end
+
+-- whether moving a onto b would flip a triangle around a (that doesn't
+-- also contain b, and so disappear)
+terra Simplifier:flips(a: uint32, b: uint32): bool
+  var pb = self:position(b)
+  var before: float[3], after: float[3]
+  for k = self.adj_offsets[a], self.adj_offsets[a + 1] do
+    var t = self.adj[k]
+    var c0, c1, c2 = self:corner(t*3), self:corner(t*3 + 1), self:corner(t*3 + 2)
+    if not (c0 == b or c1 == b or c2 == b or c0 == c1 or c1 == c2 or c0 == c2) then
+      var p0, p1, p2 = self:position(c0), self:position(c1), self:position(c2)
+      cross(p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2], p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2],
+            &before[0])
+      if c0 == a then p0 = pb elseif c1 == a then p1 = pb else p2 = pb end
+      cross(p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2], p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2],
+            &after[0])
+      if before[0]*after[0] + before[1]*after[1] + before[2]*after[2] <= 0.0f then
+        return true
+      end
+    end
+  end
+  return false
+end
+
+-- triangles around a that disappear when it moves onto b
+terra Simplifier:collapsing_triangles(a: uint32, b: uint32): uint64
+  var n: uint64 = 0
+  for k = self.adj_offsets[a], self.adj_offsets[a + 1] do
+    var t = self.adj[k]
+    var c0, c1, c2 = self:corner(t*3), self:corner(t*3 + 1), self:corner(t*3 + 2)
+    if (c0 == b or c1 == b or c2 == b) and not (c0 == c1 or c1 == c2 or c0 == c2) then
+      n = n + 1
+    end
+  end
+  return n
+end
+
+-- one pass of collapses; returns how many were made
+terra Simplifier:pass(target_tris: uint64): uint64
+  for v = 0, self.n_verts do
+    self.remap[v] = [uint32](v)
+    self.pass_locked[v] = false
+  end
+  self:build_adjacency()
+
+  var n_candidates: uint64 = 0
+  for t = 0, self.n_indices / 3 do
+    for j = 0, 3 do
+      var j1 = j + 1
+      if j1 == 3 then j1 = 0 end
+      var a, b = self.indices[t*3 + j], self.indices[t*3 + j1]
+      var col = &self.candidates[n_candidates]
+      col.cost = -1.0
+      if not self.locked[a] then
+        col.from, col.to, col.cost = a, b, self:cost(a, b)
+      end
+      if not self.locked[b] then
+        var cost = self:cost(b, a)
+        if col.cost < 0.0 or cost < col.cost then
+          col.from, col.to, col.cost = b, a, cost
+        end
+      end
+      if col.cost >= 0.0 then n_candidates = n_candidates + 1 end
+    end
+  end
+  c.std.qsort(self.candidates, n_candidates, sizeof(Collapse), compare_collapses)
+
+  var n_tris = self.n_indices / 3
+  var collapsed: uint64 = 0
+  for i = 0, n_candidates do
+    var col = self.candidates[i]
+    if n_tris <= target_tris or col.cost > self.max_cost then break end
+    var a, b = col.from, col.to
+    if not (self.pass_locked[a] or self.pass_locked[b] or self:flips(a, b)) then
+      n_tris = n_tris - self:collapsing_triangles(a, b)
+      self.remap[a] = b
+      self.quadrics[b]:add(&self.quadrics[a])
+      self.pass_locked[a], self.pass_locked[b] = true, true
+      if col.cost > self.error then self.error = col.cost end
+      collapsed = collapsed + 1
+    end
+  end
+
+  var out: uint64 = 0
+  for t = 0, self.n_indices / 3 do
+    var c0, c1, c2 = self:corner(t*3), self:corner(t*3 + 1), self:corner(t*3 + 2)
+    if not (c0 == c1 or c1 == c2 or c0 == c2) then
+      self.indices[out], self.indices[out + 1], self.indices[out + 2] = c0, c1, c2
+      out = out + 3
+    end
+  end
+  self.n_indices = out
+  return collapsed
+end
+
+-- simplifies until at most target_indices are left, or nothing more can
+-- be collapsed within max_cost
+terra Simplifier:run(target_indices: uint64)
+  while self.n_indices > target_indices do
+    if self:pass(target_indices / 3) == 0 then break end
+  end
+end
+
+-- numbers the vertices still in use (into vmap); returns how many
+terra Simplifier:compact(): uint64
+  self.vmap = [&uint32](c.std.malloc(sizeof(uint32) * self.n_verts + 1))
+  for v = 0, self.n_verts do self.vmap[v] = NO_VERTEX end
+  var n: uint32 = 0
+  for i = 0, self.n_indices do
+    var v = self.indices[i]
+    if self.vmap[v] == NO_VERTEX then
+      self.vmap[v] = n
+      n = n + 1
+    end
+  end
+  return n
+end
+
+------------------------------------------------------------------------------
+-- geometry
+------------------------------------------------------------------------------
+
+local index_converter = terralib.memoize(function(IndexType)
+  return terra(src: &IndexType, dst: &uint32, n: uint64)
+    for i = 0, n do dst[i] = src[i] end
+  end
+end)
+
+-- copies the compacted vertices and indices of a finished simplifier
+local output_copier = terralib.memoize(function(VertType, IndexType)
+  return terra(s: &Simplifier, src: &VertType, dst: &VertType, indices: &IndexType)
+    for v = 0, s.n_verts do
+      if s.vmap[v] ~= NO_VERTEX then dst[s.vmap[v]] = src[v] end
+    end
+    for i = 0, s.n_indices do
+      indices[i] = [IndexType](s.vmap[s.indices[i]])
+    end
+  end
+end)
+
+-- a vertex per distinct position (the first one), from an exact weld
+local terra position_ids(welder: &Welder, ids: &uint32)
+  for i = 0, welder.n_verts do ids[i] = welder.unique[welder.remap[i]] end
+end
+
+local terra position_bounds(positions: &uint8, stride: uint64, n: uint64,
+                            lo: &float, hi: &float)
+  for j = 0, 3 do
+    lo[j], hi[j] = 0.0f, 0.0f
+  end
+  for i = 0, n do
+    var p = [&float](positions + i * stride)
+    for j = 0, 3 do
+      if i == 0 or p[j] < lo[j] then lo[j] = p[j] end
+      if i == 0 or p[j] > hi[j] then hi[j] = p[j] end
+    end
+  end
+end
+
+local struct LevelJob {
+  simplifier: Simplifier;
+  positions: &uint8;
+  stride: uint64;
+  n_verts: uint64;
+  position_ids: &uint32;
+  indices: &uint32;
+  n_indices: uint64;
+  target_indices: uint64;
+  max_cost: double;
+}
+
+local terra level_job(userdata: &opaque)
+  var job = [&LevelJob](userdata)
+  job.simplifier:init(job.positions, job.stride, job.n_verts, job.position_ids,
+                      job.indices, job.n_indices, job.max_cost)
+  job.simplifier:run(job.target_indices)
+end
+
+-- everything the levels share: positions, position ids, uint32 indices,
+-- bounds
+local function prepare_source(geo)
+  if not geo.allocated then truss.error("Cannot simplify unallocated geometry") end
+  local vtype = geo.vertinfo.ttype
+  local src = {geo = geo, positions = jobs.position_base(vtype)(geo.verts),
+               stride = sizeof(vtype), n_verts = geo.n_verts,
+               n_indices = geo.n_indices}
+  src.indices = terralib.new(uint32[math.max(src.n_indices, 1)])
+  index_converter(geo.index_type)(geo.indices, src.indices, src.n_indices)
+  local welder = weld.weld_positions(src.positions, src.n_verts, 0, src.stride)
+  src.position_ids = terralib.new(uint32[math.max(src.n_verts, 1)])
+  position_ids(welder, src.position_ids)
+  welder:release()
+  local lo, hi = terralib.new(float[3]), terralib.new(float[3])
+  position_bounds(src.positions, src.stride, src.n_verts, lo, hi)
+  src.center = {(lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2}
+  src.extent = math.sqrt((hi[0] - lo[0])^2 + (hi[1] - lo[1])^2 + (hi[2] - lo[2])^2)
+  return src
+end
+
+-- max_error is relative to the source's bounding box diagonal
+local function make_job(src, ratio, max_error)
+  local job = terralib.new(LevelJob)
+  job.positions = src.positions
+  job.stride = src.stride
+  job.n_verts = src.n_verts
+  job.position_ids = src.position_ids
+  job.indices = src.indices
+  job.n_indices = src.n_indices
+  job.target_indices = math.floor(src.n_indices / 3 * ratio) * 3
+  job.max_cost = (max_error * src.extent)^2
+  return job
+end
+
+-- turns a finished job into a geometry (and releases its simplifier)
+local function finish_job(src, job, name, commit)
+  local s = job.simplifier
+  local n_verts = tonumber(s:compact())
+  local gfx = require("gfx")
+  local geo = gfx.StaticGeometry(name)
+  geo:allocate(n_verts, tonumber(s.n_indices), src.geo.vertinfo)
+  output_copier(src.geo.vertinfo.ttype, geo.index_type)(s, src.geo.verts,
+                                                        geo.verts, geo.indices)
+  local error = math.sqrt(s.error) / math.max(src.extent, 1e-30)
+  s:release()
+  if commit then geo:commit() end
+  return geo, error
+end
+
+-- simplifies an (allocated, welded) geometry into a new one on this
+-- thread. options (all optional):
+--   ratio: target fraction of the triangles (default 0.5)
+--   max_error: largest collapse error, relative to the bounding box
+--              diagonal (default 1, i.e., only the ratio matters)
+--   name: name of the new geometry
+--   commit: commit the new geometry (default true)
+-- returns the new geometry and its relative error
+function m.simplify_geo(geo, options)
+  options = options or {}
+  local t0 = truss.tic()
+  local src = prepare_source(geo)
+  local job = make_job(src, options.ratio or 0.5, options.max_error or 1.0)
+  level_job(terralib.cast(&opaque, job))
+  local ret, error = finish_job(src, job, options.name or (geo.name or "geo") .. "_simplified",
+                                options.commit ~= false)
+  log.info(("Simplified %s: %d -> %d triangles (error %g) in %.1f ms"):format(
+           ret.name, math.floor(geo.n_indices / 3), math.floor(ret.n_indices / 3), error,
+           truss.toc(t0) * 1000.0))
+  return ret, error
+end
+
+------------------------------------------------------------------------------
+-- LOD chains
+------------------------------------------------------------------------------
+
+-- a LOD chain being built on the job system; poll it (e.g., once a frame)
+-- until it returns the chain, or wait for it
+local LodBuild = class("LodBuild")
+m.LodBuild = LodBuild
+
+-- options (all optional):
+--   ratios: list of target triangle fractions (default DEFAULT_RATIOS)
+--   sizes: projected size (see MeshComponent:projected_size) each level
+--          is used down to, full detail first (default: from the ratios)
+--   max_error: see simplify_geo
+--   cache: source model filename; levels are cached next to it
+--   cache_salt: what else the source geometry was derived with
+--   commit: commit the levels (default true)
+function LodBuild:init(geo, options)
+  options = options or {}
+  self.options = options
+  self._t0 = truss.tic()
+  self._src = prepare_source(geo)
+  self._counter = jobs.Counter()
+  self._levels = {}
+  local ratios = options.ratios or m.DEFAULT_RATIOS
+  local max_error = options.max_error or 1.0
+  local tgeo = options.cache and require("format/tgeo.t")
+  for i, ratio in ipairs(ratios) do
+    local level = {ratio = ratio, name = ("%s_lod%d"):format(geo.name or "geo", i)}
+    if tgeo then
+      local salt = ("lod|%d|%s|%s|%g|%g"):format(m.VERSION, options.cache_salt or "",
+                                                geo.vertinfo.type_id, ratio, max_error)
+      level.geo, level.cache_path, level.cache_key = tgeo.find_cached(
+        options.cache, salt, (".lod%d"):format(i),
+        {name = level.name, commit = options.commit})
+    end
+    if not level.geo then
+      level.job = make_job(self._src, ratio, max_error)
+      jobs.submit(level_job, terralib.cast(&opaque, level.job), self._counter)
+    end
+    self._levels[i] = level
+  end
+  -- the jobs only hold raw pointers into the source and the level jobs, so
+  -- a build dropped before it finishes must not let those be collected
+  -- under a running worker (or leak the simplifiers); the guard keeps them
+  -- reachable until its finalizer has waited for the jobs
+  local pending = {counter = self._counter, src = self._src, levels = self._levels}
+  self._guard = ffi.gc(ffi.new("uint8_t[1]"), function()
+    pending.counter:wait()
+    for _, level in ipairs(pending.levels) do
+      if level.job then level.job.simplifier:release() end
+    end
+  end)
+end
+
+-- a level is used down to the size at which the next level's triangles
+-- are as dense on screen as the full mesh is at FULL_DETAIL_SIZE
+local function default_sizes(ratios)
+  local sizes = {}
+  for i = 1, #ratios do
+    sizes[i] = m.FULL_DETAIL_SIZE * math.sqrt(ratios[i])
+  end
+  return sizes
+end
+
+function LodBuild:_finish()
+  local options, src = self.options, self._src
+  local tgeo = options.cache and require("format/tgeo.t")
+  local chain = {center = src.center, radius = src.extent / 2,
+                 levels = {{geo = src.geo, ratio = 1, error = 0}}}
+  for i, level in ipairs(self._levels) do
+    local geo, error = level.geo, nil
+    if level.job then
+      geo, error = finish_job(src, level.job, level.name, false)
+      level.job = nil
+      if level.cache_path then tgeo.save_cached(level.cache_path, geo, level.cache_key) end
+      if options.commit ~= false then geo:commit() end
+    end
+    chain.levels[i+1] = {geo = geo, ratio = level.ratio, error = error}
+  end
+  local sizes = options.sizes or default_sizes(options.ratios or m.DEFAULT_RATIOS)
+  for i, level in ipairs(chain.levels) do
+    level.min_size = (i < #chain.levels and sizes[i]) or 0
+  end
+  log.info(("Built %d LOD levels for %s in %.1f ms"):format(
+           #self._levels, src.geo.name, truss.toc(self._t0) * 1000.0))
+  ffi.gc(self._guard, nil)
+  self._src, self._levels, self._guard = nil, nil, nil
+  self.chain = chain
+  return chain
+end
+
+-- the chain if it's done, otherwise nil
+function LodBuild:poll()
+  if self.chain then return self.chain end
+  if self._counter:pending() > 0 then return nil end
+  return self:_finish()
+end
+
+function LodBuild:wait()
+  if not self.chain then self._counter:wait() end
+  return self:poll()
+end
+
+-- a chain is {center = {x, y, z}, radius, levels = {{geo, ratio, error,
+-- min_size}, ...}}, full detail (the source geometry) first; see
+-- MeshComponent:set_lods
+function m.build_lods_async(geo, options)
+  return LodBuild(geo, options)
+end
+
+function m.build_lods(geo, options)
+  return LodBuild(geo, options):wait()
+end
+
+-- loads a model (see format/tgeo.t load_model), welds it if asked to
+-- (options.weld_epsilon), and builds its LOD chain, with every level
+-- cached next to the model file
+function m.load_lods(filename, options)
+  options = options or {}
+  local tgeo = require("format/tgeo.t")
+  local salt = ("%s|%s"):format(filename:sub(-4):lower(), tostring(options.invert))
+  local geo = tgeo.load_model(filename, {invert = options.invert, commit = false})
+  if not geo then return nil end
+  if options.weld_epsilon then
+    local welded = weld.weld_geo(geo, {epsilon = options.weld_epsilon, commit = false,
+                                       name = filename})
+    geo:deallocate()
+    geo = welded
+    salt = salt .. "|weld " .. options.weld_epsilon
+  end
+  if options.commit ~= false then geo:commit() end
+  local opts = {}
+  for k, v in pairs(options) do opts[k] = v end
+  opts.cache, opts.cache_salt = filename, salt
+  return m.build_lods(geo, opts)
+end
+
+return m
@@ -0,0 +1,515 @@
+-- geometry/soa.t
+--
+-- native structure-of-arrays geometry: each position, normal and uv
+-- component is its own contiguous float array (plus a uint32 index array),
+-- so transforms, merges, bounds and normals run as SIMD kernels instead of
+-- touching a math.Vector per vertex
+--
+-- Every plane starts on a vector aligned boundary; kernels handle the
+-- unaligned head and tail of a range with scalar code and the rest with
+-- LANES wide vectors. Parts of a merge are copied and transformed in
+-- parallel on the job system (see jobs.parallel).
+
+local c = require("native/clib.t")
+local jobs = require("native/jobs.t")
+local m = {}
+
+-- vertices per job when transforming a single geometry
+m.TRANSFORM_GRAIN = 2^14
+
+local LANES = 8
+m.LANES = LANES
+local ALIGN = LANES * 4
+local VF = vector(float, LANES)
+local VU = vector(uint32, LANES)
+
+local struct SoAGeometry {
+  n_verts: uint64;
+  n_indices: uint64;
+  position: (&float)[3];
+  normal: (&float)[3];  -- nil without normals
+  uv: (&float)[2];      -- nil without uvs
+  indices: &uint32;
+  block: &uint8;        -- the single allocation every array lives in
+}
+m.SoAGeometry = SoAGeometry
+
+------------------------------------------------------------------------------
+-- lane generic helpers: T is either a scalar type or its LANES wide vector
+------------------------------------------------------------------------------
+
+local function load(T, ptr, i)
+  return `@[&T](&ptr[i])
+end
+
+local function store(T, ptr, i, val)
+  return quote @[&T](&ptr[i]) = val end
+end
+
+local vmin = macro(function(a, b) return `terralib.select(a < b, a, b) end)
+local vmax = macro(function(a, b) return `terralib.select(a > b, a, b) end)
+
+local sqrt = {
+  [float] = terralib.intrinsic("llvm.sqrt.f32", {float} -> float),
+  [VF] = terralib.intrinsic(("llvm.sqrt.v%df32"):format(LANES), {VF} -> VF)
+}
+
+-- loops i over [first, last): body(S, i) until i is vector aligned, then
+-- body(V, i) a vector at a time, then body(S, i) for the rest
+local function simd_loop(S, V, first, last, body)
+  local i = symbol(uint64, "i")
+  return quote
+    var [i] = first
+    while [i] < last and [i] % LANES ~= 0 do
+      [body(S, i)]
+      [i] = [i] + 1
+    end
+    while [i] + LANES <= last do
+      [body(V, i)]
+      [i] = [i] + LANES
+    end
+    while [i] < last do
+      [body(S, i)]
+      [i] = [i] + 1
+    end
+  end
+end
+
+------------------------------------------------------------------------------
+-- allocation
+------------------------------------------------------------------------------
+
+local terra round_up(n: uint64): uint64
+  return ((n + LANES - 1) / LANES) * LANES
+end
+
+terra SoAGeometry:init()
+  c.str.memset(self, 0, sizeof(SoAGeometry))
+end
+
+terra SoAGeometry:release()
+  c.std.free(self.block)
+  self:init()
+end
+
+terra SoAGeometry:has_normals(): bool
+  return self.normal[0] ~= nil
+end
+
+terra SoAGeometry:has_uvs(): bool
+  return self.uv[0] ~= nil
+end
+
+-- (re)allocates for n_verts and n_indices; contents are undefined
+terra SoAGeometry:allocate(n_verts: uint64, n_indices: uint64,
+                           normals: bool, uvs: bool)
+  self:release()
+  var vcap, icap = round_up(n_verts), round_up(n_indices)
+  var n_planes = 3
+  if normals then n_planes = n_planes + 3 end
+  if uvs then n_planes = n_planes + 2 end
+  self.block = [&uint8](c.std.malloc(sizeof(float) * (n_planes * vcap + icap) + ALIGN))
+  var plane = [&float](([uint64](self.block) + ALIGN - 1) and not [uint64](ALIGN - 1))
+  for j = 0, 3 do
+    self.position[j] = plane
+    plane = plane + vcap
+  end
+  if normals then
+    for j = 0, 3 do
+      self.normal[j] = plane
+      plane = plane + vcap
+    end
+  end
+  if uvs then
+    for j = 0, 2 do
+      self.uv[j] = plane
+      plane = plane + vcap
+    end
+  end
+  self.indices = [&uint32](plane)
+  self.n_verts = n_verts
+  self.n_indices = n_indices
+end
+
+------------------------------------------------------------------------------
+-- transform
+------------------------------------------------------------------------------
+
+-- transforms positions in [first, last) by the 4x4 (column major, like
+-- math.Matrix4) mat, and normals by the upper 3x3 of nmat; either may be nil
+local terra transform_range(geo: &SoAGeometry, mat: &float, nmat: &float,
+                            first: uint64, last: uint64)
+  var M: float[16]
+  if mat ~= nil then
+    for k = 0, 16 do M[k] = mat[k] end
+    var px, py, pz = geo.position[0], geo.position[1], geo.position[2]
+    [simd_loop(float, VF, first, last, function(T, i) return quote
+      var x, y, z = [load(T, px, i)], [load(T, py, i)], [load(T, pz, i)]
+      [store(T, px, i, `[T](M[0])*x + [T](M[4])*y + [T](M[8])*z + [T](M[12]))]
+      [store(T, py, i, `[T](M[1])*x + [T](M[5])*y + [T](M[9])*z + [T](M[13]))]
+      [store(T, pz, i, `[T](M[2])*x + [T](M[6])*y + [T](M[10])*z + [T](M[14]))]
+    end end)]
+  end
+  if nmat ~= nil and geo:has_normals() then
+    for k = 0, 16 do M[k] = nmat[k] end
+    var nx, ny, nz = geo.normal[0], geo.normal[1], geo.normal[2]
+    [simd_loop(float, VF, first, last, function(T, i) return quote
+      var x, y, z = [load(T, nx, i)], [load(T, ny, i)], [load(T, nz, i)]
+      [store(T, nx, i, `[T](M[0])*x + [T](M[4])*y + [T](M[8])*z)]
+      [store(T, ny, i, `[T](M[1])*x + [T](M[5])*y + [T](M[9])*z)]
+      [store(T, nz, i, `[T](M[2])*x + [T](M[6])*y + [T](M[10])*z)]
+    end end)]
+  end
+end
+
+local struct TransformJob {
+  geo: &SoAGeometry;
+  mat: &float;
+  nmat: &float;
+}
+
+local terra transform_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var job = [&TransformJob](userdata)
+  transform_range(job.geo, job.mat, job.nmat, range_begin, range_end)
+end
+
+local function matrix_data(mat)
+  if mat == nil then return nil end
+  return mat.data or mat
+end
+
+-- transforms geo in place; pose follows merge.merge_data: a table of
+-- {position = Matrix4, normal = Matrix4}, either of which may be missing
+function m.transform(geo, pose)
+  local job = terralib.new(TransformJob)
+  job.geo = geo
+  job.mat = matrix_data(pose.position)
+  job.nmat = matrix_data(pose.normal)
+  jobs.run_kernel(transform_kernel, job, tonumber(geo.n_verts), m.TRANSFORM_GRAIN)
+  return geo
+end
+
+------------------------------------------------------------------------------
+-- merge
+------------------------------------------------------------------------------
+
+local struct MergePart {
+  src: &SoAGeometry;
+  vert_offset: uint64;
+  index_offset: uint64;
+  mat: &float;
+  nmat: &float;
+}
+
+local struct MergeJob {
+  dst: &SoAGeometry;
+  parts: &MergePart;
+}
+
+local terra copy_planes(dst: &&float, src: &&float, n_planes: uint32,
+                        offset: uint64, count: uint64)
+  for j = 0, n_planes do
+    c.str.memcpy(dst[j] + offset, src[j], sizeof(float) * count)
+  end
+end
+
+local terra offset_indices(idx: &uint32, first: uint64, last: uint64, offset: uint32)
+  [simd_loop(uint32, VU, first, last, function(T, i)
+    return store(T, idx, i, `[load(T, idx, i)] + [T](offset))
+  end)]
+end
+
+-- copies, transforms and reindexes each part into its range of dst; dst
+-- only has normals/uvs if every part does
+local terra merge_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var job = [&MergeJob](userdata)
+  var dst = job.dst
+  for p = range_begin, range_end do
+    var part = &job.parts[p]
+    var src = part.src
+    var v0, i0 = part.vert_offset, part.index_offset
+    var n = src.n_verts
+    copy_planes(&dst.position[0], &src.position[0], 3, v0, n)
+    if dst:has_normals() then copy_planes(&dst.normal[0], &src.normal[0], 3, v0, n) end
+    if dst:has_uvs() then copy_planes(&dst.uv[0], &src.uv[0], 2, v0, n) end
+    c.str.memcpy(dst.indices + i0, src.indices, sizeof(uint32) * src.n_indices)
+    offset_indices(dst.indices, i0, i0 + src.n_indices, [uint32](v0))
+    transform_range(dst, part.mat, part.nmat, v0, v0 + n)
+  end
+end
+
+-- merges a list of {SoAGeometry, pose} pairs (see transform) into a new
+-- SoAGeometry; the sources are left untouched
+function m.merge(parts)
+  local n_verts, n_indices = 0, 0
+  local normals, uvs = true, true
+  for _, part in ipairs(parts) do
+    local src = part[1]
+    n_verts = n_verts + tonumber(src.n_verts)
+    n_indices = n_indices + tonumber(src.n_indices)
+    normals = normals and src:has_normals()
+    uvs = uvs and src:has_uvs()
+  end
+  if n_verts >= 2^32 then truss.error("soa.merge: too many vertices") end
+
+  local dst = m.new(n_verts, n_indices, {normals = normals, uvs = uvs})
+  local job = terralib.new(MergeJob)
+  local job_parts = terralib.new(MergePart[math.max(#parts, 1)])
+  job.dst = dst
+  job.parts = job_parts
+  local v0, i0 = 0, 0
+  for idx, part in ipairs(parts) do
+    local src, pose = part[1], part[2] or {}
+    local jp = job_parts[idx-1]
+    jp.src = src
+    jp.vert_offset, jp.index_offset = v0, i0
+    jp.mat = matrix_data(pose.position)
+    jp.nmat = matrix_data(pose.normal)
+    v0 = v0 + tonumber(src.n_verts)
+    i0 = i0 + tonumber(src.n_indices)
+  end
+  jobs.run_kernel(merge_kernel, job, #parts)
+  return dst
+end
+
+------------------------------------------------------------------------------
+-- bounds and normals
+------------------------------------------------------------------------------
+
+local INF = constant(float, math.huge)
+
+-- axis aligned bounds of the positions, into lo[0..2] and hi[0..2]
+terra SoAGeometry:bounds(lo: &float, hi: &float)
+  var slo: float[3], shi: float[3]
+  var vlo: VF[3], vhi: VF[3]
+  for j = 0, 3 do
+    slo[j], shi[j] = INF, -INF
+    vlo[j], vhi[j] = [VF](INF), [VF](-INF)
+  end
+  var pos = self.position
+  var n = self.n_verts
+  [simd_loop(float, VF, 0, n, function(T, i)
+    local lo_acc, hi_acc = slo, shi
+    if T == VF then lo_acc, hi_acc = vlo, vhi end
+    local q = quote end
+    for j = 0, 2 do
+      q = quote
+        [q]
+        var v = [load(T, `pos[j], i)]
+        [lo_acc][j] = vmin([lo_acc][j], v)
+        [hi_acc][j] = vmax([hi_acc][j], v)
+      end
+    end
+    return q
+  end)]
+  var lanes: float[LANES]
+  for j = 0, 3 do
+    c.str.memcpy(&lanes, &vlo[j], sizeof(VF))
+    for k = 0, LANES do slo[j] = vmin(slo[j], lanes[k]) end
+    c.str.memcpy(&lanes, &vhi[j], sizeof(VF))
+    for k = 0, LANES do shi[j] = vmax(shi[j], lanes[k]) end
+    lo[j], hi[j] = slo[j], shi[j]
+  end
+end
+
+local terra normalize_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var geo = [&SoAGeometry](userdata)
+  var nx, ny, nz = geo.normal[0], geo.normal[1], geo.normal[2]
+  [simd_loop(float, VF, range_begin, range_end, function(T, i) return quote
+    var x, y, z = [load(T, nx, i)], [load(T, ny, i)], [load(T, nz, i)]
+    var len2 = x*x + y*y + z*z
+    var s = terralib.select(len2 > [T](0.0f), [T](1.0f) / [sqrt[T]](len2), [T](0.0f))
+    [store(T, nx, i, `x * s)]
+    [store(T, ny, i, `y * s)]
+    [store(T, nz, i, `z * s)]
+  end end)]
+end
+
+-- area weighted sums of face normals; scattering into shared vertices
+-- stays on one thread
+terra SoAGeometry:accumulate_normals()
+  var px, py, pz = self.position[0], self.position[1], self.position[2]
+  var nx, ny, nz = self.normal[0], self.normal[1], self.normal[2]
+  for j = 0, 3 do
+    c.str.memset(self.normal[j], 0, sizeof(float) * self.n_verts)
+  end
+  for t = 0, self.n_indices / 3 do
+    var ia, ib, ic = self.indices[t*3], self.indices[t*3 + 1], self.indices[t*3 + 2]
+    var e1x, e1y, e1z = px[ib] - px[ia], py[ib] - py[ia], pz[ib] - pz[ia]
+    var e2x, e2y, e2z = px[ic] - px[ia], py[ic] - py[ia], pz[ic] - pz[ia]
+    var fx = e1y*e2z - e1z*e2y
+    var fy = e1z*e2x - e1x*e2z
+    var fz = e1x*e2y - e1y*e2x
+    nx[ia], ny[ia], nz[ia] = nx[ia] + fx, ny[ia] + fy, nz[ia] + fz
+    nx[ib], ny[ib], nz[ib] = nx[ib] + fx, ny[ib] + fy, nz[ib] + fz
+    nx[ic], ny[ic], nz[ic] = nx[ic] + fx, ny[ic] + fy, nz[ic] + fz
+  end
+end
+
+-- smooth vertex normals (geo must have been allocated with normals)
+function m.compute_normals(geo)
+  if not geo:has_normals() then
+    truss.error("soa.compute_normals: geometry has no normals")
+  end
+  geo:accumulate_normals()
+  jobs.run_kernel(normalize_kernel, geo, tonumber(geo.n_verts), m.TRANSFORM_GRAIN)
+  return geo
+end
+
+------------------------------------------------------------------------------
+-- conversion
+------------------------------------------------------------------------------
+
+-- a new SoAGeometry; options: normals, uvs (default false). Release it.
+function m.new(n_verts, n_indices, options)
+  options = options or {}
+  local geo = terralib.new(SoAGeometry)
+  geo:init()
+  geo:allocate(n_verts, n_indices, not not options.normals, not not options.uvs)
+  return geo
+end
+
+local function vector_elems(v)
+  if v.elem then return v.elem.x, v.elem.y, v.elem.z end
+  return v[1], v[2], v[3]
+end
+
+local function fill_planes(planes, n_planes, attr)
+  for i, v in ipairs(attr) do
+    local x, y, z = vector_elems(v)
+    planes[0][i-1], planes[1][i-1] = x, y
+    if n_planes > 2 then planes[2][i-1] = z end
+  end
+end
+
+-- from geometry data (see geometry/geoutils.t): position, normal and
+-- texcoord0 attributes, and either list-of-lists or flat indices
+function m.from_data(data)
+  local attrs = data.attributes
+  local positions = attrs.position
+  local flat = type(data.indices[1]) == "number"
+  local n_indices = flat and #data.indices or #data.indices * 3
+  local geo = m.new(#positions, n_indices, {normals = attrs.normal ~= nil,
+                                            uvs = attrs.texcoord0 ~= nil})
+  fill_planes(geo.position, 3, positions)
+  if attrs.normal then fill_planes(geo.normal, 3, attrs.normal) end
+  if attrs.texcoord0 then fill_planes(geo.uv, 2, attrs.texcoord0) end
+  local indices = geo.indices
+  if flat then
+    for i, idx in ipairs(data.indices) do indices[i-1] = idx end
+  else
+    for i, tri in ipairs(data.indices) do
+      local base = (i-1) * 3
+      indices[base], indices[base+1], indices[base+2] = tri[1], tri[2], tri[3]
+    end
+  end
+  return geo
+end
+
+local function plane_vectors(planes, n_planes, n)
+  local Vector = require("math").Vector
+  local ret = {}
+  for i = 0, n - 1 do
+    local z = (n_planes > 2 and planes[2][i]) or nil
+    ret[i+1] = Vector(planes[0][i], planes[1][i], z)
+  end
+  return ret
+end
+
+-- to geometry data with list-of-lists indices
+function m.to_data(geo)
+  local n = tonumber(geo.n_verts)
+  local ret = {indices = {}, attributes = {}}
+  ret.attributes.position = plane_vectors(geo.position, 3, n)
+  if geo:has_normals() then
+    ret.attributes.normal = plane_vectors(geo.normal, 3, n)
+  end
+  if geo:has_uvs() then
+    ret.attributes.texcoord0 = plane_vectors(geo.uv, 2, n)
+  end
+  local indices = geo.indices
+  for t = 0, math.floor(tonumber(geo.n_indices) / 3) - 1 do
+    ret.indices[t+1] = {indices[t*3], indices[t*3+1], indices[t*3+2]}
+  end
+  return ret
+end
+
+-- attributes of a vertex type that map onto planes: {field, plane, count}
+local function plane_attributes(VertType)
+  local ret = {}
+  local planes = {position = {"position", 3}, normal = {"normal", 3},
+                  texcoord0 = {"uv", 2}}
+  for _, entry in ipairs(VertType.entries) do
+    local name, etype = entry[1], entry[2]
+    local p = planes[name]
+    if p and etype == float[p[2]] then
+      table.insert(ret, {name, p[1], p[2]})
+    end
+  end
+  return ret
+end
+
+-- copies between interleaved vertices/indices and planes; to_soa picks
+-- the direction. Attributes missing on the destination side are skipped,
+-- ones missing on the source side are zeroed.
+local geo_copier = terralib.memoize(function(VertType, IndexType, to_soa)
+  local attrs = plane_attributes(VertType)
+  return terra(geo: &SoAGeometry, verts: &VertType, indices: &IndexType)
+    for i = 0, geo.n_verts do
+      escape for _, attr in ipairs(attrs) do
+        local field, plane, count = unpack(attr)
+        for j = 0, count - 1 do
+          if to_soa then emit quote
+            if geo.[plane][j] ~= nil then geo.[plane][j][i] = verts[i].[field][j] end
+          end else emit quote
+            if geo.[plane][j] ~= nil then
+              verts[i].[field][j] = geo.[plane][j][i]
+            else
+              verts[i].[field][j] = 0.0f
+            end
+          end end
+        end
+      end end
+    end
+    for i = 0, geo.n_indices do
+      escape if to_soa then
+        emit quote geo.indices[i] = indices[i] end
+      else
+        emit quote indices[i] = [IndexType](geo.indices[i]) end
+      end end
+    end
+  end
+end)
+
+-- from an allocated StaticGeometry (positions, plus normals and texcoord0
+-- if its vertex type has them)
+function m.from_geo(src)
+  if not src.allocated then truss.error("soa.from_geo: geometry not allocated") end
+  local has = {}
+  for _, attr in ipairs(plane_attributes(src.vertinfo.ttype)) do has[attr[2]] = true end
+  local geo = m.new(src.n_verts, src.n_indices, {normals = has.normal, uvs = has.uv})
+  geo_copier(src.vertinfo.ttype, src.index_type, true)(geo, src.verts, src.indices)
+  return geo
+end
+
+-- to a new StaticGeometry; options (all optional):
+--   vertinfo: vertex type (default: basic type of the planes geo has)
+--   commit: commit the geometry (default true)
+function m.to_geo(geo, name, options)
+  options = options or {}
+  local vertinfo = options.vertinfo
+  if not vertinfo then
+    local attribs = {"position"}
+    if geo:has_normals() then table.insert(attribs, "normal") end
+    if geo:has_uvs() then table.insert(attribs, "texcoord0") end
+    vertinfo = require("gfx/vertexdefs.t").create_basic_vertex_type(attribs)
+  end
+  local gfx = require("gfx")
+  local ret = gfx.StaticGeometry(name or "soa_geo")
+  ret:allocate(tonumber(geo.n_verts), tonumber(geo.n_indices), vertinfo)
+  geo_copier(vertinfo.ttype, ret.index_type, false)(geo, ret.verts, ret.indices)
+  if options.commit ~= false then ret:commit() end
+  return ret
+end
+
+return m
@@ -0,0 +1,350 @@
+-- geometry/weld.t
+--
+-- native vertex welding: merges vertices whose positions are within an
+-- epsilon of each other, remaps the indices and drops the triangles that
+-- collapse, without creating any lua values per vertex
+--
+-- Vertices are binned into a spatial hash of epsilon sized cells, so a
+-- vertex only has to be compared against the 27 cells around it. Each
+-- vertex maps to the lowest numbered vertex within epsilon (or the lowest
+-- one that maps to, and so on), which makes the result independent of how
+-- the work is split up. Binning, matching, gathering and index remapping
+-- run in parallel chunks on the job system (see jobs.parallel).
+
+local c = require("native/clib.t")
+local jobs = require("native/jobs.t")
+local m = {}
+
+-- triangles per chunk when remapping indices
+m.TRIANGLE_CHUNK = 2^14
+
+local HASH_X = constant(uint32, 73856093)
+local HASH_Y = constant(uint32, 19349663)
+local HASH_Z = constant(uint32, 83492791)
+
+local struct Cell {
+  x: int32;
+  y: int32;
+  z: int32;
+  hash: uint32;
+}
+
+local struct Welder {
+  positions: &uint8; -- first vertex's position (3 floats)
+  stride: uint64;    -- bytes from one position to the next
+  n_verts: uint64;
+  inv_cell: float;   -- 1 / epsilon, or 0 to weld exact matches only
+  eps2: float;
+  cells: &Cell;
+  heads: &uint32;    -- hash slot -> first vertex in it
+  next: &uint32;     -- vertex -> next vertex in the same slot
+  table_mask: uint64;
+  remap: &uint32;    -- vertex -> welded vertex
+  unique: &uint32;   -- welded vertex -> source vertex
+  n_unique: uint64;
+}
+m.Welder = Welder
+
+local terra alloc_u32(n: uint64): &uint32
+  return [&uint32](c.std.malloc(sizeof(uint32) * n + 1))
+end
+
+terra Welder:init(positions: &uint8, stride: uint64, n_verts: uint64, epsilon: float)
+  c.str.memset(self, 0, sizeof(Welder))
+  self.positions = positions
+  self.stride = stride
+  self.n_verts = n_verts
+  if epsilon > 0.0f then
+    self.inv_cell = 1.0f / epsilon
+    self.eps2 = epsilon * epsilon
+  end
+  var table_size: uint64 = 16
+  while table_size < n_verts * 2 do table_size = table_size * 2 end
+  self.table_mask = table_size - 1
+  self.cells = [&Cell](c.std.malloc(sizeof(Cell) * n_verts + 1))
+  self.heads = alloc_u32(table_size)
+  c.str.memset(self.heads, 0xff, sizeof(uint32) * table_size)
+  self.next = alloc_u32(n_verts)
+  self.remap = alloc_u32(n_verts)
+  self.unique = alloc_u32(n_verts)
+end
+
+terra Welder:release()
+  c.std.free(self.cells)
+  c.std.free(self.heads)
+  c.std.free(self.next)
+  c.std.free(self.remap)
+  c.std.free(self.unique)
+  c.str.memset(self, 0, sizeof(Welder))
+end
+
+terra Welder:position(idx: uint64): &float
+  return [&float](self.positions + idx * self.stride)
+end
+
+local terra hash_cell(x: int32, y: int32, z: int32): uint32
+  -- (^ is xor here, but binds tighter than *)
+  var h = ([uint32](x) * HASH_X) ^ ([uint32](y) * HASH_Y) ^ ([uint32](z) * HASH_Z)
+  return h ^ (h >> 16)
+end
+
+local terra float_bits(v: float): int32
+  v = v + 0.0f -- -0 becomes +0
+  var bits: int32
+  c.str.memcpy(&bits, &v, 4)
+  return bits
+end
+
+local terra cell_coord(v: float, inv_cell: float): int32
+  var s = c.math.floorf(v * inv_cell)
+  if s < -2.0e9f then s = -2.0e9f end
+  if s > 2.0e9f then s = 2.0e9f end
+  return [int32](s)
+end
+
+local terra bin_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var w = [&Welder](userdata)
+  for i = range_begin, range_end do
+    var p = w:position(i)
+    var cell = &w.cells[i]
+    if w.inv_cell > 0.0f then
+      cell.x = cell_coord(p[0], w.inv_cell)
+      cell.y = cell_coord(p[1], w.inv_cell)
+      cell.z = cell_coord(p[2], w.inv_cell)
+    else -- exact: every distinct position is its own cell
+      cell.x, cell.y, cell.z = float_bits(p[0]), float_bits(p[1]), float_bits(p[2])
+    end
+    cell.hash = hash_cell(cell.x, cell.y, cell.z)
+  end
+end
+
+-- chains every slot's vertices in increasing order
+terra Welder:build_table()
+  var i = self.n_verts
+  while i > 0 do
+    i = i - 1
+    var slot = self.cells[i].hash and self.table_mask
+    self.next[i] = self.heads[slot]
+    self.heads[slot] = [uint32](i)
+  end
+end
+
+-- lowest vertex before best in cell (x, y, z) within epsilon of p
+terra Welder:search_cell(x: int32, y: int32, z: int32, p: &float, best: uint32): uint32
+  var j = self.heads[hash_cell(x, y, z) and self.table_mask]
+  while j < best do -- (empty is 0xffffffff, past any vertex)
+    var cell = &self.cells[j]
+    if cell.x == x and cell.y == y and cell.z == z then
+      var q = self:position(j)
+      var dx, dy, dz = q[0] - p[0], q[1] - p[1], q[2] - p[2]
+      if self.inv_cell == 0.0f or dx*dx + dy*dy + dz*dz <= self.eps2 then
+        return j
+      end
+    end
+    j = self.next[j]
+  end
+  return best
+end
+
+local terra match_kernel(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var w = [&Welder](userdata)
+  for i = range_begin, range_end do
+    var cell = w.cells[i]
+    var p = w:position(i)
+    var best = [uint32](i)
+    if w.inv_cell == 0.0f then
+      best = w:search_cell(cell.x, cell.y, cell.z, p, best)
+    else
+      for dx = -1, 2 do
+        for dy = -1, 2 do
+          for dz = -1, 2 do
+            best = w:search_cell(cell.x + dx, cell.y + dy, cell.z + dz, p, best)
+          end
+        end
+      end
+    end
+    w.remap[i] = best
+  end
+end
+
+-- every vertex maps to a lower (already resolved) one or itself
+terra Welder:resolve()
+  var count: uint32 = 0
+  for i = 0, self.n_verts do
+    var target = self.remap[i]
+    if target == i then
+      self.unique[count] = [uint32](i)
+      self.remap[i] = count
+      count = count + 1
+    else
+      self.remap[i] = self.remap[target]
+    end
+  end
+  self.n_unique = count
+end
+
+-- welds n_verts positions (3 floats, stride bytes apart); returns the
+-- Welder, whose remap and unique arrays give the result. Release it.
+function m.weld_positions(positions, n_verts, epsilon, stride)
+  local welder = terralib.new(Welder)
+  welder:init(terralib.cast(&uint8, positions), stride or 12, n_verts, epsilon or 0)
+  jobs.run_kernel(bin_kernel, welder, n_verts)
+  welder:build_table()
+  jobs.run_kernel(match_kernel, welder, n_verts)
+  welder:resolve()
+  return welder
+end
+
+------------------------------------------------------------------------------
+-- geometry
+------------------------------------------------------------------------------
+
+local struct GatherJob {
+  welder: &Welder;
+  src: &opaque;
+  dst: &opaque;
+}
+
+-- copies the surviving vertices: whole vertices if the types are the same,
+-- just positions otherwise
+local gather_kernel = terralib.memoize(function(SrcVert, DstVert)
+  return terra(userdata: &opaque, range_begin: uint64, range_end: uint64)
+    var job = [&GatherJob](userdata)
+    var src, dst = [&SrcVert](job.src), [&DstVert](job.dst)
+    for k = range_begin, range_end do
+      var i = job.welder.unique[k]
+      escape if SrcVert == DstVert then emit quote
+        dst[k] = src[i]
+      end else emit quote
+        for j = 0, 3 do dst[k].position[j] = src[i].position[j] end
+      end end end
+    end
+  end
+end)
+
+local struct TriangleJob {
+  welder: &Welder;
+  src: &opaque;
+  dst: &opaque;
+  n_tris: uint64;
+  chunk: uint64;
+  counts: &uint64;  -- per chunk: surviving triangles, then first output triangle
+  keep_degenerate: bool;
+}
+
+local triangle_kernels = terralib.memoize(function(SrcIndex, DstIndex)
+  -- remapped triangle t, and whether it survives
+  local remapped = macro(function(job, t, ia, ib, ic)
+    return quote
+      var src = [&SrcIndex](job.src)
+      var remap = job.welder.remap
+      ia = remap[src[t*3]]
+      ib = remap[src[t*3 + 1]]
+      ic = remap[src[t*3 + 2]]
+    in
+      job.keep_degenerate or (ia ~= ib and ib ~= ic and ia ~= ic)
+    end
+  end)
+
+  local terra count(userdata: &opaque, range_begin: uint64, range_end: uint64)
+    var job = [&TriangleJob](userdata)
+    var ia: uint32, ib: uint32, ic: uint32
+    for ci = range_begin, range_end do
+      var t_end = (ci + 1) * job.chunk
+      if t_end > job.n_tris then t_end = job.n_tris end
+      var n: uint64 = 0
+      for t = ci * job.chunk, t_end do
+        if remapped(job, t, ia, ib, ic) then n = n + 1 end
+      end
+      job.counts[ci] = n
+    end
+  end
+
+  local terra write(userdata: &opaque, range_begin: uint64, range_end: uint64)
+    var job = [&TriangleJob](userdata)
+    var dst = [&DstIndex](job.dst)
+    var ia: uint32, ib: uint32, ic: uint32
+    for ci = range_begin, range_end do
+      var t_end = (ci + 1) * job.chunk
+      if t_end > job.n_tris then t_end = job.n_tris end
+      var out = job.counts[ci] * 3
+      for t = ci * job.chunk, t_end do
+        if remapped(job, t, ia, ib, ic) then
+          dst[out] = [DstIndex](ia)
+          dst[out + 1] = [DstIndex](ib)
+          dst[out + 2] = [DstIndex](ic)
+          out = out + 3
+        end
+      end
+    end
+  end
+
+  return {count = count, write = write}
+end)
+
+-- welds an (allocated) geometry into a new one, whose vertices are the
+-- first of each welded group and whose indices drop collapsed triangles.
+-- options (all optional):
+--   epsilon: weld distance (default 0: exactly equal positions only)
+--   attributes: carry the other vertex attributes through (default true;
+--               if false the result only has positions)
+--   keep_degenerate: keep triangles that collapsed (default false)
+--   name: name of the new geometry
+--   commit: commit the new geometry (default true)
+-- returns the new geometry and stats {verts_in, verts_out, tris_in, tris_out}
+function m.weld_geo(geo, options)
+  options = options or {}
+  if not geo.allocated then truss.error("Cannot weld unallocated geometry") end
+  local t0 = truss.tic()
+  local src_type = geo.vertinfo.ttype
+  local welder = m.weld_positions(jobs.position_base(src_type)(geo.verts), geo.n_verts,
+                                  options.epsilon, sizeof(src_type))
+  local n_unique = tonumber(welder.n_unique)
+
+  local n_tris = math.floor(geo.n_indices / 3)
+  local n_chunks = math.max(1, math.ceil(n_tris / m.TRIANGLE_CHUNK))
+  local tri_job = terralib.new(TriangleJob)
+  tri_job.welder = welder
+  tri_job.src = geo.indices
+  tri_job.n_tris = n_tris
+  tri_job.chunk = m.TRIANGLE_CHUNK
+  local counts = terralib.new(uint64[n_chunks])
+  tri_job.counts = counts
+  tri_job.keep_degenerate = not not options.keep_degenerate
+  -- the destination index type depends on the welded vertex count, so
+  -- count with a placeholder destination first
+  jobs.run_kernel(triangle_kernels(geo.index_type, uint32).count, tri_job, n_chunks)
+  local tris_out = 0
+  for i = 0, n_chunks - 1 do
+    local n = tonumber(counts[i])
+    counts[i] = tris_out
+    tris_out = tris_out + n
+  end
+
+  local vertinfo = geo.vertinfo
+  if options.attributes == false then
+    vertinfo = require("gfx/vertexdefs.t").create_basic_vertex_type({"position"})
+  end
+  local gfx = require("gfx")
+  local ret = gfx.StaticGeometry(options.name or geo.name .. "_welded")
+  ret:allocate(n_unique, tris_out * 3, vertinfo)
+
+  local gather_job = terralib.new(GatherJob)
+  gather_job.welder = welder
+  gather_job.src = geo.verts
+  gather_job.dst = ret.verts
+  jobs.run_kernel(gather_kernel(src_type, vertinfo.ttype), gather_job, n_unique)
+  tri_job.dst = ret.indices
+  jobs.run_kernel(triangle_kernels(geo.index_type, ret.index_type).write, tri_job, n_chunks)
+  welder:release()
+
+  local stats = {verts_in = geo.n_verts, verts_out = n_unique,
+                 tris_in = n_tris, tris_out = tris_out}
+  log.info(("Welded %s: %d -> %d vertices, %d -> %d triangles in %.1f ms"):format(
+           geo.name, stats.verts_in, stats.verts_out, stats.tris_in,
+           stats.tris_out, truss.toc(t0) * 1000.0))
+  if options.commit ~= false then ret:commit() end
+  return ret, stats
+end
+
+return m
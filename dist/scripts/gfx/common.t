@@ -13,7 +13,7 @@ m._safe_wait_frames = 3
 m._bgfx_initted = false
 
 function m.load_file_to_bgfx(filename)
-  local msg = truss.C.load_file(filename)
+  local msg = truss.C.map_file(filename)
   if msg == nil then
     return nil
   end
@@ -276,6 +276,35 @@ function StaticGeometry:allocate(n_verts, n_indices, vertinfo)
 end
 DynamicGeometry.allocate = StaticGeometry.allocate
 
+-- bgfx calls this (possibly from its render thread) once it's done with
+-- memory that belongs to a message; releasing a message is thread safe
+local terra release_message_ref(ptr: &opaque, userdata: &opaque)
+  truss.C.release_message([&truss.C.Message](userdata))
+end
+
+-- uses vertex and index data that live inside a truss_message (e.g., a
+-- mapped file, see format/tgeo.t) instead of allocating; on commit bgfx
+-- gets references into the message rather than copies. The geometry keeps
+-- a reference to the message until it is deallocated. Mapped files are
+-- read-only, so don't write through verts/indices in that case.
+function StaticGeometry:from_message(msg, vertinfo, n_verts, n_indices,
+                                     index_type, vertex_offset, index_offset)
+  if self.allocated then truss.error("Geometry already allocated!") end
+  truss.C.acquire_message(msg)
+  self._message = msg
+  local base = terralib.cast(&uint8, msg.data)
+  self.vertinfo = vertinfo
+  self.index_type = index_type
+  self.verts = terralib.cast(&vertinfo.ttype, base + vertex_offset)
+  self.n_verts = n_verts
+  self.indices = terralib.cast(&index_type, base + index_offset)
+  self.n_indices = n_indices
+  self.vert_data_size = sizeof(vertinfo.ttype) * n_verts
+  self.index_data_size = sizeof(index_type) * n_indices
+  self.allocated = true
+  return self
+end
+
 function StaticGeometry:get_compute_vertex_view()
   if not self.allocated then
     truss.error("Cannot get compute view: geometry has not been allocated!")
@@ -314,6 +343,12 @@ function StaticGeometry:deallocate()
   self.verts, self.indices = nil, nil
   self.allocated = false
 
+  -- bgfx holds its own references to message data (see from_message)
+  if self._message then
+    truss.C.release_message(self._message)
+    self._message = nil
+  end
+
   -- edge case: after being committed, buffers can't be safely released
   -- until bgfx is done with them, which in multithreaded mode may be
   -- several frames later, so instead schedule the deletion by moving
@@ -416,16 +451,24 @@ function StaticGeometry:set_from_data(modeldata, strict)
 end
 DynamicGeometry.set_from_data = StaticGeometry.set_from_data
 
+function StaticGeometry:_mem_ref(data, datasize)
+  if self._message then
+    truss.C.acquire_message(self._message)
+    return bgfx.make_ref_release(data, datasize, release_message_ref, self._message)
+  end
+  return bgfx.make_ref(data, datasize)
+end
+
 function StaticGeometry:_create_bgfx_buffers(flags)
   if self.vert_data_size > 0 then
     self._vbh = bgfx.create_vertex_buffer(
-        bgfx.make_ref(self.verts, self.vert_data_size),
+        self:_mem_ref(self.verts, self.vert_data_size),
         self.vertinfo.vdecl, flags )
   end
 
   if self.index_data_size > 0 then
     self._ibh = bgfx.create_index_buffer(
-        bgfx.make_ref(self.indices, self.index_data_size), flags )
+        self:_mem_ref(self.indices, self.index_data_size), flags )
   end
 end
 
@@ -10,10 +10,7 @@ function m.release_image(imgdata)
   C.igBGFXUtilReleaseImage(imgdata)
 end
 
-function m.load_image_from_file(fn)
-  assert(build.is_native(), "cannot actually call image load functions in cross-compilation context!")
-  local data = truss.C.load_file(fn)
-  if data == nil then return nil end
+local function decode_image(data)
   local imdata = terralib.new(C.bgfx_util_imagedata)
   imdata.data = nil
   imdata.datasize = 0
@@ -25,4 +22,19 @@ function m.load_image_from_file(fn)
   return ret
 end
 
+function m.load_image_from_file(fn)
+  assert(build.is_native(), "cannot actually call image load functions in cross-compilation context!")
+  local data = truss.C.load_file(fn)
+  if data == nil then return nil end
+  return decode_image(data)
+end
+
+-- reads the file on the io thread pool (decoding still happens on this
+-- thread); returns a promise that resolves to the image data
+function m.load_image_from_file_async(fn, priority)
+  assert(build.is_native(), "cannot actually call image load functions in cross-compilation context!")
+  local fileio = require("async/fileio.t")
+  return fileio.load_file(fn, {priority = priority}):next(decode_image)
+end
+
 return m
\ No newline at end of file
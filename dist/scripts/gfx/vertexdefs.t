@@ -148,6 +148,29 @@ function m.create_basic_vertex_type(attrib_list, attrib_order)
   return m.create_vertex_type(attrib_table, attrib_order)
 end
 
+-- inverse of a vertex type's type_id (e.g., "p:3f_n:3f_c0:4u8n"), so a
+-- vertex layout can be stored as its name
+function m.vertex_type_from_id(type_id)
+  local attrib_table, attrib_order = {}, {}
+  for part in type_id:gmatch("[^_]+") do
+    local sn, count, typename, normalized = part:match("^(%w+):(%d+)(%a+%d*)(n?)$")
+    local attrib_name, ctype
+    for name, info in pairs(m.ATTRIBUTE_INFO) do
+      if info.sn == sn then attrib_name = name end
+    end
+    for t, tname in pairs(TYPENAMES) do
+      if tname == typename then ctype = t end
+    end
+    if not (attrib_name and ctype) then
+      truss.error("Invalid vertex type id: " .. type_id)
+    end
+    attrib_table[attrib_name] = {ctype = ctype, count = tonumber(count),
+                                 normalized = normalized == "n"}
+    table.insert(attrib_order, attrib_name)
+  end
+  return m.create_vertex_type(attrib_table, attrib_order)
+end
+
 function m.guess_vertex_type(data)
   local attributes = data.attributes or data
   local attrib_list = {}
@@ -307,6 +307,28 @@ description[[
 Set the material of this mesh. Can cause a recompilation.
 ]]
 
+classfunc 'set_lods'
+args{table 'chain'}
+description[[
+Draw a level of detail chain (see `geometry/simplify.t`) instead of a
+single geometry: every draw picks the first level whose `min_size` the
+mesh's projected size (see `projected_size`) reaches. Pass `nil` to go
+back to the full detail geometry. Setting a geometry also clears the
+chain.
+]]
+example[[
+local simplify = require("geometry/simplify.t")
+mesh.mesh:set_lods(simplify.load_lods("models/part.stl", {weld_epsilon = 1e-5}))
+]]
+
+classfunc 'projected_size'
+args{object['gfx.View'] 'view', object['math.Matrix4'] 'transform'}
+returns{number 'size'}
+description[[
+The fraction of the view's height covered by the bounding sphere of the
+mesh's LOD chain, when drawn with the given world transform.
+]]
+
 classdef 'DummyMeshComponent'
 description[[
 Like a `MeshComponent`, but does not actually draw. This is mainly
@@ -0,0 +1,67 @@
+-- graphics/_test_graphics.t
+--
+-- tests for renderer-side logic that doesn't need a gpu
+
+local m = {}
+
+function m.run(test)
+  test("LOD selection", m.test_lod_selection)
+end
+
+local function approx(a, b)
+  return math.abs(a - b) < 1e-4 * math.max(1, math.abs(b))
+end
+
+function m.test_lod_selection(t)
+  local math3d = require("math")
+  local MeshComponent = require("graphics/renderer.t").MeshComponent
+
+  -- just the state set_lods leaves behind, so no geometry is needed
+  local mesh = setmetatable({
+    _lod_center = {0, 0, 0},
+    _lod_radius = 1,
+    _lods = {{drawcall = "full", min_size = 0.3},
+             {drawcall = "half", min_size = 0.1},
+             {drawcall = "low", min_size = 0}}
+  }, {__index = MeshComponent})
+
+  local function at(z, scale)
+    local tf = math3d.Matrix4():translation(math3d.Vector(0, 0, z))
+    for i = 0, 2 do tf.data[i*5] = scale or 1 end
+    return tf
+  end
+
+  -- camera at the origin looking down -z, 90 degree vertical fov
+  local view = {_viewmat = math3d.Matrix4():identity(),
+                _projmat = math3d.Matrix4():perspective_projection(90, 1, 0.1, 100)}
+  t.ok(approx(mesh:projected_size(view, at(-2)), 0.5), "perspective: near")
+  t.ok(approx(mesh:projected_size(view, at(-5)), 0.2), "perspective: mid")
+  t.ok(approx(mesh:projected_size(view, at(-20)), 0.05), "perspective: far")
+  t.ok(approx(mesh:projected_size(view, at(-20, 4)), 0.2), "perspective: scaled")
+  t.expect(mesh:projected_size(view, at(-0.5)), math.huge, "perspective: inside")
+  t.expect(mesh:lod_drawcall(view, at(-2)), "full", "perspective: near level")
+  t.expect(mesh.lod_level, 1, "lod_level")
+  t.expect(mesh:lod_drawcall(view, at(-5)), "half", "perspective: mid level")
+  t.expect(mesh:lod_drawcall(view, at(-20)), "low", "perspective: far level")
+  t.expect(mesh.lod_level, 3, "lod_level")
+  t.expect(mesh:lod_drawcall(view, at(-20, 4)), "half", "perspective: scaled level")
+
+  -- moving the camera back is the same as moving the mesh away
+  view._viewmat:translation(math3d.Vector(0, 0, -5))
+  t.expect(mesh:lod_drawcall(view, at(0)), "half", "perspective: moved camera")
+
+  -- orthographic: size doesn't depend on distance
+  local ortho = {_viewmat = math3d.Matrix4():identity(),
+                 _projmat = math3d.Matrix4():orthographic_projection(-5, 5, -5, 5, 0.1, 100)}
+  t.ok(approx(mesh:projected_size(ortho, at(-2)), 0.2), "orthographic: near")
+  t.ok(approx(mesh:projected_size(ortho, at(-50)), 0.2), "orthographic: far")
+  t.ok(approx(mesh:projected_size(ortho, at(-50, 2)), 0.4), "orthographic: scaled")
+  t.expect(mesh:lod_drawcall(ortho, at(-50)), "half", "orthographic level")
+  t.expect(mesh:lod_drawcall(ortho, at(-50, 2)), "full", "orthographic: scaled level")
+
+  mesh._lods = nil
+  mesh.drawcall = "plain"
+  t.expect(mesh:lod_drawcall(view, at(-2)), "plain", "no chain: the plain drawcall")
+end
+
+return m
@@ -152,15 +152,82 @@ end
 
 function MeshComponent:set_geometry(geo)
   if not geo then truss.error("No geo provided to set_geometry!") end
+  if self._lods then
+    self.drawcall = self._lods[1].drawcall
+    self._lods = nil
+  end
   self.drawcall:set_geometry(geo)
 end
 
 function MeshComponent:set_material(mat)
   if not mat then truss.error("No mat provided to set_material!") end
-  self.drawcall:set_material(mat)
+  for _, lod in ipairs(self._lods or {self}) do
+    lod.drawcall:set_material(mat)
+  end
   self.tags:extend(mat.tags or {})
 end
 
+-- draws one of a chain of geometries (see geometry/simplify.t) depending
+-- on how large the mesh is on screen: each draw uses the first level
+-- whose min_size the projected size reaches. chain is {center = {x, y, z},
+-- radius, levels = {{geo, min_size}, ...}}, full detail first; nil
+-- goes back to always drawing the full detail geometry.
+function MeshComponent:set_lods(chain)
+  if self._lods then self.drawcall = self._lods[1].drawcall end
+  self._lods = nil
+  if not chain then return end
+  self.drawcall:set_geometry(chain.levels[1].geo)
+  local lods = {}
+  for i, level in ipairs(chain.levels) do
+    local drawcall = self.drawcall
+    if i > 1 then
+      drawcall = self.drawcall:clone()
+      drawcall:set_geometry(level.geo)
+    end
+    lods[i] = {drawcall = drawcall, min_size = level.min_size or 0}
+  end
+  self._lods = lods
+  self._lod_center = chain.center
+  self._lod_radius = chain.radius
+  self.lod_level = 1
+end
+
+-- fraction of the view's height covered by the mesh's bounding sphere
+-- when drawn with world transform tf
+function MeshComponent:projected_size(view, tf)
+  local t = tf.data
+  local cx, cy, cz = unpack(self._lod_center)
+  local wx = t[0]*cx + t[4]*cy + t[8]*cz + t[12]
+  local wy = t[1]*cx + t[5]*cy + t[9]*cz + t[13]
+  local wz = t[2]*cx + t[6]*cy + t[10]*cz + t[14]
+  local scale2 = math.max(t[0]*t[0] + t[1]*t[1] + t[2]*t[2],
+                          t[4]*t[4] + t[5]*t[5] + t[6]*t[6],
+                          t[8]*t[8] + t[9]*t[9] + t[10]*t[10])
+  local radius = self._lod_radius * math.sqrt(scale2)
+  local p = view._projmat.data
+  if p[11] == 0 then return radius * p[5] end -- orthographic
+  local v = view._viewmat.data
+  local depth = math.abs(v[2]*wx + v[6]*wy + v[10]*wz + v[14])
+  if depth <= radius then return math.huge end
+  return radius * math.abs(p[5]) / depth
+end
+
+-- the drawcall to use for view, picking a level if there's a LOD chain
+function MeshComponent:lod_drawcall(view, tf)
+  local lods = self._lods
+  if not lods then return self.drawcall end
+  local size = self:projected_size(view, tf)
+  local level = #lods
+  for i = 1, #lods - 1 do
+    if size >= lods[i].min_size then
+      level = i
+      break
+    end
+  end
+  self.lod_level = level
+  return lods[level].drawcall
+end
+
 local DummyMeshComponent = ecs.Component:extend("DummyMeshComponent")
 function DummyMeshComponent:init(geo, mat)
   self.geo, self.mat = geo, mat
@@ -33,7 +33,9 @@ end
 
 function DrawOp:bind_to(stage)
   return function(renderable, tf)
-    renderable.drawcall:submit(stage.view._viewid, stage.globals, tf)
+    local drawcall = renderable.drawcall
+    if renderable._lods then drawcall = renderable:lod_drawcall(stage.view, tf) end
+    drawcall:submit(stage.view._viewid, stage.globals, tf)
   end
 end
 
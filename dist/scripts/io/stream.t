@@ -0,0 +1,86 @@
+-- io/stream.t
+--
+-- chunked file streams (over physfs paths, or real paths with raw = true)
+
+local class = require("class")
+local m = {}
+
+local C = truss.C
+
+local FileStream = class("FileStream")
+m.FileStream = FileStream
+
+-- mode is one of "r", "w", "a"
+function FileStream:init(filename, mode, raw)
+  local modes = {r = C.STREAM_READ, w = C.STREAM_WRITE, a = C.STREAM_APPEND}
+  local cmode = modes[mode or "r"]
+  if not cmode then truss.error("Invalid stream mode: " .. tostring(mode)) end
+  if raw then cmode = cmode + C.STREAM_RAW end
+  self.filename = filename
+  self._handle = C.stream_open(filename, cmode)
+  if self._handle == nil then
+    truss.error("Unable to open stream [" .. filename .. "]")
+  end
+end
+
+function FileStream:is_open()
+  return self._handle ~= nil
+end
+
+-- read up to size bytes into dest; returns the number of bytes read
+function FileStream:read(dest, size)
+  return tonumber(C.stream_read(self._handle, dest, size))
+end
+
+function FileStream:write(src, size)
+  if type(src) == "string" then
+    size = size or #src
+    src = terralib.cast(&int8, src)
+  end
+  local written = tonumber(C.stream_write(self._handle, src, size))
+  if written ~= size then
+    truss.error("Error writing to stream [" .. self.filename .. "]")
+  end
+  return written
+end
+
+function FileStream:seek(pos)
+  return C.stream_seek(self._handle, pos) ~= 0
+end
+
+function FileStream:tell()
+  return tonumber(C.stream_tell(self._handle))
+end
+
+function FileStream:length()
+  return tonumber(C.stream_length(self._handle))
+end
+
+function FileStream:eof()
+  return C.stream_eof(self._handle) ~= 0
+end
+
+function FileStream:close()
+  if self._handle ~= nil then
+    C.stream_close(self._handle)
+    self._handle = nil
+  end
+end
+
+-- iterate over a stream in chunks: for buff, nbytes in stream:chunks(2^20)
+-- (the same buffer is reused for every chunk)
+function FileStream:chunks(chunksize, buffer)
+  chunksize = chunksize or 2^20
+  buffer = buffer or terralib.new(uint8[chunksize])
+  return function()
+    local nread = self:read(buffer, chunksize)
+    if nread <= 0 then return nil end
+    return buffer, nread
+  end
+end
+
+function m.open(filename, mode, raw)
+  return FileStream(filename, mode, raw)
+end
+
+return m
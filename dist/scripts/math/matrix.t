@@ -7,6 +7,7 @@ local CMath = require("math/cmath.t")
 local class = require("class")
 local projections = require("math/projections.t")
 local mathtypes = require("math/types.t")
+local build = require("core/build.t")
 
 local scalar_ = mathtypes.scalar_
 local vec4_ = mathtypes.vec4_
@@ -261,6 +262,15 @@ terra m.copy_matrix(dest: &scalar_, src: &scalar_)
   end
 end
 
+-- precompiled if an AOT library has been built (see core/build.t)
+build.aot_module("math", m, {
+  "set_identity_matrix", "set_zero_matrix", "quaternion_to_matrix",
+  "scale_matrix", "get_matrix_scale", "remove_matrix_scale",
+  "set_matrix_position", "multiply_matrices", "multiply_matrix_vector",
+  "multiply_matrix_scalar", "transpose_matrix", "invert_matrix",
+  "matrix_to_quaternion", "copy_matrix"
+})
+
 local Matrix4 = class("Matrix4")
 
 function Matrix4:init()
@@ -0,0 +1,104 @@
+-- native/_test_jobs.t
+--
+-- tests for the native job system
+
+local m = {}
+
+function m.run(test)
+  test("jobs parallel_for", m.test_parallel_for)
+  test("jobs submit and wait", m.test_submit)
+  test("jobs run_kernel", m.test_run_kernel)
+  test("jobs restart", m.test_restart)
+end
+
+local N = 100000
+
+terra fill_squares(userdata: &opaque, range_begin: uint64, range_end: uint64)
+  var dest = [&uint64](userdata)
+  for i = range_begin, range_end do
+    dest[i] = i * i
+  end
+end
+
+local function check_squares(dest)
+  for i = 0, N - 1 do
+    if dest[i] ~= i * i then return false end
+  end
+  return true
+end
+
+function m.test_parallel_for(t)
+  local jobs = require("native/jobs.t")
+  local dest = terralib.new(uint64[N])
+
+  jobs.parallel_for(fill_squares, dest, 0, N)
+  t.ok(check_squares(dest), "blocking parallel_for covered the range")
+
+  for i = 0, N - 1 do dest[i] = 0 end
+  local counter = jobs.Counter()
+  jobs.parallel_for(fill_squares, dest, 0, N, 7, counter)
+  counter:wait()
+  t.expect(counter:pending(), 0, "counter drained")
+  t.ok(check_squares(dest), "small grain parallel_for covered the range")
+end
+
+terra mark_done(userdata: &opaque)
+  @[&uint8](userdata) = @[&uint8](userdata) + 1
+end
+
+function m.test_submit(t)
+  local jobs = require("native/jobs.t")
+  local NJOBS = 1000
+  local done = terralib.new(uint8[NJOBS])
+  local counter = jobs.Counter()
+  for i = 0, NJOBS - 1 do
+    jobs.submit(mark_done, done + i, counter)
+  end
+  counter:wait()
+  local ran_once = 0
+  for i = 0, NJOBS - 1 do
+    if done[i] == 1 then ran_once = ran_once + 1 end
+  end
+  t.expect(ran_once, NJOBS, "every job ran exactly once")
+end
+
+function m.test_run_kernel(t)
+  local jobs = require("native/jobs.t")
+  local dest = terralib.new(uint64[N])
+  jobs.run_kernel(fill_squares, dest, N)
+  t.ok(check_squares(dest), "parallel run covered the range")
+
+  for i = 0, N - 1 do dest[i] = 0 end
+  jobs.parallel = false
+  jobs.run_kernel(fill_squares, dest, N, 64)
+  jobs.parallel = true
+  t.ok(check_squares(dest), "serial run covered the range")
+end
+
+function m.test_restart(t)
+  local jobs = require("native/jobs.t")
+  local nthreads = jobs.num_threads()
+  local NJOBS = 10000
+  local done = terralib.new(uint8[NJOBS])
+  local counter = jobs.Counter()
+  for i = 0, NJOBS - 1 do
+    jobs.submit(mark_done, done + i, counter)
+  end
+  -- jobs still queued when the old workers stop run during the restart
+  jobs.set_threads(2)
+  t.expect(counter:pending(), 0, "queued jobs finished by the restart")
+  t.expect(jobs.num_threads(), 2, "new thread count")
+  local ran_once = 0
+  for i = 0, NJOBS - 1 do
+    if done[i] == 1 then ran_once = ran_once + 1 end
+  end
+  t.expect(ran_once, NJOBS, "every job ran exactly once")
+
+  local dest = terralib.new(uint64[N])
+  jobs.parallel_for(fill_squares, dest, 0, N)
+  t.ok(check_squares(dest), "parallel_for after the restart")
+  jobs.set_threads(nthreads)
+  t.expect(jobs.num_threads(), nthreads, "thread count restored")
+end
+
+return m
@@ -0,0 +1,83 @@
+-- native/jobs.t
+--
+-- data-parallel terra on the core work-stealing job system; job functions
+-- run on native worker threads, so they must not call back into lua
+
+local class = require("class")
+local m = {}
+
+local C = truss.C
+
+-- thread count (0 or nil = one per core, minus the calling thread)
+function m.set_threads(n)
+  C.set_job_threads(n or 0)
+end
+
+function m.num_threads()
+  return C.get_job_threads()
+end
+
+local function fnptr(f, ptrtype)
+  if terralib.isfunction(f) then f = f:getpointer() end
+  return terralib.cast(ptrtype, f)
+end
+
+local Counter = class("Counter")
+m.Counter = Counter
+
+function Counter:init()
+  -- destroying a counter waits for its jobs
+  self._counter = ffi.gc(C.create_job_counter(), C.destroy_job_counter)
+end
+
+function Counter:pending()
+  return tonumber(C.job_counter_pending(self._counter))
+end
+
+-- runs other jobs on this thread until the counter drops to zero
+function Counter:wait()
+  C.job_wait(self._counter)
+end
+
+local function raw_counter(counter)
+  if counter then return counter._counter end
+  return nil
+end
+
+-- f: terra(userdata: &opaque) (or a function pointer)
+function m.submit(f, userdata, counter)
+  C.submit_job(fnptr(f, C.job_fn), userdata, raw_counter(counter))
+end
+
+-- f: terra(userdata: &opaque, range_begin: uint64, range_end: uint64) is
+-- called on pieces of [range_begin, range_end) of at most grain items
+-- (nil/0: picked automatically). Blocks until done unless given a counter.
+function m.parallel_for(f, userdata, range_begin, range_end, grain, counter)
+  C.parallel_for(fnptr(f, C.range_fn), userdata, range_begin, range_end,
+                 grain or 0, raw_counter(counter))
+end
+
+-- if false, run_kernel runs everything on the calling thread (to debug, or
+-- to compare against, the parallel path)
+m.parallel = true
+
+-- runs a parallel_for kernel over [0, count) and waits for it; a single
+-- item (or m.parallel = false) is just called directly
+function m.run_kernel(f, userdata, count, grain)
+  userdata = terralib.cast(&opaque, userdata)
+  if m.parallel and count > 1 then
+    m.parallel_for(f, userdata, 0, count, grain)
+  else
+    f(userdata, 0, count)
+  end
+end
+
+-- terra(verts: &VertType): &uint8, the address of the first vertex's
+-- position, for kernels that step through positions with a vertex stride
+m.position_base = terralib.memoize(function(VertType)
+  return terra(verts: &VertType): &uint8
+    return [&uint8](&verts[0].position[0])
+  end
+end)
+
+return m
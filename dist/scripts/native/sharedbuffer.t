@@ -0,0 +1,117 @@
+-- native/sharedbuffer.t
+--
+-- typed views of shared buffers: large, aligned, refcounted allocations
+-- that interpreters hand to each other without copying (see
+-- truss_create_shared_buffer in truss_api.h)
+--
+-- e.g., a worker fills a vertex buffer and transfers it:
+--   local buf = terralib.new(SharedBuffer(Vertex))
+--   buf:create(nverts, 0) ... buf:transfer(render_id)
+-- and the render interpreter adopts the fetched message and uploads it
+-- in place:
+--   buf:view(msg); bgfx.create_vertex_buffer(buf:bgfx_ref(), ...)
+
+local bgfx = require("gfx/bgfx.t")
+local C = truss.C
+
+-- bgfx calls this (possibly from its render thread) once it's done with
+-- the memory; releasing a message is safe from any thread
+local terra bgfx_release(ptr: &opaque, userdata: &opaque)
+  C.release_message([&C.Message](userdata))
+end
+
+local MAX_BGFX_SIZE = constant(uint64, 2^32 - 1)
+
+local SharedBuffer = terralib.memoize(function(T)
+  local struct _SharedBuffer {
+    message: &C.Message;
+    data: &T;
+    count: uint64;
+  }
+
+  terra _SharedBuffer:init()
+    self.message = nil
+    self.data = nil
+    self.count = 0
+  end
+
+  -- takes over a reference the caller already holds
+  terra _SharedBuffer:adopt(msg: &C.Message)
+    self:release()
+    self.message = msg
+    self.data = [&T](msg.data)
+    self.count = msg.data_length / sizeof(T)
+  end
+
+  -- allocates count elements aligned to alignment bytes (0: 64)
+  terra _SharedBuffer:create(count: uint64, alignment: uint64): bool
+    var msg = C.create_shared_buffer(count * sizeof(T), alignment)
+    if msg == nil then return false end
+    self:adopt(msg)
+    return true
+  end
+
+  -- views a buffer someone else holds (e.g., a fetched message), adding a
+  -- reference so it outlives the fetch
+  terra _SharedBuffer:view(msg: &C.Message)
+    C.acquire_message(msg)
+    self:adopt(msg)
+  end
+
+  terra _SharedBuffer:release()
+    if self.message ~= nil then
+      C.release_message(self.message)
+    end
+    self:init()
+  end
+
+  terra _SharedBuffer:is_valid(): bool
+    return self.message ~= nil
+  end
+
+  -- writable only while nobody else can see it
+  terra _SharedBuffer:is_exclusive(): bool
+    return self.message ~= nil and C.is_message_exclusive(self.message) ~= 0
+  end
+
+  terra _SharedBuffer:as_bytes(): &uint8
+    return [&uint8](self.data)
+  end
+
+  terra _SharedBuffer:datasize(): uint64
+    return self.count * sizeof(T)
+  end
+
+  -- read-only sharing: freezes the buffer and sends dest a reference;
+  -- this view stays valid
+  terra _SharedBuffer:share(dest: int32)
+    C.freeze_message(self.message)
+    C.send_message(dest, self.message)
+  end
+
+  -- ownership transfer: dest receives this view's reference, and the view
+  -- is cleared; on failure (no such interpreter, or the buffer was
+  -- shared and so is frozen) the view is kept
+  terra _SharedBuffer:transfer(dest: int32): bool
+    if self.message == nil then return false end
+    if C.transfer_message(dest, self.message) ~= 0 then return false end
+    self:init()
+    return true
+  end
+
+  -- zero-copy bgfx memory; holds a reference until bgfx releases it. bgfx
+  -- sizes are 32 bit, so larger buffers log an error and return nil.
+  terra _SharedBuffer:bgfx_ref(): &bgfx.memory_t
+    var size = self:datasize()
+    if size > MAX_BGFX_SIZE then
+      C.log(C.LOG_ERROR, "SharedBuffer:bgfx_ref: buffer is over 4 GB")
+      return nil
+    end
+    C.acquire_message(self.message)
+    return bgfx.make_ref_release(self.data, [uint32](size), bgfx_release, self.message)
+  end
+
+  return _SharedBuffer
+end)
+
+return {SharedBuffer = SharedBuffer, SharedByteBuffer = SharedBuffer(uint8)}
@@ -9,6 +9,7 @@ local vec4 = require("math/types.t").vec4_
 local clib = require("native/clib.t")
 local cmath = clib.math
 local cio = clib.io
+local build = require("core/build.t")
 
 local struct index_list {
   n_indices: uint8;
@@ -730,4 +731,9 @@ function m.mc_data_from_terra(target, f, limits)
   map_terra_func(target.dsize, target.cubedata, f:getpointer())
 end
 
+-- precompiled if an AOT library has been built (see core/build.t)
+m._map_terra_func = map_terra_func
+build.aot_module("procgen", m, {"_cubify", "_add_data", "_map_terra_func"})
+map_terra_func = m._map_terra_func
+
 return m
\ No newline at end of file
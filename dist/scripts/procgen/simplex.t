@@ -39,6 +39,7 @@ local math = require("math")
 local scalar_type = double
 
 local cmath = require("math/cmath.t")
+local build = require("core/build.t")
 local cmax, cmin, cfloor
 if scalar_type == double then
   cmax, cmin, cfloor = cmath.fmax, cmath.fmin, cmath.floor
@@ -615,4 +616,9 @@ function m.simplex_4d(x, y, z, w)
   return m.simplex_4d_raw(x, y, z, w, m.noisetable_c)
 end
 
+-- precompiled if an AOT library has been built (see core/build.t)
+build.aot_module("procgen", m, {
+  "simplex_2d_raw", "simplex_3d_raw", "simplex_3d_raw_alt", "simplex_4d_raw"
+})
+
 return m
@@ -3,6 +3,7 @@
 #include "truss.h"
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
 
 #if defined(WIN32)
 // On Windows, manually construct an RPATH to the `./lib` subdirectory.
@@ -37,7 +38,77 @@ void storeArgs(int argc, char** argv) {
 	}
 }
 
+// number of worker interpreters to boot in the background (--interpreter-pool N)
+int interpreterPoolSize(int argc, char** argv) {
+	for (int i = 1; i + 1 < argc; ++i) {
+		if (std::string(argv[i]) == "--interpreter-pool") {
+			return std::atoi(argv[i + 1]);
+		}
+	}
+	return 0;
+}
+
+// --binary-log: write trusslog.bin (see logger.h) instead of trusslog.txt
+bool binaryLog(int argc, char** argv) {
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--binary-log") {
+			return true;
+		}
+	}
+	return false;
+}
+
+// --log-level N: discard messages above level N (default: everything)
+int logLevel(int argc, char** argv) {
+	for (int i = 1; i + 1 < argc; ++i) {
+		if (std::string(argv[i]) == "--log-level") {
+			return std::atoi(argv[i + 1]);
+		}
+	}
+	return TRUSS_LOG_DEBUG;
+}
+
+// --profile-startup[=file]: trace startup (up to the end of the main
+// interpreter's first frame, or a whole batch run) and save it as Chrome
+// trace JSON; returns "" if not profiling
+std::string profileStartupPath(int argc, char** argv) {
+	const std::string flag = "--profile-startup";
+	for (int i = 1; i < argc; ++i) {
+		std::string arg(argv[i]);
+		if (arg == flag) {
+			return "startup_trace.json";
+		}
+		if (arg.compare(0, flag.size() + 1, flag + "=") == 0) {
+			return arg.substr(flag.size() + 1);
+		}
+	}
+	return "";
+}
+
+// stops tracing, so a long session doesn't keep recording, and saves
+void saveStartupTrace(const std::string& path) {
+	truss::Tracer& tracer = truss::Tracer::instance();
+	tracer.setEnabled(false);
+	if (!tracer.save(path.c_str())) {
+		std::cout << "Unable to write startup profile to " << path << std::endl;
+		return;
+	}
+	std::cout << "Wrote startup profile to " << path;
+	if (tracer.getDropped() > 0) {
+		std::cout << " (truncated: " << tracer.getDropped() << " spans past the limit were dropped)";
+	}
+	std::cout << std::endl;
+}
+
 int main(int argc, char** argv) {
+	std::string tracePath = profileStartupPath(argc, argv);
+	if (!tracePath.empty()) {
+		truss::Tracer::instance().setEnabled(true);
+		truss::Tracer::instance().setThreadName("main");
+	}
+	bool binary = binaryLog(argc, argv);
+	truss::core().logger().open(binary ? "trusslog.bin" : "trusslog.txt", binary);
+	truss::core().logger().setLevel(logLevel(argc, argv));
 	truss_test();
 	truss_log(0, "Entered main!");
 	storeArgs(argc, argv);
@@ -49,17 +120,38 @@ int main(int argc, char** argv) {
 	setupRPath();									// set windows RPATH if necessary
 
 	truss::core().setWriteDir("");              	// write into basedir/
+	truss::core().interpreterPool().setTargetSize(interpreterPoolSize(argc, argv));
 
-	truss::Interpreter* interpreter = truss::core().spawnInterpreter();
-	interpreter->setDebug(0); // want most verbose debugging output
-	truss_log(0, "Starting interpreter!");
-	// start this interpreter without threading so we can manually call it in a loop
-	interpreter->start("scripts/main.t", false);
-	while (interpreter->getState() == THREAD_IDLE) {
-		interpreter->step();
+	truss::BatchOptions batchOptions;
+	int batchResult = 0;
+	if (truss::parseBatchOptions(argc, argv, batchOptions)) {
+		// --batch script.t [--jobs N] inputs...: no main interpreter
+		batchResult = truss::runBatch(batchOptions);
+		if (!tracePath.empty()) {
+			saveStartupTrace(tracePath);
+		}
+	} else {
+		truss::Interpreter* interpreter = truss::core().spawnInterpreter();
+		interpreter->setDebug(0); // want most verbose debugging output
+		truss_log(0, "Starting interpreter!");
+		// start this interpreter without threading so we can manually call it in a loop
+		interpreter->start("scripts/main.t", false);
+		while (interpreter->getState() == THREAD_IDLE) {
+			interpreter->step();
+			if (!tracePath.empty()) {
+				saveStartupTrace(tracePath);
+				tracePath.clear();
+			}
+		}
+		if (!tracePath.empty()) {
+			saveStartupTrace(tracePath); // quit during startup
+		}
 	}
 
 	int retval = truss::core().getError();
+	if (retval == 0) {
+		retval = batchResult;
+	}
 	if (retval != 0) {
 		std::cout << "Quit with error code: " << retval << std::endl;
 	}
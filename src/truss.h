@@ -3,8 +3,11 @@
 #ifndef TRUSS_H_
 #define TRUSS_H_
 
+#include "truss/batch.h"
 #include "truss/core.h"
 #include "truss/interpreter.h"
+#include "truss/logger.h"
+#include "truss/tracer.h"
 
 #include "trussapi.h"
 
@@ -0,0 +1,193 @@
+#include "batch.h"
+#include "core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+using namespace truss;
+
+namespace {
+
+const char* JOBS_CHANNEL = "batch/jobs";
+const char* RESULTS_CHANNEL = "batch/results";
+const char* SCRIPT_KEY = "batch/script";
+const char* WORKER_SCRIPT = "scripts/core/batchworker.t";
+
+// status of a job whose worker died before reporting it
+const int JOB_LOST = -2;
+
+struct JobResult {
+    bool done;
+    int status;
+    double ms;
+    std::string error;
+};
+
+double elapsedMs(std::chrono::steady_clock::time_point t0) {
+    std::chrono::duration<double, std::milli> dt = std::chrono::steady_clock::now() - t0;
+    return dt.count();
+}
+
+// flags that take values, so their values aren't mistaken for inputs
+int flagValueCount(const std::string& arg) {
+    if (arg == "--addpath") {
+        return 2;
+    }
+    if (arg == "--batch" || arg == "--jobs" || arg == "--interpreter-pool" ||
+        arg == "--log-level") {
+        return 1;
+    }
+    return 0;
+}
+
+// results read "index\tstatus\tms\terror"
+bool parseResult(truss_message* msg, std::vector<JobResult>& results) {
+    std::string text(reinterpret_cast<const char*>(msg->data), msg->data_length);
+    std::istringstream in(text);
+    size_t index;
+    JobResult result;
+    char tab;
+    if (!(in >> index >> result.status >> result.ms) || index >= results.size()) {
+        return false;
+    }
+    in.get(tab);
+    std::getline(in, result.error, '\0');
+    result.done = true;
+    results[index] = result;
+    return true;
+}
+
+bool isRunning(Interpreter* interpreter) {
+    truss_interpreter_state state = interpreter->getState();
+    return state == THREAD_IDLE || state == THREAD_RUNNING;
+}
+
+} // namespace
+
+bool truss::parseBatchOptions(int argc, char** argv, BatchOptions& options) {
+    bool batch = false;
+    options.jobs = static_cast<int>(std::thread::hardware_concurrency());
+    options.inputs.clear();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        int nvalues = flagValueCount(arg);
+        if (i + nvalues >= argc) {
+            break;
+        }
+        if (arg == "--batch") {
+            batch = true;
+            options.script = argv[i + 1];
+        } else if (arg == "--jobs") {
+            options.jobs = std::atoi(argv[i + 1]);
+        } else if (batch && nvalues == 0 && arg.compare(0, 2, "--") != 0) {
+            options.inputs.push_back(arg);
+        }
+        i += nvalues;
+    }
+    options.jobs = std::max(options.jobs, 1);
+    return batch;
+}
+
+int truss::runBatch(const BatchOptions& options) {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    size_t njobs = options.inputs.size();
+    int nworkers = static_cast<int>(std::min<size_t>(options.jobs, std::max<size_t>(njobs, 1)));
+
+    // workers are spawned with the worker script as their argument, so they
+    // find the batch script in the datastore instead
+    core().setStoreValue(SCRIPT_KEY, options.script);
+
+    // queue every job up front; workers quit once the closed channel is empty
+    uint32_t capacity = static_cast<uint32_t>(std::max<size_t>(njobs, 1));
+    Channel* jobs = core().channels().open(JOBS_CHANNEL, capacity, TRUSS_CHANNEL_BLOCK);
+    Channel* resultChannel = core().channels().open(RESULTS_CHANNEL, capacity, TRUSS_CHANNEL_BLOCK);
+    for (size_t i = 0; i < njobs; ++i) {
+        std::string text = std::to_string(i) + "\t" + options.inputs[i];
+        truss_message* msg = core().allocateMessage(text.size());
+        msg->message_type = TRUSS_MESSAGE_CSTR;
+        std::memcpy(msg->data, text.data(), text.size());
+        jobs->push(msg, 0);
+        core().releaseMessage(msg);
+    }
+    jobs->close();
+
+    // boot every worker in parallel before starting any of them
+    InterpreterPool& pool = core().interpreterPool();
+    pool.setTargetSize(nworkers);
+    truss_interpreter_pool_stats poolStats;
+    do {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        pool.getStats(&poolStats);
+    } while (poolStats.ready < nworkers && poolStats.booting > 0);
+
+    std::vector<Interpreter*> workers;
+    for (int i = 0; i < nworkers; ++i) {
+        Interpreter* worker = pool.spawn(0, WORKER_SCRIPT);
+        if (worker != NULL) {
+            workers.push_back(worker);
+        }
+    }
+    pool.setTargetSize(0);
+    double startupMs = elapsedMs(t0);
+    std::cout << "Batch: " << njobs << " jobs of " << options.script << " on "
+              << workers.size() << " workers (startup " << static_cast<int>(startupMs)
+              << " ms)" << std::endl;
+
+    // each worker step runs one job; keep idle workers stepping until every
+    // job has reported or no worker is left to report it
+    std::vector<JobResult> results(njobs, JobResult{false, JOB_LOST, 0.0, "worker stopped"});
+    std::vector<truss_message*> batch(64);
+    size_t nreported = 0;
+    while (nreported < njobs) {
+        bool anyRunning = false;
+        for (Interpreter* worker : workers) {
+            if (isRunning(worker)) {
+                anyRunning = true;
+                worker->step();
+            }
+        }
+        int n = resultChannel->popBatch(batch.data(), static_cast<int>(batch.size()),
+                                        anyRunning ? 20 : 0);
+        for (int i = 0; i < n; ++i) {
+            if (parseResult(batch[i], results)) {
+                ++nreported;
+            }
+            core().releaseMessage(batch[i]);
+        }
+        if (!anyRunning && n == 0) {
+            break;
+        }
+    }
+    for (Interpreter* worker : workers) {
+        worker->stop();
+    }
+    double totalMs = elapsedMs(t0);
+
+    size_t nfailed = 0;
+    double jobTotalMs = 0.0, jobMaxMs = 0.0;
+    for (size_t i = 0; i < njobs; ++i) {
+        const JobResult& result = results[i];
+        jobTotalMs += result.ms;
+        jobMaxMs = std::max(jobMaxMs, result.ms);
+        if (result.status != 0) {
+            ++nfailed;
+            std::cout << "  FAILED [" << result.status << "] " << options.inputs[i]
+                      << ": " << result.error << std::endl;
+        }
+    }
+    char summary[256];
+    snprintf(summary, sizeof(summary),
+             "Batch: %zu ok, %zu failed in %.2f s (%.2f jobs/s); job mean %.1f ms, max %.1f ms",
+             njobs - nfailed, nfailed, totalMs / 1000.0,
+             totalMs > 0.0 ? njobs * 1000.0 / totalMs : 0.0,
+             njobs > 0 ? jobTotalMs / njobs : 0.0, jobMaxMs);
+    std::cout << summary << std::endl;
+    core().logMessage(TRUSS_LOG_INFO, summary);
+    return nfailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#ifndef TRUSS_BATCH_H_
+#define TRUSS_BATCH_H_
+
+#include <string>
+#include <vector>
+
+namespace truss {
+
+// Headless batch mode: truss --batch script.t [--jobs N] inputs...
+//
+// Every input becomes a job on the "batch/jobs" channel. N worker
+// interpreters (booted in parallel, after one shared startup) run
+// scripts/core/batchworker.t, which loads the script named by the
+// "batch/script" datastore key, calls its process(input, index) for each
+// job it pops and reports status and timing on "batch/results". Prints a
+// line per failed job and a throughput summary.
+struct BatchOptions {
+    std::string script;
+    int jobs;
+    std::vector<std::string> inputs;
+};
+
+// Returns false if argv doesn't ask for batch mode
+bool parseBatchOptions(int argc, char** argv, BatchOptions& options);
+
+// Returns the process exit code: 0 if every job succeeded
+int runBatch(const BatchOptions& options);
+
+} // namespace truss
+
+#endif // TRUSS_BATCH_H_
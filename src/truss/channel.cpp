@@ -0,0 +1,206 @@
+#include "channel.h"
+
+#include <algorithm>
+
+using namespace truss;
+
+Channel::Channel(const std::string& name, uint32_t capacity, int policy)
+    : name_(name), capacity_(capacity > 0 ? capacity : 1), policy_(policy),
+      head_(0), count_(0), closed_(false),
+      pushed_(0), popped_(0), dropped_(0), maxDepth_(0),
+      totalLatencyMs_(0.0), maxLatencyMs_(0.0) {
+    ring_.resize(capacity_);
+}
+
+Channel::~Channel() {
+    // Channels only die with the registry at exit, when the message pool
+    // may already be gone; like the datastore, queued messages are left
+    // to process teardown and only the ring is freed
+}
+
+const std::string& Channel::getName() const {
+    return name_;
+}
+
+uint32_t Channel::getCapacity() const {
+    return capacity_;
+}
+
+int Channel::getPolicy() const {
+    return policy_;
+}
+
+template <typename Ready>
+bool Channel::wait_(std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+                    int timeoutMs, Ready ready) {
+    if (timeoutMs < 0) {
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+}
+
+int Channel::push(truss_message* msg, int timeoutMs) {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (closed_) {
+        return TRUSS_CHANNEL_CLOSED;
+    }
+    if (count_ == capacity_) {
+        if (policy_ == TRUSS_CHANNEL_DROP_NEWEST) {
+            ++dropped_;
+            return TRUSS_CHANNEL_DROPPED;
+        } else if (policy_ == TRUSS_CHANNEL_DROP_OLDEST) {
+            truss_release_message(ring_[head_].msg);
+            head_ = (head_ + 1) % capacity_;
+            --count_;
+            ++dropped_;
+        } else if (!wait_(lock, notFull_, timeoutMs,
+                          [this] { return count_ < capacity_ || closed_; })) {
+            return TRUSS_CHANNEL_TIMEOUT;
+        } else if (closed_) {
+            return TRUSS_CHANNEL_CLOSED;
+        }
+    }
+
+    truss_acquire_message(msg);
+    Entry& entry = ring_[(head_ + count_) % capacity_];
+    entry.msg = msg;
+    entry.sent = Clock::now();
+    ++count_;
+    ++pushed_;
+    maxDepth_ = std::max(maxDepth_, static_cast<uint32_t>(count_));
+    lock.unlock();
+    notEmpty_.notify_one();
+    return TRUSS_CHANNEL_OK;
+}
+
+truss_message* Channel::take_(Clock::time_point now) {
+    Entry& entry = ring_[head_];
+    truss_message* msg = entry.msg;
+    double latencyMs = std::chrono::duration<double, std::milli>(now - entry.sent).count();
+    totalLatencyMs_ += latencyMs;
+    maxLatencyMs_ = std::max(maxLatencyMs_, latencyMs);
+    entry.msg = NULL;
+    head_ = (head_ + 1) % capacity_;
+    --count_;
+    ++popped_;
+    return msg;
+}
+
+truss_message* Channel::pop(int timeoutMs) {
+    truss_message* msg = NULL;
+    if (popBatch(&msg, 1, timeoutMs) == 0) {
+        return NULL;
+    }
+    return msg;
+}
+
+int Channel::popBatch(truss_message** dest, int maxCount, int timeoutMs) {
+    if (maxCount <= 0) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(lock_);
+    if (!wait_(lock, notEmpty_, timeoutMs, [this] { return count_ > 0 || closed_; })) {
+        return 0;
+    }
+    Clock::time_point now = Clock::now();
+    int ntaken = 0;
+    while (ntaken < maxCount && count_ > 0) {
+        dest[ntaken++] = take_(now);
+    }
+    lock.unlock();
+    if (ntaken > 1) {
+        notFull_.notify_all();
+    } else if (ntaken == 1) {
+        notFull_.notify_one();
+    }
+    return ntaken;
+}
+
+void Channel::close() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        closed_ = true;
+    }
+    notEmpty_.notify_all();
+    notFull_.notify_all();
+}
+
+bool Channel::isClosed() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return closed_;
+}
+
+void Channel::getStats(truss_channel_stats* stats) {
+    std::lock_guard<std::mutex> lock(lock_);
+    stats->pushed = pushed_;
+    stats->popped = popped_;
+    stats->dropped = dropped_;
+    stats->depth = static_cast<uint32_t>(count_);
+    stats->max_depth = maxDepth_;
+    stats->capacity = capacity_;
+    stats->mean_latency_ms = popped_ > 0 ? totalLatencyMs_ / popped_ : 0.0;
+    stats->max_latency_ms = maxLatencyMs_;
+}
+
+ChannelRegistry::ChannelRegistry() {}
+
+ChannelRegistry::~ChannelRegistry() {
+    for (auto& channel : channels_) {
+        delete channel.second;
+    }
+}
+
+Channel* ChannelRegistry::open(const std::string& name, uint32_t capacity, int policy) {
+    std::lock_guard<std::mutex> lock(lock_);
+    Channel*& channel = channels_[name];
+    if (channel == NULL) {
+        channel = new Channel(name, capacity, policy);
+    }
+    return channel;
+}
+
+Channel* ChannelRegistry::find(const std::string& name) {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = channels_.find(name);
+    return it == channels_.end() ? NULL : it->second;
+}
+
+int ChannelRegistry::subscribe(const std::string& topic, Channel* channel) {
+    std::lock_guard<std::mutex> lock(lock_);
+    std::vector<Channel*>& subscribers = topics_[topic];
+    if (std::find(subscribers.begin(), subscribers.end(), channel) == subscribers.end()) {
+        subscribers.push_back(channel);
+    }
+    return static_cast<int>(subscribers.size());
+}
+
+int ChannelRegistry::unsubscribe(const std::string& topic, Channel* channel) {
+    std::lock_guard<std::mutex> lock(lock_);
+    std::vector<Channel*>& subscribers = topics_[topic];
+    subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), channel),
+                      subscribers.end());
+    return static_cast<int>(subscribers.size());
+}
+
+int ChannelRegistry::publish(const std::string& topic, truss_message* msg, int timeoutMs) {
+    // blocking subscribers must not hold up (un)subscribing elsewhere, so
+    // push to a snapshot of the list
+    std::vector<Channel*> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto it = topics_.find(topic);
+        if (it == topics_.end() || it->second.empty()) {
+            return 0;
+        }
+        subscribers = it->second;
+    }
+    truss_freeze_message(msg);
+    int ndelivered = 0;
+    for (Channel* channel : subscribers) {
+        if (channel->push(msg, timeoutMs) == TRUSS_CHANNEL_OK) {
+            ++ndelivered;
+        }
+    }
+    return ndelivered;
+}
@@ -0,0 +1,116 @@
+#ifndef TRUSS_CHANNEL_H_
+#define TRUSS_CHANNEL_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// Named, bounded multi-producer/multi-consumer message queue. When full it
+// applies its overflow policy (TRUSS_CHANNEL_*): block the producer (up to
+// a timeout), drop the oldest queued message, or drop the new one. Queued
+// messages hold a reference, so senders can release theirs right away.
+class Channel {
+public:
+    Channel(const std::string& name, uint32_t capacity, int policy);
+    ~Channel();
+
+    const std::string& getName() const;
+    uint32_t getCapacity() const;
+    int getPolicy() const;
+
+    // Timeouts are in ms (< 0: no limit, 0: don't wait). Returns
+    // TRUSS_CHANNEL_OK, _DROPPED (drop-newest), _TIMEOUT or _CLOSED.
+    int push(truss_message* msg, int timeoutMs);
+
+    // Returns an acquired message (the caller releases it), or NULL if the
+    // channel stayed empty or was closed
+    truss_message* pop(int timeoutMs);
+    // Waits for at least one message, then takes up to maxCount
+    int popBatch(truss_message** dest, int maxCount, int timeoutMs);
+
+    // Wakes every waiter; later pushes fail, queued messages can still be
+    // popped
+    void close();
+    bool isClosed();
+
+    void getStats(truss_channel_stats* stats);
+
+private:
+    // Mark channel as non-copyable.
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        truss_message* msg;
+        Clock::time_point sent;
+    };
+
+    // waits on cv until ready() (returns true) or the timeout passes
+    template <typename Ready>
+    bool wait_(std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+               int timeoutMs, Ready ready);
+    truss_message* take_(Clock::time_point now);
+
+    std::string name_;
+    uint32_t capacity_;
+    int policy_;
+
+    std::mutex lock_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::vector<Entry> ring_;
+    size_t head_;
+    size_t count_;
+    bool closed_;
+
+    uint64_t pushed_;
+    uint64_t popped_;
+    uint64_t dropped_;
+    uint32_t maxDepth_;
+    double totalLatencyMs_;
+    double maxLatencyMs_;
+};
+
+// Channels and pub/sub topics by name. A topic delivers every published
+// message (frozen, so it's shared rather than copied) to each subscribed
+// channel, under that channel's overflow policy. Channels live until exit,
+// so their handles never dangle.
+class ChannelRegistry {
+public:
+    ChannelRegistry();
+    ~ChannelRegistry();
+
+    // Returns the existing channel if the name is taken (keeping its
+    // capacity and policy)
+    Channel* open(const std::string& name, uint32_t capacity, int policy);
+    Channel* find(const std::string& name);
+
+    // Returns the number of subscribers to topic afterwards
+    int subscribe(const std::string& topic, Channel* channel);
+    int unsubscribe(const std::string& topic, Channel* channel);
+
+    // Returns the number of channels the message was queued on
+    int publish(const std::string& topic, truss_message* msg, int timeoutMs);
+
+private:
+    // Mark registry as non-copyable.
+    ChannelRegistry(const ChannelRegistry&) = delete;
+    ChannelRegistry& operator=(const ChannelRegistry&) = delete;
+
+    std::mutex lock_;
+    std::map<std::string, Channel*> channels_;
+    std::map<std::string, std::vector<Channel*>> topics_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_CHANNEL_H_
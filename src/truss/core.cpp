@@ -1,4 +1,8 @@
 #include "core.h"
+#include "messagepool.h"
+#include "filemap.h"
+#include "filestream.h"
+#include "tracer.h"
 
 // TODO: switch to a better logging framework
 #include <array>
@@ -6,6 +10,7 @@
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <chrono>
 #include "external/bx_utils.h" // has to be included early or else luaconfig.h will clobber winver
 
 #include "trussapi.h"
@@ -78,6 +83,7 @@ void Core::initFS(char* argv0, bool mountBaseDir) {
         logMessage(TRUSS_LOG_WARNING, "PhysFS already initialized.");
         return;
     }
+    TraceScope trace("Core::initFS");
 
     int retval = PHYSFS_init(argv0);
     if (mountBaseDir) {
@@ -104,6 +110,7 @@ void Core::addFSPath(const char* pathname, const char* mountname, bool append, b
 // Extract contents of include and lib directories just-in-time.
 // NOTE: Not thread-safe due to changing write-dir()
 void Core::extractLibraries() {
+    TraceScope trace("Core::extractLibraries");
     int retval;
 
     // The write directory might be NULL if unset.  So we will store both
@@ -157,28 +164,25 @@ void Core::setRawWriteDir(const char* path, bool mount) {
 	}
 }
 
-// NOT THREAD SAFE!!!
-std::ostream& Core::logStream(int log_level) {
-    logfile_ << "[" << log_level << "] ";
-    return logfile_;
-}
-
 void Core::logMessage(int log_level, const char* msg) {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-    // dump to logfile
-    logfile_ << "[" << log_level << "] " << msg << std::endl;
+    logger_.log(log_level, msg);
 }
 
 void Core::logPrint(int log_level, const char* format, ...) {
-    std::array<char, 4096> buffer;
-
+    // skip the formatting entirely for filtered levels
+    if (!logger_.isEnabled(log_level)) {
+        return;
+    }
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer.data(), buffer.size(), format, args);
-    logMessage(log_level, buffer.data());
+    logger_.logv(log_level, format, args);
     va_end(args);
 }
 
+Logger& Core::logger() {
+    return logger_;
+}
+
 void Core::setError(int errcode) {
     errCode_ = errcode;
 }
@@ -187,33 +191,103 @@ int Core::getError() {
     return errCode_;
 }
 
+// Lock-free: this sits on the message send/fetch path of every interpreter
 Interpreter* Core::getInterpreter(int idx) {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-
     if(idx < 0)
         return NULL;
-    if (idx >= interpreters_.size())
+    if (idx >= numInterpreters_.load(std::memory_order_acquire))
         return NULL;
     return interpreters_[idx];
 }
 
 Interpreter* Core::spawnInterpreter() {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-    Interpreter* interpreter = new Interpreter((int)(interpreters_.size()));
-    interpreters_.push_back(interpreter);
+    Interpreter* interpreter = NULL;
+    {
+        std::lock_guard<std::mutex> Lock(coreLock_);
+        int idx = numInterpreters_.load(std::memory_order_relaxed);
+        if (!freeSlots_.empty()) {
+            interpreter = interpreters_[freeSlots_.back()];
+            freeSlots_.pop_back();
+        } else if (idx < MAX_INTERPRETERS) {
+            interpreter = new Interpreter(idx);
+            interpreters_[idx] = interpreter;
+            numInterpreters_.store(idx + 1, std::memory_order_release);
+        }
+    }
+    if (interpreter == NULL) {
+        logPrint(TRUSS_LOG_ERROR, "Cannot spawn interpreter: limit of %d reached.",
+                 MAX_INTERPRETERS);
+    }
     return interpreter;
 }
 
-void Core::stopAllInterpreters() {
+void Core::releaseInterpreter(Interpreter* interpreter) {
+    if (!interpreter->reset()) {
+        logPrint(TRUSS_LOG_WARNING, "Can't release interpreter [%d]: it was started.",
+                 interpreter->getID());
+        return;
+    }
     std::lock_guard<std::mutex> Lock(coreLock_);
-    for (unsigned int i = 0; i < interpreters_.size(); ++i) {
+    freeSlots_.push_back(interpreter->getID());
+}
+
+InterpreterPool& Core::interpreterPool() {
+    return interpreterPool_;
+}
+
+void Core::waitForInterpreters() {
+    int count = numInterpreters_.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        interpreters_[i]->waitForStep();
+    }
+}
+
+int Core::stepInterpreters(const int* targets, int ntargets) {
+    int nstepped = 0;
+    for (int i = 0; i < ntargets; ++i) {
+        Interpreter* interpreter = getInterpreter(targets[i]);
+        if (interpreter != NULL && interpreter->step()) {
+            ++nstepped;
+        }
+    }
+    return nstepped;
+}
+
+int Core::joinInterpreters(const int* targets, int ntargets, int timeoutMs, double* frameTimes) {
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs > 0 ? timeoutMs : 0);
+    int nrunning = 0;
+    for (int i = 0; i < ntargets; ++i) {
+        Interpreter* interpreter = getInterpreter(targets[i]);
+        bool done = false;
+        if (interpreter != NULL) {
+            int remaining = timeoutMs;
+            if (timeoutMs > 0) {
+                std::chrono::milliseconds left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now());
+                remaining = left.count() > 0 ? static_cast<int>(left.count()) : 0;
+            }
+            done = interpreter->waitForStep(remaining);
+            if (!done) {
+                ++nrunning;
+            }
+        }
+        if (frameTimes != NULL) {
+            frameTimes[i] = done ? interpreter->getLastStepTime() : -1.0;
+        }
+    }
+    return nrunning;
+}
+
+void Core::stopAllInterpreters() {
+    int count = numInterpreters_.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
         interpreters_[i]->stop();
     }
 }
 
 int Core::numInterpreters() {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-    return static_cast<int>(interpreters_.size());
+    return numInterpreters_.load(std::memory_order_acquire);
 }
 
 void Core::dispatchMessage(int targetIdx, truss_message* msg) {
@@ -223,38 +297,112 @@ void Core::dispatchMessage(int targetIdx, truss_message* msg) {
     }
 }
 
+int Core::broadcastMessage(const int* targets, int ntargets, truss_message* msg) {
+    freezeMessage(msg);
+
+    // resolve every target first so a single refcount update covers all
+    // of the deliveries
+    int ndelivered = 0;
+    for (int i = 0; i < ntargets; ++i) {
+        if (getInterpreter(targets[i]) != NULL) {
+            ++ndelivered;
+        }
+    }
+    if (ndelivered == 0) {
+        return 0;
+    }
+    msg->refcount.fetch_add(ndelivered, std::memory_order_relaxed);
+    for (int i = 0; i < ntargets; ++i) {
+        Interpreter* interpreter = getInterpreter(targets[i]);
+        if (interpreter != NULL) {
+            interpreter->sendAcquiredMessage(msg);
+        }
+    }
+    return ndelivered;
+}
+
 void Core::acquireMessage(truss_message* msg) {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-    ++(msg->refcount);
+    // a new reference can only be made from an existing one, so no
+    // ordering is needed here
+    msg->refcount.fetch_add(1, std::memory_order_relaxed);
 }
 
 void Core::releaseMessage(truss_message* msg) {
-    std::lock_guard<std::mutex> Lock(coreLock_);
-    --(msg->refcount);
-    if(msg->refcount <= 0) {
+    // acq_rel: writes made through other references must be visible to
+    // whichever thread ends up freeing the message
+    if (msg->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
         deallocateMessage(msg);
     }
 }
 
+void Core::freezeMessage(truss_message* msg) {
+    // re-broadcasting an already frozen message must not write to it; the
+    // flag word is shared with other bits, so set it with an atomic or
+    MessageBlock* block = MessagePool::blockOf(msg);
+    if ((block->flags.load(std::memory_order_acquire) & MessageBlock::FROZEN) == 0) {
+        block->flags.fetch_or(MessageBlock::FROZEN, std::memory_order_acq_rel);
+    }
+}
+
+bool Core::isMessageFrozen(truss_message* msg) {
+    return (MessagePool::blockOf(msg)->flags.load(std::memory_order_acquire) &
+            MessageBlock::FROZEN) != 0;
+}
+
+unsigned char* Core::getWritableData(truss_message* msg) {
+    if (isMessageFrozen(msg)) {
+        logMessage(TRUSS_LOG_ERROR, "getWritableData: message is frozen");
+        return NULL;
+    }
+    return msg->data;
+}
+
 truss_message* Core::copyMessage(truss_message* src) {
-    std::lock_guard<std::mutex> Lock(coreLock_);
     truss_message* newmsg = allocateMessage(src->data_length);
     newmsg->message_type = src->message_type;
     std::memcpy(newmsg->data, src->data, newmsg->data_length);
     return newmsg;
 }
 
+// Header and payload share one pooled block (see messagepool.h)
 truss_message* Core::allocateMessage(size_t dataLength) {
-    truss_message* ret = new truss_message;
-    ret->data = new unsigned char[dataLength];
-    ret->data_length = dataLength;
-    ret->refcount = 1;
-    return ret;
+    return MessagePool::instance().allocate(dataLength);
 }
 
 void Core::deallocateMessage(truss_message* msg) {
-    delete[] msg->data;
-    delete msg;
+    MessagePool::instance().release(msg);
+}
+
+void Core::getMessageStats(truss_message_stats* stats) {
+    MessagePool::instance().getStats(stats);
+}
+
+truss_message* Core::createSharedBuffer(size_t dataLength, size_t alignment) {
+    truss_message* msg = MessagePool::instance().allocateShared(dataLength, alignment);
+    if (msg == NULL) {
+        logPrint(TRUSS_LOG_ERROR, "createSharedBuffer: unable to allocate %zu bytes (alignment %zu)",
+                 dataLength, alignment);
+    }
+    return msg;
+}
+
+bool Core::transferMessage(int targetIdx, truss_message* msg) {
+    // a frozen message may have other readers, so it has no owner to hand
+    // over; send (or broadcast) it instead
+    if (isMessageFrozen(msg)) {
+        logMessage(TRUSS_LOG_ERROR, "transferMessage: message is frozen");
+        return false;
+    }
+    Interpreter* interpreter = getInterpreter(targetIdx);
+    if (interpreter == NULL) {
+        return false;
+    }
+    interpreter->sendAcquiredMessage(msg);
+    return true;
+}
+
+bool Core::isMessageExclusive(truss_message* msg) {
+    return msg->refcount.load(std::memory_order_acquire) == 1 && !isMessageFrozen(msg);
 }
 
 int Core::checkFile(const char* filename) {
@@ -323,32 +471,107 @@ truss_message* Core::loadFile(const char* filename) {
     return ret;
 }
 
-void Core::saveData(const char* filename, const char* data, unsigned int datalength) {
+truss_message* Core::mapFileRaw(const char* filename) {
+    truss_message* ret = mapFileRegion(filename, 0, -1);
+    if (ret == NULL) {
+        logPrint(TRUSS_LOG_WARNING, "Unable to map '%s'; reading instead.", filename);
+        return loadFileRaw(filename);
+    }
+    return ret;
+}
+
+// Maps real files and stored (uncompressed) zip entries directly; anything
+// else (e.g., deflated entries) falls back to an ordinary read.
+truss_message* Core::mapFile(const char* filename) {
+    if (!physFSInitted_) {
+        logPrint(TRUSS_LOG_ERROR, "Cannot map file '%s': PhysFS not initialized.", filename);
+        return NULL;
+    }
+
+    const char* realDir = PHYSFS_getRealDir(filename);
+    if (realDir == NULL || PHYSFS_isDirectory(filename) != 0) {
+        return loadFile(filename); // reports the error
+    }
+
+    // path of the file relative to where its archive/directory is mounted
+    std::string relPath = filename;
+    while (!relPath.empty() && relPath[0] == '/') {
+        relPath.erase(0, 1);
+    }
+    const char* mountPoint = PHYSFS_getMountPoint(realDir);
+    std::string mount = mountPoint ? mountPoint : "";
+    while (!mount.empty() && mount[0] == '/') {
+        mount.erase(0, 1);
+    }
+    if (!mount.empty() && relPath.compare(0, mount.size(), mount) == 0) {
+        relPath.erase(0, mount.size());
+    }
+
+    truss_message* ret = NULL;
+    std::string realDirPath = realDir;
+    if (isRealDirectory(realDirPath)) {
+        const std::string separator = PHYSFS_getDirSeparator();
+        if (realDirPath.compare(realDirPath.size() - separator.size(),
+                                separator.size(), separator) != 0) {
+            realDirPath += separator;
+        }
+        ret = mapFileRegion(realDirPath + relPath, 0, -1);
+    } else {
+        ZipEntryInfo entry;
+        if (findZipEntry(realDirPath, relPath, entry) && entry.method == 0) {
+            ret = mapFileRegion(realDirPath, entry.dataOffset,
+                                static_cast<int64_t>(entry.size));
+        }
+    }
+
+    if (ret == NULL) {
+        logPrint(TRUSS_LOG_DEBUG, "Reading '%s' (could not be mapped).", filename);
+        return loadFile(filename);
+    }
+    return ret;
+}
+
+bool Core::saveData(const char* filename, const char* data, uint64_t datalength) {
     if (!physFSInitted_) {
         logPrint(TRUSS_LOG_ERROR, "Cannot save file '%s': PhysFS not initialized.", filename);
-        return;
+        return false;
     }
 
-    PHYSFS_file* myfile = PHYSFS_openWrite(filename);
-    PHYSFS_write(myfile, data, 1, datalength);
-    PHYSFS_close(myfile);
+    // streams split the write into chunks PhysFS can take
+    FileStream* stream = FileStream::open(filename, TRUSS_STREAM_WRITE);
+    if (stream == NULL) {
+        return false;
+    }
+    int64_t written = stream->write(data, static_cast<int64_t>(datalength));
+    bool closed = stream->close();
+    delete stream;
+    if (written != static_cast<int64_t>(datalength) || !closed) {
+        logPrint(TRUSS_LOG_ERROR, "Cannot save file '%s': wrote %lld of %llu bytes.",
+                 filename, static_cast<long long>(written < 0 ? 0 : written),
+                 static_cast<unsigned long long>(datalength));
+        return false;
+    }
+    return true;
 }
 
-void Core::saveDataRaw(const char* filename, const char* data, unsigned int datalength) {
+bool Core::saveDataRaw(const char* filename, const char* data, uint64_t datalength) {
     std::ofstream outfile;
     outfile.open(filename, std::ios::binary | std::ios::out);
-    outfile.write(data, datalength);
+    outfile.write(data, static_cast<std::streamsize>(datalength));
     outfile.close();
+    if (!outfile) {
+        logPrint(TRUSS_LOG_ERROR, "Cannot save raw file '%s'.", filename);
+        return false;
+    }
+    return true;
 }
 
-void Core::saveFile(const char* filename, truss_message* data) {
-    saveData(filename, (char*)(data->data),
-             static_cast<unsigned int>(data->data_length));
+bool Core::saveFile(const char* filename, truss_message* data) {
+    return saveData(filename, (char*)(data->data), data->data_length);
 }
 
-void Core::saveFileRaw(const char* filename, truss_message* data) {
-    saveDataRaw(filename, (char*)(data->data),
-                static_cast<unsigned int>(data->data_length));
+bool Core::saveFileRaw(const char* filename, truss_message* data) {
+    return saveDataRaw(filename, (char*)(data->data), data->data_length);
 }
 
 int Core::listDirectory(int interpreter, const char* dirpath) {
@@ -401,25 +624,24 @@ void Core::clearStringResults(int interpreter) {
     stringResults_[interpreter].clear();
 }
 
+IOPool& Core::ioPool() {
+    return ioPool_;
+}
+
+ChannelRegistry& Core::channels() {
+    return channels_;
+}
+
+Datastore& Core::store() {
+    return store_;
+}
+
 truss_message* Core::getStoreValue(const std::string& key) {
-    if (store_.count(key) > 0) {
-        return store_[key];
-    } else {
-        return NULL;
-    }
+    return store_.get(key);
 }
 
 int Core::setStoreValue(const std::string& key, truss_message* val) {
-    acquireMessage(val);
-    if (store_.count(key) > 0) {
-        truss_message* oldmsg = store_[key];
-        store_[key] = val;
-        releaseMessage(oldmsg);
-        return 1;
-    } else {
-        store_[key] = val;
-        return 0;
-    }
+    return store_.set(key, val) ? 1 : 0;
 }
 
 int Core::setStoreValue(const std::string& key, const std::string& val) {
@@ -432,17 +654,21 @@ int Core::setStoreValue(const std::string& key, const std::string& val) {
 }
 
 Core::~Core() {
+    // outstanding saves and boots still need the filesystem
+    ioPool_.stop();
+    interpreterPool_.stop();
+
     // destroy physfs
     if (physFSInitted_) {
         PHYSFS_deinit();
     }
-    logfile_.close();
+    logger_.flush();
 }
 
-Core::Core() {
+Core::Core() : numInterpreters_(0) {
     physFSInitted_ = false;
     errCode_ = 0;
-
-    // open log file
-    logfile_.open("trusslog.txt", std::ios::out);
+    interpreters_.fill(NULL);
+    // the log file is opened by whoever picks the sink (see main.cpp);
+    // records wait in the logger until then
 }
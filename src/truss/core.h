@@ -2,11 +2,17 @@
 #define TRUSS_CORE_H_
 
 #include "interpreter.h"
+#include "iopool.h"
+#include "channel.h"
+#include "datastore.h"
+#include "interpreterpool.h"
+#include "logger.h"
 
 #include <string>
 #include <vector>
+#include <array>
+#include <atomic>
 #include <map>
-#include <fstream>
 #include <thread>
 #include <terra/terra.h>
 #include <trussapi.h>
@@ -15,6 +21,9 @@ namespace truss {
 
 class Core {
 public:
+    // Interpreter slots are preallocated so that lookups never need a lock
+    static const int MAX_INTERPRETERS = 1024;
+
     static Core& instance();
 
     // functions for dealing with physfs (you can also make direct physfs
@@ -25,41 +34,79 @@ public:
 	void setRawWriteDir(const char* path, bool mount=true);
     void extractLibraries();
 
-    std::ostream& logStream(int log_level);
+    // logging never blocks on the file (see logger.h)
     void logMessage(int log_level, const char* msg);
     void logPrint(int log_level, const char* format, ...);
+    Logger& logger();
     void setError(int errcode);
     int getError();
 
     Interpreter* getInterpreter(int idx);
+    // Reuses a released slot if there is one
     Interpreter* spawnInterpreter();
+    // Resets an interpreter that was never started (see Interpreter::reset)
+    // and queues its slot for reuse; the object itself stays in the slot,
+    // since lock-free lookups may still be holding it
+    void releaseInterpreter(Interpreter* interpreter);
+
+    // pre-booted interpreters for fast spawning (see interpreterpool.h)
+    InterpreterPool& interpreterPool();
 
-    // block until all interpreters have finished
+    // block until all interpreters have finished their current step
     void waitForInterpreters();
 
+    // Fork-join frame stepping: step a set of interpreters in parallel, then
+    // join them (timeoutMs < 0: no limit, 0: poll). The join writes each
+    // interpreter's frame time in ms (-1 if unfinished or invalid) to
+    // frameTimes if given, and returns how many are still running.
+    int stepInterpreters(const int* targets, int ntargets);
+    int joinInterpreters(const int* targets, int ntargets, int timeoutMs, double* frameTimes);
+
     void stopAllInterpreters();
 
     int numInterpreters();
     void dispatchMessage(int targetIdx, truss_message* msg);
+    int broadcastMessage(const int* targets, int ntargets, truss_message* msg);
 
+    // refcounting is lock-free and safe from any thread
     void acquireMessage(truss_message* msg);
     void releaseMessage(truss_message* msg);
+    void freezeMessage(truss_message* msg);
+    bool isMessageFrozen(truss_message* msg);
+    unsigned char* getWritableData(truss_message* msg); // NULL if frozen
     truss_message* copyMessage(truss_message* src);
     truss_message* allocateMessage(size_t dataLength);
     void deallocateMessage(truss_message* msg);
+    void getMessageStats(truss_message_stats* stats);
+
+    // shared buffers (see truss_create_shared_buffer); transferring hands
+    // the caller's reference to the target instead of adding one
+    truss_message* createSharedBuffer(size_t dataLength, size_t alignment);
+    bool transferMessage(int targetIdx, truss_message* msg);
+    bool isMessageExclusive(truss_message* msg);
 
     int checkFile(const char* filename);
 	const char* getFileRealPath(const char* filename);
     truss_message* loadFile(const char* filename);
     truss_message* loadFileRaw(const char* filename);
-    void saveFile(const char* filename, truss_message* data);
-    void saveFileRaw(const char* filename, truss_message* data);
-    void saveData(const char* filename, const char* data, unsigned int datalength);
-    void saveDataRaw(const char* filename, const char* data, unsigned int datalength);
+    truss_message* mapFile(const char* filename);
+    truss_message* mapFileRaw(const char* filename);
+    bool saveFile(const char* filename, truss_message* data);
+    bool saveFileRaw(const char* filename, truss_message* data);
+    bool saveData(const char* filename, const char* data, uint64_t datalength);
+    bool saveDataRaw(const char* filename, const char* data, uint64_t datalength);
     int listDirectory(int interpreter, const char* dirpath);
     const char* getStringResult(int interpreter, int idx);
     void clearStringResults(int interpreter);
 
+    // background loads/saves (see iopool.h)
+    IOPool& ioPool();
+
+    // bounded channels and pub/sub topics (see channel.h)
+    ChannelRegistry& channels();
+
+    // the datastore is safe to use from any thread (see datastore.h)
+    Datastore& store();
     truss_message* getStoreValue(const std::string& key);
     int setStoreValue(const std::string& key, truss_message* val);
     int setStoreValue(const std::string& key, const std::string& val);
@@ -72,12 +119,22 @@ private:
     Core(const Core&) = delete;
     Core& operator=(const Core&) = delete;
 
+    // declared first so that it outlives everything that might log
+    Logger logger_;
+
     std::mutex coreLock_;
     bool physFSInitted_;
-    std::vector<Interpreter*> interpreters_;
+
+    // Slots [0, numInterpreters_) are filled; a slot is written once, before
+    // the count is published, so readers only need an acquire load
+    std::array<Interpreter*, MAX_INTERPRETERS> interpreters_;
+    std::atomic<int> numInterpreters_;
+    std::vector<int> freeSlots_; // guarded by coreLock_
     std::vector<std::vector<std::string>> stringResults_;
-    std::map<std::string, truss_message*> store_;
-    std::ofstream logfile_;
+    Datastore store_;
+    ChannelRegistry channels_;
+    IOPool ioPool_;
+    InterpreterPool interpreterPool_;
 
     int errCode_;
 };
@@ -0,0 +1,312 @@
+#include "datastore.h"
+#include "core.h"
+
+using namespace truss;
+
+namespace {
+
+// Retired values are checked for reclamation once this many build up
+const size_t RECLAIM_THRESHOLD = 64;
+
+// Epoch based reclamation: a reading thread publishes the global epoch it
+// started in, and a value retired in epoch R is freed once every active
+// reader started after R.
+std::atomic<uint64_t> globalEpoch_(1);
+
+struct ThreadRecord {
+    std::atomic<uint64_t> epoch;   // 0 while the thread isn't reading
+    std::atomic<bool> inUse;
+    ThreadRecord* next;
+    int depth;                     // only touched by the owning thread
+};
+
+// Records are never freed, only recycled when their thread exits
+std::atomic<ThreadRecord*> records_(nullptr);
+
+ThreadRecord* claimRecord() {
+    for (ThreadRecord* r = records_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->inUse.load(std::memory_order_relaxed) &&
+            r->inUse.compare_exchange_strong(expected, true)) {
+            r->depth = 0;
+            return r;
+        }
+    }
+    ThreadRecord* r = new ThreadRecord;
+    r->epoch.store(0, std::memory_order_relaxed);
+    r->inUse.store(true, std::memory_order_relaxed);
+    r->depth = 0;
+    r->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(r->next, r,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        // r->next has been reloaded with the current head; retry
+    }
+    return r;
+}
+
+struct ThreadRecordHolder {
+    ThreadRecord* record;
+    ThreadRecordHolder() : record(claimRecord()) {}
+    ~ThreadRecordHolder() {
+        record->epoch.store(0, std::memory_order_release);
+        record->inUse.store(false, std::memory_order_release);
+    }
+};
+
+thread_local ThreadRecordHolder threadRecord_;
+
+// innermost BorrowScope of this thread, if any
+thread_local Datastore::BorrowScope* borrowScope_ = nullptr;
+
+// Oldest epoch any thread is currently reading in, or UINT64_MAX if none
+uint64_t oldestActiveEpoch() {
+    uint64_t oldest = UINT64_MAX;
+    for (ThreadRecord* r = records_.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint64_t epoch = r->epoch.load(std::memory_order_seq_cst);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+// FNV-1a
+uint64_t hashKey(const std::string& key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); ++i) {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+} // namespace
+
+Datastore::ReadSection::ReadSection() {
+    ThreadRecord* r = threadRecord_.record;
+    if (r->depth++ == 0) {
+        r->epoch.store(globalEpoch_.load(std::memory_order_seq_cst),
+                       std::memory_order_seq_cst);
+    }
+}
+
+Datastore::ReadSection::~ReadSection() {
+    ThreadRecord* r = threadRecord_.record;
+    if (--r->depth == 0) {
+        r->epoch.store(0, std::memory_order_release);
+    }
+}
+
+Datastore::BorrowScope::BorrowScope() : outer_(borrowScope_) {
+    borrowScope_ = this;
+}
+
+Datastore::BorrowScope::~BorrowScope() {
+    borrowScope_ = outer_;
+    for (truss_message* msg : held_) {
+        core().releaseMessage(msg);
+    }
+}
+
+void Datastore::BorrowScope::hold(truss_message* msg) {
+    // scripts often poll the same key over and over
+    if (!held_.empty() && held_.back() == msg) {
+        return;
+    }
+    core().acquireMessage(msg);
+    held_.push_back(msg);
+}
+
+Datastore::Datastore() : numRetired_(0) {
+    for (uint32_t s = 0; s < NUM_SHARDS; ++s) {
+        for (uint32_t b = 0; b < BUCKETS_PER_SHARD; ++b) {
+            shards_[s].buckets[b].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+}
+
+Datastore::~Datastore() {
+    // Only the nodes are freed: at exit the message pool may already be
+    // gone, so (as before) the stored messages are left to process teardown
+    for (uint32_t s = 0; s < NUM_SHARDS; ++s) {
+        for (uint32_t b = 0; b < BUCKETS_PER_SHARD; ++b) {
+            Entry* entry = shards_[s].buckets[b].load(std::memory_order_relaxed);
+            while (entry != nullptr) {
+                Entry* next = entry->next.load(std::memory_order_relaxed);
+                delete entry->value.load(std::memory_order_relaxed);
+                delete entry;
+                entry = next;
+            }
+        }
+    }
+    for (auto& retired : retired_) {
+        delete retired.value;
+    }
+}
+
+Datastore::Entry* Datastore::find_(uint64_t hash, const std::string& key) {
+    Shard& shard = shards_[hash >> 58];
+    Entry* entry = shard.buckets[hash % BUCKETS_PER_SHARD].load(std::memory_order_acquire);
+    while (entry != nullptr) {
+        if (entry->hash == hash && entry->key == key) {
+            return entry;
+        }
+        entry = entry->next.load(std::memory_order_acquire);
+    }
+    return nullptr;
+}
+
+// Called with the shard's writeLock held
+Datastore::Entry* Datastore::findOrInsert_(uint64_t hash, const std::string& key) {
+    Entry* entry = find_(hash, key);
+    if (entry != nullptr) {
+        return entry;
+    }
+    std::atomic<Entry*>& bucket = shards_[hash >> 58].buckets[hash % BUCKETS_PER_SHARD];
+    entry = new Entry;
+    entry->hash = hash;
+    entry->key = key;
+    entry->value.store(nullptr, std::memory_order_relaxed);
+    entry->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    bucket.store(entry, std::memory_order_release);
+    return entry;
+}
+
+// Called with the shard's writeLock held
+uint64_t Datastore::replace_(Entry* entry, truss_message* val) {
+    Value* prev = entry->value.load(std::memory_order_relaxed);
+    Value* value = new Value;
+    value->msg = val;
+    value->version = (prev != nullptr ? prev->version : 0) + 1;
+    if (val != NULL) {
+        core().acquireMessage(val);
+    }
+    entry->value.exchange(value, std::memory_order_seq_cst);
+    if (prev != nullptr) {
+        retire_(prev);
+    }
+    return value->version;
+}
+
+void Datastore::retire_(Value* value) {
+    size_t count;
+    {
+        std::lock_guard<std::mutex> lock(retiredLock_);
+        Retired retired;
+        retired.value = value;
+        retired.epoch = globalEpoch_.fetch_add(1, std::memory_order_seq_cst);
+        retired_.push_back(retired);
+        count = numRetired_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    if (count >= RECLAIM_THRESHOLD) {
+        reclaim();
+    }
+}
+
+void Datastore::reclaim() {
+    if (numRetired_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::vector<Value*> freed;
+    {
+        std::lock_guard<std::mutex> lock(retiredLock_);
+        uint64_t oldest = oldestActiveEpoch();
+        size_t kept = 0;
+        for (size_t i = 0; i < retired_.size(); ++i) {
+            if (retired_[i].epoch < oldest) {
+                freed.push_back(retired_[i].value);
+            } else {
+                retired_[kept++] = retired_[i];
+            }
+        }
+        retired_.resize(kept);
+        numRetired_.store(kept, std::memory_order_relaxed);
+    }
+    // release outside the lock: a message's release can run arbitrary hooks
+    for (Value* value : freed) {
+        if (value->msg != NULL) {
+            core().releaseMessage(value->msg);
+        }
+        delete value;
+    }
+}
+
+// Called inside a ReadSection
+truss_message* Datastore::load_(const std::string& key, uint64_t* version) {
+    Entry* entry = find_(hashKey(key), key);
+    Value* value = entry ? entry->value.load(std::memory_order_seq_cst) : nullptr;
+    if (version != NULL) {
+        *version = value ? value->version : 0;
+    }
+    return value ? value->msg : NULL;
+}
+
+truss_message* Datastore::get(const std::string& key, uint64_t* version) {
+    ReadSection section;
+    truss_message* msg = load_(key, version);
+    if (msg != NULL && borrowScope_ != nullptr) {
+        borrowScope_->hold(msg);
+    }
+    return msg;
+}
+
+truss_message* Datastore::getAcquired(const std::string& key, uint64_t* version) {
+    ReadSection section;
+    truss_message* msg = load_(key, version);
+    if (msg != NULL) {
+        core().acquireMessage(msg);
+    }
+    return msg;
+}
+
+uint64_t Datastore::getVersion(const std::string& key) {
+    ReadSection section;
+    uint64_t version = 0;
+    load_(key, &version);
+    return version;
+}
+
+bool Datastore::set(const std::string& key, truss_message* val, uint64_t* version) {
+    uint64_t hash = hashKey(key);
+    std::lock_guard<std::mutex> lock(shards_[hash >> 58].writeLock);
+    Entry* entry = findOrInsert_(hash, key);
+    Value* prev = entry->value.load(std::memory_order_relaxed);
+    bool replaced = (prev != nullptr && prev->msg != NULL);
+    uint64_t newVersion = replace_(entry, val);
+    if (version != NULL) {
+        *version = newVersion;
+    }
+    return replaced;
+}
+
+uint64_t Datastore::compareAndSwap(const std::string& key, uint64_t expectedVersion,
+                                   truss_message* val) {
+    uint64_t hash = hashKey(key);
+    std::lock_guard<std::mutex> lock(shards_[hash >> 58].writeLock);
+    Entry* entry = (expectedVersion == 0) ? findOrInsert_(hash, key) : find_(hash, key);
+    if (entry == nullptr) {
+        return 0;
+    }
+    Value* prev = entry->value.load(std::memory_order_relaxed);
+    if ((prev != nullptr ? prev->version : 0) != expectedVersion) {
+        return 0;
+    }
+    return replace_(entry, val);
+}
+
+bool Datastore::erase(const std::string& key) {
+    uint64_t hash = hashKey(key);
+    std::lock_guard<std::mutex> lock(shards_[hash >> 58].writeLock);
+    Entry* entry = find_(hash, key);
+    if (entry == nullptr) {
+        return false;
+    }
+    Value* prev = entry->value.load(std::memory_order_relaxed);
+    if (prev == nullptr || prev->msg == NULL) {
+        return false;
+    }
+    // keep a (NULL) value so the version keeps counting up
+    replace_(entry, NULL);
+    return true;
+}
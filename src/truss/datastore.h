@@ -0,0 +1,118 @@
+#ifndef TRUSS_DATASTORE_H_
+#define TRUSS_DATASTORE_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// Concurrent key -> message map shared by every interpreter. Keys hash to
+// one of NUM_SHARDS shards; writers take the shard's lock, readers never
+// lock. Replaced values are reclaimed once no reader can still see them
+// (epoch based), so a pointer returned by get() stays valid for the rest
+// of the caller's ReadSection. Reads are kept short so that reclamation
+// isn't held back: interpreters hold a BorrowScope rather than a
+// ReadSection for every call into their script, i.e., values read during a
+// step stay valid (acquired) until the end of that step.
+//
+// Every key has a version that increases with each write (including
+// erases), for cheap change detection and compareAndSwap.
+class Datastore {
+public:
+    static const uint32_t NUM_SHARDS = 64;
+    static const uint32_t BUCKETS_PER_SHARD = 256;
+
+    // Marks the current thread as reading; may be nested
+    class ReadSection {
+    public:
+        ReadSection();
+        ~ReadSection();
+    private:
+        ReadSection(const ReadSection&) = delete;
+        ReadSection& operator=(const ReadSection&) = delete;
+    };
+
+    // Acquires every value this thread reads with get() and releases them
+    // when the scope ends; may be nested
+    class BorrowScope {
+    public:
+        BorrowScope();
+        ~BorrowScope();
+        void hold(truss_message* msg);
+    private:
+        BorrowScope(const BorrowScope&) = delete;
+        BorrowScope& operator=(const BorrowScope&) = delete;
+
+        std::vector<truss_message*> held_;
+        BorrowScope* outer_;
+    };
+
+    Datastore();
+    ~Datastore();
+
+    // Borrowed: only valid inside the caller's ReadSection or BorrowScope.
+    // Returns NULL
+    // (and version 0 if the key was never written) for missing keys.
+    truss_message* get(const std::string& key, uint64_t* version = NULL);
+    // As get, but acquired on behalf of the caller (any thread)
+    truss_message* getAcquired(const std::string& key, uint64_t* version = NULL);
+    uint64_t getVersion(const std::string& key);
+
+    // Returns true if an existing value was replaced
+    bool set(const std::string& key, truss_message* val, uint64_t* version = NULL);
+    // Writes only if the key's version is still expectedVersion (0 for a
+    // key that was never written). Returns the new version, or 0 on failure.
+    uint64_t compareAndSwap(const std::string& key, uint64_t expectedVersion,
+                            truss_message* val);
+    // Returns true if the key had a value
+    bool erase(const std::string& key);
+
+    // Frees retired values nobody can see anymore
+    void reclaim();
+
+private:
+    // Mark datastore as non-copyable.
+    Datastore(const Datastore&) = delete;
+    Datastore& operator=(const Datastore&) = delete;
+
+    // Immutable once published; msg may be NULL for an erased key
+    struct Value {
+        truss_message* msg;
+        uint64_t version;
+    };
+    // Entries are never unlinked, so readers can walk chains freely
+    struct Entry {
+        uint64_t hash;
+        std::string key;
+        std::atomic<Value*> value;
+        std::atomic<Entry*> next;
+    };
+    struct Shard {
+        std::mutex writeLock;
+        std::atomic<Entry*> buckets[BUCKETS_PER_SHARD];
+    };
+    struct Retired {
+        Value* value;
+        uint64_t epoch;
+    };
+
+    Entry* find_(uint64_t hash, const std::string& key);
+    truss_message* load_(const std::string& key, uint64_t* version);
+    Entry* findOrInsert_(uint64_t hash, const std::string& key);
+    uint64_t replace_(Entry* entry, truss_message* val);
+    void retire_(Value* value);
+
+    Shard shards_[NUM_SHARDS];
+
+    std::mutex retiredLock_;
+    std::vector<Retired> retired_;
+    std::atomic<size_t> numRetired_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_DATASTORE_H_
@@ -0,0 +1,128 @@
+#include "diskcache.h"
+#include "filemap.h"
+#include "core.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <physfs.h>
+
+using namespace truss;
+
+namespace {
+
+const char ENTRY_MAGIC[8] = {'T', 'R', 'S', 'C', 'A', 'C', 'H', '2'};
+
+struct EntryHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t length;
+    uint64_t contentHash; // hashData of the payload
+};
+
+std::string cacheDir(const std::string& cacheName) {
+    return "cache/" + cacheName;
+}
+
+// Real path of a file in the cache, or "" if there is no write dir
+std::string entryPath(const std::string& cacheName, uint64_t key, const char* suffix) {
+    const char* writeDir = PHYSFS_getWriteDir();
+    if (writeDir == NULL) {
+        return "";
+    }
+    std::string sep = PHYSFS_getDirSeparator();
+    std::stringstream ss;
+    ss << writeDir;
+    if (ss.str().empty() || ss.str().back() != sep.back()) {
+        ss << sep;
+    }
+    ss << "cache" << sep << cacheName << sep
+       << std::hex << std::setw(16) << std::setfill('0') << key << suffix;
+    return ss.str();
+}
+
+} // namespace
+
+uint64_t truss::hashData(const void* data, uint64_t length, uint64_t seed) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = (seed != 0) ? seed : 14695981039346656037ULL;
+    for (uint64_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+truss_message* truss::loadCacheEntry(const std::string& cacheName, uint64_t key) {
+    std::string path = entryPath(cacheName, key, ".bin");
+    if (path.empty()) {
+        return NULL;
+    }
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return NULL; // not cached yet
+    }
+    EntryHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                 memcmp(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == 0 &&
+                 header.key == key;
+    fclose(file);
+    if (!valid) {
+        core().logPrint(TRUSS_LOG_WARNING, "Ignoring damaged cache entry '%s'.", path.c_str());
+        return NULL;
+    }
+    truss_message* msg = mapFileRegion(path, sizeof(header), static_cast<int64_t>(header.length));
+    if (msg != NULL && msg->data_length != header.length) {
+        core().logPrint(TRUSS_LOG_WARNING, "Ignoring truncated cache entry '%s'.", path.c_str());
+        core().releaseMessage(msg);
+        return NULL;
+    }
+    if (msg != NULL && hashData(msg->data, msg->data_length, 0) != header.contentHash) {
+        core().logPrint(TRUSS_LOG_WARNING, "Ignoring corrupted cache entry '%s'.", path.c_str());
+        core().releaseMessage(msg);
+        return NULL;
+    }
+    return msg;
+}
+
+bool truss::saveCacheEntry(const std::string& cacheName, uint64_t key,
+                           const void* data, uint64_t length) {
+    // one temporary file per thread, so concurrent writers never share one
+    std::stringstream suffix;
+    suffix << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    std::string tmpPath = entryPath(cacheName, key, suffix.str().c_str());
+    std::string path = entryPath(cacheName, key, ".bin");
+    if (path.empty()) {
+        return false;
+    }
+    PHYSFS_mkdir(cacheDir(cacheName).c_str());
+
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (file == NULL) {
+        core().logPrint(TRUSS_LOG_WARNING, "Unable to write cache entry '%s'.", tmpPath.c_str());
+        return false;
+    }
+    EntryHeader header;
+    memcpy(header.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+    header.key = key;
+    header.length = length;
+    header.contentHash = hashData(data, length, 0);
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   (length == 0 || fwrite(data, static_cast<size_t>(length), 1, file) == 1);
+    written = (fclose(file) == 0) && written;
+
+    if (written && std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        // (on Windows rename won't replace an existing file, but then an
+        // identical entry is already in place)
+        file = fopen(path.c_str(), "rb");
+        written = (file != NULL);
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+    std::remove(tmpPath.c_str());
+    return written;
+}
@@ -0,0 +1,28 @@
+#ifndef TRUSS_DISKCACHE_H_
+#define TRUSS_DISKCACHE_H_
+
+#include <string>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// 64-bit FNV-1a; chain calls through seed to hash several pieces
+uint64_t hashData(const void* data, uint64_t length, uint64_t seed);
+
+// Persistent cache for derived data (compiled scripts and the like), kept
+// in the write dir under cache/<cacheName>/ with one file per 64-bit key.
+// Keys should hash everything the data was derived from, so entries never
+// need to be invalidated, only replaced.
+//
+// Entries are written to a temporary file and renamed into place, so
+// interpreters racing to fill the same entry never see a partial one.
+// Loads map the entry (see filemap.h) and check it against the hash of its
+// contents stored when it was saved; NULL if it is missing or damaged.
+truss_message* loadCacheEntry(const std::string& cacheName, uint64_t key);
+bool saveCacheEntry(const std::string& cacheName, uint64_t key,
+                    const void* data, uint64_t length);
+
+} // namespace truss
+
+#endif // TRUSS_DISKCACHE_H_
@@ -0,0 +1,294 @@
+#include "filemap.h"
+#include "messagepool.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace truss;
+
+namespace {
+
+struct Mapping {
+    void* base;
+    size_t length;
+};
+
+void unmapRelease(truss_message* /*msg*/, void* userdata) {
+    Mapping* mapping = static_cast<Mapping*>(userdata);
+#if defined(_WIN32)
+    UnmapViewOfFile(mapping->base);
+#else
+    munmap(mapping->base, mapping->length);
+#endif
+    delete mapping;
+}
+
+truss_message* wrapMapping(void* base, size_t mapLength, size_t delta, size_t length) {
+    Mapping* mapping = new Mapping;
+    mapping->base = base;
+    mapping->length = mapLength;
+    truss_message* msg = MessagePool::instance().wrapExternal(
+        static_cast<unsigned char*>(base) + delta, length, unmapRelease, mapping);
+    if (msg == NULL) {
+        unmapRelease(NULL, mapping);
+        return NULL;
+    }
+    // pages are read-only, so the message is safe to share as-is
+    MessagePool::blockOf(msg)->flags.fetch_or(MessageBlock::FROZEN,
+                                              std::memory_order_relaxed);
+    return msg;
+}
+
+// Zip central directory, keyed by entry name
+struct ZipCentralEntry {
+    uint64_t localHeaderOffset;
+    uint64_t compressedSize;
+    uint64_t size;
+    uint16_t method;
+};
+// An archive's parsed central directory, along with the size and mtime the
+// archive had when it was parsed; a replaced archive (e.g. remounted after
+// a rebuild) no longer matches, and is parsed again
+struct ZipIndex {
+    bool valid;
+    int64_t fileSize;
+    int64_t mtime;
+    std::map<std::string, ZipCentralEntry> entries;
+};
+
+std::mutex zipIndexLock_;
+std::map<std::string, ZipIndex> zipIndices_;
+
+uint16_t readU16(const unsigned char* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t readU32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+const uint32_t ZIP_EOCD_SIG = 0x06054b50;
+const uint32_t ZIP_CENTRAL_SIG = 0x02014b50;
+const uint32_t ZIP_LOCAL_SIG = 0x04034b50;
+const size_t ZIP_EOCD_SIZE = 22;
+const size_t ZIP_CENTRAL_SIZE = 46;
+const size_t ZIP_LOCAL_SIZE = 30;
+
+bool parseZipIndex(const std::string& archivePath, ZipIndex& index) {
+    std::ifstream file(archivePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+    if (fileSize < ZIP_EOCD_SIZE) {
+        return false;
+    }
+
+    // the end of central directory record sits behind an optional comment
+    // of up to 64 KB, so scan backwards through the tail of the file
+    uint64_t tailSize = std::min<uint64_t>(fileSize, ZIP_EOCD_SIZE + 65535);
+    std::vector<unsigned char> tail(static_cast<size_t>(tailSize));
+    file.seekg(static_cast<std::streamoff>(fileSize - tailSize), std::ios::beg);
+    file.read(reinterpret_cast<char*>(tail.data()), tail.size());
+    const unsigned char* eocd = NULL;
+    for (size_t pos = tail.size() - ZIP_EOCD_SIZE + 1; pos-- > 0;) {
+        if (readU32(&tail[pos]) == ZIP_EOCD_SIG) {
+            eocd = &tail[pos];
+            break;
+        }
+    }
+    if (eocd == NULL) {
+        return false;
+    }
+
+    uint32_t cdSize = readU32(eocd + 12);
+    uint32_t cdOffset = readU32(eocd + 16);
+    if (cdOffset == 0xffffffff || cdSize == 0xffffffff ||
+        uint64_t(cdOffset) + cdSize > fileSize) {
+        return false; // zip64 or corrupt
+    }
+
+    std::vector<unsigned char> cd(cdSize);
+    file.seekg(cdOffset, std::ios::beg);
+    file.read(reinterpret_cast<char*>(cd.data()), cd.size());
+    if (!file) {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos + ZIP_CENTRAL_SIZE <= cd.size() && readU32(&cd[pos]) == ZIP_CENTRAL_SIG) {
+        const unsigned char* hdr = &cd[pos];
+        uint16_t nameLen = readU16(hdr + 28);
+        uint16_t extraLen = readU16(hdr + 30);
+        uint16_t commentLen = readU16(hdr + 32);
+        if (pos + ZIP_CENTRAL_SIZE + nameLen > cd.size()) {
+            break;
+        }
+        std::string name(reinterpret_cast<const char*>(hdr + ZIP_CENTRAL_SIZE), nameLen);
+        ZipCentralEntry entry;
+        entry.method = readU16(hdr + 10);
+        entry.compressedSize = readU32(hdr + 20);
+        entry.size = readU32(hdr + 24);
+        entry.localHeaderOffset = readU32(hdr + 42);
+        if (!name.empty() && name[name.size() - 1] != '/') {
+            index.entries[name] = entry;
+        }
+        pos += ZIP_CENTRAL_SIZE + nameLen + extraLen + commentLen;
+    }
+    return true;
+}
+
+} // namespace
+
+truss_message* truss::mapFileRegion(const std::string& path, uint64_t offset, int64_t length) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || offset > uint64_t(fileSize.QuadPart)) {
+        CloseHandle(file);
+        return NULL;
+    }
+    uint64_t available = uint64_t(fileSize.QuadPart) - offset;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset > uint64_t(st.st_size)) {
+        close(fd);
+        return NULL;
+    }
+    uint64_t available = uint64_t(st.st_size) - offset;
+#endif
+    uint64_t mapLength = (length < 0) ? available : uint64_t(length);
+    if (mapLength > available) {
+        mapLength = available;
+    }
+    if (mapLength == 0) {
+        // nothing to map; an ordinary empty message behaves the same
+#if defined(_WIN32)
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+        return MessagePool::instance().allocate(0);
+    }
+
+    // mappings have to start on a page (allocation granularity) boundary
+#if defined(_WIN32)
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    uint64_t granularity = sysinfo.dwAllocationGranularity;
+#else
+    uint64_t granularity = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+    uint64_t alignedOffset = offset - (offset % granularity);
+    size_t delta = static_cast<size_t>(offset - alignedOffset);
+    size_t viewLength = static_cast<size_t>(mapLength) + delta;
+
+#if defined(_WIN32)
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    void* base = MapViewOfFile(mapping, FILE_MAP_READ,
+                               static_cast<DWORD>(alignedOffset >> 32),
+                               static_cast<DWORD>(alignedOffset & 0xffffffff),
+                               viewLength);
+    CloseHandle(mapping); // the view keeps the mapping alive
+    if (base == NULL) {
+        return NULL;
+    }
+#else
+    void* base = mmap(NULL, viewLength, PROT_READ, MAP_PRIVATE, fd,
+                      static_cast<off_t>(alignedOffset));
+    close(fd); // the mapping keeps the file alive
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+#endif
+    return wrapMapping(base, viewLength, delta, static_cast<size_t>(mapLength));
+}
+
+bool truss::findZipEntry(const std::string& archivePath, const std::string& entryName,
+                         ZipEntryInfo& info) {
+    ZipCentralEntry entry;
+    {
+        struct stat st;
+        if (stat(archivePath.c_str(), &st) != 0) {
+            return false;
+        }
+        int64_t fileSize = static_cast<int64_t>(st.st_size);
+        int64_t mtime = static_cast<int64_t>(st.st_mtime);
+
+        std::lock_guard<std::mutex> lock(zipIndexLock_);
+        std::map<std::string, ZipIndex>::iterator it = zipIndices_.find(archivePath);
+        if (it == zipIndices_.end()) {
+            it = zipIndices_.insert(std::make_pair(archivePath, ZipIndex())).first;
+            it->second.fileSize = -1;
+        }
+        if (it->second.fileSize != fileSize || it->second.mtime != mtime) {
+            // cache failures too so a bad archive is only scanned once
+            it->second.entries.clear();
+            it->second.fileSize = fileSize;
+            it->second.mtime = mtime;
+            it->second.valid = parseZipIndex(archivePath, it->second);
+        }
+        if (!it->second.valid) {
+            return false;
+        }
+        std::map<std::string, ZipCentralEntry>::iterator entryIt =
+            it->second.entries.find(entryName);
+        if (entryIt == it->second.entries.end()) {
+            return false;
+        }
+        entry = entryIt->second;
+    }
+
+    // the local header repeats the name and has its own extra field, so the
+    // data offset can only be found by reading it
+    std::ifstream file(archivePath.c_str(), std::ios::in | std::ios::binary);
+    unsigned char local[ZIP_LOCAL_SIZE];
+    file.seekg(static_cast<std::streamoff>(entry.localHeaderOffset), std::ios::beg);
+    file.read(reinterpret_cast<char*>(local), ZIP_LOCAL_SIZE);
+    if (!file || readU32(local) != ZIP_LOCAL_SIG) {
+        return false;
+    }
+    info.dataOffset = entry.localHeaderOffset + ZIP_LOCAL_SIZE +
+                      readU16(local + 26) + readU16(local + 28);
+    info.compressedSize = entry.compressedSize;
+    info.size = entry.size;
+    info.method = entry.method;
+    return true;
+}
+
+bool truss::isRealDirectory(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    return (st.st_mode & S_IFMT) == S_IFDIR;
+}
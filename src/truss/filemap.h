@@ -0,0 +1,34 @@
+#ifndef TRUSS_FILEMAP_H_
+#define TRUSS_FILEMAP_H_
+
+#include <string>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// Location of an entry's data inside a zip archive
+struct ZipEntryInfo {
+    uint64_t dataOffset;
+    uint64_t compressedSize;
+    uint64_t size;
+    uint16_t method;    // 0 = stored, 8 = deflate, ...
+};
+
+// Maps a region of a file on the real filesystem read-only and wraps it in
+// a frozen truss_message; the mapping is released with the last reference.
+// A negative length maps to the end of the file. Returns NULL on failure.
+truss_message* mapFileRegion(const std::string& path, uint64_t offset, int64_t length);
+
+// Looks up an entry in a zip archive (the central directory of each
+// archive is parsed once and cached until the archive's size or mtime
+// changes). Returns false if the archive or entry
+// can't be found or uses features we don't parse (e.g., zip64).
+bool findZipEntry(const std::string& archivePath, const std::string& entryName,
+                  ZipEntryInfo& info);
+
+bool isRealDirectory(const std::string& path);
+
+} // namespace truss
+
+#endif // TRUSS_FILEMAP_H_
@@ -0,0 +1,184 @@
+#include "filestream.h"
+#include "core.h"
+
+#include <physfs.h>
+
+using namespace truss;
+
+namespace {
+
+// PhysFS takes 32-bit object counts, so large transfers are split up
+const int64_t PHYSFS_MAX_CHUNK = 0x40000000;
+
+int64_t rawTell(FILE* file) {
+#if defined(_WIN32)
+    return _ftelli64(file);
+#else
+    return static_cast<int64_t>(ftello(file));
+#endif
+}
+
+bool rawSeek(FILE* file, int64_t pos, int whence) {
+#if defined(_WIN32)
+    return _fseeki64(file, pos, whence) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(pos), whence) == 0;
+#endif
+}
+
+} // namespace
+
+FileStream::FileStream() : physfsFile_(NULL), rawFile_(NULL) {}
+
+FileStream* FileStream::open(const char* filename, int mode) {
+    int access = mode & ~TRUSS_STREAM_RAW;
+    if (access != TRUSS_STREAM_READ && access != TRUSS_STREAM_WRITE &&
+        access != TRUSS_STREAM_APPEND) {
+        core().logPrint(TRUSS_LOG_ERROR, "Invalid stream mode %d for '%s'.", mode, filename);
+        return NULL;
+    }
+
+    FileStream* stream = new FileStream;
+    if (mode & TRUSS_STREAM_RAW) {
+        const char* fmode = "rb";
+        if (access == TRUSS_STREAM_WRITE) {
+            fmode = "wb";
+        } else if (access == TRUSS_STREAM_APPEND) {
+            fmode = "ab";
+        }
+        stream->rawFile_ = fopen(filename, fmode);
+    } else {
+        if (access == TRUSS_STREAM_READ) {
+            stream->physfsFile_ = PHYSFS_openRead(filename);
+        } else if (access == TRUSS_STREAM_WRITE) {
+            stream->physfsFile_ = PHYSFS_openWrite(filename);
+        } else {
+            stream->physfsFile_ = PHYSFS_openAppend(filename);
+        }
+    }
+
+    if (stream->physfsFile_ == NULL && stream->rawFile_ == NULL) {
+        core().logPrint(TRUSS_LOG_ERROR, "Unable to open stream '%s'.", filename);
+        delete stream;
+        return NULL;
+    }
+    return stream;
+}
+
+FileStream::~FileStream() {
+    close();
+}
+
+bool FileStream::close() {
+    bool ok = true;
+    if (physfsFile_ != NULL) {
+        ok = PHYSFS_close(physfsFile_) != 0;
+        physfsFile_ = NULL;
+    }
+    if (rawFile_ != NULL) {
+        ok = fclose(rawFile_) == 0;
+        rawFile_ = NULL;
+    }
+    return ok;
+}
+
+int64_t FileStream::read(void* dest, int64_t size) {
+    if (size <= 0) {
+        return 0;
+    }
+    if (rawFile_ != NULL) {
+        size_t nread = fread(dest, 1, static_cast<size_t>(size), rawFile_);
+        if (nread == 0 && ferror(rawFile_)) {
+            return -1;
+        }
+        return static_cast<int64_t>(nread);
+    }
+
+    int64_t total = 0;
+    unsigned char* pos = static_cast<unsigned char*>(dest);
+    while (total < size) {
+        int64_t chunk = size - total;
+        if (chunk > PHYSFS_MAX_CHUNK) {
+            chunk = PHYSFS_MAX_CHUNK;
+        }
+        PHYSFS_sint64 nread = PHYSFS_read(physfsFile_, pos + total, 1,
+                                          static_cast<PHYSFS_uint32>(chunk));
+        if (nread < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += nread;
+        if (nread < chunk) {
+            break; // end of file
+        }
+    }
+    return total;
+}
+
+int64_t FileStream::write(const void* src, int64_t size) {
+    if (size <= 0) {
+        return 0;
+    }
+    if (rawFile_ != NULL) {
+        size_t nwritten = fwrite(src, 1, static_cast<size_t>(size), rawFile_);
+        if (nwritten == 0 && ferror(rawFile_)) {
+            return -1;
+        }
+        return static_cast<int64_t>(nwritten);
+    }
+
+    int64_t total = 0;
+    const unsigned char* pos = static_cast<const unsigned char*>(src);
+    while (total < size) {
+        int64_t chunk = size - total;
+        if (chunk > PHYSFS_MAX_CHUNK) {
+            chunk = PHYSFS_MAX_CHUNK;
+        }
+        PHYSFS_sint64 nwritten = PHYSFS_write(physfsFile_, pos + total, 1,
+                                              static_cast<PHYSFS_uint32>(chunk));
+        if (nwritten < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += nwritten;
+        if (nwritten < chunk) {
+            break; // out of space
+        }
+    }
+    return total;
+}
+
+bool FileStream::seek(int64_t pos) {
+    if (pos < 0) {
+        return false;
+    }
+    if (rawFile_ != NULL) {
+        return rawSeek(rawFile_, pos, SEEK_SET);
+    }
+    return PHYSFS_seek(physfsFile_, static_cast<PHYSFS_uint64>(pos)) != 0;
+}
+
+int64_t FileStream::tell() {
+    if (rawFile_ != NULL) {
+        return rawTell(rawFile_);
+    }
+    return PHYSFS_tell(physfsFile_);
+}
+
+int64_t FileStream::length() {
+    if (rawFile_ != NULL) {
+        int64_t cur = rawTell(rawFile_);
+        if (cur < 0 || !rawSeek(rawFile_, 0, SEEK_END)) {
+            return -1;
+        }
+        int64_t len = rawTell(rawFile_);
+        rawSeek(rawFile_, cur, SEEK_SET);
+        return len;
+    }
+    return PHYSFS_fileLength(physfsFile_);
+}
+
+bool FileStream::eof() {
+    if (rawFile_ != NULL) {
+        return feof(rawFile_) != 0;
+    }
+    return PHYSFS_eof(physfsFile_) != 0;
+}
@@ -0,0 +1,47 @@
+#ifndef TRUSS_FILESTREAM_H_
+#define TRUSS_FILESTREAM_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <trussapi.h>
+
+struct PHYSFS_File;
+
+namespace truss {
+
+// Chunked, 64-bit file access over either a PhysFS path or (with
+// TRUSS_STREAM_RAW) a real filesystem path, so large files can be processed
+// in bounded memory.
+class FileStream {
+public:
+    // Returns NULL (and logs) if the file can't be opened
+    static FileStream* open(const char* filename, int mode);
+    ~FileStream();
+
+    // Return the number of bytes transferred, or -1 on error
+    int64_t read(void* dest, int64_t size);
+    int64_t write(const void* src, int64_t size);
+
+    // Flushes and closes the file; false if that failed (e.g. the disk
+    // filled up while buffered data was written out)
+    bool close();
+
+    bool seek(int64_t pos);
+    int64_t tell();
+    int64_t length();
+    bool eof();
+
+private:
+    FileStream();
+
+    // Mark stream as non-copyable.
+    FileStream(const FileStream&) = delete;
+    FileStream& operator=(const FileStream&) = delete;
+
+    PHYSFS_File* physfsFile_;
+    FILE* rawFile_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_FILESTREAM_H_
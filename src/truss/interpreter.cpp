@@ -1,11 +1,13 @@
 #include "interpreter.h"
 #include "core.h"
+#include "tracer.h"
 
 // TODO: switch to a better logging framework
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <chrono>
 #include <external/bx_utils.h> // has to be included early or else luaconfig.h will clobber winver
 #include <trussapi.h>
 #include <physfs.h>
@@ -18,27 +20,25 @@ void run_interpreter_thread(void* interpreter) {
 }
 
 Interpreter::Interpreter(int id)
-    : thread_(NULL)
-    , terraState_(NULL)
-    , id_(id)
+    : id_(id)
 	, state_(THREAD_NOT_STARTED)
+	, booted_(false)
+	, verboseLevel_(0)
+	, debugEnabled_(0)
+	, thread_(NULL)
 	, stepRequested_(false)
-{
-    // TODO: Is any of this necessary?
-    curMessages_ = new std::vector < truss_message* > ;
-    fetchedMessages_ = new std::vector < truss_message* >;
-}
+	, lastStepMs_(0.0)
+	, terraState_(NULL)
+{}
 
 Interpreter::~Interpreter() {
 	stop();
-	for (auto msg : *curMessages_) {
-		core().releaseMessage(msg);
-	}
-	for (auto msg : *fetchedMessages_) {
-		core().releaseMessage(msg);
+	releaseBatch_(fetchedMessages_);
+	for (auto& typed : typedMessages_) {
+		releaseBatch_(typed.second);
 	}
-	delete curMessages_;
-	delete fetchedMessages_;
+	mailbox_.drain(heldMessages_);
+	releaseBatch_(heldMessages_);
 }
 
 int Interpreter::getID() const {
@@ -55,24 +55,38 @@ void Interpreter::setDebug(int debugLevel) {
     }
 }
 
-void Interpreter::start(const char* arg, bool multithreaded) {
-	if (state_ != THREAD_NOT_STARTED) {
-		core().logMessage(TRUSS_LOG_ERROR, "Can't start interpreter: in wrong state.");
-		return;
-	}
+bool Interpreter::isBooted() const {
+    return booted_;
+}
+
+bool Interpreter::boot() {
+    if (booted_) {
+        return true;
+    }
+    std::string traceName;
+    if (Tracer::instance().isEnabled()) {
+        std::stringstream ss;
+        ss << "boot [" << id_ << "]";
+        traceName = ss.str();
+    }
+    TraceScope trace(traceName.c_str(), "interpreter");
+    LogInterpreterScope logScope(id_);
 
     terraState_ = luaL_newstate();
     if (!terraState_) {
         core().logMessage(TRUSS_LOG_ERROR, "Error creating a new Lua state.");
         state_ = THREAD_FATAL_ERROR;
-        return;
+        return false;
     }
 
     luaL_openlibs(terraState_);
     terra_Options* opts = new terra_Options;
     opts->verbose = verboseLevel_;
     opts->debug = debugEnabled_;
-    terra_initwithoptions(terraState_, opts);
+    {
+        TraceScope terraTrace("terra_initwithoptions", "interpreter");
+        terra_initwithoptions(terraState_, opts);
+    }
     delete opts; // not sure if necessary or desireable
 
     // Set some globals
@@ -80,12 +94,13 @@ void Interpreter::start(const char* arg, bool multithreaded) {
     lua_setglobal(terraState_, "TRUSS_INTERPRETER_ID");
 
     // load and execute the bootstrap script
+    TraceScope coreTrace("core.t", "interpreter");
     truss_message* bootstrap = core().loadFile("scripts/core/core.t");
     if (!bootstrap) {
         core().logMessage(TRUSS_LOG_ERROR, "Error loading core script.");
         core().setError(1000);
         state_ = THREAD_FATAL_ERROR;
-        return;
+        return false;
     }
     int res = terra_loadbuffer(terraState_,
                      (char*)bootstrap->data,
@@ -97,7 +112,7 @@ void Interpreter::start(const char* arg, bool multithreaded) {
                         lua_tostring(terraState_, -1));
         core().setError(1001);
         state_ = THREAD_FATAL_ERROR;
-        return;        
+        return false;
     }
 
     res = lua_pcall(terraState_, 0, 0, 0);
@@ -106,10 +121,52 @@ void Interpreter::start(const char* arg, bool multithreaded) {
                         lua_tostring(terraState_, -1));
         core().setError(1001);
         state_ = THREAD_FATAL_ERROR;
+        return false;
+    }
+    booted_ = true;
+    return true;
+}
+
+bool Interpreter::reset() {
+    if (thread_ != NULL) {
+        return false;
+    }
+    if (terraState_ != NULL) {
+        lua_close(terraState_);
+        terraState_ = NULL;
+    }
+    booted_ = false;
+    setDebug(0);
+    lastStepMs_.store(0.0, std::memory_order_relaxed);
+    releaseBatch_(fetchedMessages_);
+    for (auto& typed : typedMessages_) {
+        releaseBatch_(typed.second);
+    }
+    mailbox_.drain(heldMessages_);
+    releaseBatch_(heldMessages_);
+
+    std::lock_guard<std::mutex> lock(stateLock_);
+    state_ = THREAD_NOT_STARTED;
+    return true;
+}
+
+void Interpreter::start(const char* arg, bool multithreaded) {
+	if (state_ != THREAD_NOT_STARTED) {
+		core().logMessage(TRUSS_LOG_ERROR, "Can't start interpreter: in wrong state.");
+		return;
+	}
+    if (!boot()) {
         return;
     }
 
     // Call init
+    std::string traceName;
+    if (Tracer::instance().isEnabled()) {
+        std::stringstream ss;
+        ss << "init [" << id_ << "] " << (arg ? arg : "");
+        traceName = ss.str();
+    }
+    TraceScope trace(traceName.c_str(), "interpreter");
     if (!call("_core_init", arg)) {
         core().logPrint(TRUSS_LOG_ERROR, "Error in core_init, stopping interpreter [%d].", id_);
         core().setError(1002);
@@ -125,7 +182,17 @@ void Interpreter::start(const char* arg, bool multithreaded) {
 void Interpreter::stop() {
 	core().logPrint(TRUSS_LOG_INFO, "Stopping [%d]", id_);
 	setState_(THREAD_TERMINATED);
-	if (thread_ != NULL && thread_->joinable()) {
+	if (thread_ == NULL || thread_->get_id() == std::this_thread::get_id()) {
+		// stopping from inside a step: the thread loop exits on its own
+		return;
+	}
+	{
+		// taking the step lock guarantees the thread is waiting (or has
+		// already seen the new state) so the wakeup can't be lost
+		std::lock_guard<std::mutex> lock(stepLock_);
+	}
+	stepCV_.notify_all();
+	if (thread_->joinable()) {
 		thread_->join();
 		delete thread_;
 		thread_ = NULL;
@@ -134,7 +201,10 @@ void Interpreter::stop() {
 
 bool Interpreter::step() {
 	if (thread_ == NULL) {
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
 		step_();
+		std::chrono::duration<double, std::milli> dt = std::chrono::steady_clock::now() - t0;
+		lastStepMs_.store(dt.count(), std::memory_order_relaxed);
 		return true;
 	}
 	if (getState() != THREAD_IDLE) {
@@ -149,8 +219,29 @@ bool Interpreter::step() {
 	return true;
 }
 
-void Interpreter::step_() {
-	call("_core_update");
+bool Interpreter::step_() {
+	return call("_core_update");
+}
+
+bool Interpreter::waitForStep(int timeoutMs) {
+	if (thread_ == NULL) {
+		return true; // steps run synchronously
+	}
+	std::unique_lock<std::mutex> lock(stepLock_, std::defer_lock);
+	if (thread_->get_id() == std::this_thread::get_id()) {
+		return false;
+	}
+	lock.lock();
+	auto done = [this] { return !stepRequested_; };
+	if (timeoutMs < 0) {
+		stepDoneCV_.wait(lock, done);
+		return true;
+	}
+	return stepDoneCV_.wait_for(lock, std::chrono::milliseconds(timeoutMs), done);
+}
+
+double Interpreter::getLastStepTime() {
+	return lastStepMs_.load(std::memory_order_relaxed);
 }
 
 truss_interpreter_state Interpreter::getState() {
@@ -169,57 +260,125 @@ bool Interpreter::setState_(truss_interpreter_state newState) {
 }
 
 void Interpreter::threadLoop_() {
+	if (Tracer::instance().isEnabled()) {
+		std::stringstream threadName;
+		threadName << "interpreter [" << id_ << "]";
+		Tracer::instance().setThreadName(threadName.str());
+	}
+
+	auto stopped = [this] {
+		truss_interpreter_state state = getState();
+		return state == THREAD_TERMINATED || state == THREAD_FATAL_ERROR;
+	};
+
+	// the step lock is held except while waiting and while stepping, so
+	// waiters (waitForStep) can time out during a long step; a finished
+	// step goes back to idle under the lock before waiters are woken
+	std::unique_lock<std::mutex> lock(stepLock_);
 	while (true) {
-		std::unique_lock<std::mutex> lock(stepLock_);
-		if (!setState_(THREAD_IDLE)) {
+		// start() leaves the state idle before this thread runs, so a step
+		// can already be pending (and its notify gone) on the first pass;
+		// the predicate catches that, and a stop() made while stepping
+		stepCV_.wait(lock, [&] { return stepRequested_ || stopped(); });
+		if (stopped()) {
 			break;
 		}
-		stepCV_.wait(lock);
-		if (!stepRequested_) {
-			continue; // handle spurious unlocks
-		}
+		lock.unlock();
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
 		step_();
+		std::chrono::duration<double, std::milli> dt = std::chrono::steady_clock::now() - t0;
+		lastStepMs_.store(dt.count(), std::memory_order_relaxed);
+		lock.lock();
 		stepRequested_ = false;
+		if (stopped() || !setState_(THREAD_IDLE)) {
+			break;
+		}
+		stepDoneCV_.notify_all();
 	}
+	// a request that arrived with the stop is dropped; don't leave waiters hanging
+	stepRequested_ = false;
+	stepDoneCV_.notify_all();
 }
 
 void Interpreter::sendMessage(truss_message* message) {
-    std::lock_guard<std::mutex> lock(messageLock_);
     truss_acquire_message(message);
-    curMessages_->push_back(message);
+    mailbox_.push(message);
 }
 
-int Interpreter::fetchMessages() {
-    std::lock_guard<std::mutex> Lock(messageLock_);
-
-    // swap messages
-    std::vector<truss_message*>* temp = curMessages_;
-    curMessages_ = fetchedMessages_;
-    fetchedMessages_ = temp;
+void Interpreter::sendAcquiredMessage(truss_message* message) {
+    mailbox_.push(message);
+}
 
-    // clear the 'current' messages (i.e., the old fetched messages)
-    for(auto msg : *curMessages_) {
+void Interpreter::releaseBatch_(std::vector<truss_message*>& batch) {
+    for (auto msg : batch) {
         truss_release_message(msg);
     }
-    curMessages_->clear();
-    return fetchedMessages_->size();
+    batch.clear();
+}
+
+int Interpreter::fetchMessages(int messageType) {
+    // release the previous batch of this kind, then take everything sent since
+    mailbox_.drain(heldMessages_);
+    if (messageType < 0) {
+        releaseBatch_(fetchedMessages_);
+        fetchedMessages_.swap(heldMessages_);
+        return static_cast<int>(fetchedMessages_.size());
+    }
+
+    std::vector<truss_message*>& fetched = typedMessages_[messageType];
+    releaseBatch_(fetched);
+    size_t kept = 0;
+    for (size_t i = 0; i < heldMessages_.size(); ++i) {
+        truss_message* msg = heldMessages_[i];
+        if (msg->message_type == static_cast<unsigned int>(messageType)) {
+            fetched.push_back(msg);
+        } else {
+            heldMessages_[kept++] = msg;
+        }
+    }
+    heldMessages_.resize(kept);
+    return static_cast<int>(fetched.size());
 }
 
 truss_message* Interpreter::getMessage(int index) {
     // Note: don't need to lock because only 'our' thread
     // should call fetchMessages (which is the only other function
     // that touches fetchedMessages_)
-    return (*fetchedMessages_)[index];
+    if (index < 0 || index >= static_cast<int>(fetchedMessages_.size())) {
+        return NULL;
+    }
+    return fetchedMessages_[index];
+}
+
+truss_message** Interpreter::getMessageArray(int messageType) {
+    std::vector<truss_message*>* fetched = &fetchedMessages_;
+    if (messageType >= 0) {
+        auto typed = typedMessages_.find(messageType);
+        if (typed == typedMessages_.end()) {
+            return NULL;
+        }
+        fetched = &typed->second;
+    }
+    if (fetched->empty()) {
+        return NULL;
+    }
+    return fetched->data();
 }
 
 bool Interpreter::call(const char* funcname, const char* argstr) {
+    LogInterpreterScope logScope(id_);
     int nargs = 0;
     lua_getglobal(terraState_, funcname);
     if(argstr != NULL) {
         nargs = 1;
         lua_pushstring(terraState_, argstr);
     }
-    int res = lua_pcall(terraState_, nargs, 0, 0);
+    int res;
+    {
+        // datastore values read by the script stay valid for the whole call
+        Datastore::BorrowScope borrowed;
+        res = lua_pcall(terraState_, nargs, 0, 0);
+    }
     if(res != 0) {
 		core().logPrint(TRUSS_LOG_ERROR, "[%d] call error: %s", id_, lua_tostring(terraState_, -1));
 		setState_(THREAD_SCRIPT_ERROR);
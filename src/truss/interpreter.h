@@ -2,6 +2,7 @@
 #define TRUSS_INTERPRETER_H_
 
 #include <thread>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <string>
@@ -10,6 +11,7 @@
 #include <fstream>
 #include <terra/terra.h>
 #include <trussapi.h>
+#include "mailbox.h"
 
 namespace truss {
 
@@ -25,17 +27,44 @@ public:
     // Must be called before starting
     void setDebug(int debugLevel);
 
+    // Creates the Lua/Terra state and runs core.t, but not the script's
+    // init; start() does this itself if it hasn't been done (used to boot
+    // interpreters ahead of time, see interpreterpool.h)
+    bool boot();
+    bool isBooted() const;
+    // Closes the Lua/Terra state of an interpreter that was never started
+    // and returns it to its freshly constructed state (see
+    // Core::releaseInterpreter); returns false if it has a thread
+    bool reset();
+
     // Starting and stopping
     void start(const char* arg, bool multithreaded);
     void stop();
 	bool step();
-	void step_();
+	bool step_();
 	truss_interpreter_state getState();
 
-    // Send a message
+	// Blocks until a requested step has finished (timeoutMs < 0: no
+	// limit); returns false on timeout, or if called from the
+	// interpreter's own thread while it is stepping
+	bool waitForStep(int timeoutMs = -1);
+	// Wall time of the last finished step in milliseconds
+	double getLastStepTime();
+
+    // Send a message (any thread)
     void sendMessage(truss_message* message);
-    int fetchMessages();
+    // Send a message the caller has already acquired on our behalf
+    void sendAcquiredMessage(truss_message* message);
+
+    // Receiving: only the interpreter's own thread should call these.
+    // With a messageType >= 0 only messages of that type are fetched; the
+    // others are held (in order) for a later fetch. Every message type
+    // (and the untyped fetch) has its own batch, which stays valid until
+    // the next fetch of the same type, so e.g. a poller fetching io
+    // results doesn't free the messages the app is still reading.
+    int fetchMessages(int messageType = -1);
     truss_message* getMessage(int index);
+    truss_message** getMessageArray(int messageType = -1);
 
 	void threadLoop_();
 private:
@@ -47,6 +76,8 @@ private:
 	std::mutex stateLock_;
 	bool setState_(truss_interpreter_state newState);
 
+    bool booted_;
+
     // Debug settings (ints because that's what terra wants)
     int verboseLevel_;
     int debugEnabled_;
@@ -61,13 +92,16 @@ private:
 	std::mutex stepLock_;
 	bool stepRequested_;
 	std::condition_variable stepCV_;
-
-    // Lock for messaging
-    std::mutex messageLock_;
-
-    // Messages
-    std::vector<truss_message*>* curMessages_;
-    std::vector<truss_message*>* fetchedMessages_;
+	std::condition_variable stepDoneCV_;
+	std::atomic<double> lastStepMs_;
+
+    // Incoming messages (lock-free), messages drained but passed over by a
+    // typed fetch, and the last fetched batch (untyped and per type)
+    Mailbox mailbox_;
+    std::vector<truss_message*> heldMessages_;
+    std::vector<truss_message*> fetchedMessages_;
+    std::map<int, std::vector<truss_message*> > typedMessages_;
+    static void releaseBatch_(std::vector<truss_message*>& batch);
 
     // Terra state
     lua_State* terraState_;
@@ -0,0 +1,177 @@
+#include "interpreterpool.h"
+#include "core.h"
+#include "tracer.h"
+
+#include <chrono>
+
+using namespace truss;
+
+namespace {
+
+double elapsedMs(std::chrono::steady_clock::time_point t0) {
+    std::chrono::duration<double, std::milli> dt = std::chrono::steady_clock::now() - t0;
+    return dt.count();
+}
+
+} // namespace
+
+InterpreterPool::InterpreterPool()
+    : target_(0), booting_(0), stopping_(false),
+      warmSpawns_(0), coldSpawns_(0), boots_(0),
+      warmSpawnTotalMs_(0.0), coldSpawnTotalMs_(0.0), bootTotalMs_(0.0),
+      lastSpawnMs_(0.0) {}
+
+InterpreterPool::~InterpreterPool() {
+    stop();
+}
+
+void InterpreterPool::setTargetSize(int count) {
+    std::vector<Interpreter*> trimmed;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        target_ = count > 0 ? count : 0;
+        while (static_cast<int>(ready_.size()) > target_) {
+            trimmed.push_back(ready_.back());
+            ready_.pop_back();
+        }
+        refill_();
+    }
+    // never handed out, so nobody else has them: free their states and
+    // slots, or repeated resizing would run out of interpreter slots
+    for (Interpreter* interpreter : trimmed) {
+        core().releaseInterpreter(interpreter);
+    }
+}
+
+int InterpreterPool::getTargetSize() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return target_;
+}
+
+Interpreter* InterpreterPool::spawn(int debugLevel, const char* scriptName) {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    // pooled interpreters were booted without debug options
+    Interpreter* interpreter = NULL;
+    if (debugLevel <= 0) {
+        std::lock_guard<std::mutex> lock(lock_);
+        interpreter = take_();
+        if (interpreter != NULL) {
+            refill_();
+        }
+    }
+    bool warm = (interpreter != NULL);
+    if (!warm) {
+        interpreter = core().spawnInterpreter();
+        if (interpreter == NULL) {
+            return NULL;
+        }
+        interpreter->setDebug(debugLevel);
+    }
+    interpreter->start(scriptName, true);
+
+    double dt = elapsedMs(t0);
+    std::lock_guard<std::mutex> lock(lock_);
+    if (warm) {
+        ++warmSpawns_;
+        warmSpawnTotalMs_ += dt;
+    } else {
+        ++coldSpawns_;
+        coldSpawnTotalMs_ += dt;
+    }
+    lastSpawnMs_ = dt;
+    return interpreter;
+}
+
+void InterpreterPool::getStats(truss_interpreter_pool_stats* stats) {
+    std::lock_guard<std::mutex> lock(lock_);
+    stats->target_size = target_;
+    stats->ready = static_cast<int>(ready_.size());
+    stats->booting = booting_;
+    stats->warm_spawns = warmSpawns_;
+    stats->cold_spawns = coldSpawns_;
+    stats->last_spawn_ms = lastSpawnMs_;
+    stats->avg_warm_spawn_ms = warmSpawns_ > 0 ? warmSpawnTotalMs_ / warmSpawns_ : 0.0;
+    stats->avg_cold_spawn_ms = coldSpawns_ > 0 ? coldSpawnTotalMs_ / coldSpawns_ : 0.0;
+    stats->avg_boot_ms = boots_ > 0 ? bootTotalMs_ / boots_ : 0.0;
+    stats->occupancy = target_ > 0 ? double(ready_.size()) / target_ : 0.0;
+}
+
+void InterpreterPool::stop() {
+    std::list<std::unique_ptr<Booter>> booters;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stopping_ = true;
+        booters.swap(booters_);
+    }
+    for (auto& booter : booters) {
+        booter->thread.join();
+    }
+}
+
+// Called with lock_ held
+Interpreter* InterpreterPool::take_() {
+    while (!ready_.empty()) {
+        Interpreter* interpreter = ready_.back();
+        ready_.pop_back();
+        // skip any that were stopped (e.g., by truss_shutdown) while waiting
+        if (interpreter->getState() == THREAD_NOT_STARTED) {
+            return interpreter;
+        }
+    }
+    return NULL;
+}
+
+// Called with lock_ held
+void InterpreterPool::refill_() {
+    reapBooters_();
+    while (!stopping_ && static_cast<int>(ready_.size()) + booting_ < target_) {
+        // the id is reserved now, so the interpreter boots knowing it
+        Interpreter* interpreter = core().spawnInterpreter();
+        if (interpreter == NULL) {
+            break;
+        }
+        ++booting_;
+        Booter* booter = new Booter;
+        booter->done = false;
+        booters_.push_back(std::unique_ptr<Booter>(booter));
+        booter->thread = std::thread(&InterpreterPool::boot_, this, interpreter, booter);
+    }
+}
+
+// Called with lock_ held
+void InterpreterPool::reapBooters_() {
+    for (auto it = booters_.begin(); it != booters_.end();) {
+        if ((*it)->done) {
+            (*it)->thread.join();
+            it = booters_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void InterpreterPool::boot_(Interpreter* interpreter, Booter* booter) {
+    Tracer::instance().setThreadName("interpreter pool boot");
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    bool booted = interpreter->boot();
+    double dt = elapsedMs(t0);
+
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        --booting_;
+        ++boots_;
+        bootTotalMs_ += dt;
+        if (booted) {
+            ready_.push_back(interpreter);
+        }
+        booter->done = true;
+    }
+    if (!booted) {
+        // not replaced until the target is set again: a broken install
+        // would just keep failing
+        core().logPrint(TRUSS_LOG_ERROR, "Pooled interpreter [%d] failed to boot.",
+                        interpreter->getID());
+        core().releaseInterpreter(interpreter);
+    }
+}
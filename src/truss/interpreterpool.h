@@ -0,0 +1,73 @@
+#ifndef TRUSS_INTERPRETERPOOL_H_
+#define TRUSS_INTERPRETERPOOL_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+class Interpreter;
+
+// Keeps a number of interpreters booted (Lua/Terra state created and core.t
+// run) in the background, so spawning one only has to run the target
+// script's init. Boots run in parallel, one thread each, and the pool is
+// topped back up whenever an interpreter is handed out.
+class InterpreterPool {
+public:
+    InterpreterPool();
+    ~InterpreterPool();
+
+    // Number of interpreters to keep ready (0 disables the pool); extra
+    // ready interpreters are closed and their slots released for reuse
+    void setTargetSize(int count);
+    int getTargetSize();
+
+    // Starts an interpreter running the given script on its own thread,
+    // from the pool when possible; returns NULL on failure
+    Interpreter* spawn(int debugLevel, const char* scriptName);
+
+    void getStats(truss_interpreter_pool_stats* stats);
+
+    // Waits for boots in progress; ready interpreters are left as they are
+    void stop();
+
+private:
+    // Mark pool as non-copyable.
+    InterpreterPool(const InterpreterPool&) = delete;
+    InterpreterPool& operator=(const InterpreterPool&) = delete;
+
+    struct Booter {
+        std::thread thread;
+        bool done;
+    };
+
+    Interpreter* take_();
+    void refill_();
+    void reapBooters_();
+    void boot_(Interpreter* interpreter, Booter* booter);
+
+    std::mutex lock_;
+    std::vector<Interpreter*> ready_;
+    std::list<std::unique_ptr<Booter>> booters_;
+    int target_;
+    int booting_;
+    bool stopping_;
+
+    // metrics (guarded by lock_)
+    uint64_t warmSpawns_;
+    uint64_t coldSpawns_;
+    uint64_t boots_;
+    double warmSpawnTotalMs_;
+    double coldSpawnTotalMs_;
+    double bootTotalMs_;
+    double lastSpawnMs_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_INTERPRETERPOOL_H_
@@ -0,0 +1,208 @@
+#include "iopool.h"
+#include "core.h"
+#include "messagepool.h"
+#include "filestream.h"
+
+#include <algorithm>
+
+using namespace truss;
+
+namespace {
+
+// The result struct is owned by its message; releasing the message also
+// drops the loaded data unless the receiver acquired it.
+void releaseResult(truss_message* /*msg*/, void* userdata) {
+    truss_io_result* result = static_cast<truss_io_result*>(userdata);
+    if (result->data != NULL) {
+        core().releaseMessage(result->data);
+    }
+    delete result;
+}
+
+int defaultThreadCount() {
+    // loads are mostly waiting on the disk, so a few threads are plenty
+    int hw = static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(1, std::min(4, hw / 2));
+}
+
+} // namespace
+
+IOPool::IOPool() : threadCount_(0), generation_(0), stopping_(false),
+                   nextID_(1), pending_(0) {}
+
+IOPool::~IOPool() {
+    stop();
+}
+
+void IOPool::setThreadCount(int count) {
+    std::vector<std::thread> retired;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        threadCount_ = count;
+        if (workers_.empty()) {
+            return; // started lazily by the next request
+        }
+        // current workers finish their request in hand and then exit
+        ++generation_;
+        retired.swap(workers_);
+        startWorkers_(threadCount_);
+    }
+    queueCV_.notify_all();
+    for (auto& worker : retired) {
+        worker.join();
+    }
+}
+
+int IOPool::getThreadCount() {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (!workers_.empty()) {
+        return static_cast<int>(workers_.size());
+    }
+    return threadCount_ > 0 ? threadCount_ : defaultThreadCount();
+}
+
+uint64_t IOPool::load(int requester, const char* filename, int flags, int priority) {
+    Request* request = new Request;
+    request->op = TRUSS_IO_LOAD;
+    request->flags = flags;
+    request->priority = priority;
+    request->requester = requester;
+    request->filename = filename;
+    request->data = NULL;
+    return submit_(request);
+}
+
+uint64_t IOPool::save(int requester, const char* filename, truss_message* data,
+                      int flags, int priority) {
+    if (data == NULL) {
+        core().logPrint(TRUSS_LOG_ERROR, "Cannot save '%s': no data.", filename);
+        return 0;
+    }
+    // the pool holds a reference until the write is done
+    core().acquireMessage(data);
+    Request* request = new Request;
+    request->op = TRUSS_IO_SAVE;
+    request->flags = flags;
+    request->priority = priority;
+    request->requester = requester;
+    request->filename = filename;
+    request->data = data;
+    return submit_(request);
+}
+
+int IOPool::pending() {
+    return pending_.load(std::memory_order_relaxed);
+}
+
+void IOPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stopping_ = true;
+    }
+    queueCV_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+    workers_.clear();
+    stopping_ = false;
+}
+
+uint64_t IOPool::submit_(Request* request) {
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (workers_.empty()) {
+            startWorkers_(threadCount_);
+        }
+        id = nextID_++;
+        request->id = id;
+        request->sequence = id;
+        queue_.push(request);
+        pending_.fetch_add(1, std::memory_order_relaxed);
+    }
+    queueCV_.notify_one();
+    return id;
+}
+
+// Called with lock_ held
+void IOPool::startWorkers_(int count) {
+    if (count <= 0) {
+        count = defaultThreadCount();
+    }
+    for (int i = 0; i < count; ++i) {
+        workers_.push_back(std::thread(&IOPool::workerLoop_, this, generation_));
+    }
+}
+
+void IOPool::workerLoop_(uint64_t generation) {
+    while (true) {
+        Request* request = NULL;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            queueCV_.wait(lock, [&] {
+                return generation_ != generation || stopping_ || !queue_.empty();
+            });
+            if (generation_ != generation || queue_.empty()) {
+                return; // retired, or stopping with nothing left to do
+            }
+            request = queue_.top();
+            queue_.pop();
+        }
+        execute_(request);
+    }
+}
+
+void IOPool::execute_(Request* request) {
+    const char* filename = request->filename.c_str();
+    bool raw = (request->flags & TRUSS_IO_RAW) != 0;
+
+    truss_io_result* result = new truss_io_result;
+    result->request_id = request->id;
+    result->op = request->op;
+    result->status = TRUSS_IO_OK;
+    result->data = NULL;
+
+    if (request->op == TRUSS_IO_LOAD) {
+        if (request->flags & TRUSS_IO_MAP) {
+            result->data = raw ? core().mapFileRaw(filename) : core().mapFile(filename);
+        } else {
+            result->data = raw ? core().loadFileRaw(filename) : core().loadFile(filename);
+        }
+        if (result->data == NULL) {
+            result->status = TRUSS_IO_ERROR;
+        }
+    } else {
+        FileStream* stream = FileStream::open(filename,
+            TRUSS_STREAM_WRITE | (raw ? TRUSS_STREAM_RAW : 0));
+        int64_t length = static_cast<int64_t>(request->data->data_length);
+        if (stream == NULL || stream->write(request->data->data, length) != length) {
+            result->status = TRUSS_IO_ERROR;
+        }
+        // buffered data only reaches the file on close
+        if (stream != NULL && !stream->close()) {
+            result->status = TRUSS_IO_ERROR;
+        }
+        delete stream;
+        core().releaseMessage(request->data);
+    }
+
+    int requester = request->requester;
+    delete request;
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+
+    Interpreter* target = core().getInterpreter(requester);
+    if (target == NULL) {
+        releaseResult(NULL, result);
+        return;
+    }
+    truss_message* msg = MessagePool::instance().wrapExternal(
+        reinterpret_cast<unsigned char*>(result), sizeof(truss_io_result),
+        releaseResult, result);
+    if (msg == NULL) {
+        releaseResult(NULL, result);
+        return;
+    }
+    msg->message_type = TRUSS_MESSAGE_IO;
+    target->sendAcquiredMessage(msg);
+}
@@ -0,0 +1,85 @@
+#ifndef TRUSS_IOPOOL_H_
+#define TRUSS_IOPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// Background file loads and saves. Requests are serviced by a small pool of
+// threads, highest priority first (FIFO within a priority), and each result
+// is sent to the requesting interpreter as a TRUSS_MESSAGE_IO message whose
+// data is a truss_io_result.
+class IOPool {
+public:
+    IOPool();
+    ~IOPool();
+
+    // Changes the number of worker threads; queued requests are kept.
+    // A count <= 0 picks a default based on the number of cores.
+    void setThreadCount(int count);
+    int getThreadCount();
+
+    // Return a request id (> 0), or 0 if the request couldn't be queued.
+    // A requester < 0 means nobody is notified (e.g., fire-and-forget saves).
+    uint64_t load(int requester, const char* filename, int flags, int priority);
+    uint64_t save(int requester, const char* filename, truss_message* data,
+                  int flags, int priority);
+
+    // Number of requests queued or in progress
+    int pending();
+
+    // Finishes every queued request, then joins the workers
+    void stop();
+
+private:
+    // Mark pool as non-copyable.
+    IOPool(const IOPool&) = delete;
+    IOPool& operator=(const IOPool&) = delete;
+
+    struct Request {
+        uint64_t id;
+        uint64_t sequence;
+        int op;
+        int flags;
+        int priority;
+        int requester;
+        std::string filename;
+        truss_message* data;
+    };
+    struct RequestOrder {
+        bool operator()(const Request* a, const Request* b) const {
+            if (a->priority != b->priority) {
+                return a->priority < b->priority;
+            }
+            return a->sequence > b->sequence;
+        }
+    };
+
+    uint64_t submit_(Request* request);
+    void startWorkers_(int count);
+    void joinWorkers_();
+    void workerLoop_(uint64_t generation);
+    void execute_(Request* request);
+
+    std::mutex lock_;
+    std::condition_variable queueCV_;
+    std::priority_queue<Request*, std::vector<Request*>, RequestOrder> queue_;
+    std::vector<std::thread> workers_;
+    int threadCount_;
+    uint64_t generation_;   // workers from older generations exit
+    bool stopping_;
+    uint64_t nextID_;
+    std::atomic<int> pending_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_IOPOOL_H_
@@ -0,0 +1,422 @@
+#include "jobsystem.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace truss;
+
+namespace truss {
+
+struct Job {
+    truss_job_fn fn;
+    truss_range_fn rangeFn;
+    void* userdata;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t grain;
+    truss_job_counter* counter;
+};
+
+} // namespace truss
+
+namespace {
+
+const int64_t INITIAL_DEQUE_CAPACITY = 256;
+const int SPINS_BEFORE_SLEEP = 64;
+
+// index of the current thread in the worker list, -1 for other threads
+thread_local int workerIndex_ = -1;
+// nesting of job system calls on this thread; only the outermost call of a
+// thread that isn't a worker counts as a user (workers start at 1)
+thread_local int callDepth_ = 0;
+
+void execute(JobSystem& jobs, Job* job) {
+    if (job->rangeFn != NULL) {
+        // keep halving: the upper half goes where idle workers can steal it
+        while (job->end - job->begin > job->grain) {
+            uint64_t mid = job->begin + (job->end - job->begin) / 2;
+            Job* upper = new Job(*job);
+            upper->begin = mid;
+            job->end = mid;
+            if (job->counter != NULL) {
+                job->counter->pending.fetch_add(1, std::memory_order_relaxed);
+            }
+            jobs.push_(upper);
+        }
+        job->rangeFn(job->userdata, job->begin, job->end);
+    } else {
+        job->fn(job->userdata);
+    }
+    jobs.finish_(job);
+}
+
+class CallScope {
+public:
+    CallScope(JobSystem& jobs) : jobs_(jobs) {
+        if (callDepth_++ == 0) {
+            jobs_.enter_();
+        }
+    }
+    ~CallScope() {
+        if (--callDepth_ == 0) {
+            jobs_.leave_();
+        }
+    }
+private:
+    JobSystem& jobs_;
+};
+
+} // namespace
+
+JobDeque::Buffer::Buffer(int64_t cap) : capacity(cap) {
+    slots = new std::atomic<Job*>[static_cast<size_t>(cap)];
+}
+
+JobDeque::Buffer::~Buffer() {
+    delete[] slots;
+}
+
+JobDeque::JobDeque() : top_(0), bottom_(0) {
+    buffer_.store(new Buffer(INITIAL_DEQUE_CAPACITY), std::memory_order_relaxed);
+}
+
+JobDeque::~JobDeque() {
+    delete buffer_.load(std::memory_order_relaxed);
+    for (Buffer* old : oldBuffers_) {
+        delete old;
+    }
+}
+
+void JobDeque::push(Job* job) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    if (b - t > buffer->capacity - 1) {
+        Buffer* bigger = new Buffer(buffer->capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, buffer->get(i));
+        }
+        oldBuffers_.push_back(buffer);
+        buffer_.store(bigger, std::memory_order_release);
+        buffer = bigger;
+    }
+    buffer->put(b, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+}
+
+Job* JobDeque::take() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom_.store(b + 1, std::memory_order_relaxed); // was empty
+        return nullptr;
+    }
+    Job* job = buffer->get(b);
+    if (t == b) {
+        // last job: race any thieves for it
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            job = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return job;
+}
+
+Job* JobDeque::steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    Buffer* buffer = buffer_.load(std::memory_order_acquire);
+    Job* job = buffer->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+        return nullptr; // lost the race to another thief or the owner
+    }
+    return job;
+}
+
+bool JobDeque::empty() const {
+    return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+}
+
+JobSystem& JobSystem::instance() {
+    static JobSystem jobs;
+    return jobs;
+}
+
+JobSystem::JobSystem()
+    : numInjected_(0), sleepers_(0), running_(false), threadCount_(0)
+    , users_(0), restarting_(false) {}
+
+JobSystem::~JobSystem() {
+    shutdown_();
+}
+
+void JobSystem::setThreadCount(int count) {
+    std::unique_lock<std::mutex> lock(startLock_);
+    threadCount_ = count;
+    if (!running_.load() || callDepth_ > 0) {
+        // a job can't wait for itself to finish
+        return;
+    }
+    restarting_.store(true, std::memory_order_seq_cst);
+    while (users_.load(std::memory_order_seq_cst) > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    shutdown_();
+    start_(threadCount_);
+    restarting_.store(false, std::memory_order_seq_cst);
+    lock.unlock();
+    restartCV_.notify_all();
+}
+
+int JobSystem::getThreadCount() {
+    std::lock_guard<std::mutex> lock(startLock_);
+    if (running_.load()) {
+        return static_cast<int>(workers_.size());
+    }
+    if (threadCount_ > 0) {
+        return threadCount_;
+    }
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+}
+
+void JobSystem::submit(truss_job_fn fn, void* userdata, truss_job_counter* counter) {
+    CallScope scope(*this);
+    Job* job = new Job;
+    job->fn = fn;
+    job->rangeFn = NULL;
+    job->userdata = userdata;
+    job->begin = job->end = job->grain = 0;
+    job->counter = counter;
+    if (counter != NULL) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    push_(job);
+}
+
+void JobSystem::parallelFor(truss_range_fn fn, void* userdata, uint64_t begin, uint64_t end,
+                            uint64_t grain, truss_job_counter* counter) {
+    if (end <= begin) {
+        return;
+    }
+    CallScope scope(*this);
+    if (grain == 0) {
+        // enough pieces to balance uneven work, not so many that the
+        // splitting dominates
+        uint64_t pieces = static_cast<uint64_t>(workers_.size() + 1) * 8;
+        grain = std::max<uint64_t>(1, (end - begin) / pieces);
+    }
+
+    // without a counter the call is synchronous
+    truss_job_counter local;
+    local.pending.store(0, std::memory_order_relaxed);
+    truss_job_counter* target = (counter != NULL) ? counter : &local;
+
+    Job* job = new Job;
+    job->fn = NULL;
+    job->rangeFn = fn;
+    job->userdata = userdata;
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain;
+    job->counter = target;
+    target->pending.fetch_add(1, std::memory_order_relaxed);
+    push_(job);
+
+    if (counter == NULL) {
+        wait(&local);
+    }
+}
+
+void JobSystem::wait(truss_job_counter* counter) {
+    CallScope scope(*this);
+    int idle = 0;
+    while (counter->pending.load(std::memory_order_acquire) > 0) {
+        Job* job = findJob_();
+        if (job != nullptr) {
+            execute(*this, job);
+            idle = 0;
+        } else if (++idle < SPINS_BEFORE_SLEEP) {
+            std::this_thread::yield();
+        } else {
+            // the last pieces are running elsewhere
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+}
+
+void JobSystem::push_(Job* job) {
+    if (workerIndex_ >= 0 && workerIndex_ < static_cast<int>(deques_.size())) {
+        deques_[workerIndex_]->push(job);
+    } else {
+        std::lock_guard<std::mutex> lock(injectLock_);
+        injected_.push_back(job);
+        numInjected_.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake_();
+}
+
+void JobSystem::finish_(Job* job) {
+    if (job->counter != NULL) {
+        job->counter->pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    delete job;
+}
+
+void JobSystem::enter_() {
+    while (true) {
+        users_.fetch_add(1, std::memory_order_seq_cst);
+        if (!restarting_.load(std::memory_order_seq_cst)) {
+            break;
+        }
+        // back out and wait for the restart to finish
+        users_.fetch_sub(1, std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> lock(startLock_);
+        restartCV_.wait(lock, [this] { return !restarting_.load(); });
+    }
+    ensureStarted_();
+}
+
+void JobSystem::leave_() {
+    users_.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void JobSystem::ensureStarted_() {
+    if (running_.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(startLock_);
+    if (!running_.load()) {
+        start_(threadCount_);
+    }
+}
+
+// Called with startLock_ held
+void JobSystem::start_(int count) {
+    if (count <= 0) {
+        count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+    }
+    for (int i = 0; i < count; ++i) {
+        deques_.push_back(new JobDeque);
+    }
+    running_.store(true, std::memory_order_release);
+    for (int i = 0; i < count; ++i) {
+        workers_.push_back(std::thread(&JobSystem::workerLoop_, this, i));
+    }
+}
+
+void JobSystem::shutdown_() {
+    {
+        std::lock_guard<std::mutex> lock(sleepLock_);
+        running_.store(false);
+    }
+    sleepCV_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+
+    // run whatever is still queued on this thread, so that every counter
+    // reaches zero and no job leaks; anything these push is injected here
+    ++callDepth_;
+    for (Job* job = findJob_(); job != nullptr; job = findJob_()) {
+        execute(*this, job);
+    }
+    --callDepth_;
+
+    for (JobDeque* deque : deques_) {
+        delete deque;
+    }
+    deques_.clear();
+}
+
+void JobSystem::workerLoop_(int index) {
+    workerIndex_ = index;
+    callDepth_ = 1; // workers never count as users, they're joined instead
+    int idle = 0;
+    while (running_.load(std::memory_order_acquire)) {
+        Job* job = findJob_();
+        if (job != nullptr) {
+            execute(*this, job);
+            idle = 0;
+            continue;
+        }
+        if (++idle < SPINS_BEFORE_SLEEP) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepLock_);
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        if (!hasWork_() && running_.load()) {
+            // the timeout is only a backstop against a missed wake up
+            sleepCV_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        idle = 0;
+    }
+    workerIndex_ = -1;
+    callDepth_ = 0;
+}
+
+Job* JobSystem::findJob_() {
+    int self = workerIndex_;
+    int ndeques = static_cast<int>(deques_.size());
+    if (self >= 0 && self < ndeques) {
+        Job* job = deques_[self]->take();
+        if (job != nullptr) {
+            return job;
+        }
+    }
+    if (numInjected_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(injectLock_);
+        if (!injected_.empty()) {
+            Job* job = injected_.front();
+            injected_.pop_front();
+            numInjected_.fetch_sub(1, std::memory_order_relaxed);
+            return job;
+        }
+    }
+    // steal, starting just after ourselves so thieves spread out
+    for (int i = 1; i <= ndeques; ++i) {
+        int victim = (self + i + ndeques) % ndeques;
+        if (victim == self) {
+            continue;
+        }
+        Job* job = deques_[victim]->steal();
+        if (job != nullptr) {
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+bool JobSystem::hasWork_() {
+    if (numInjected_.load(std::memory_order_seq_cst) > 0) {
+        return true;
+    }
+    for (JobDeque* deque : deques_) {
+        if (!deque->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::wake_() {
+    // pairs with the sleepers_ increment before a worker's last check
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(sleepLock_);
+        sleepCV_.notify_one();
+    }
+}
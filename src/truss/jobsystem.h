@@ -0,0 +1,123 @@
+#ifndef TRUSS_JOBSYSTEM_H_
+#define TRUSS_JOBSYSTEM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+// Completion counter: the number of jobs (and job pieces) still running
+struct truss_job_counter {
+    std::atomic<int64_t> pending;
+};
+
+namespace truss {
+
+struct Job;
+
+// Lock-free work-stealing deque (Chase-Lev): the owning worker pushes and
+// takes at the bottom, any other thread steals from the top.
+class JobDeque {
+public:
+    JobDeque();
+    ~JobDeque();
+
+    void push(Job* job);   // owner only
+    Job* take();           // owner only
+    Job* steal();          // any thread
+    bool empty() const;
+
+private:
+    // Mark deque as non-copyable.
+    JobDeque(const JobDeque&) = delete;
+    JobDeque& operator=(const JobDeque&) = delete;
+
+    struct Buffer {
+        int64_t capacity;  // power of two
+        std::atomic<Job*>* slots;
+        Buffer(int64_t cap);
+        ~Buffer();
+        Job* get(int64_t idx) { return slots[idx & (capacity - 1)].load(std::memory_order_acquire); }
+        void put(int64_t idx, Job* job) { slots[idx & (capacity - 1)].store(job, std::memory_order_release); }
+    };
+
+    std::atomic<int64_t> top_;
+    std::atomic<int64_t> bottom_;
+    std::atomic<Buffer*> buffer_;
+    std::vector<Buffer*> oldBuffers_;  // thieves may still be reading these
+};
+
+// Pool of native worker threads for data-parallel work. Jobs are plain C
+// function pointers (e.g., Terra functions) that must not call back into
+// Lua. Parallel-for ranges are split recursively so idle workers can steal
+// the larger halves. Waiting on a counter runs other jobs meanwhile, so it
+// is safe (and useful) to wait from inside a job.
+class JobSystem {
+public:
+    static JobSystem& instance();
+
+    // Restarts the workers with a new thread count (<= 0: one per core,
+    // minus one for the calling thread). New submits from other threads
+    // block until the restart is done; it waits for the calls already in
+    // progress, and runs whatever is still queued after the old workers
+    // stop. Ignored (until the next start) when called from inside a job.
+    void setThreadCount(int count);
+    int getThreadCount();
+
+    void submit(truss_job_fn fn, void* userdata, truss_job_counter* counter);
+    void parallelFor(truss_range_fn fn, void* userdata, uint64_t begin, uint64_t end,
+                     uint64_t grain, truss_job_counter* counter);
+    void wait(truss_job_counter* counter);
+
+    // used by jobs
+    void push_(Job* job);
+    void finish_(Job* job);
+    // bracket every submit/parallelFor/wait made from outside the workers
+    void enter_();
+    void leave_();
+
+    ~JobSystem();
+private:
+    JobSystem();
+
+    // Mark job system as non-copyable.
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    void ensureStarted_();
+    void start_(int count);
+    void shutdown_();
+    void workerLoop_(int index);
+    Job* findJob_();
+    bool hasWork_();
+    void wake_();
+
+    std::vector<JobDeque*> deques_;
+    std::vector<std::thread> workers_;
+
+    // jobs submitted from threads that aren't workers
+    std::mutex injectLock_;
+    std::deque<Job*> injected_;
+    std::atomic<int64_t> numInjected_;
+
+    std::mutex sleepLock_;
+    std::condition_variable sleepCV_;
+    std::atomic<int> sleepers_;
+    std::atomic<bool> running_;
+    std::mutex startLock_;
+    int threadCount_;
+
+    // calls in progress from outside the workers; a restart waits for these
+    // to finish while restarting_ holds new ones back
+    std::atomic<int> users_;
+    std::atomic<bool> restarting_;
+    std::condition_variable restartCV_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_JOBSYSTEM_H_
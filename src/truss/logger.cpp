@@ -0,0 +1,351 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <trussapi.h>
+
+using namespace truss;
+
+namespace truss {
+
+struct LogRing {
+    static const uint64_t CAPACITY = 1 << 16;  // power of two
+
+    std::atomic<uint64_t> head;  // only advanced by the owning thread
+    std::atomic<uint64_t> tail;  // only advanced by the writer
+    std::atomic<bool> inUse;
+    LogRing* next;
+    char* data;
+};
+
+struct LogRecord {
+    int level;
+    int interpreter;
+    uint64_t time;
+    std::string text;
+};
+
+} // namespace truss
+
+namespace {
+
+// Records start on RECORD_ALIGN boundaries, so the space left before the
+// end of a ring always fits at least a (padding) header
+const uint64_t RECORD_ALIGN = 32;
+const uint64_t MAX_MESSAGE = LogRing::CAPACITY / 4;
+const uint32_t PADDING = 0x80000000u;
+const int WRITE_INTERVAL_MS = 20;
+
+struct RecordHeader {
+    uint32_t size;     // whole record, including the header; PADDING flag
+    uint32_t length;   // of the text
+    int32_t level;
+    int32_t interpreter;
+    uint64_t time;
+};
+
+struct RingHolder {
+    const Logger* owner;
+    LogRing* ring;
+    RingHolder() : owner(NULL), ring(NULL) {}
+    ~RingHolder() {
+        if (ring != NULL) {
+            ring->inUse.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local RingHolder ringHolder_;
+thread_local int threadInterpreter_ = -1;
+thread_local std::vector<char> formatBuffer_;
+
+} // namespace
+
+Logger::Logger()
+    : level_(TRUSS_LOG_DEBUG), dropped_(0), epoch_(std::chrono::steady_clock::now()),
+      rings_(nullptr), binary_(false), writing_(false), wakeRequested_(false),
+      flushRequests_(0), flushesDone_(0), stopping_(false) {}
+
+Logger::~Logger() {
+    if (writer_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(wakeLock_);
+            stopping_ = true;
+        }
+        wakeCV_.notify_all();
+        writer_.join();
+    }
+    file_.close();
+    if (ringHolder_.owner == this) {
+        ringHolder_.owner = NULL;
+        ringHolder_.ring = NULL;
+    }
+    LogRing* ring = rings_.load(std::memory_order_acquire);
+    while (ring != nullptr) {
+        LogRing* next = ring->next;
+        delete[] ring->data;
+        delete ring;
+        ring = next;
+    }
+}
+
+bool Logger::open(const std::string& path, bool binary) {
+    if (writer_.joinable()) {
+        flush(); // earlier records belong in the old file
+    }
+    {
+        std::lock_guard<std::mutex> lock(fileLock_);
+        file_.close();
+        file_.clear();
+        file_.open(path.c_str(), std::ios::out | std::ios::binary);
+        binary_ = binary;
+        if (binary_) {
+            file_.write("TRUSSLOG", 8);
+        }
+    }
+    // records logged before the file was opened have been waiting
+    if (!writer_.joinable()) {
+        writer_ = std::thread(&Logger::writerLoop_, this);
+        writing_.store(true, std::memory_order_release);
+    }
+    return file_.is_open();
+}
+
+void Logger::setLevel(int level) {
+    level_.store(level, std::memory_order_relaxed);
+}
+
+int Logger::getLevel() const {
+    return level_.load(std::memory_order_relaxed);
+}
+
+bool Logger::isEnabled(int level) const {
+    return level <= level_.load(std::memory_order_relaxed);
+}
+
+uint64_t Logger::getDropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+int Logger::setThreadInterpreter(int id) {
+    int prev = threadInterpreter_;
+    threadInterpreter_ = id;
+    return prev;
+}
+
+void Logger::log(int level, const char* msg) {
+    if (isEnabled(level)) {
+        append_(level, msg, strlen(msg));
+    }
+}
+
+void Logger::logv(int level, const char* format, va_list args) {
+    if (!isEnabled(level)) {
+        return;
+    }
+    std::vector<char>& buffer = formatBuffer_;
+    if (buffer.size() < 256) {
+        buffer.resize(256);
+    }
+    va_list retry;
+    va_copy(retry, args);
+    int length = vsnprintf(buffer.data(), buffer.size(), format, args);
+    if (length >= 0 && static_cast<size_t>(length) >= buffer.size()) {
+        buffer.resize(static_cast<size_t>(length) + 1);
+        length = vsnprintf(buffer.data(), buffer.size(), format, retry);
+    }
+    va_end(retry);
+    if (length >= 0) {
+        append_(level, buffer.data(), static_cast<size_t>(length));
+    }
+}
+
+void Logger::flush() {
+    std::unique_lock<std::mutex> lock(wakeLock_);
+    if (!writer_.joinable()) {
+        return;
+    }
+    uint64_t target = ++flushRequests_;
+    wakeCV_.notify_all();
+    flushedCV_.wait(lock, [&] { return flushesDone_ >= target; });
+}
+
+LogRing* Logger::threadRing_() {
+    RingHolder& holder = ringHolder_;
+    if (holder.owner == this) {
+        return holder.ring;
+    }
+    if (holder.ring != NULL) {
+        holder.ring->inUse.store(false, std::memory_order_release);
+    }
+
+    // reuse the ring of a thread that has exited, once it's drained
+    LogRing* ring = rings_.load(std::memory_order_acquire);
+    for (; ring != nullptr; ring = ring->next) {
+        bool expected = false;
+        if (!ring->inUse.load(std::memory_order_relaxed) &&
+            ring->head.load(std::memory_order_relaxed) == ring->tail.load(std::memory_order_acquire) &&
+            ring->inUse.compare_exchange_strong(expected, true)) {
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        ring = new LogRing;
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        ring->inUse.store(true, std::memory_order_relaxed);
+        ring->data = new char[LogRing::CAPACITY];
+        ring->next = rings_.load(std::memory_order_relaxed);
+        while (!rings_.compare_exchange_weak(ring->next, ring,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+            // ring->next has been reloaded with the current head; retry
+        }
+    }
+    holder.owner = this;
+    holder.ring = ring;
+    return ring;
+}
+
+void Logger::append_(int level, const char* msg, size_t length) {
+    LogRing* ring = threadRing_();
+    length = std::min<size_t>(length, MAX_MESSAGE);
+    uint64_t need = (sizeof(RecordHeader) + length + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t offset = head & (LogRing::CAPACITY - 1);
+    uint64_t toEnd = LogRing::CAPACITY - offset;
+    uint64_t total = (need <= toEnd) ? need : need + toEnd;
+
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    while (head + total - tail > LogRing::CAPACITY) {
+        // nothing drains the rings until a file is opened
+        if (level > TRUSS_LOG_WARNING || !writing_.load(std::memory_order_acquire)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!wakeRequested_.exchange(true)) {
+            wakeCV_.notify_one();
+        }
+        std::this_thread::yield();
+        tail = ring->tail.load(std::memory_order_acquire);
+    }
+
+    RecordHeader header;
+    if (need > toEnd) {
+        // not enough room before the end: pad and wrap around
+        header.size = static_cast<uint32_t>(toEnd) | PADDING;
+        memcpy(ring->data + offset, &header.size, sizeof(header.size));
+        head += toEnd;
+        offset = 0;
+    }
+    header.size = static_cast<uint32_t>(need);
+    header.length = static_cast<uint32_t>(length);
+    header.level = level;
+    header.interpreter = threadInterpreter_;
+    header.time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch_).count());
+    memcpy(ring->data + offset, &header, sizeof(header));
+    memcpy(ring->data + offset + sizeof(header), msg, length);
+    ring->head.store(head + need, std::memory_order_release);
+
+    // errors should reach the file promptly, and a filling ring soon
+    if (level <= TRUSS_LOG_ERROR || head + need - tail > LogRing::CAPACITY / 2) {
+        if (!wakeRequested_.exchange(true)) {
+            wakeCV_.notify_one();
+        }
+    }
+}
+
+void Logger::writerLoop_() {
+    std::vector<LogRecord> records;
+    std::unique_lock<std::mutex> lock(wakeLock_);
+    while (true) {
+        uint64_t flushTarget = flushRequests_;
+        bool stop = stopping_;
+        lock.unlock();
+
+        records.clear();
+        drain_(records);
+        std::stable_sort(records.begin(), records.end(),
+                         [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+        write_(records);
+
+        lock.lock();
+        if (flushTarget > flushesDone_) {
+            flushesDone_ = flushTarget;
+            flushedCV_.notify_all();
+        }
+        if (stop) {
+            break;
+        }
+        if (!wakeRequested_.load() && flushRequests_ == flushesDone_ && !stopping_) {
+            wakeCV_.wait_for(lock, std::chrono::milliseconds(WRITE_INTERVAL_MS));
+        }
+        wakeRequested_.store(false);
+    }
+}
+
+size_t Logger::drain_(std::vector<LogRecord>& records) {
+    size_t count = 0;
+    for (LogRing* ring = rings_.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail < head) {
+            const char* pos = ring->data + (tail & (LogRing::CAPACITY - 1));
+            RecordHeader header;
+            memcpy(&header.size, pos, sizeof(header.size));
+            if (header.size & PADDING) {
+                tail += header.size & ~PADDING;
+                continue;
+            }
+            memcpy(&header, pos, sizeof(header));
+            LogRecord record;
+            record.level = header.level;
+            record.interpreter = header.interpreter;
+            record.time = header.time;
+            record.text.assign(pos + sizeof(header), header.length);
+            records.push_back(std::move(record));
+            tail += header.size;
+            ++count;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    return count;
+}
+
+void Logger::write_(const std::vector<LogRecord>& records) {
+    std::lock_guard<std::mutex> lock(fileLock_);
+    if (records.empty() || !file_.is_open()) {
+        return;
+    }
+    std::string out;
+    char prefix[64];
+    for (const LogRecord& record : records) {
+        if (binary_) {
+            RecordHeader header;
+            header.size = static_cast<uint32_t>(record.text.size());
+            header.level = record.level;
+            header.interpreter = record.interpreter;
+            header.time = record.time;
+            // uint32 length, int32 level, int32 interpreter, uint64 time
+            out.append(reinterpret_cast<const char*>(&header.size), sizeof(header.size));
+            out.append(reinterpret_cast<const char*>(&header.level), sizeof(header.level));
+            out.append(reinterpret_cast<const char*>(&header.interpreter), sizeof(header.interpreter));
+            out.append(reinterpret_cast<const char*>(&header.time), sizeof(header.time));
+            out.append(record.text);
+            continue;
+        }
+        if (record.interpreter >= 0) {
+            snprintf(prefix, sizeof(prefix), "[%d] %10.3f [%d] ", record.level,
+                     record.time / 1e6, record.interpreter);
+        } else {
+            snprintf(prefix, sizeof(prefix), "[%d] %10.3f [-] ", record.level, record.time / 1e6);
+        }
+        out.append(prefix);
+        out.append(record.text);
+        out.push_back('\n');
+    }
+    file_.write(out.data(), static_cast<std::streamsize>(out.size()));
+    file_.flush();
+}
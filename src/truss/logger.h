@@ -0,0 +1,104 @@
+#ifndef TRUSS_LOGGER_H_
+#define TRUSS_LOGGER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace truss {
+
+struct LogRing;
+struct LogRecord;
+
+// Asynchronous log: each thread appends records to its own lock-free ring
+// buffer and a background thread merges them in time order and writes them
+// out, so logging never waits on the file or on other threads. When a ring
+// is full, debug and info records are dropped (and counted); warnings and
+// errors wait for room instead (or are dropped too, until a file has been
+// opened and something is draining the rings).
+//
+// Text lines read "[level] seconds [interpreter] message", with "-" for
+// records logged outside of any interpreter. The binary format is the
+// 8 bytes "TRUSSLOG" followed by records of: uint32 length, int32 level,
+// int32 interpreter, uint64 microseconds, then length bytes of text.
+class Logger {
+public:
+    Logger();
+    ~Logger();
+
+    // (Re)opens the log file, writing the binary format if binary is set
+    bool open(const std::string& path, bool binary);
+
+    // Messages above this level are discarded before they're formatted
+    void setLevel(int level);
+    int getLevel() const;
+    bool isEnabled(int level) const;
+
+    void log(int level, const char* msg);
+    void logv(int level, const char* format, va_list args);
+
+    // Blocks until everything logged so far has been written
+    void flush();
+
+    uint64_t getDropped() const;
+
+    // Tags the calling thread's records with an interpreter id (-1: none);
+    // returns the previous id
+    static int setThreadInterpreter(int id);
+
+private:
+    // Mark logger as non-copyable.
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    LogRing* threadRing_();
+    void append_(int level, const char* msg, size_t length);
+    void writerLoop_();
+    size_t drain_(std::vector<LogRecord>& records);
+    void write_(const std::vector<LogRecord>& records);
+
+    std::atomic<int> level_;
+    std::atomic<uint64_t> dropped_;
+    std::chrono::steady_clock::time_point epoch_;
+
+    std::atomic<LogRing*> rings_;  // never freed until the logger is
+
+    std::mutex fileLock_;          // file settings, only held by the writer
+    std::ofstream file_;
+    bool binary_;
+
+    std::thread writer_;
+    std::atomic<bool> writing_;    // set once writer_ has started
+    std::mutex wakeLock_;
+    std::condition_variable wakeCV_;
+    std::condition_variable flushedCV_;
+    std::atomic<bool> wakeRequested_;
+    uint64_t flushRequests_;
+    uint64_t flushesDone_;
+    bool stopping_;
+};
+
+// Tags the calling thread's records with an interpreter id for its lifetime
+class LogInterpreterScope {
+public:
+    explicit LogInterpreterScope(int id) : prev_(Logger::setThreadInterpreter(id)) {}
+    ~LogInterpreterScope() { Logger::setThreadInterpreter(prev_); }
+
+private:
+    // Mark scope as non-copyable.
+    LogInterpreterScope(const LogInterpreterScope&) = delete;
+    LogInterpreterScope& operator=(const LogInterpreterScope&) = delete;
+
+    int prev_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_LOGGER_H_
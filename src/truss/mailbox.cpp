@@ -0,0 +1,164 @@
+#include "mailbox.h"
+
+#include <mutex>
+
+using namespace truss;
+
+namespace {
+
+typedef Mailbox::Node Node;
+
+const uint32_t THREAD_CACHE_LIMIT = 256; // nodes
+const uint32_t TRANSFER_BATCH = 128;
+
+// Shared free list; nodes freed on a consumer thread come back through
+// here in batches to the producer threads that allocate them
+struct NodeCentral {
+    std::mutex lock;
+    Node* head;
+    uint32_t count;
+
+    NodeCentral() : head(nullptr), count(0) {}
+
+    ~NodeCentral() {
+        while (head != nullptr) {
+            Node* next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    void give(Node* first, Node* last, uint32_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        last->next = head;
+        head = first;
+        count += n;
+    }
+
+    Node* take(uint32_t& n) {
+        std::lock_guard<std::mutex> guard(lock);
+        Node* first = head;
+        n = 0;
+        Node* last = nullptr;
+        while (head != nullptr && n < TRANSFER_BATCH) {
+            last = head;
+            head = head->next;
+            ++n;
+        }
+        if (last != nullptr) {
+            last->next = nullptr;
+        }
+        count -= n;
+        return first;
+    }
+};
+
+NodeCentral& central() {
+    static NodeCentral central_;
+    return central_;
+}
+
+// Per-thread free list; returned to the shared list when the thread exits
+struct NodeCache {
+    Node* head;
+    uint32_t count;
+
+    NodeCache() : head(nullptr), count(0) {
+        central(); // constructed first, so destroyed after every cache
+    }
+
+    ~NodeCache() {
+        if (head == nullptr) {
+            return;
+        }
+        Node* tail = head;
+        while (tail->next != nullptr) {
+            tail = tail->next;
+        }
+        central().give(head, tail, count);
+    }
+
+    Node* pop() {
+        if (head == nullptr) {
+            head = central().take(count);
+            if (head == nullptr) {
+                return new Node;
+            }
+        }
+        Node* node = head;
+        head = node->next;
+        --count;
+        return node;
+    }
+
+    void push(Node* node) {
+        node->next = head;
+        head = node;
+        ++count;
+        if (count > THREAD_CACHE_LIMIT) {
+            Node* first = head;
+            Node* last = first;
+            for (uint32_t i = 1; i < TRANSFER_BATCH; ++i) {
+                last = last->next;
+            }
+            head = last->next;
+            count -= TRANSFER_BATCH;
+            central().give(first, last, TRANSFER_BATCH);
+        }
+    }
+};
+
+thread_local NodeCache nodeCache_;
+
+} // namespace
+
+Mailbox::Mailbox() : head_(nullptr) {}
+
+Mailbox::~Mailbox() {
+    // Owner is responsible for draining (and releasing) any messages first;
+    // this only returns the nodes so nothing leaks on shutdown.
+    Node* cur = head_.exchange(nullptr, std::memory_order_acquire);
+    while (cur != nullptr) {
+        Node* next = cur->next;
+        nodeCache_.push(cur);
+        cur = next;
+    }
+}
+
+void Mailbox::push(truss_message* msg) {
+    Node* node = nodeCache_.pop();
+    node->msg = msg;
+    node->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(node->next, node,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+        // node->next has been reloaded with the current head; retry
+    }
+}
+
+size_t Mailbox::drain(std::vector<truss_message*>& dest) {
+    Node* cur = head_.exchange(nullptr, std::memory_order_acquire);
+    if (cur == nullptr) {
+        return 0;
+    }
+
+    // The stack is newest-first: write it into dest back to front.
+    size_t count = 0;
+    for (Node* n = cur; n != nullptr; n = n->next) {
+        ++count;
+    }
+    size_t base = dest.size();
+    dest.resize(base + count);
+    size_t pos = base + count;
+    while (cur != nullptr) {
+        Node* next = cur->next;
+        dest[--pos] = cur->msg;
+        nodeCache_.push(cur);
+        cur = next;
+    }
+    return count;
+}
+
+bool Mailbox::empty() const {
+    return head_.load(std::memory_order_relaxed) == nullptr;
+}
@@ -0,0 +1,45 @@
+#ifndef TRUSS_MAILBOX_H_
+#define TRUSS_MAILBOX_H_
+
+#include <atomic>
+#include <vector>
+#include <trussapi.h>
+
+namespace truss {
+
+// Lock-free multi-producer/single-consumer message queue.
+// Producers push onto an intrusive stack with a single CAS; the consumer
+// takes the entire stack with one atomic exchange and reverses it, so
+// messages come out in the order they were sent. Because the consumer only
+// ever detaches the whole list, there is no ABA hazard. Nodes come from a
+// per-thread pool (see mailbox.cpp), so pushing doesn't allocate.
+class Mailbox {
+public:
+    struct Node {
+        truss_message* msg;
+        Node* next;
+    };
+
+    Mailbox();
+    ~Mailbox();
+
+    // Safe to call from any thread
+    void push(truss_message* msg);
+
+    // Consumer thread only: appends every pending message to dest
+    // (oldest first) and returns how many were appended
+    size_t drain(std::vector<truss_message*>& dest);
+
+    bool empty() const;
+
+private:
+    // Mark mailbox as non-copyable.
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    std::atomic<Node*> head_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_MAILBOX_H_
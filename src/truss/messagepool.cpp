@@ -0,0 +1,366 @@
+#include "messagepool.h"
+
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+using namespace truss;
+
+static_assert(sizeof(truss_refcount) == sizeof(unsigned int),
+              "truss_message layout must match the C api header");
+
+namespace {
+
+// Offset from the start of a block to the truss_message and its payload;
+// the payload is kept 16-byte aligned for SIMD-friendly reads.
+const size_t MESSAGE_OFFSET = sizeof(MessageBlock);
+const size_t PAYLOAD_OFFSET =
+    (sizeof(MessageBlock) + sizeof(truss_message) + 15) & ~size_t(15);
+
+uint32_t sizeClassFor(size_t dataLength) {
+    uint32_t sizeClass = 0;
+    size_t classSize = size_t(1) << MessagePool::MIN_CLASS_SHIFT;
+    while (classSize < dataLength) {
+        classSize <<= 1;
+        ++sizeClass;
+        if (sizeClass >= MessagePool::NUM_CLASSES) {
+            return MessagePool::LARGE_CLASS;
+        }
+    }
+    return sizeClass;
+}
+
+truss_message* messageOf(MessageBlock* block) {
+    return reinterpret_cast<truss_message*>(
+        reinterpret_cast<unsigned char*>(block) + MESSAGE_OFFSET);
+}
+
+unsigned char* payloadOf(MessageBlock* block) {
+    return reinterpret_cast<unsigned char*>(block) + PAYLOAD_OFFSET;
+}
+
+// External blocks keep their release hook where the payload would be
+struct ExternalRelease {
+    ExternalReleaseFn releaseFn;
+    void* userdata;
+};
+
+ExternalRelease* externalOf(MessageBlock* block) {
+    return reinterpret_cast<ExternalRelease*>(payloadOf(block));
+}
+
+void* alignedAlloc(size_t size, size_t alignment) {
+#if defined(_WIN32)
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        return NULL;
+    }
+    return ptr;
+#endif
+}
+
+void alignedFree(truss_message* /*msg*/, void* userdata) {
+#if defined(_WIN32)
+    _aligned_free(userdata);
+#else
+    std::free(userdata);
+#endif
+}
+
+// Per-thread free lists; returned to the shared lists when the thread exits
+struct ThreadCache {
+    MessageBlock* heads[MessagePool::NUM_CLASSES];
+    uint32_t counts[MessagePool::NUM_CLASSES];
+    MessagePoolCounters counters;
+
+    ThreadCache() {
+        for (uint32_t i = 0; i < MessagePool::NUM_CLASSES; ++i) {
+            heads[i] = NULL;
+            counts[i] = 0;
+        }
+        MessagePool::instance().registerCounters(&counters);
+    }
+
+    ~ThreadCache() {
+        MessagePool& pool = MessagePool::instance();
+        for (uint32_t i = 0; i < MessagePool::NUM_CLASSES; ++i) {
+            if (heads[i] == NULL) {
+                continue;
+            }
+            MessageBlock* tail = heads[i];
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+            pool.giveBatch(i, heads[i], tail, counts[i]);
+        }
+        pool.retireCounters(&counters);
+    }
+
+    void push(uint32_t sizeClass, MessageBlock* block) {
+        block->next = heads[sizeClass];
+        heads[sizeClass] = block;
+        ++counts[sizeClass];
+        if (counts[sizeClass] > MessagePool::THREAD_CACHE_LIMIT) {
+            // hand a batch back so blocks freed on a consumer thread can be
+            // reused by the producer thread that allocates them
+            MessageBlock* head = heads[sizeClass];
+            MessageBlock* tail = head;
+            for (uint32_t i = 1; i < MessagePool::TRANSFER_BATCH; ++i) {
+                tail = tail->next;
+            }
+            heads[sizeClass] = tail->next;
+            counts[sizeClass] -= MessagePool::TRANSFER_BATCH;
+            MessagePool::instance().giveBatch(sizeClass, head, tail,
+                                              MessagePool::TRANSFER_BATCH);
+        }
+    }
+
+    MessageBlock* pop(uint32_t sizeClass) {
+        if (heads[sizeClass] == NULL) {
+            heads[sizeClass] = MessagePool::instance().takeBatch(
+                sizeClass, counts[sizeClass]);
+            if (heads[sizeClass] == NULL) {
+                return NULL;
+            }
+        }
+        MessageBlock* block = heads[sizeClass];
+        heads[sizeClass] = block->next;
+        --counts[sizeClass];
+        return block;
+    }
+};
+
+thread_local ThreadCache threadCache_;
+
+void bump(std::atomic<int64_t>& counter, int64_t delta) {
+    // single writer: a relaxed load/store avoids a locked instruction
+    counter.store(counter.load(std::memory_order_relaxed) + delta,
+                  std::memory_order_relaxed);
+}
+
+void bump(std::atomic<uint64_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
+} // namespace
+
+MessagePoolCounters::MessagePoolCounters()
+    : liveMessages(0), liveBytes(0), poolHits(0), poolMisses(0)
+    , largeAllocations(0) {}
+
+MessagePool& MessagePool::instance() {
+    static MessagePool pool;
+    return pool;
+}
+
+MessageBlock* MessagePool::blockOf(truss_message* msg) {
+    return reinterpret_cast<MessageBlock*>(
+        reinterpret_cast<unsigned char*>(msg) - MESSAGE_OFFSET);
+}
+
+size_t MessagePool::classPayloadSize(uint32_t sizeClass) {
+    return size_t(1) << (sizeClass + MIN_CLASS_SHIFT);
+}
+
+truss_message* MessagePool::allocate(size_t dataLength) {
+    ThreadCache& cache = threadCache_;
+    uint32_t sizeClass = sizeClassFor(dataLength);
+    MessageBlock* block = NULL;
+
+    if (sizeClass == LARGE_CLASS) {
+        block = static_cast<MessageBlock*>(std::malloc(PAYLOAD_OFFSET + dataLength));
+        bump(cache.counters.largeAllocations);
+    } else {
+        block = cache.pop(sizeClass);
+        if (block != NULL) {
+            bump(cache.counters.poolHits);
+        } else {
+            block = static_cast<MessageBlock*>(
+                std::malloc(PAYLOAD_OFFSET + classPayloadSize(sizeClass)));
+            bump(cache.counters.poolMisses);
+        }
+    }
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->sizeClass = sizeClass;
+    block->flags.store(0, std::memory_order_relaxed);
+    block->next = NULL;
+
+    truss_message* msg = new (messageOf(block)) truss_message;
+    msg->message_type = TRUSS_MESSAGE_UNKNOWN;
+    msg->data_length = dataLength;
+    msg->data = payloadOf(block);
+    msg->refcount = 1;
+
+    bump(cache.counters.liveMessages, 1);
+    bump(cache.counters.liveBytes, static_cast<int64_t>(dataLength));
+    return msg;
+}
+
+truss_message* MessagePool::wrapExternal(unsigned char* data, size_t dataLength,
+                                         ExternalReleaseFn releaseFn, void* userdata) {
+    ThreadCache& cache = threadCache_;
+    MessageBlock* block = static_cast<MessageBlock*>(
+        std::malloc(PAYLOAD_OFFSET + sizeof(ExternalRelease)));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->sizeClass = EXTERNAL_CLASS;
+    block->flags.store(0, std::memory_order_relaxed);
+    block->next = NULL;
+    externalOf(block)->releaseFn = releaseFn;
+    externalOf(block)->userdata = userdata;
+
+    truss_message* msg = new (messageOf(block)) truss_message;
+    msg->message_type = TRUSS_MESSAGE_BLOB;
+    msg->data_length = dataLength;
+    msg->data = data;
+    msg->refcount = 1;
+
+    bump(cache.counters.liveMessages, 1);
+    bump(cache.counters.liveBytes, static_cast<int64_t>(dataLength));
+    return msg;
+}
+
+truss_message* MessagePool::allocateShared(size_t dataLength, size_t alignment) {
+    if (alignment == 0) {
+        alignment = DEFAULT_SHARED_ALIGNMENT;
+    }
+    if ((alignment & (alignment - 1)) != 0 || alignment < sizeof(void*)) {
+        return NULL;
+    }
+    // a zero-length buffer still gets a unique, aligned pointer
+    void* data = alignedAlloc(dataLength > 0 ? dataLength : 1, alignment);
+    if (data == NULL) {
+        return NULL;
+    }
+    truss_message* msg = wrapExternal(static_cast<unsigned char*>(data), dataLength,
+                                      alignedFree, data);
+    if (msg == NULL) {
+        alignedFree(NULL, data);
+        return NULL;
+    }
+    msg->message_type = TRUSS_MESSAGE_SHARED;
+    return msg;
+}
+
+void MessagePool::release(truss_message* msg) {
+    ThreadCache& cache = threadCache_;
+    MessageBlock* block = blockOf(msg);
+    bump(cache.counters.liveMessages, -1);
+    bump(cache.counters.liveBytes, -static_cast<int64_t>(msg->data_length));
+
+    if (block->sizeClass == EXTERNAL_CLASS) {
+        ExternalRelease* ext = externalOf(block);
+        if (ext->releaseFn != NULL) {
+            ext->releaseFn(msg, ext->userdata);
+        }
+    }
+    msg->~truss_message();
+
+    if (block->sizeClass == LARGE_CLASS || block->sizeClass == EXTERNAL_CLASS) {
+        std::free(block);
+    } else {
+        cache.push(block->sizeClass, block);
+    }
+}
+
+void MessagePool::getStats(truss_message_stats* stats) {
+    std::lock_guard<std::mutex> lock(countersLock_);
+    int64_t liveMessages = retired_.liveMessages.load();
+    int64_t liveBytes = retired_.liveBytes.load();
+    uint64_t hits = retired_.poolHits.load();
+    uint64_t misses = retired_.poolMisses.load();
+    uint64_t large = retired_.largeAllocations.load();
+    for (MessagePoolCounters* c : threadCounters_) {
+        liveMessages += c->liveMessages.load(std::memory_order_relaxed);
+        liveBytes += c->liveBytes.load(std::memory_order_relaxed);
+        hits += c->poolHits.load(std::memory_order_relaxed);
+        misses += c->poolMisses.load(std::memory_order_relaxed);
+        large += c->largeAllocations.load(std::memory_order_relaxed);
+    }
+
+    stats->live_messages = liveMessages > 0 ? static_cast<uint64_t>(liveMessages) : 0;
+    stats->live_bytes = liveBytes > 0 ? static_cast<uint64_t>(liveBytes) : 0;
+    stats->pool_hits = hits;
+    stats->pool_misses = misses;
+    stats->large_allocations = large;
+    uint64_t total = hits + misses + large;
+    stats->pool_hit_rate = total > 0 ? double(hits) / double(total) : 0.0;
+}
+
+void MessagePool::registerCounters(MessagePoolCounters* counters) {
+    std::lock_guard<std::mutex> lock(countersLock_);
+    threadCounters_.push_back(counters);
+}
+
+void MessagePool::retireCounters(MessagePoolCounters* counters) {
+    std::lock_guard<std::mutex> lock(countersLock_);
+    retired_.liveMessages.fetch_add(counters->liveMessages.load());
+    retired_.liveBytes.fetch_add(counters->liveBytes.load());
+    retired_.poolHits.fetch_add(counters->poolHits.load());
+    retired_.poolMisses.fetch_add(counters->poolMisses.load());
+    retired_.largeAllocations.fetch_add(counters->largeAllocations.load());
+    for (size_t i = 0; i < threadCounters_.size(); ++i) {
+        if (threadCounters_[i] == counters) {
+            threadCounters_.erase(threadCounters_.begin() + i);
+            break;
+        }
+    }
+}
+
+MessageBlock* MessagePool::takeBatch(uint32_t sizeClass, uint32_t& count) {
+    CentralList& list = central_[sizeClass];
+    std::lock_guard<std::mutex> lock(list.lock);
+    if (list.head == NULL) {
+        count = 0;
+        return NULL;
+    }
+    MessageBlock* head = list.head;
+    MessageBlock* tail = head;
+    uint32_t taken = 1;
+    while (taken < TRANSFER_BATCH && tail->next != NULL) {
+        tail = tail->next;
+        ++taken;
+    }
+    list.head = tail->next;
+    list.count -= taken;
+    tail->next = NULL;
+    count = taken;
+    return head;
+}
+
+void MessagePool::giveBatch(uint32_t sizeClass, MessageBlock* head,
+                            MessageBlock* tail, uint32_t count) {
+    CentralList& list = central_[sizeClass];
+    std::lock_guard<std::mutex> lock(list.lock);
+    tail->next = list.head;
+    list.head = head;
+    list.count += count;
+}
+
+MessagePool::MessagePool() {
+    for (uint32_t i = 0; i < NUM_CLASSES; ++i) {
+        central_[i].head = NULL;
+        central_[i].count = 0;
+    }
+}
+
+MessagePool::~MessagePool() {
+    for (uint32_t i = 0; i < NUM_CLASSES; ++i) {
+        MessageBlock* cur = central_[i].head;
+        while (cur != NULL) {
+            MessageBlock* next = cur->next;
+            std::free(cur);
+            cur = next;
+        }
+        central_[i].head = NULL;
+    }
+}
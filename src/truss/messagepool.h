@@ -0,0 +1,96 @@
+#ifndef TRUSS_MESSAGEPOOL_H_
+#define TRUSS_MESSAGEPOOL_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <trussapi.h>
+
+namespace truss {
+
+// Hidden header in front of every truss_message. The message and its
+// payload follow it in the same allocation: [block][message][payload].
+struct MessageBlock {
+    uint32_t sizeClass;   // index into the pool size classes, or LARGE_CLASS
+    std::atomic<uint32_t> flags; // MessageBlock::FROZEN, ...
+    MessageBlock* next;   // free list link while the block is pooled
+
+    // set before a message is shared; never cleared while it is alive
+    static const uint32_t FROZEN = 1 << 0;
+};
+
+// Called when the last reference to an external message is released
+typedef void (*ExternalReleaseFn)(truss_message* msg, void* userdata);
+
+// Per-thread allocation counters. Only the owning thread writes them, so
+// they never bounce between cores; readers sum them for stats.
+struct MessagePoolCounters {
+    std::atomic<int64_t> liveMessages;
+    std::atomic<int64_t> liveBytes;
+    std::atomic<uint64_t> poolHits;
+    std::atomic<uint64_t> poolMisses;
+    std::atomic<uint64_t> largeAllocations;
+    MessagePoolCounters();
+};
+
+// Size-classed allocator for truss_message. Each thread keeps a small free
+// list per class; overflow and refills go through a shared per-class list
+// in batches, and payloads above the largest class go straight to malloc.
+class MessagePool {
+public:
+    static const uint32_t NUM_CLASSES = 11;        // 64 B .. 64 KB payloads
+    static const uint32_t MIN_CLASS_SHIFT = 6;
+    static const uint32_t LARGE_CLASS = 0xffffffff;
+    static const uint32_t EXTERNAL_CLASS = 0xfffffffe;
+    static const uint32_t THREAD_CACHE_LIMIT = 64; // blocks per class
+    static const uint32_t TRANSFER_BATCH = 32;
+
+    static MessagePool& instance();
+
+    truss_message* allocate(size_t dataLength);
+    void release(truss_message* msg);
+
+    // Wraps memory owned elsewhere (e.g., a file mapping) in a message;
+    // releaseFn runs once the last reference is dropped
+    truss_message* wrapExternal(unsigned char* data, size_t dataLength,
+                                ExternalReleaseFn releaseFn, void* userdata);
+
+    // Shared buffers are external messages over their own allocation, aligned
+    // to a power of two (0: DEFAULT_SHARED_ALIGNMENT)
+    static const size_t DEFAULT_SHARED_ALIGNMENT = 64;
+    truss_message* allocateShared(size_t dataLength, size_t alignment);
+    void getStats(truss_message_stats* stats);
+
+    static MessageBlock* blockOf(truss_message* msg);
+
+    // used by the per-thread caches
+    void registerCounters(MessagePoolCounters* counters);
+    void retireCounters(MessagePoolCounters* counters);
+    MessageBlock* takeBatch(uint32_t sizeClass, uint32_t& count);
+    void giveBatch(uint32_t sizeClass, MessageBlock* head, MessageBlock* tail, uint32_t count);
+    static size_t classPayloadSize(uint32_t sizeClass);
+
+    ~MessagePool();
+private:
+    MessagePool();
+
+    // Mark pool as non-copyable.
+    MessagePool(const MessagePool&) = delete;
+    MessagePool& operator=(const MessagePool&) = delete;
+
+    struct CentralList {
+        std::mutex lock;
+        MessageBlock* head;
+        uint32_t count;
+    };
+    CentralList central_[NUM_CLASSES];
+
+    std::mutex countersLock_;
+    std::vector<MessagePoolCounters*> threadCounters_;
+    MessagePoolCounters retired_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_MESSAGEPOOL_H_
@@ -0,0 +1,148 @@
+#include "tracer.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <trussapi.h>
+
+using namespace truss;
+
+namespace {
+
+std::atomic<int> nextThreadId_(1);
+thread_local int threadId_ = 0;
+
+int currentThreadId() {
+    if (threadId_ == 0) {
+        threadId_ = nextThreadId_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return threadId_;
+}
+
+void writeJSONString(std::ostream& out, const std::string& s) {
+    out << '"';
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << ' ';
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+} // namespace
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer() : enabled_(false), epoch_(std::chrono::steady_clock::now()), dropped_(0) {}
+
+void Tracer::setEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+bool Tracer::isEnabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+uint64_t Tracer::now() const {
+    std::chrono::microseconds dt = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch_);
+    return static_cast<uint64_t>(dt.count());
+}
+
+void Tracer::addSpan(const char* name, const char* category, uint64_t startUs, uint64_t endUs) {
+    if (!isEnabled()) {
+        return;
+    }
+    Span span;
+    span.name = name;
+    span.category = category ? category : "";
+    span.start = startUs;
+    span.duration = endUs > startUs ? endUs - startUs : 0;
+    span.thread = currentThreadId();
+
+    // spans past MAX_SPANS are dropped (and counted), so a forgotten trace
+    // can't grow without bound
+    bool firstDrop = false;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (spans_.size() < MAX_SPANS) {
+            spans_.push_back(std::move(span));
+            return;
+        }
+        firstDrop = (dropped_++ == 0);
+    }
+    if (firstDrop) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Tracer: %zu spans recorded; dropping the rest",
+                 MAX_SPANS);
+        truss_log(TRUSS_LOG_WARNING, msg);
+    }
+}
+
+uint64_t Tracer::getDropped() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return dropped_;
+}
+
+void Tracer::setThreadName(const std::string& name) {
+    if (!isEnabled()) {
+        return;
+    }
+    int thread = currentThreadId();
+    std::lock_guard<std::mutex> lock(lock_);
+    threadNames_[thread] = name;
+}
+
+bool Tracer::save(const char* path) {
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+    out << "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":" << dropped_
+        << ",\"truncated\":" << (dropped_ > 0 ? "true" : "false")
+        << "},\"traceEvents\":[\n";
+    bool first = true;
+    for (auto& thread : threadNames_) {
+        out << (first ? "" : ",\n")
+            << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << thread.first
+            << ",\"args\":{\"name\":";
+        writeJSONString(out, thread.second);
+        out << "}}";
+        first = false;
+    }
+    for (const Span& span : spans_) {
+        out << (first ? "" : ",\n") << "{\"ph\":\"X\",\"name\":";
+        writeJSONString(out, span.name);
+        out << ",\"cat\":";
+        writeJSONString(out, span.category);
+        out << ",\"pid\":1,\"tid\":" << span.thread
+            << ",\"ts\":" << span.start << ",\"dur\":" << span.duration << "}";
+        first = false;
+    }
+    out << "\n]}\n";
+    return out.good();
+}
+
+TraceScope::TraceScope(const char* name, const char* category)
+    : category_(category), start_(0), active_(Tracer::instance().isEnabled()) {
+    if (active_) {
+        name_ = name;
+        start_ = Tracer::instance().now();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (active_) {
+        Tracer& tracer = Tracer::instance();
+        tracer.addSpan(name_.c_str(), category_, start_, tracer.now());
+    }
+}
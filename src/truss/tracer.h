@@ -0,0 +1,86 @@
+#ifndef TRUSS_TRACER_H_
+#define TRUSS_TRACER_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace truss {
+
+// Records named spans of time per thread and saves them as Chrome
+// trace-event JSON (open in chrome://tracing or Perfetto); spans on the
+// same thread nest by time. Off until enabled (--profile-startup), and
+// while off a span costs one relaxed load. At most MAX_SPANS are kept; the
+// first span past that logs a warning, and the saved trace records how
+// many were dropped.
+class Tracer {
+public:
+    static const size_t MAX_SPANS = 1 << 20;
+
+    static Tracer& instance();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+    // Microseconds since the tracer was created
+    uint64_t now() const;
+
+    void addSpan(const char* name, const char* category, uint64_t startUs, uint64_t endUs);
+
+    // Names the calling thread in the trace
+    void setThreadName(const std::string& name);
+
+    // Spans dropped because MAX_SPANS were already recorded
+    uint64_t getDropped();
+
+    // Writes everything recorded so far to a file on the real filesystem
+    bool save(const char* path);
+
+private:
+    Tracer();
+
+    // Mark tracer as non-copyable.
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    struct Span {
+        std::string name;
+        std::string category;
+        uint64_t start;
+        uint64_t duration;
+        int thread;
+    };
+
+    std::atomic<bool> enabled_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::mutex lock_;
+    std::vector<Span> spans_;
+    uint64_t dropped_;
+    std::map<int, std::string> threadNames_;
+};
+
+// Records a span covering its own lifetime; the name is only copied while
+// tracing, so callers that build names should do so under isEnabled()
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* category = "truss");
+    ~TraceScope();
+
+private:
+    // Mark scope as non-copyable.
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    std::string name_;
+    const char* category_;
+    uint64_t start_;
+    bool active_;
+};
+
+} // namespace truss
+
+#endif // TRUSS_TRACER_H_
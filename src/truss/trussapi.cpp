@@ -1,4 +1,8 @@
 #include "core.h"
+#include "diskcache.h"
+#include "filestream.h"
+#include "jobsystem.h"
+#include "tracer.h"
 
 // TODO: switch to a better logging framework
 #include <iostream>
@@ -32,6 +36,26 @@ void truss_set_error(int errcode) {
 	Core::instance().setError(errcode);
 }
 
+void truss_set_log_level(int log_level) {
+    Core::instance().logger().setLevel(log_level);
+}
+
+int truss_get_log_level() {
+    return Core::instance().logger().getLevel();
+}
+
+int truss_open_log(const char* path, int binary) {
+    return Core::instance().logger().open(path, binary != 0) ? 0 : -1;
+}
+
+void truss_flush_log() {
+    Core::instance().logger().flush();
+}
+
+uint64_t truss_get_dropped_log_count() {
+    return Core::instance().logger().getDropped();
+}
+
 void truss_shutdown() {
     Core::instance().stopAllInterpreters();
 }
@@ -48,6 +72,48 @@ void truss_sleep(unsigned int ms) {
 	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
+/* Tracing */
+int truss_trace_enabled() {
+    return Tracer::instance().isEnabled() ? 1 : 0;
+}
+
+void truss_set_trace_enabled(int enabled) {
+    Tracer::instance().setEnabled(enabled != 0);
+}
+
+uint64_t truss_trace_now() {
+    return Tracer::instance().now();
+}
+
+void truss_trace_span(const char* name, const char* category, uint64_t start_us) {
+    Tracer& tracer = Tracer::instance();
+    tracer.addSpan(name, category, start_us, tracer.now());
+}
+
+void truss_trace_thread_name(const char* name) {
+    Tracer::instance().setThreadName(name);
+}
+
+int truss_save_trace(const char* path) {
+    return Tracer::instance().save(path) ? 0 : -1;
+}
+
+/* Profiling */
+static std::atomic<int> profilerOwner_(-1);
+
+int truss_acquire_profiler(int interpreter) {
+    int expected = -1;
+    if (profilerOwner_.compare_exchange_strong(expected, interpreter) || expected == interpreter) {
+        return 0;
+    }
+    return -1;
+}
+
+void truss_release_profiler(int interpreter) {
+    int expected = interpreter;
+    profilerOwner_.compare_exchange_strong(expected, -1);
+}
+
 int truss_check_file(const char* filename) {
     return Core::instance().checkFile(filename);
 }
@@ -60,15 +126,21 @@ truss_message* truss_load_file(const char* filename) {
     return Core::instance().loadFile(filename);
 }
 
+truss_message* truss_map_file(const char* filename) {
+    return Core::instance().mapFile(filename);
+}
+
+truss_message* truss_map_file_raw(const char* path) {
+    return Core::instance().mapFileRaw(path);
+}
+
 /* Note that when saving the message_type field is not saved */
 int truss_save_file(const char* filename, truss_message* data) {
-    Core::instance().saveFile(filename, data);
-    return 0; // TODO: actually check for errors
+    return Core::instance().saveFile(filename, data) ? 0 : -1;
 }
 
-int truss_save_data(const char* filename, const char* data, unsigned int datalength) {
-	Core::instance().saveData(filename, data, datalength);
-	return 0;
+int truss_save_data(const char* filename, const char* data, uint64_t datalength) {
+	return Core::instance().saveData(filename, data, datalength) ? 0 : -1;
 }
 
 int truss_add_fs_path(const char* path, const char* mountpath, int append, int relative) {
@@ -98,6 +170,130 @@ void truss_clear_string_results(truss_interpreter_id interpreter) {
     Core::instance().clearStringResults(interpreter);
 }
 
+/* Persistent cache */
+uint64_t truss_hash_data(const void* data, uint64_t length, uint64_t seed) {
+    return hashData(data, length, seed);
+}
+
+truss_message* truss_load_cache_entry(const char* cache_name, uint64_t key) {
+    return loadCacheEntry(cache_name, key);
+}
+
+int truss_save_cache_entry(const char* cache_name, uint64_t key, const void* data, uint64_t length) {
+    return saveCacheEntry(cache_name, key, data, length) ? 0 : -1;
+}
+
+/* Background FileIO */
+void truss_set_io_threads(int nthreads) {
+    core().ioPool().setThreadCount(nthreads);
+}
+
+int truss_get_io_threads() {
+    return core().ioPool().getThreadCount();
+}
+
+uint64_t truss_io_load(truss_interpreter_id requester, const char* filename, int flags, int priority) {
+    return core().ioPool().load(requester, filename, flags, priority);
+}
+
+uint64_t truss_io_save(truss_interpreter_id requester, const char* filename, truss_message* data, int flags, int priority) {
+    return core().ioPool().save(requester, filename, data, flags, priority);
+}
+
+int truss_io_pending() {
+    return core().ioPool().pending();
+}
+
+/* Streaming FileIO */
+truss_stream* truss_stream_open(const char* filename, int mode) {
+    return reinterpret_cast<truss_stream*>(FileStream::open(filename, mode));
+}
+
+int64_t truss_stream_read(truss_stream* stream, void* dest, int64_t size) {
+    if (stream == NULL || dest == NULL) {
+        return -1;
+    }
+    return reinterpret_cast<FileStream*>(stream)->read(dest, size);
+}
+
+int64_t truss_stream_write(truss_stream* stream, const void* src, int64_t size) {
+    if (stream == NULL || src == NULL) {
+        return -1;
+    }
+    return reinterpret_cast<FileStream*>(stream)->write(src, size);
+}
+
+int truss_stream_seek(truss_stream* stream, int64_t pos) {
+    if (stream == NULL) {
+        return 0;
+    }
+    return reinterpret_cast<FileStream*>(stream)->seek(pos) ? 1 : 0;
+}
+
+int64_t truss_stream_tell(truss_stream* stream) {
+    if (stream == NULL) {
+        return -1;
+    }
+    return reinterpret_cast<FileStream*>(stream)->tell();
+}
+
+int64_t truss_stream_length(truss_stream* stream) {
+    if (stream == NULL) {
+        return -1;
+    }
+    return reinterpret_cast<FileStream*>(stream)->length();
+}
+
+int truss_stream_eof(truss_stream* stream) {
+    if (stream == NULL) {
+        return 1;
+    }
+    return reinterpret_cast<FileStream*>(stream)->eof() ? 1 : 0;
+}
+
+void truss_stream_close(truss_stream* stream) {
+    delete reinterpret_cast<FileStream*>(stream);
+}
+
+/* Job system */
+void truss_set_job_threads(int nthreads) {
+    JobSystem::instance().setThreadCount(nthreads);
+}
+
+int truss_get_job_threads() {
+    return JobSystem::instance().getThreadCount();
+}
+
+truss_job_counter* truss_create_job_counter() {
+    truss_job_counter* counter = new truss_job_counter;
+    counter->pending.store(0);
+    return counter;
+}
+
+void truss_destroy_job_counter(truss_job_counter* counter) {
+    if (counter != NULL) {
+        JobSystem::instance().wait(counter);
+    }
+    delete counter;
+}
+
+int64_t truss_job_counter_pending(truss_job_counter* counter) {
+    return counter->pending.load(std::memory_order_acquire);
+}
+
+void truss_submit_job(truss_job_fn fn, void* userdata, truss_job_counter* counter) {
+    JobSystem::instance().submit(fn, userdata, counter);
+}
+
+void truss_parallel_for(truss_range_fn fn, void* userdata, uint64_t begin, uint64_t end, uint64_t grain, truss_job_counter* counter) {
+    JobSystem::instance().parallelFor(fn, userdata, begin, end, grain, counter);
+}
+
+void truss_job_wait(truss_job_counter* counter) {
+    if (counter != NULL) {
+        JobSystem::instance().wait(counter);
+    }
+}
 
 /* Datastore functions */
 truss_message* truss_get_store_value(const char* key) {
@@ -116,14 +312,43 @@ int truss_set_store_value_str(const char* key, const char* msg) {
     return Core::instance().setStoreValue(tempkey, tempmsg);
 }
 
+truss_message* truss_get_store_value_versioned(const char* key, uint64_t* version) {
+    return core().store().get(key, version);
+}
+
+truss_message* truss_acquire_store_value(const char* key, uint64_t* version) {
+    return core().store().getAcquired(key, version);
+}
+
+uint64_t truss_get_store_version(const char* key) {
+    return core().store().getVersion(key);
+}
+
+uint64_t truss_compare_and_swap_store_value(const char* key, uint64_t expected_version, truss_message* val) {
+    return core().store().compareAndSwap(key, expected_version, val);
+}
+
+int truss_erase_store_value(const char* key) {
+    return core().store().erase(key) ? 1 : 0;
+}
+
 /* Interpreter management functions */
 int truss_spawn_interpreter(int debug_level, const char* init_script_name) {
-	Interpreter* spawned = Core::instance().spawnInterpreter();
-	spawned->setDebug(debug_level);
-	spawned->start(init_script_name, true);
+	Interpreter* spawned = core().interpreterPool().spawn(debug_level, init_script_name);
+	if (spawned == NULL) {
+		return -1;
+	}
 	return spawned->getID();
 }
 
+void truss_set_interpreter_pool_size(int count) {
+	core().interpreterPool().setTargetSize(count);
+}
+
+void truss_get_interpreter_pool_stats(truss_interpreter_pool_stats* stats) {
+	core().interpreterPool().getStats(stats);
+}
+
 void truss_stop_interpreter(truss_interpreter_id target_id) {
 	Core::instance().getInterpreter(target_id)->stop();
 }
@@ -136,6 +361,23 @@ truss_interpreter_state truss_get_interpreter_state(truss_interpreter_id target_
 	return Core::instance().getInterpreter(target_id)->getState();
 }
 
+int truss_step_interpreters(const truss_interpreter_id* targets, int ntargets) {
+	return core().stepInterpreters(targets, ntargets);
+}
+
+int truss_join_interpreters(const truss_interpreter_id* targets, int ntargets, int timeout_ms, double* frame_ms) {
+	return core().joinInterpreters(targets, ntargets, timeout_ms, frame_ms);
+}
+
+double truss_get_interpreter_frame_time(truss_interpreter_id target_id) {
+	Interpreter* interpreter = core().getInterpreter(target_id);
+	return interpreter ? interpreter->getLastStepTime() : -1.0;
+}
+
+void truss_wait_for_interpreters() {
+	core().waitForInterpreters();
+}
+
 void truss_send_message(truss_interpreter_id dest, truss_message* message) {
     Core::instance().dispatchMessage(dest, message);
 }
@@ -158,6 +400,25 @@ truss_message* truss_get_message(truss_interpreter_id idx, int message_index) {
     }
 }
 
+truss_message** truss_fetch_message_array(truss_interpreter_id idx, int* count) {
+    return truss_fetch_typed_message_array(idx, -1, count);
+}
+
+truss_message** truss_fetch_typed_message_array(truss_interpreter_id idx, int message_type, int* count) {
+    Interpreter* interpreter = Core::instance().getInterpreter(idx);
+    if(interpreter == NULL) {
+        if(count != NULL) {
+            *count = -1;
+        }
+        return NULL;
+    }
+    int nmessages = interpreter->fetchMessages(message_type);
+    if(count != NULL) {
+        *count = nmessages;
+    }
+    return interpreter->getMessageArray(message_type);
+}
+
 /* Message management functions */
 truss_message* truss_create_message(size_t data_length) {
     return Core::instance().allocateMessage(data_length);
@@ -165,16 +426,13 @@ truss_message* truss_create_message(size_t data_length) {
 
 void truss_acquire_message(truss_message* msg) {
     if (msg != NULL) {
-        ++(msg->refcount);
+        Core::instance().acquireMessage(msg);
     }
 }
 
 void truss_release_message(truss_message* msg) {
     if (msg != NULL) {
-        --(msg->refcount);
-        if (msg->refcount <= 0) {
-            Core::instance().deallocateMessage(msg);
-        }
+        Core::instance().releaseMessage(msg);
     }
 }
 
@@ -182,9 +440,134 @@ truss_message* truss_copy_message(truss_message* src) {
     if (src == NULL) {
         return NULL;
     }
+    return Core::instance().copyMessage(src);
+}
+
+void truss_freeze_message(truss_message* msg) {
+    if (msg != NULL) {
+        Core::instance().freezeMessage(msg);
+    }
+}
+
+int truss_is_message_frozen(truss_message* msg) {
+    if (msg == NULL) {
+        return 0;
+    }
+    return Core::instance().isMessageFrozen(msg) ? 1 : 0;
+}
+
+unsigned char* truss_get_writable_data(truss_message* msg) {
+    if (msg == NULL) {
+        return NULL;
+    }
+    return Core::instance().getWritableData(msg);
+}
+
+int truss_broadcast_message(const truss_interpreter_id* dests, int ndests, truss_message* msg) {
+    if (dests == NULL || msg == NULL) {
+        return 0;
+    }
+    return Core::instance().broadcastMessage(dests, ndests, msg);
+}
+
+void truss_get_message_stats(truss_message_stats* stats) {
+    if (stats != NULL) {
+        Core::instance().getMessageStats(stats);
+    }
+}
+
+/* Channels */
+static Channel* channelOf(truss_channel* channel) {
+    return reinterpret_cast<Channel*>(channel);
+}
+
+truss_channel* truss_open_channel(const char* name, uint32_t capacity, int policy) {
+    if (name == NULL) {
+        return NULL;
+    }
+    if (policy < TRUSS_CHANNEL_BLOCK || policy > TRUSS_CHANNEL_DROP_NEWEST) {
+        core().logPrint(TRUSS_LOG_ERROR, "open_channel: invalid policy %d for [%s]", policy, name);
+        return NULL;
+    }
+    return reinterpret_cast<truss_channel*>(core().channels().open(name, capacity, policy));
+}
+
+truss_channel* truss_find_channel(const char* name) {
+    if (name == NULL) {
+        return NULL;
+    }
+    return reinterpret_cast<truss_channel*>(core().channels().find(name));
+}
+
+int truss_channel_push(truss_channel* channel, truss_message* msg, int timeout_ms) {
+    if (channel == NULL || msg == NULL) {
+        return TRUSS_CHANNEL_CLOSED;
+    }
+    return channelOf(channel)->push(msg, timeout_ms);
+}
+
+truss_message* truss_channel_pop(truss_channel* channel, int timeout_ms) {
+    if (channel == NULL) {
+        return NULL;
+    }
+    return channelOf(channel)->pop(timeout_ms);
+}
+
+int truss_channel_pop_batch(truss_channel* channel, truss_message** dest, int max_count, int timeout_ms) {
+    if (channel == NULL || dest == NULL) {
+        return 0;
+    }
+    return channelOf(channel)->popBatch(dest, max_count, timeout_ms);
+}
 
-    truss_message* newmsg = Core::instance().allocateMessage(src->data_length);
-    newmsg->message_type = src->message_type;
-    std::memcpy(newmsg->data, src->data, newmsg->data_length);
-    return newmsg;
+void truss_close_channel(truss_channel* channel) {
+    if (channel != NULL) {
+        channelOf(channel)->close();
+    }
+}
+
+void truss_get_channel_stats(truss_channel* channel, truss_channel_stats* stats) {
+    if (channel != NULL && stats != NULL) {
+        channelOf(channel)->getStats(stats);
+    }
+}
+
+int truss_subscribe_topic(const char* topic, truss_channel* channel) {
+    if (topic == NULL || channel == NULL) {
+        return -1;
+    }
+    return core().channels().subscribe(topic, channelOf(channel));
+}
+
+int truss_unsubscribe_topic(const char* topic, truss_channel* channel) {
+    if (topic == NULL || channel == NULL) {
+        return -1;
+    }
+    return core().channels().unsubscribe(topic, channelOf(channel));
+}
+
+int truss_publish(const char* topic, truss_message* msg, int timeout_ms) {
+    if (topic == NULL || msg == NULL) {
+        return 0;
+    }
+    return core().channels().publish(topic, msg, timeout_ms);
+}
+
+/* Shared buffers */
+truss_message* truss_create_shared_buffer(size_t data_length, size_t alignment) {
+    return Core::instance().createSharedBuffer(data_length, alignment);
+}
+
+int truss_transfer_message(truss_interpreter_id dest, truss_message* msg) {
+    if (msg == NULL) {
+        return -1;
+    }
+    return Core::instance().transferMessage(dest, msg) ? 0 : -1;
+}
+
+int truss_is_message_exclusive(truss_message* msg) {
+    if (msg == NULL) {
+        return 0;
+    }
+    return Core::instance().isMessageExclusive(msg) ? 1 : 0;
 }
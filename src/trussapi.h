@@ -27,6 +27,25 @@
 #define TRUSS_MESSAGE_UNKNOWN 0
 #define TRUSS_MESSAGE_CSTR    1
 #define TRUSS_MESSAGE_BLOB    2
+#define TRUSS_MESSAGE_IO      3 /* data is a truss_io_result */
+#define TRUSS_MESSAGE_SHARED  4 /* data is a shared buffer */
+
+/* Stream modes (TRUSS_STREAM_RAW may be or'ed in to use a real path) */
+#define TRUSS_STREAM_READ   0
+#define TRUSS_STREAM_WRITE  1
+#define TRUSS_STREAM_APPEND 2
+#define TRUSS_STREAM_RAW    4
+
+/* Background io requests: ops, flags, priorities and result status */
+#define TRUSS_IO_LOAD 0
+#define TRUSS_IO_SAVE 1
+#define TRUSS_IO_RAW  1 /* real path instead of a physfs path */
+#define TRUSS_IO_MAP  2 /* load with truss_map_file (read-only data) */
+#define TRUSS_IO_PRIORITY_LOW    0
+#define TRUSS_IO_PRIORITY_NORMAL 1
+#define TRUSS_IO_PRIORITY_HIGH   2
+#define TRUSS_IO_OK     0
+#define TRUSS_IO_ERROR -1
 
 /* Logging */
 #define TRUSS_LOG_CRITICAL 0
@@ -45,17 +64,94 @@ typedef enum {
 	THREAD_FATAL_ERROR
 } truss_interpreter_state;
 
+/* Message refcounts are atomic; the C view of the struct (truss_api.h)
+   declares a plain unsigned int with the same layout. Only change it
+   through truss_acquire_message / truss_release_message. */
+#if defined(__cplusplus)
+#include <atomic>
+typedef std::atomic<unsigned int> truss_refcount;
+#else
+typedef unsigned int truss_refcount;
+#endif
+
 /* Message struct */
 typedef struct {
 	unsigned int message_type;
 	size_t data_length;
 	unsigned char* data;
-	unsigned int refcount;
+	truss_refcount refcount;
 } truss_message;
 
+/* Message allocator statistics (see truss_get_message_stats) */
+typedef struct {
+	uint64_t live_messages;
+	uint64_t live_bytes;
+	uint64_t pool_hits;
+	uint64_t pool_misses;
+	uint64_t large_allocations;
+	double pool_hit_rate;
+} truss_message_stats;
+
+/* Payload of a TRUSS_MESSAGE_IO message. The loaded data belongs to the
+   result message: acquire it to keep it after the message is released. */
+typedef struct {
+	uint64_t request_id;
+	int op;
+	int status;
+	truss_message* data;
+} truss_io_result;
+
+/* Interpreter pool metrics (see truss_get_interpreter_pool_stats) */
+typedef struct {
+	int target_size;
+	int ready;
+	int booting;
+	uint64_t warm_spawns;   /* spawns served from the pool */
+	uint64_t cold_spawns;
+	double last_spawn_ms;
+	double avg_warm_spawn_ms;
+	double avg_cold_spawn_ms;
+	double avg_boot_ms;
+	double occupancy;       /* ready / target_size */
+} truss_interpreter_pool_stats;
+
+/* Channel overflow policies and push results (see truss_open_channel) */
+#define TRUSS_CHANNEL_BLOCK       0
+#define TRUSS_CHANNEL_DROP_OLDEST 1
+#define TRUSS_CHANNEL_DROP_NEWEST 2
+
+#define TRUSS_CHANNEL_OK          0
+#define TRUSS_CHANNEL_DROPPED     1
+#define TRUSS_CHANNEL_TIMEOUT     2
+#define TRUSS_CHANNEL_CLOSED      3
+
+/* Per-channel counters; latency is from push to pop */
+typedef struct {
+	uint64_t pushed;
+	uint64_t popped;
+	uint64_t dropped;
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t capacity;
+	double mean_latency_ms;
+	double max_latency_ms;
+} truss_channel_stats;
+
+/* Opaque channel handle; valid until exit */
+typedef struct truss_channel truss_channel;
+
 /* Interpreter IDs are just ints for now */
 typedef int truss_interpreter_id;
 
+/* Opaque file stream handle */
+typedef struct truss_stream truss_stream;
+
+/* Native jobs: plain function pointers (e.g., Terra functions) run on the
+   job system's worker threads; they must not call back into Lua */
+typedef void (*truss_job_fn)(void* userdata);
+typedef void (*truss_range_fn)(void* userdata, uint64_t begin, uint64_t end);
+typedef struct truss_job_counter truss_job_counter;
+
 /* Info */
 TRUSS_C_API const char* truss_get_version();
 
@@ -63,6 +159,15 @@ TRUSS_C_API void truss_test();
 TRUSS_C_API void truss_log(int log_level, const char* str);
 TRUSS_C_API void truss_set_error(int errcode);
 
+/* Logging is asynchronous: records are written by a background thread, in
+   time order. Messages above the log level are discarded before formatting;
+   when logging outpaces the file, debug and info messages are dropped. */
+TRUSS_C_API void truss_set_log_level(int log_level);
+TRUSS_C_API int truss_get_log_level();
+TRUSS_C_API int truss_open_log(const char* path, int binary);
+TRUSS_C_API void truss_flush_log();
+TRUSS_C_API uint64_t truss_get_dropped_log_count();
+
 /* Quit program by stopping all interpreters */
 TRUSS_C_API void truss_shutdown();
 
@@ -71,13 +176,36 @@ TRUSS_C_API uint64_t truss_get_hp_time();
 TRUSS_C_API uint64_t truss_get_hp_freq();
 TRUSS_C_API void truss_sleep(unsigned int ms);
 
+/* Tracing (e.g., --profile-startup): spans of time per thread, saved as
+   Chrome trace-event JSON. Spans on one thread nest by time; a span
+   starts at start_us (from truss_trace_now) and ends when it's added. */
+TRUSS_C_API int truss_trace_enabled();
+TRUSS_C_API void truss_set_trace_enabled(int enabled);
+TRUSS_C_API uint64_t truss_trace_now();
+TRUSS_C_API void truss_trace_span(const char* name, const char* category, uint64_t start_us);
+TRUSS_C_API void truss_trace_thread_name(const char* name);
+TRUSS_C_API int truss_save_trace(const char* path);
+
+/* LuaJIT's sampling profiler can only run in one Lua state at a time, so
+   interpreters claim it first (see core/profiler.t). Acquiring returns 0 if
+   the interpreter now holds (or already held) the profiler, -1 if another
+   interpreter does. */
+TRUSS_C_API int truss_acquire_profiler(int interpreter);
+TRUSS_C_API void truss_release_profiler(int interpreter);
+
 /* FileIO */
 /* Note that when saving the message_type field is not saved */
 TRUSS_C_API int truss_check_file(const char* filename); /* returns 1 if file exists, 2 if directory, 0 otherwise */
 TRUSS_C_API const char* truss_get_file_real_path(const char* filename);
 TRUSS_C_API truss_message* truss_load_file(const char* filename);
+/* Read-only, zero-copy load: real files and stored (uncompressed) entries
+   of mounted zips are memory mapped and unmapped with the last reference;
+   anything else is read normally. Do not write to the returned data. */
+TRUSS_C_API truss_message* truss_map_file(const char* filename);
+TRUSS_C_API truss_message* truss_map_file_raw(const char* path);
+/* Saves return 0, or -1 if the file couldn't be opened or fully written */
 TRUSS_C_API int truss_save_file(const char* filename, truss_message* data);
-TRUSS_C_API int truss_save_data(const char* filename, const char* data, unsigned int datalength);
+TRUSS_C_API int truss_save_data(const char* filename, const char* data, uint64_t datalength);
 TRUSS_C_API int truss_add_fs_path(const char* path, const char* mountpath, int append, int relative);
 TRUSS_C_API int truss_set_fs_savedir(const char* path);
 TRUSS_C_API int truss_set_raw_write_dir(const char* path);
@@ -85,21 +213,90 @@ TRUSS_C_API int truss_list_directory(truss_interpreter_id interpreter, const cha
 TRUSS_C_API const char* truss_get_string_result(truss_interpreter_id interpreter, int idx);
 TRUSS_C_API void truss_clear_string_results(truss_interpreter_id interpreter);
 
-/* Datastore functions */
+/* Persistent cache of derived data (e.g., compiled scripts) in the write
+   dir under cache/<cache_name>/. Keys should hash everything an entry was
+   derived from (chain truss_hash_data through seed, 0 to start). Loads
+   return a read-only message, or NULL if the entry isn't cached. */
+TRUSS_C_API uint64_t truss_hash_data(const void* data, uint64_t length, uint64_t seed);
+TRUSS_C_API truss_message* truss_load_cache_entry(const char* cache_name, uint64_t key);
+TRUSS_C_API int truss_save_cache_entry(const char* cache_name, uint64_t key, const void* data, uint64_t length);
+
+/* Background FileIO: requests run on a pool of io threads (highest priority
+   first) and complete by sending a TRUSS_MESSAGE_IO message to the
+   requester (pass -1 to not be notified). Return a request id, or 0 on
+   failure. The pool starts on first use; 0 threads picks a default. */
+TRUSS_C_API void truss_set_io_threads(int nthreads);
+TRUSS_C_API int truss_get_io_threads();
+TRUSS_C_API uint64_t truss_io_load(truss_interpreter_id requester, const char* filename, int flags, int priority);
+TRUSS_C_API uint64_t truss_io_save(truss_interpreter_id requester, const char* filename, truss_message* data, int flags, int priority);
+TRUSS_C_API int truss_io_pending();
+
+/* Streaming FileIO: read/write return bytes transferred or -1 on error */
+TRUSS_C_API truss_stream* truss_stream_open(const char* filename, int mode);
+TRUSS_C_API int64_t truss_stream_read(truss_stream* stream, void* dest, int64_t size);
+TRUSS_C_API int64_t truss_stream_write(truss_stream* stream, const void* src, int64_t size);
+TRUSS_C_API int truss_stream_seek(truss_stream* stream, int64_t pos);
+TRUSS_C_API int64_t truss_stream_tell(truss_stream* stream);
+TRUSS_C_API int64_t truss_stream_length(truss_stream* stream);
+TRUSS_C_API int truss_stream_eof(truss_stream* stream);
+TRUSS_C_API void truss_stream_close(truss_stream* stream);
+
+/* Job system: a work-stealing pool of native threads, started on first
+   use. Jobs add themselves to a counter (which may be NULL for
+   submit) and truss_job_wait runs other jobs until it drops to zero.
+   parallel_for splits [begin, end) into pieces of at most grain items
+   (0 picks a grain); with a NULL counter it returns once all are done. */
+TRUSS_C_API void truss_set_job_threads(int nthreads);
+TRUSS_C_API int truss_get_job_threads();
+TRUSS_C_API truss_job_counter* truss_create_job_counter();
+TRUSS_C_API void truss_destroy_job_counter(truss_job_counter* counter);
+TRUSS_C_API int64_t truss_job_counter_pending(truss_job_counter* counter);
+TRUSS_C_API void truss_submit_job(truss_job_fn fn, void* userdata, truss_job_counter* counter);
+TRUSS_C_API void truss_parallel_for(truss_range_fn fn, void* userdata, uint64_t begin, uint64_t end, uint64_t grain, truss_job_counter* counter);
+TRUSS_C_API void truss_job_wait(truss_job_counter* counter);
+
+/* Datastore functions: safe from any thread. get returns a borrowed value
+   that stays valid until the calling interpreter's current step ends;
+   other threads should use truss_acquire_store_value (and release it).
+   Each key's version goes up with every write; 0 means never written. */
 TRUSS_C_API truss_message* truss_get_store_value(const char* key);
 TRUSS_C_API int truss_set_store_value(const char* key, truss_message* val);
 TRUSS_C_API int truss_set_store_value_str(const char* key, const char* msg);
+TRUSS_C_API truss_message* truss_get_store_value_versioned(const char* key, uint64_t* version);
+TRUSS_C_API truss_message* truss_acquire_store_value(const char* key, uint64_t* version);
+TRUSS_C_API uint64_t truss_get_store_version(const char* key);
+/* Writes only if the key is still at expected_version; returns the new
+   version, or 0 if the key was changed in the meantime */
+TRUSS_C_API uint64_t truss_compare_and_swap_store_value(const char* key, uint64_t expected_version, truss_message* val);
+TRUSS_C_API int truss_erase_store_value(const char* key);
 
 /* Interpreter management functions */
 TRUSS_C_API int truss_spawn_interpreter(int debug_level, const char* init_script_name);
+/* Keep count interpreters booted in the background so spawns (with
+   debug_level 0) only need to run their script's init; 0 disables */
+TRUSS_C_API void truss_set_interpreter_pool_size(int count);
+TRUSS_C_API void truss_get_interpreter_pool_stats(truss_interpreter_pool_stats* stats);
 TRUSS_C_API void truss_stop_interpreter(truss_interpreter_id target_id);
 TRUSS_C_API int truss_step_interpreter(truss_interpreter_id target_id);
 TRUSS_C_API truss_interpreter_state truss_get_interpreter_state(truss_interpreter_id target_id);
+/* Fork-join stepping: steps every target in parallel; join blocks until
+   their steps finish (timeout_ms < 0: no limit, 0: poll), writes each
+   frame time in ms (-1 if unfinished) to frame_ms if not NULL, and
+   returns how many are still running */
+TRUSS_C_API int truss_step_interpreters(const truss_interpreter_id* targets, int ntargets);
+TRUSS_C_API int truss_join_interpreters(const truss_interpreter_id* targets, int ntargets, int timeout_ms, double* frame_ms);
+TRUSS_C_API double truss_get_interpreter_frame_time(truss_interpreter_id target_id);
+TRUSS_C_API void truss_wait_for_interpreters();
 
 /* Message transport */
 TRUSS_C_API void truss_send_message(truss_interpreter_id dest, truss_message* message);
 TRUSS_C_API int truss_fetch_messages(truss_interpreter_id interpreter);
 TRUSS_C_API truss_message* truss_get_message(truss_interpreter_id interpreter, int message_index);
+/* Batched fetch: returns every pending message as a contiguous array (NULL
+   if none) and writes the count; valid until the next fetch */
+TRUSS_C_API truss_message** truss_fetch_message_array(truss_interpreter_id interpreter, int* count);
+/* Fetches only messages of one type; the rest wait for a later fetch */
+TRUSS_C_API truss_message** truss_fetch_typed_message_array(truss_interpreter_id interpreter, int message_type, int* count);
 
 /* Message management functions */
 TRUSS_C_API truss_message* truss_create_message(size_t data_length);
@@ -107,4 +304,48 @@ TRUSS_C_API void truss_acquire_message(truss_message* msg);
 TRUSS_C_API void truss_release_message(truss_message* msg);
 TRUSS_C_API truss_message* truss_copy_message(truss_message* src);
 
+/* Frozen messages are immutable and may be shared by any number of
+   interpreters without copying; broadcast freezes and delivers one message
+   to every destination with a single refcount update. Returns the number
+   of interpreters the message was delivered to. */
+TRUSS_C_API void truss_freeze_message(truss_message* msg);
+TRUSS_C_API int truss_is_message_frozen(truss_message* msg);
+/* msg->data, or NULL (and an error is logged) if msg is frozen */
+TRUSS_C_API unsigned char* truss_get_writable_data(truss_message* msg);
+TRUSS_C_API int truss_broadcast_message(const truss_interpreter_id* dests, int ndests, truss_message* msg);
+TRUSS_C_API void truss_get_message_stats(truss_message_stats* stats);
+
+/* Shared buffers are large messages (TRUSS_MESSAGE_SHARED) whose data is
+   aligned to a power of two (0: 64 bytes) and never moves, so any number of
+   interpreters can view it in place. The message is the handle:
+   - read-only sharing: freeze it, then send or broadcast it as usual
+   - ownership transfer: truss_transfer_message hands the caller's
+     reference to dest instead of adding one; returns -1 (and the caller
+     keeps its reference) if dest doesn't exist or the buffer is frozen
+   Only write to a buffer that is exclusive: unfrozen and the only
+   reference. */
+TRUSS_C_API truss_message* truss_create_shared_buffer(size_t data_length, size_t alignment);
+TRUSS_C_API int truss_transfer_message(truss_interpreter_id dest, truss_message* msg);
+TRUSS_C_API int truss_is_message_exclusive(truss_message* msg);
+
+/* Channels: named, bounded queues of messages between any threads. When a
+   channel is full, pushes block (up to timeout_ms; < 0: no limit, 0: don't
+   wait), drop the oldest queued message, or drop the new one, according to
+   its policy. Channels acquire what they queue; popped messages belong to
+   the caller, who releases them. Opening an existing name returns that
+   channel unchanged. */
+TRUSS_C_API truss_channel* truss_open_channel(const char* name, uint32_t capacity, int policy);
+TRUSS_C_API truss_channel* truss_find_channel(const char* name);
+TRUSS_C_API int truss_channel_push(truss_channel* channel, truss_message* msg, int timeout_ms);
+TRUSS_C_API truss_message* truss_channel_pop(truss_channel* channel, int timeout_ms);
+TRUSS_C_API int truss_channel_pop_batch(truss_channel* channel, truss_message** dest, int max_count, int timeout_ms);
+TRUSS_C_API void truss_close_channel(truss_channel* channel);
+TRUSS_C_API void truss_get_channel_stats(truss_channel* channel, truss_channel_stats* stats);
+
+/* Topics: publishing freezes the message and pushes it to every subscribed
+   channel (timeout_ms applies per channel); returns how many queued it */
+TRUSS_C_API int truss_subscribe_topic(const char* topic, truss_channel* channel);
+TRUSS_C_API int truss_unsubscribe_topic(const char* topic, truss_channel* channel);
+TRUSS_C_API int truss_publish(const char* topic, truss_message* msg, int timeout_ms);
+
 #endif